@@ -0,0 +1,100 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2013 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "Arena.hh"
+
+#include <algorithm>
+
+namespace DupModule {
+
+tArena::tArena(size_t pBlockSize, size_t pMaxKept)
+    : mBlockSize(pBlockSize), mMaxKept(pMaxKept), mUsed(0), mLast(NULL) {
+}
+
+tArena::~tArena() {
+    for (size_t i = 0; i < mBlocks.size(); ++i) {
+        delete[] mBlocks[i].mData;
+    }
+}
+
+char *
+tArena::allocate(size_t pSize) {
+    if (mBlocks.empty() || mBlocks.back().mSize - mUsed < pSize) {
+        // Each block twice as big as the previous one, so that a big request needs few of them
+        tBlock lBlock;
+        lBlock.mSize = std::max(mBlocks.empty() ? mBlockSize : 2 * mBlocks.back().mSize, pSize);
+        lBlock.mData = new char[lBlock.mSize];
+        mBlocks.push_back(lBlock);
+        mUsed = 0;
+    }
+    mLast = mBlocks.back().mData + mUsed;
+    mUsed += pSize;
+    return mLast;
+}
+
+char *
+tArena::grow(char *pData, size_t pSize, size_t pNewSize) {
+    if (pData && pData == mLast && mBlocks.back().mSize - mUsed >= pNewSize - pSize) {
+        mUsed += pNewSize - pSize;
+        return pData;
+    }
+    char *lData = allocate(pNewSize);
+    std::copy(pData, pData + pSize, lData);
+    return lData;
+}
+
+void
+tArena::reset() {
+    if (capacity() > mMaxKept) {
+        // An unusually big request: only keep the first block, if it is not the big one
+        size_t lKept = mBlocks.front().mSize <= mMaxKept ? 1 : 0;
+        for (size_t i = lKept; i < mBlocks.size(); ++i) {
+            delete[] mBlocks[i].mData;
+        }
+        mBlocks.resize(lKept);
+    } else if (mBlocks.size() > 1) {
+        // One block big enough for the request which needed several
+        tBlock lBlock;
+        lBlock.mSize = capacity();
+        for (size_t i = 0; i < mBlocks.size(); ++i) {
+            delete[] mBlocks[i].mData;
+        }
+        lBlock.mData = new char[lBlock.mSize];
+        mBlocks.assign(1, lBlock);
+    }
+    mUsed = 0;
+    mLast = NULL;
+}
+
+size_t
+tArena::capacity() const {
+    size_t lCapacity = 0;
+    for (size_t i = 0; i < mBlocks.size(); ++i) {
+        lCapacity += mBlocks[i].mSize;
+    }
+    return lCapacity;
+}
+
+void
+tArenaString::reserve(size_t pCapacity) {
+    size_t lCapacity = std::max(pCapacity, std::max<size_t>(2 * mCapacity, 64));
+    mData = mArena.grow(mData, mCapacity, lCapacity);
+    mCapacity = lCapacity;
+}
+
+}
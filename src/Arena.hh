@@ -0,0 +1,154 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2013 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <boost/noncopyable.hpp>
+#include <cstddef>
+#include <vector>
+
+namespace DupModule {
+
+/**
+ * @brief Scratch memory handed out by bumping a pointer, and freed all at once by a reset.
+ * Meant to be owned by a thread and reset once per request: a reset keeps the memory, merged into a single block
+ * when the request needed several, so that once warmed up the arena allocates nothing.
+ * Past a maximum, a reset frees the memory down to the first block, so that a single big request does not stay
+ * allocated for the life of the thread.
+ */
+class tArena : private boost::noncopyable
+{
+public:
+    /**
+     * @param pBlockSize the size of the first block, allocated on first use
+     * @param pMaxKept the most memory a reset keeps
+     */
+    explicit tArena(size_t pBlockSize = 4096, size_t pMaxKept = 1 << 20);
+
+    ~tArena();
+
+    /**
+     * @brief Allocate bytes, not aligned, valid until the next reset
+     */
+    char *
+    allocate(size_t pSize);
+
+    /**
+     * @brief Grow an allocation: in place if it is the last one and its block has room, by a copy otherwise
+     * @param pData the allocation
+     * @param pSize its size
+     * @param pNewSize the size it needs, bigger than pSize
+     * @return the allocation, moved or not
+     */
+    char *
+    grow(char *pData, size_t pSize, size_t pNewSize);
+
+    /**
+     * @brief Free all the allocations, keeping the memory for the next ones
+     */
+    void
+    reset();
+
+    /** @brief The memory held by the arena */
+    size_t
+    capacity() const;
+
+private:
+    struct tBlock {
+        char    *mData;
+        size_t  mSize;
+    };
+
+    /** @brief The blocks, all full but the last one */
+    std::vector<tBlock>     mBlocks;
+    /** @brief The size of the first block */
+    size_t                  mBlockSize;
+    /** @brief The most memory a reset keeps */
+    size_t                  mMaxKept;
+    /** @brief The bytes allocated in the last block */
+    size_t                  mUsed;
+    /** @brief The last allocation, which can grow in place */
+    char                    *mLast;
+};
+
+/**
+ * @brief A string built in a tArena, growing by doubling, which can be fed through std::back_inserter
+ */
+class tArenaString
+{
+public:
+    typedef char value_type;
+    typedef const char &const_reference;
+
+    explicit tArenaString(tArena &pArena)
+        : mArena(pArena), mData(NULL), mSize(0), mCapacity(0) {}
+
+    /**
+     * @brief Room for pSize more bytes, to fill then commit
+     */
+    char *
+    prepare(size_t pSize) {
+        if (mCapacity - mSize < pSize) {
+            reserve(mSize + pSize);
+        }
+        return mData + mSize;
+    }
+
+    /**
+     * @brief Add the first pSize bytes of the last prepared room to the string
+     */
+    void
+    commit(size_t pSize) {
+        mSize += pSize;
+    }
+
+    void
+    append(const char *pData, size_t pSize) {
+        std::copy(pData, pData + pSize, prepare(pSize));
+        mSize += pSize;
+    }
+
+    void
+    push_back(char pChar) {
+        *prepare(1) = pChar;
+        ++mSize;
+    }
+
+    /** @brief The bytes of the string, not null terminated, valid until the arena is reset */
+    const char *
+    data() const {
+        return mData ? mData : "";
+    }
+
+    size_t
+    size() const {
+        return mSize;
+    }
+
+private:
+    void
+    reserve(size_t pCapacity);
+
+    tArena      &mArena;
+    char        *mData;
+    size_t      mSize;
+    size_t      mCapacity;
+};
+
+}
@@ -0,0 +1,180 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2013 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "Args.hh"
+
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace DupModule {
+
+/// @brief Upper cases an ASCII letter, leaves the other bytes as they are
+static inline unsigned char
+upper(unsigned char pChar) {
+    return (pChar >= 'a' && pChar <= 'z') ? pChar - ('a' - 'A') : pChar;
+}
+
+bool
+iequals(const tStringRef &pLeft, const tStringRef &pRight) {
+    if (pLeft.mSize != pRight.mSize) {
+        return false;
+    }
+    for (size_t i = 0; i < pLeft.mSize; ++i) {
+        if (upper(pLeft.mData[i]) != upper(pRight.mData[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t
+tArgKeyHash::operator()(const tStringRef &pKey) const {
+    // 64 bits FNV-1a, on the upper cased bytes
+    uint64_t lHash = 14695981039346656037ULL;
+    for (size_t i = 0; i < pKey.mSize; ++i) {
+        lHash = (lHash ^ upper(pKey.mData[i])) * 1099511628211ULL;
+    }
+    return static_cast<size_t>(lHash);
+}
+
+namespace {
+
+/// @brief Builds the arguments from the positions of the separators, in their order
+class tArgsBuilder {
+public:
+    tArgsBuilder(const char *pArgs, tArgs &pParsedArgs)
+        : mArgs(pArgs), mParsedArgs(pParsedArgs), mStart(0), mEqual(0), mHasEqual(false) {}
+
+    /// @brief Takes a separator into account
+    void separator(size_t pPos) {
+        if (mArgs[pPos] == '&') {
+            end(pPos);
+            mStart = pPos + 1;
+            mHasEqual = false;
+        } else if (!mHasEqual) {
+            // Only the first '=' splits the key from the value
+            mEqual = pPos;
+            mHasEqual = true;
+        }
+    }
+
+    /// @brief Ends the current argument
+    void end(size_t pPos) {
+        if (pPos == mStart) {
+            return;
+        }
+        tArg lArg;
+        if (mHasEqual) {
+            lArg.mKey = tStringRef(mArgs + mStart, mEqual - mStart);
+            lArg.mValue = tStringRef(mArgs + mEqual + 1, pPos - mEqual - 1);
+        } else {
+            lArg.mKey = tStringRef(mArgs + mStart, pPos - mStart);
+        }
+        mParsedArgs.push_back(lArg);
+    }
+
+private:
+    const char  *mArgs;
+    tArgs       &mParsedArgs;
+    size_t      mStart;
+    size_t      mEqual;
+    bool        mHasEqual;
+};
+
+}
+
+void
+tokenizeArgs(const std::string &pArgs, tArgs &pParsedArgs) {
+    const char *lArgs = pArgs.data();
+    const size_t lSize = pArgs.size();
+    tArgsBuilder lBuilder(lArgs, pParsedArgs);
+    size_t lPos = 0;
+#ifdef __SSE2__
+    // 16 bytes at a time: a mask of the separators, then one step per separator
+    const __m128i lAmpersands = _mm_set1_epi8('&');
+    const __m128i lEquals = _mm_set1_epi8('=');
+    for (; lPos + 16 <= lSize; lPos += 16) {
+        const __m128i lChunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lArgs + lPos));
+        unsigned int lMask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(lChunk, lAmpersands),
+                                                            _mm_cmpeq_epi8(lChunk, lEquals)));
+        while (lMask) {
+            lBuilder.separator(lPos + __builtin_ctz(lMask));
+            lMask &= lMask - 1;
+        }
+    }
+#endif
+    for (; lPos < lSize; ++lPos) {
+        if (lArgs[lPos] == '&' || lArgs[lPos] == '=') {
+            lBuilder.separator(lPos);
+        }
+    }
+    lBuilder.end(lSize);
+}
+
+tArgsCache::tArgsCache()
+    : mCodec(NULL) {
+}
+
+void
+tArgsCache::reset(const std::string &pArgs, const IUrlCodec &pCodec) {
+    mCodec = &pCodec;
+    mArgs.clear();
+    tokenizeArgs(pArgs, mArgs);
+    mValues.assign(mArgs.size(), std::string());
+    mDecoded.assign(mArgs.size(), false);
+}
+
+const std::string &
+tArgsCache::value(size_t pIndex) {
+    if (!mDecoded[pIndex]) {
+        const tStringRef &lValue = mArgs[pIndex].mValue;
+        if (!lValue.empty()) {
+            // Straight into the cached value, with the codecs which decode into a buffer
+            std::string &lDecoded = mValues[pIndex];
+            lDecoded.resize(lValue.mSize);
+            lDecoded.resize(mCodec->decode(lValue.mData, lValue.mSize, &lDecoded[0]) - lDecoded.data());
+        }
+        mDecoded[pIndex] = true;
+    }
+    return mValues[pIndex];
+}
+
+tRequestArgs::tRequestArgs()
+    : mBodyString(NULL), mCodec(NULL), mBodyParsed(false) {
+}
+
+void
+tRequestArgs::reset(const std::string &pHeader, const std::string &pBody, const IUrlCodec &pCodec) {
+    mHeader.reset(pHeader, pCodec);
+    mBodyString = &pBody;
+    mCodec = &pCodec;
+    mBodyParsed = false;
+}
+
+tArgsCache &
+tRequestArgs::body() {
+    if (!mBodyParsed && mBodyString) {
+        mBody.reset(*mBodyString, *mCodec);
+        mBodyParsed = true;
+    }
+    return mBody;
+}
+
+}
@@ -0,0 +1,158 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2013 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "UrlCodec.hh"
+
+namespace DupModule {
+
+/**
+ * @brief A part of a string, which it points into: valid as long as the string is neither changed nor destroyed
+ */
+struct tStringRef {
+    tStringRef()
+        : mData(NULL), mSize(0) {}
+
+    tStringRef(const char *pData, size_t pSize)
+        : mData(pData), mSize(pSize) {}
+
+    explicit tStringRef(const std::string &pString)
+        : mData(pString.data()), mSize(pString.size()) {}
+
+    /** @brief A copy of the part */
+    std::string str() const {
+        return std::string(mData, mSize);
+    }
+
+    bool empty() const {
+        return !mSize;
+    }
+
+    const char  *mData;
+    size_t      mSize;
+};
+
+/**
+ * @brief Compares two strings, ASCII case insensitively
+ */
+bool
+iequals(const tStringRef &pLeft, const tStringRef &pRight);
+
+/**
+ * @brief Hashes the keys of the arguments ASCII case insensitively, as their case does not matter to the directives
+ */
+struct tArgKeyHash {
+    size_t operator()(const tStringRef &pKey) const;
+};
+
+/**
+ * @brief Compares the keys of the arguments ASCII case insensitively
+ */
+struct tArgKeyEqual {
+    bool operator()(const tStringRef &pLeft, const tStringRef &pRight) const {
+        return iequals(pLeft, pRight);
+    }
+};
+
+/**
+ * @brief An argument of a query string or of an url-encoded body, pointing into it: its key as is and its value not decoded
+ */
+struct tArg {
+    tStringRef mKey;
+    tStringRef mValue;
+};
+
+/** @brief The arguments of a query string or of an url-encoded body, in their order */
+typedef std::vector<tArg> tArgs;
+
+/**
+ * @brief Splits a query string or an url-encoded body into its arguments, on the '&' then on the first '=' of each,
+ * without copying them. Empty arguments are skipped.
+ * @param pArgs the string to split, which the arguments point into
+ * @param pParsedArgs filled with the arguments
+ */
+void
+tokenizeArgs(const std::string &pArgs, tArgs &pParsedArgs);
+
+/**
+ * @brief The arguments of a string, tokenized once, with each value url-decoded once, when first read
+ */
+class tArgsCache {
+public:
+    tArgsCache();
+
+    /**
+     * @brief Starts over on another string
+     * @param pArgs the string, to keep alive and unchanged as long as the cache is used
+     * @param pCodec the codec decoding the values
+     */
+    void reset(const std::string &pArgs, const IUrlCodec &pCodec);
+
+    /** @brief The arguments, in their order */
+    const tArgs &args() const {
+        return mArgs;
+    }
+
+    /** @brief The value of the argument at pIndex, url-decoded */
+    const std::string &value(size_t pIndex);
+
+private:
+    tArgs                       mArgs;          /** The arguments of the string */
+    const IUrlCodec             *mCodec;        /** The codec decoding the values */
+    std::vector<std::string>    mValues;        /** The decoded values, for the arguments marked in mDecoded */
+    std::vector<bool>           mDecoded;       /** Whether the value of each argument is decoded yet */
+};
+
+/**
+ * @brief The arguments of a request, shared by the filters, the substitutions and the sampling of all its destinations:
+ * the header ones tokenized when the request gets processed, the body ones when they are first needed
+ */
+class tRequestArgs {
+public:
+    tRequestArgs();
+
+    /**
+     * @brief Starts over on another request
+     * @param pHeader the query string, tokenized right away
+     * @param pBody the body, to keep alive and unchanged as long as the arguments are used
+     * @param pCodec the codec decoding the values
+     */
+    void reset(const std::string &pHeader, const std::string &pBody, const IUrlCodec &pCodec);
+
+    /** @brief The arguments of the query string */
+    tArgsCache &header() {
+        return mHeader;
+    }
+
+    /** @brief The arguments of the body, tokenized on the first call */
+    tArgsCache &body();
+
+private:
+    tArgsCache          mHeader;            /** The arguments of the query string */
+    tArgsCache          mBody;              /** The arguments of the body, once mBodyParsed */
+    const std::string   *mBodyString;       /** The body of the request, NULL before a reset */
+    const IUrlCodec     *mCodec;            /** The codec decoding the values */
+    bool                mBodyParsed;        /** Whether mBody is filled */
+};
+
+}
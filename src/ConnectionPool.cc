@@ -0,0 +1,167 @@
+/*
+ * mod_dup - duplicates apache requests
+ *
+ * Copyright (C) 2013 Orange
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/foreach.hpp>
+
+#include "ConnectionPool.hh"
+#include "Log.hh"
+
+namespace DupModule {
+
+ConnectionPool::ConnectionPool(tHandleFactory pFactory)
+: mFactory(pFactory)
+, mMaxIdle(4)
+, mMaxTotal(0)
+, mIdleTimeoutMs(30000)
+, mRefusedCount(0) {
+}
+
+ConnectionPool::~ConnectionPool() {
+    typedef std::pair<const std::string, tDestinationPool> value_type;
+    BOOST_FOREACH(value_type &lPool, mPools) {
+        BOOST_FOREACH(tIdleHandle &lHandle, lPool.second.mIdle) {
+            curl_easy_cleanup(lHandle.mCurl);
+        }
+    }
+}
+
+void
+ConnectionPool::setLimits(size_t pMaxIdle, size_t pMaxTotal, unsigned int pIdleTimeoutMs) {
+    boost::lock_guard<boost::mutex> lLock(mMutex);
+    mMaxIdle = pMaxIdle;
+    mMaxTotal = pMaxTotal;
+    mIdleTimeoutMs = pIdleTimeoutMs;
+}
+
+void
+ConnectionPool::expire(tDestinationPool &pPool, const boost::posix_time::ptime &pNow) {
+    if (!mIdleTimeoutMs) {
+        return;
+    }
+    // The oldest handles are at the front
+    while (!pPool.mIdle.empty() &&
+           (pNow - pPool.mIdle.front().mSince).total_milliseconds() >= mIdleTimeoutMs) {
+        curl_easy_cleanup(pPool.mIdle.front().mCurl);
+        pPool.mIdle.pop_front();
+        pPool.mTotal--;
+    }
+}
+
+CURL *
+ConnectionPool::acquire(const std::string &pDestination) {
+    {
+        boost::lock_guard<boost::mutex> lLock(mMutex);
+        tDestinationPool &lPool = mPools[pDestination];
+        expire(lPool, boost::posix_time::microsec_clock::universal_time());
+        if (!lPool.mIdle.empty()) {
+            // The most recently used handle has the best chance to still have its connection open
+            CURL *lCurl = lPool.mIdle.back().mCurl;
+            lPool.mIdle.pop_back();
+            return lCurl;
+        }
+        if (mMaxTotal && lPool.mTotal >= mMaxTotal) {
+            // All the handles of the destination are busy
+            __sync_fetch_and_add(&mRefusedCount, 1);
+            return NULL;
+        }
+        lPool.mTotal++;
+    }
+    // Handle creation does not need the lock
+    CURL *lCurl = mFactory();
+    if (!lCurl) {
+        boost::lock_guard<boost::mutex> lLock(mMutex);
+        mPools[pDestination].mTotal--;
+    }
+    return lCurl;
+}
+
+void
+ConnectionPool::release(const std::string &pDestination, CURL *pCurl) {
+    if (!pCurl) {
+        return;
+    }
+    boost::lock_guard<boost::mutex> lLock(mMutex);
+    tDestinationPool &lPool = mPools[pDestination];
+    boost::posix_time::ptime lNow = boost::posix_time::microsec_clock::universal_time();
+    expire(lPool, lNow);
+    if (lPool.mIdle.size() >= mMaxIdle || (mMaxTotal && lPool.mTotal > mMaxTotal)) {
+        // Over the limits: close the handle and its connection
+        curl_easy_cleanup(pCurl);
+        lPool.mTotal--;
+        return;
+    }
+    tIdleHandle lHandle;
+    lHandle.mCurl = pCurl;
+    lHandle.mSince = lNow;
+    lPool.mIdle.push_back(lHandle);
+}
+
+const unsigned int
+ConnectionPool::getRefusedCount() {
+    // Atomic read + reset
+    return __sync_fetch_and_and(&mRefusedCount, 0);
+}
+
+size_t
+ConnectionPool::getIdleCount(const std::string &pDestination) {
+    boost::lock_guard<boost::mutex> lLock(mMutex);
+    std::map<std::string, tDestinationPool>::const_iterator lIt = mPools.find(pDestination);
+    return lIt == mPools.end() ? 0 : lIt->second.mIdle.size();
+}
+
+CurlShare::CurlShare()
+: mShare(NULL) {
+}
+
+CurlShare::~CurlShare() {
+    if (mShare) {
+        curl_share_cleanup(mShare);
+    }
+}
+
+bool
+CurlShare::init() {
+    if (mShare) {
+        return true;
+    }
+    mShare = curl_share_init();
+    if (!mShare) {
+        return false;
+    }
+    curl_share_setopt(mShare, CURLSHOPT_LOCKFUNC, &CurlShare::lock);
+    curl_share_setopt(mShare, CURLSHOPT_UNLOCKFUNC, &CurlShare::unlock);
+    curl_share_setopt(mShare, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(mShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(mShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    // The connection cache is not shared: libcurl does not support using shared connections from concurrent threads.
+    // Connections are kept warm across the workers by the ConnectionPool instead.
+    return true;
+}
+
+void
+CurlShare::lock(CURL *pCurl, curl_lock_data pData, curl_lock_access pAccess, void *pUserPtr) {
+    static_cast<CurlShare *>(pUserPtr)->mLocks[pData].lock();
+}
+
+void
+CurlShare::unlock(CURL *pCurl, curl_lock_data pData, void *pUserPtr) {
+    static_cast<CurlShare *>(pUserPtr)->mLocks[pData].unlock();
+}
+
+}
@@ -0,0 +1,198 @@
+/*
+ * mod_dup - duplicates apache requests
+ *
+ * Copyright (C) 2013 Orange
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <curl/curl.h>
+#include <list>
+#include <map>
+#include <string>
+
+namespace DupModule {
+
+/**
+ * @brief Keeps curl easy handles, and with them their open connections, per duplication destination.
+ * A handle is only given back for the destination it was released for, so that its connection can be reused
+ * instead of paying a new TCP (and TLS) handshake for every duplication.
+ * At most mMaxIdle handles are kept per destination, and at most mMaxTotal live handles: no handle is given once
+ * they are all in use, so that a slow destination does not get more and more connections opened to it.
+ * Handles idle for longer than mIdleTimeout are closed.
+ */
+class ConnectionPool
+{
+public:
+    /** @brief The type of the function object creating new curl handles */
+    typedef boost::function0<CURL *> tHandleFactory;
+
+    /**
+     * @brief Constructs a ConnectionPool
+     * @param pFactory the function creating and initializing new curl handles
+     */
+    ConnectionPool(tHandleFactory pFactory);
+
+    /**
+     * @brief Closes all the idle handles
+     */
+    ~ConnectionPool();
+
+    /**
+     * @brief Set the limits of the pool
+     * @param pMaxIdle the maximum number of idle handles kept per destination
+     * @param pMaxTotal the maximum number of live handles per destination, 0 means no limit
+     * @param pIdleTimeoutMs the time in ms after which an idle handle gets closed, 0 means never
+     */
+    void
+    setLimits(size_t pMaxIdle, size_t pMaxTotal, unsigned int pIdleTimeoutMs);
+
+    /**
+     * @brief Get a handle to send a request to a destination
+     * @param pDestination the destination in &lt;host>[:&lt;port>] format
+     * @return an idle handle of this destination if there is one, a new handle otherwise. NULL if curl fails or if
+     * the destination already has its maximum number of live handles, all in use.
+     */
+    CURL *
+    acquire(const std::string &pDestination);
+
+    /**
+     * @brief Give back a handle acquired for a destination
+     * @param pDestination the destination the handle was acquired for
+     * @param pCurl the handle
+     */
+    void
+    release(const std::string &pDestination, CURL *pCurl);
+
+    /**
+     * @brief Get the number of idle handles kept for a destination
+     */
+    size_t
+    getIdleCount(const std::string &pDestination);
+
+    /**
+     * @brief Get the number of handles refused because of mMaxTotal since last call to this method
+     */
+    const unsigned int
+    getRefusedCount();
+
+    /** @brief The maximum number of idle handles kept per destination */
+    size_t
+    getMaxIdle() const {
+        return mMaxIdle;
+    }
+
+    /** @brief The maximum number of live handles per destination, 0 if there is no limit */
+    size_t
+    getMaxTotal() const {
+        return mMaxTotal;
+    }
+
+    /** @brief The time in ms after which an idle handle gets closed, 0 if never */
+    unsigned int
+    getIdleTimeout() const {
+        return mIdleTimeoutMs;
+    }
+
+private:
+    /** @brief A handle waiting to be reused */
+    struct tIdleHandle {
+        CURL                        *mCurl;
+        /** When the handle was released */
+        boost::posix_time::ptime    mSince;
+    };
+
+    /** @brief The handles of one destination */
+    struct tDestinationPool {
+        tDestinationPool() : mTotal(0) {}
+
+        /** Idle handles, the most recently released one last */
+        std::list<tIdleHandle>      mIdle;
+        /** Number of live handles, idle or in use */
+        size_t                      mTotal;
+    };
+
+    /**
+     * @brief Close the handles of a destination which were idle for too long. Must be called with the lock held.
+     */
+    void
+    expire(tDestinationPool &pPool, const boost::posix_time::ptime &pNow);
+
+    /** @brief Creates the new handles */
+    tHandleFactory                              mFactory;
+    /** @brief The handles, indexed by destination */
+    std::map<std::string, tDestinationPool>     mPools;
+    /** @brief Protects mPools */
+    boost::mutex                                mMutex;
+    /** @brief The maximum number of idle handles kept per destination */
+    size_t                                      mMaxIdle;
+    /** @brief The maximum number of live handles per destination */
+    size_t                                      mMaxTotal;
+    /** @brief The time in ms after which an idle handle gets closed */
+    unsigned int                                mIdleTimeoutMs;
+    /** @brief The number of handles refused because of mMaxTotal */
+    volatile unsigned int                       mRefusedCount;
+};
+
+/**
+ * @brief A curl share object, letting all the handles of the process use the same DNS and TLS session caches.
+ * New handles, and so new worker threads, get the addresses and sessions already known instead of resolving
+ * and negotiating again.
+ * It must be destroyed after all the handles using it.
+ */
+class CurlShare
+{
+public:
+    CurlShare();
+
+    /**
+     * @brief Releases the share object
+     */
+    ~CurlShare();
+
+    /**
+     * @brief Create the share object. To call in each child process, once curl is globally initialized.
+     * @return true if the share object could be created
+     */
+    bool
+    init();
+
+    /**
+     * @brief Get the share object to set as CURLOPT_SHARE, NULL if not initialized
+     */
+    CURLSH *
+    get() const {
+        return mShare;
+    }
+
+private:
+    /** @brief The lock callback of the share object */
+    static void
+    lock(CURL *pCurl, curl_lock_data pData, curl_lock_access pAccess, void *pUserPtr);
+
+    /** @brief The unlock callback of the share object */
+    static void
+    unlock(CURL *pCurl, curl_lock_data pData, void *pUserPtr);
+
+    /** @brief The share object */
+    CURLSH                                      *mShare;
+    /** @brief One mutex per kind of shared data */
+    boost::mutex                                mLocks[CURL_LOCK_DATA_LAST];
+};
+
+}
@@ -0,0 +1,229 @@
+/*
+ * mod_dup - duplicates apache requests
+ *
+ * Copyright (C) 2013 Orange
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <errno.h>
+#include <fstream>
+#include <pthread.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <vector>
+
+#include "CpuPolicy.hh"
+#include "Log.hh"
+
+namespace DupModule {
+
+const char *CpuPolicy::cCgroupRoot = "/sys/fs/cgroup";
+
+const char *CpuPolicy::cProcCgroup = "/proc/self/cgroup";
+
+/**
+ * @brief Returns the number of CPUs the quota set in a cgroup directory allows, 0 if it sets none
+ * @param pDir the directory of the cgroup
+ * @param pV2 true for cgroup v2
+ */
+static double
+readCpuQuota(const std::string &pDir, bool pV2) {
+    std::string lQuota, lPeriod;
+    if (pV2) {
+        // "<quota> <period>", or "max <period>" without a quota
+        std::ifstream lMax((pDir + "/cpu.max").c_str());
+        if (!(lMax >> lQuota >> lPeriod)) {
+            return 0;
+        }
+    } else {
+        // A quota of -1 means none
+        std::ifstream lQuotaFile((pDir + "/cpu.cfs_quota_us").c_str());
+        std::ifstream lPeriodFile((pDir + "/cpu.cfs_period_us").c_str());
+        if (!(lQuotaFile >> lQuota) || !(lPeriodFile >> lPeriod)) {
+            return 0;
+        }
+    }
+    try {
+        double lQuotaUs = boost::lexical_cast<double>(lQuota);
+        double lPeriodUs = boost::lexical_cast<double>(lPeriod);
+        return lQuotaUs > 0 && lPeriodUs > 0 ? lQuotaUs / lPeriodUs : 0;
+    } catch (boost::bad_lexical_cast&) {
+        // "max"
+        return 0;
+    }
+}
+
+/**
+ * @brief Returns the lowest quota of a cgroup and of its parents, 0 if none sets one
+ * @param pRoot the root of the hierarchy
+ * @param pPath the cgroup, relative to pRoot
+ * @param pV2 true for cgroup v2
+ */
+static double
+readLowestCpuQuota(const std::string &pRoot, std::string pPath, bool pV2) {
+    double lLowest = 0;
+    for (;;) {
+        double lQuota = readCpuQuota(pRoot + pPath, pV2);
+        if (lQuota > 0 && (!lLowest || lQuota < lLowest)) {
+            lLowest = lQuota;
+        }
+        size_t lSlash = pPath.rfind('/');
+        if (pPath.empty() || lSlash == std::string::npos) {
+            return lLowest;
+        }
+        pPath.erase(lSlash);
+    }
+}
+
+CpuPolicy::CpuPolicy()
+: mPinned(false)
+, mIdle(false)
+, mNice(0)
+, mWarned(0) {
+    CPU_ZERO(&mCpus);
+}
+
+bool
+CpuPolicy::setAffinity(const std::string &pCpus) {
+    cpu_set_t lCpus;
+    CPU_ZERO(&lCpus);
+    std::vector<std::string> lRanges;
+    boost::algorithm::split(lRanges, pCpus, boost::algorithm::is_any_of(","));
+    try {
+        for (std::vector<std::string>::const_iterator lIt = lRanges.begin(); lIt != lRanges.end(); ++lIt) {
+            size_t lDash = lIt->find('-');
+            unsigned int lFirst = boost::lexical_cast<unsigned int>(lIt->substr(0, lDash));
+            unsigned int lLast = lDash == std::string::npos ? lFirst : boost::lexical_cast<unsigned int>(lIt->substr(lDash + 1));
+            if (lFirst > lLast || lLast >= CPU_SETSIZE) {
+                return false;
+            }
+            for (unsigned int lCpu = lFirst; lCpu <= lLast; ++lCpu) {
+                CPU_SET(lCpu, &lCpus);
+            }
+        }
+    } catch (boost::bad_lexical_cast&) {
+        return false;
+    }
+    mCpus = lCpus;
+    mPinned = true;
+    return true;
+}
+
+void
+CpuPolicy::setIdle() {
+    mIdle = true;
+    mNice = 0;
+}
+
+bool
+CpuPolicy::setNice(int pNice) {
+    // Lowering it would need privileges, and take the cycles of the Apache threads
+    if (pNice < 0 || pNice > 19) {
+        return false;
+    }
+    mNice = pNice;
+    mIdle = false;
+    return true;
+}
+
+bool
+CpuPolicy::apply() const {
+    const char *lWhat = NULL;
+    if (mPinned && pthread_setaffinity_np(pthread_self(), sizeof(mCpus), &mCpus)) {
+        lWhat = "CPU affinity";
+    }
+#ifdef SCHED_IDLE
+    struct sched_param lParam;
+    lParam.sched_priority = 0;
+    // On Linux, the scheduling class and the nice value are per thread
+    if (mIdle && sched_setscheduler(0, SCHED_IDLE, &lParam)) {
+        lWhat = "SCHED_IDLE class";
+    }
+#endif
+    if (mNice && setpriority(PRIO_PROCESS, syscall(SYS_gettid), mNice)) {
+        lWhat = "nice value";
+    }
+    if (!lWhat) {
+        return true;
+    }
+    if (!__sync_lock_test_and_set(&mWarned, 1)) {
+        Log::warn(307, "Cannot set the %s of the worker threads: %s", lWhat, strerror(errno));
+    }
+    return false;
+}
+
+int
+CpuPolicy::getCpuCount() const {
+    return mPinned ? CPU_COUNT(&mCpus) : 0;
+}
+
+size_t
+CpuPolicy::scaleThreads(size_t pMaxThreads, const std::string &pCgroupRoot, const std::string &pProcCgroup) {
+    double lQuota = getCpuQuota(pCgroupRoot, pProcCgroup);
+    long lOnline = sysconf(_SC_NPROCESSORS_ONLN);
+    if (lQuota <= 0 || lOnline <= 0 || lQuota >= lOnline) {
+        return pMaxThreads;
+    }
+    return std::max<size_t>(1, std::ceil(pMaxThreads * lQuota / lOnline));
+}
+
+double
+CpuPolicy::getCpuQuota(const std::string &pCgroupRoot, const std::string &pProcCgroup) {
+    // Lines of "<id>:<controllers>:<path>": "0::<path>" with v2, the one with the cpu controller with v1
+    std::string lV2Path, lV1Path;
+    bool lV2 = false, lV1 = false;
+    std::ifstream lProcCgroup(pProcCgroup.c_str());
+    std::string lLine;
+    while (std::getline(lProcCgroup, lLine)) {
+        size_t lFirst = lLine.find(':');
+        size_t lSecond = lFirst == std::string::npos ? std::string::npos : lLine.find(':', lFirst + 1);
+        if (lSecond == std::string::npos) {
+            continue;
+        }
+        std::string lList = lLine.substr(lFirst + 1, lSecond - lFirst - 1);
+        std::vector<std::string> lControllers;
+        boost::algorithm::split(lControllers, lList, boost::algorithm::is_any_of(","));
+        if (lLine.compare(0, lSecond + 1, "0::") == 0) {
+            lV2 = true;
+            lV2Path = lLine.substr(lSecond + 1);
+        } else if (std::find(lControllers.begin(), lControllers.end(), "cpu") != lControllers.end()) {
+            lV1 = true;
+            lV1Path = lLine.substr(lSecond + 1);
+        }
+    }
+    // "/" is the root itself
+    if (lV1Path == "/") {
+        lV1Path.clear();
+    }
+    if (lV2Path == "/") {
+        lV2Path.clear();
+    }
+    if (!lV1 && !lV2) {
+        // Without the list, the cgroup is looked for at the root, as when the process has its own cgroup namespace
+        lV2 = std::ifstream((pCgroupRoot + "/cpu.max").c_str()).good();
+        lV1 = !lV2;
+    }
+    // The cpu controller is only in the v2 hierarchy if it is not in a v1 one
+    double lQuota = lV1 ? readLowestCpuQuota(pCgroupRoot + "/cpu", lV1Path, false)
+                        : readLowestCpuQuota(pCgroupRoot, lV2Path, true);
+    return lQuota;
+}
+
+}
@@ -0,0 +1,112 @@
+/*
+ * mod_dup - duplicates apache requests
+ *
+ * Copyright (C) 2013 Orange
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sched.h>
+#include <string>
+
+namespace DupModule {
+
+/**
+ * @brief Where and at which priority the worker threads of a pool run, so that they do not take the CPU of the
+ * Apache threads serving the requests.
+ * The workers can be pinned to a set of CPUs, and run either in the SCHED_IDLE class, which only gets the cycles no
+ * other thread wants, or with a higher nice value. Both only apply to the threads which call apply.
+ */
+class CpuPolicy
+{
+public:
+    /** @brief The default root of the cgroup file system */
+    static const char *cCgroupRoot;
+    /** @brief The file listing the cgroups of the process */
+    static const char *cProcCgroup;
+
+    CpuPolicy();
+
+    /**
+     * @brief Pin the workers to a set of CPUs
+     * @param pCpus the list of CPUs or ranges of CPUs, such as 0-3,6
+     * @return false if the list is not valid
+     */
+    bool
+    setAffinity(const std::string &pCpus);
+
+    /**
+     * @brief Run the workers in the SCHED_IDLE class
+     */
+    void
+    setIdle();
+
+    /**
+     * @brief Run the workers with a nice value
+     * @param pNice the nice value, from 0 to 19
+     * @return false if the value is not valid
+     */
+    bool
+    setNice(int pNice);
+
+    /**
+     * @brief Apply the policy to the calling thread
+     * @return false if it could not be applied, which is logged once per policy
+     */
+    bool
+    apply() const;
+
+    /**
+     * @brief Returns the number of CPUs in the set of the affinity, 0 if the workers are not pinned
+     */
+    int
+    getCpuCount() const;
+
+    /**
+     * @brief Returns the maximum number of threads a pool should run under the CPU quota of the cgroup of the
+     * process, in proportion to the share of the online CPUs the quota allows
+     * @param pMaxThreads the maximum number of threads without a quota
+     * @param pCgroupRoot the root of the cgroup file system
+     * @param pProcCgroup the file listing the cgroups of the process
+     */
+    static size_t
+    scaleThreads(size_t pMaxThreads, const std::string &pCgroupRoot = cCgroupRoot,
+                 const std::string &pProcCgroup = cProcCgroup);
+
+    /**
+     * @brief Returns the number of CPUs the CPU quota of the cgroup of the process allows, 0 if there is no quota.
+     * The cgroup is the one of the cpu controller with cgroup v1, the 0:: one with v2, as listed in pProcCgroup.
+     * The lowest quota of the cgroup and of its parents applies: cpu.max with v2, cpu.cfs_quota_us and
+     * cpu.cfs_period_us under cpu/ with v1.
+     * @param pCgroupRoot the root of the cgroup file system
+     * @param pProcCgroup the file listing the cgroups of the process
+     */
+    static double
+    getCpuQuota(const std::string &pCgroupRoot = cCgroupRoot, const std::string &pProcCgroup = cProcCgroup);
+
+private:
+    /** @brief The CPUs the workers are pinned to */
+    cpu_set_t           mCpus;
+    /** @brief true if the workers are pinned */
+    bool                mPinned;
+    /** @brief true to run the workers in the SCHED_IDLE class */
+    bool                mIdle;
+    /** @brief The nice value of the workers, 0 to keep the one of the process */
+    int                 mNice;
+    /** @brief 1 once a failure to apply the policy was logged */
+    mutable volatile int mWarned;
+};
+
+}
@@ -0,0 +1,149 @@
+/*
+ * mod_dup - duplicates apache requests
+ *
+ * Copyright (C) 2013 Orange
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "DestinationHealth.hh"
+#include "Log.hh"
+
+namespace DupModule {
+
+/// @brief The number of latencies the percentile is computed on
+static const size_t cLatencySamples = 256;
+/// @brief The percentile is computed again every cLatencyRefresh new latencies
+static const unsigned int cLatencyRefresh = 32;
+
+tHealthSettings::tHealthSettings()
+: mErrorRate(0)
+, mWindow(20)
+, mOpenMs(5000)
+, mMinTimeoutMs(0)
+, mTimeoutFactor(3) {
+}
+
+DestinationHealth::DestinationHealth()
+: mState(CLOSED)
+, mProbe(0)
+, mResultPos(0)
+, mFailures(0)
+, mLatencyPos(0)
+, mNewLatencies(0)
+, mLatencyP99(0) {
+}
+
+void
+DestinationHealth::open(const tHealthSettings &pSettings, const boost::posix_time::ptime &pNow) {
+    if (mState == CLOSED) {
+        Log::warn(304, "Destination %s is failing, not duplicating to it for %u ms", mName.c_str(), pSettings.mOpenMs);
+    }
+    mState = OPEN;
+    mRetryAt = pNow + boost::posix_time::milliseconds(pSettings.mOpenMs);
+}
+
+bool
+DestinationHealth::allowRequest(const tHealthSettings &pSettings, unsigned int &pProbe) {
+    pProbe = 0;
+    if (!pSettings.mErrorRate || mState == CLOSED) {
+        return true;
+    }
+    boost::lock_guard<boost::mutex> lLock(mMutex);
+    if (mState == OPEN && boost::posix_time::microsec_clock::universal_time() >= mRetryAt) {
+        // This request is the probe, 0 is no probe
+        mState = HALF_OPEN;
+        if (!++mProbe) {
+            ++mProbe;
+        }
+        pProbe = mProbe;
+        return true;
+    }
+    return mState == CLOSED;
+}
+
+void
+DestinationHealth::onResult(const tHealthSettings &pSettings, unsigned int pProbe, bool pSuccess, unsigned int pLatencyMs) {
+    boost::lock_guard<boost::mutex> lLock(mMutex);
+
+    if (pSuccess && pSettings.mMinTimeoutMs) {
+        if (mLatencies.size() < cLatencySamples) {
+            mLatencies.push_back(pLatencyMs);
+        } else {
+            mLatencies[mLatencyPos] = pLatencyMs;
+            mLatencyPos = (mLatencyPos + 1) % cLatencySamples;
+        }
+        if (++mNewLatencies >= cLatencyRefresh) {
+            mNewLatencies = 0;
+            std::vector<unsigned int> lSorted(mLatencies);
+            std::vector<unsigned int>::iterator lP99 = lSorted.begin() + (lSorted.size() * 99) / 100;
+            std::nth_element(lSorted.begin(), lP99, lSorted.end());
+            mLatencyP99 = *lP99;
+        }
+    }
+
+    if (!pSettings.mErrorRate) {
+        return;
+    }
+
+    if (mState == OPEN) {
+        // A request sent before the circuit opened
+        return;
+    }
+    if (mState == HALF_OPEN) {
+        if (pProbe != mProbe) {
+            // A request sent before the circuit opened, which says nothing of the destination now
+            return;
+        }
+        if (pSuccess) {
+            Log::notice(202, "Destination %s answers again, duplicating to it", mName.c_str());
+            mState = CLOSED;
+            mResults.assign(pSettings.mWindow, false);
+            mResultPos = 0;
+            mFailures = 0;
+        } else {
+            open(pSettings, boost::posix_time::microsec_clock::universal_time());
+        }
+        return;
+    }
+
+    if (mResults.size() != pSettings.mWindow) {
+        mResults.assign(pSettings.mWindow, false);
+        mResultPos = 0;
+        mFailures = 0;
+    }
+    // Replace the oldest result
+    mFailures -= mResults[mResultPos];
+    mResults[mResultPos] = !pSuccess;
+    mFailures += !pSuccess;
+    mResultPos = (mResultPos + 1) % mResults.size();
+
+    if (mFailures * 100 >= pSettings.mErrorRate * pSettings.mWindow) {
+        open(pSettings, boost::posix_time::microsec_clock::universal_time());
+    }
+}
+
+unsigned int
+DestinationHealth::getTimeout(const tHealthSettings &pSettings, unsigned int pMaxTimeout) const {
+    unsigned int lP99 = mLatencyP99;
+    if (!pSettings.mMinTimeoutMs || !lP99) {
+        return pMaxTimeout;
+    }
+    unsigned int lTimeout = std::max(lP99 * pSettings.mTimeoutFactor, pSettings.mMinTimeoutMs);
+    return pMaxTimeout ? std::min(lTimeout, pMaxTimeout) : lTimeout;
+}
+
+}
@@ -0,0 +1,138 @@
+/*
+ * mod_dup - duplicates apache requests
+ *
+ * Copyright (C) 2013 Orange
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <string>
+#include <vector>
+
+namespace DupModule {
+
+/**
+ * @brief The settings of the circuit breakers and adaptive timeouts, common to all destinations
+ */
+struct tHealthSettings {
+    tHealthSettings();
+
+    /** The percentage of failed requests over the window which opens the circuit, 0 disables the circuit breaker */
+    unsigned int    mErrorRate;
+    /** The number of last results the error rate is computed on */
+    unsigned int    mWindow;
+    /** The time in ms the circuit stays open before a probe request is let through */
+    unsigned int    mOpenMs;
+    /** The lowest timeout in ms an adaptive timeout can get to, 0 disables adaptive timeouts */
+    unsigned int    mMinTimeoutMs;
+    /** The adaptive timeout is the 99th percentile of the latencies times this factor */
+    unsigned int    mTimeoutFactor;
+};
+
+/**
+ * @brief The health of a duplication destination: a circuit breaker and an adaptive timeout.
+ * The circuit is closed as long as the destination answers. When the rate of failed requests (curl errors, timeouts
+ * included) over the last results goes over a threshold, it opens: no request is sent for a while. Then it is
+ * half open: a single probe request is let through, which closes the circuit if it succeeds, or opens it again.
+ * The results of the requests sent before the circuit opened, which can come in while it is half open, are ignored.
+ * The adaptive timeout follows the 99th percentile of the latencies of the successful requests, so that a
+ * destination which stops answering costs a small multiple of its usual latency instead of the full timeout.
+ */
+class DestinationHealth : private boost::noncopyable
+{
+public:
+    enum eState {
+        CLOSED      = 0,    // Requests are sent
+        OPEN        = 1,    // Requests are dropped
+        HALF_OPEN   = 2,    // A probe request is in flight, the others are dropped
+    };
+
+    DestinationHealth();
+
+    /**
+     * @brief Set the name used in the log messages
+     */
+    void
+    setName(const std::string &pName) {
+        mName = pName;
+    }
+
+    /**
+     * @brief Returns true if a request can be sent to the destination. Must be followed by a call to onResult if so.
+     * @param pSettings the circuit breaker settings
+     * @param pProbe set to the token of the request if it is the probe of a half open circuit, 0 otherwise
+     */
+    bool
+    allowRequest(const tHealthSettings &pSettings, unsigned int &pProbe);
+
+    /**
+     * @brief Account for the result of a request
+     * @param pSettings the circuit breaker settings
+     * @param pProbe the token allowRequest gave to the request
+     * @param pSuccess false if the request failed or timed out
+     * @param pLatencyMs the time the request took
+     */
+    void
+    onResult(const tHealthSettings &pSettings, unsigned int pProbe, bool pSuccess, unsigned int pLatencyMs);
+
+    /**
+     * @brief Get the timeout to use for the next request
+     * @param pSettings the adaptive timeout settings
+     * @param pMaxTimeout the configured timeout, never exceeded
+     */
+    unsigned int
+    getTimeout(const tHealthSettings &pSettings, unsigned int pMaxTimeout) const;
+
+    /** @brief The state of the circuit */
+    eState
+    getState() const {
+        return mState;
+    }
+
+private:
+    /** @brief Open the circuit. Must be called with the lock held. */
+    void
+    open(const tHealthSettings &pSettings, const boost::posix_time::ptime &pNow);
+
+    /** @brief The name used in the log messages */
+    std::string                         mName;
+    /** @brief Protects everything below */
+    boost::mutex                        mMutex;
+    /** @brief The state of the circuit, read without the lock */
+    volatile eState                     mState;
+    /** @brief When the circuit goes from open to half open */
+    boost::posix_time::ptime            mRetryAt;
+    /** @brief The token of the last probe request, only its result closes or opens a half open circuit */
+    unsigned int                        mProbe;
+    /** @brief true if the request was a failure, for the last mWindow results */
+    std::vector<bool>                   mResults;
+    /** @brief The position of the next result in mResults */
+    size_t                              mResultPos;
+    /** @brief The number of failures in mResults */
+    unsigned int                        mFailures;
+    /** @brief The latencies of the last successful requests */
+    std::vector<unsigned int>           mLatencies;
+    /** @brief The position of the next latency in mLatencies */
+    size_t                              mLatencyPos;
+    /** @brief The number of latencies recorded since the percentile was last computed */
+    unsigned int                        mNewLatencies;
+    /** @brief The 99th percentile of mLatencies, 0 until enough latencies are known */
+    volatile unsigned int               mLatencyP99;
+};
+
+}
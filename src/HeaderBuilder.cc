@@ -0,0 +1,133 @@
+/*
+ * mod_dup - duplicates apache requests
+ *
+ * Copyright (C) 2013 Orange
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <boost/foreach.hpp>
+#include <cstdio>
+
+#include "HeaderBuilder.hh"
+
+namespace DupModule {
+
+/// @brief Headers never copied from the original request: set by curl or per duplication by mod_dup
+static const char *cAlwaysReserved[] = {
+    "Host", "Transfer-Encoding", "Content-Length", "Duplication-Type", "ELAPSED_TIME_BY_DUP", NULL
+};
+
+HeaderTemplate::HeaderTemplate(DuplicationType::eDuplicationType pDuplicationType) {
+    // This avoids the Expect: 100 continue
+    // Which is generated by curl when it's a POST and the body is long
+    mLines.push_back("Expect:");
+    mLines.push_back("X-DUPLICATED-REQUEST: 1");
+    // Setting mod-dup as the real agent for tracability
+    mLines.push_back("User-RealAgent: mod-dup");
+    if (pDuplicationType == DuplicationType::REQUEST_WITH_ANSWER) {
+        mLines.push_back("Content-Type: application/x-dup-serialized");
+        // Indicates that the request is duplicated with its answer
+        mLines.push_back("Duplication-Type: Response");
+    }
+
+    BOOST_FOREACH(const std::string &lLine, mLines) {
+        mReserved.push_back(lLine.substr(0, lLine.find(':')));
+    }
+    for (const char **lName = cAlwaysReserved; *lName; ++lName) {
+        mReserved.push_back(*lName);
+    }
+}
+
+bool
+HeaderTemplate::isReserved(const std::string &pName) const {
+    BOOST_FOREACH(const std::string &lReserved, mReserved) {
+        if (lReserved == pName) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+HeaderBuilder::clear() {
+    mBuffer.clear();
+    mLines.clear();
+    mNames.clear();
+}
+
+void
+HeaderBuilder::add(const HeaderTemplate &pTemplate) {
+    BOOST_FOREACH(const std::string &lLine, pTemplate.lines()) {
+        mLines.push_back(std::make_pair(lLine.c_str(), 0));
+    }
+}
+
+void
+HeaderBuilder::startLine() {
+    mLines.push_back(std::make_pair(static_cast<const char *>(NULL), mBuffer.size()));
+}
+
+void
+HeaderBuilder::add(const char *pName, const std::string &pValue) {
+    startLine();
+    mBuffer.append(pName);
+    mBuffer.append(": ", 2);
+    mBuffer.append(pValue);
+    mBuffer.push_back('\0');
+}
+
+void
+HeaderBuilder::add(const char *pName, long pValue) {
+    char lValue[24];
+    int lLength = snprintf(lValue, sizeof(lValue), "%ld", pValue);
+    startLine();
+    mBuffer.append(pName);
+    mBuffer.append(": ", 2);
+    mBuffer.append(lValue, lLength);
+    mBuffer.push_back('\0');
+}
+
+void
+HeaderBuilder::addOriginal(const RequestInfo::tHeaders &pHeaders, const HeaderTemplate &pTemplate) {
+    BOOST_FOREACH(const RequestInfo::tHeaders::value_type &v, pHeaders) {
+        if (pTemplate.isReserved(v.first)) {
+            continue;
+        }
+        bool lDuplicate = false;
+        BOOST_FOREACH(const std::string *lName, mNames) {
+            if (*lName == v.first) {
+                lDuplicate = true;
+                break;
+            }
+        }
+        if (!lDuplicate) {
+            mNames.push_back(&v.first);
+            add(v.first.c_str(), v.second);
+        }
+    }
+}
+
+struct curl_slist *
+HeaderBuilder::get() {
+    // The buffer does not move anymore: the nodes can point into it
+    mNodes.resize(mLines.size());
+    for (size_t i = 0; i < mLines.size(); ++i) {
+        const char *lData = mLines[i].first ? mLines[i].first : mBuffer.data() + mLines[i].second;
+        mNodes[i].data = const_cast<char *>(lData);
+        mNodes[i].next = i + 1 < mLines.size() ? &mNodes[i + 1] : NULL;
+    }
+    return mNodes.empty() ? NULL : &mNodes[0];
+}
+
+}
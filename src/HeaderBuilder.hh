@@ -0,0 +1,127 @@
+/*
+ * mod_dup - duplicates apache requests
+ *
+ * Copyright (C) 2013 Orange
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <curl/curl.h>
+#include <string>
+#include <vector>
+
+#include "RequestInfo.hh"
+
+namespace DupModule {
+
+/**
+ * @brief The headers sent with every duplication of a destination, computed once at configuration time.
+ * Also knows the headers which must never be copied from the original request: the ones it adds, the ones added
+ * per request by mod_dup, and the ones describing the original connection or body.
+ */
+class HeaderTemplate
+{
+public:
+    /**
+     * @brief Constructs the template of a duplication type
+     * @param pDuplicationType REQUEST_WITH_ANSWER adds the dup format content type headers
+     */
+    HeaderTemplate(DuplicationType::eDuplicationType pDuplicationType);
+
+    /** @brief The header lines, in "name: value" format */
+    const std::vector<std::string> &
+    lines() const {
+        return mLines;
+    }
+
+    /**
+     * @brief Returns true if a header of the original request must not be copied
+     * @param pName the name of the header, case sensitive
+     */
+    bool
+    isReserved(const std::string &pName) const;
+
+private:
+    /** @brief The header lines */
+    std::vector<std::string>    mLines;
+    /** @brief The names of the headers not to copy from the original request */
+    std::vector<std::string>    mReserved;
+};
+
+/**
+ * @brief Builds the header list of a duplication without allocating once warmed up.
+ * The lines of the template are referenced in place, the lines computed per request are written in a buffer kept
+ * from one request to the next, and the curl_slist nodes are stored in a vector instead of being malloced one by one.
+ * The list returned by get must not be freed with curl_slist_free_all, and stays valid until the next call to clear.
+ */
+class HeaderBuilder : private boost::noncopyable
+{
+public:
+    /**
+     * @brief Start a new header list. Keeps the memory already allocated.
+     */
+    void
+    clear();
+
+    /**
+     * @brief Add the lines of a template. The template must outlive the header list.
+     */
+    void
+    add(const HeaderTemplate &pTemplate);
+
+    /**
+     * @brief Add a header line
+     */
+    void
+    add(const char *pName, const std::string &pValue);
+
+    /**
+     * @brief Add a header line with a numerical value
+     */
+    void
+    add(const char *pName, long pValue);
+
+    /**
+     * @brief Add the headers of the original request, except the ones reserved by the template and the duplicates.
+     * Apache would otherwise merge the duplicated values into a csv list.
+     * @param pHeaders the headers of the original request
+     * @param pTemplate the template of the destination
+     */
+    void
+    addOriginal(const RequestInfo::tHeaders &pHeaders, const HeaderTemplate &pTemplate);
+
+    /**
+     * @brief Get the header list to give to CURLOPT_HTTPHEADER, NULL if empty
+     */
+    struct curl_slist *
+    get();
+
+private:
+    /** @brief Starts a line written in the buffer */
+    void
+    startLine();
+
+    /** @brief The lines computed per request, each one null terminated */
+    std::string                                     mBuffer;
+    /** @brief The lines: a template line, or NULL and the offset of the line in the buffer */
+    std::vector<std::pair<const char *, size_t> >   mLines;
+    /** @brief The original headers already added */
+    std::vector<const std::string *>                mNames;
+    /** @brief The nodes of the list given to curl */
+    std::vector<struct curl_slist>                  mNodes;
+};
+
+}
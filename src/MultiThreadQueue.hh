@@ -18,8 +18,17 @@
 
 #pragma once
 
+#include <algorithm>
+#include <climits>
 #include <deque>
+#include <vector>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 #include <boost/foreach.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
 #include <boost/thread.hpp>
 
 #include "Log.hh"
@@ -27,35 +36,539 @@
 namespace DupModule {
 
 /**
- * @brief A thread safe (using boost::mutex and boost::condition_variable) wrapper around a std::deque.
+ * @brief A thread safe FIFO queue built on a lock free bounded ring buffer.
  * It exposes the typical FIFO methods pop and push as well as push_front which makes it possible to add a prioritized item to the front of the queue.
  * It also keeps track of 3 counters for the number of pushed, popped and dropped items. getCounters will return those values and reset them.
  * The class gets the queue item type as its template argument. This makes it independent of any business needs and therefore more easily reusable.
+ *
+ * push and pop only take a compare and swap on the ring indexes (the multi producer multi consumer ring of D. Vyukov):
+ * the producers, which are the Apache threads, never wait for the consumers nor for each other.
+ * The consumers only sleep, on a futex, when the queue is empty. The rare items pushed to the front are kept apart,
+ * under a mutex, and are looked for first.
+ *
+ * When it is full, the queue can spill the items to an overflow, such as a spool on disk, instead of dropping them.
+ * The next items of the classes which were spilled, or which hold their share, then go to the overflow too until it is
+ * drained, and the consumers take the items from the overflow once the rings are empty, so that the items of a class are
+ * still popped in order. While the overflow is full, the items go to the ring again if it has room, ahead of the spilled ones.
+ *
+ * The items can be split into weighted classes, such as the locations they come from, each with its own ring: the consumers
+ * then serve the classes with deficit round robin, so that a class flooding the queue does not starve the others, and a full
+ * queue only drops the items of the classes holding more than their share of it. The round is lock free too: the consumers
+ * take the turns of the current class with a compare and swap, and the first one to find them used moves the round on.
+ *
+ * The queue also helps a thread pool size itself: it tells the consumers which stay idle too long to exit, by handing
+ * them a retire item without it ever being queued, and it wakes up whoever waits for the queue to reach a high water mark.
  */
 template <typename T>
-class MultiThreadQueue
+class MultiThreadQueue : private boost::noncopyable
 {
 private:
-    /** @brief The underlying queue holding the itms */
-    std::deque<T> mQueue;
-    /** @brief The mutex used to ensure thread safety */
-    boost::mutex mMutex;
-    /** @brief Used to make pull-clients wait and wake them up when necessary */
-    boost::condition_variable mAvailableCondition;
+public:
+    /** @brief The type of the function object which returns the memory held by an item in bytes */
+    typedef boost::function1<size_t, const T &> tSizeOf;
+
+    /** @brief The type of the function object which returns the index of the class of an item */
+    typedef boost::function1<size_t, const T &> tClassOf;
+
+    /**
+     * @brief Where the items go when the queue is full. Must be thread safe.
+     */
+    class IOverflow {
+    public:
+        virtual ~IOverflow() {}
+
+        /**
+         * @brief Keep an item
+         * @return false if the overflow is full too
+         */
+        virtual bool spill(const T &pItem) = 0;
+
+        /**
+         * @brief Take the oldest item
+         * @return false if the overflow is empty
+         */
+        virtual bool unspill(T &pItem) = 0;
+
+        /** @brief The number of items kept, read on each push and pop: must be cheap */
+        virtual size_t size() const = 0;
+    };
+
+private:
+    /** @brief A slot of the ring */
+    struct tCell {
+        /** @brief The position the cell can be written at, or this position + 1 once written */
+        volatile size_t mSequence;
+        /** @brief The item */
+        T mItem;
+        /** @brief The bytes accounted for the item in mBytes */
+        size_t mBytes;
+    };
+
+    /** @brief The number of times a consumer looks for an item before going to sleep on an empty queue */
+    static const int cSpins = 128;
+
+    /** @brief The capacity of the ring when there is no maximum size */
+    static const size_t cDefaultCapacity = 65536;
+
+    /** @brief A class of items: their ring, and how they are scheduled */
+    struct tClass : private boost::noncopyable {
+        /** @brief The ring holding the items, its size is a power of 2 */
+        std::vector<tCell> mRing;
+        /** @brief The size of the ring minus 1 */
+        size_t mMask;
+        /** @brief The position of the next item to push, on its own cache line */
+        char mPad0[64];
+        volatile size_t mTail;
+        /** @brief The position of the next item to pop, on its own cache line */
+        char mPad1[64];
+        volatile size_t mHead;
+        char mPad2[64];
+        /** @brief The name of the class, for the stats */
+        std::string mName;
+        /** @brief The number of items served per round */
+        unsigned int mWeight;
+        /** @brief The number of items the class may hold when the queue is full */
+        size_t mShare;
+        /** @brief The number of items the class may still be served during the current round */
+        volatile unsigned int mDeficit;
+        /** @brief The number of items of the class in the overflow, at least */
+        volatile size_t mSpilled;
+        /** @brief Number of items of the class dropped since last call to getClassDropCount */
+        volatile unsigned mDropCount;
+
+        tClass(const std::string &pName, unsigned int pWeight) : mMask(0), mTail(0), mHead(0), mName(pName),
+                                                                 mWeight(pWeight), mShare(0), mDeficit(0),
+                                                                 mSpilled(0), mDropCount(0) {
+        }
+
+        /**
+         * @brief Allocate the ring
+         * @param pCapacity the minimum number of items it must hold
+         */
+        void allocate(size_t pCapacity) {
+            size_t lSize = 1;
+            while (lSize < pCapacity) {
+                lSize <<= 1;
+            }
+            std::vector<tCell>(lSize).swap(mRing);
+            for (size_t i = 0; i < lSize; ++i) {
+                mRing[i].mSequence = i;
+            }
+            mMask = lSize - 1;
+            mHead = mTail = 0;
+        }
+
+        /**
+         * @brief Add an item at the back of the ring
+         * @return false if the ring is full
+         */
+        bool push(const T &object, size_t pBytes) {
+            size_t lPos = mTail;
+            for (;;) {
+                tCell &lCell = mRing[lPos & mMask];
+                ssize_t lDiff = static_cast<ssize_t>(lCell.mSequence) - static_cast<ssize_t>(lPos);
+                if (lDiff == 0) {
+                    if (__sync_bool_compare_and_swap(&mTail, lPos, lPos + 1)) {
+                        lCell.mItem = object;
+                        lCell.mBytes = pBytes;
+                        // Publish the item after it is written
+                        __sync_synchronize();
+                        lCell.mSequence = lPos + 1;
+                        return true;
+                    }
+                    lPos = mTail;
+                } else if (lDiff < 0) {
+                    // The cell still holds the item pushed a whole ring ago
+                    return false;
+                } else {
+                    lPos = mTail;
+                }
+            }
+        }
+
+        /**
+         * @brief Remove the item at the front of the ring
+         * @param pBytes filled with the bytes accounted for the item, still in mBytes
+         * @return false if the ring is empty
+         */
+        bool pop(T &pObject, size_t &pBytes) {
+            size_t lPos = mHead;
+            for (;;) {
+                tCell &lCell = mRing[lPos & mMask];
+                ssize_t lDiff = static_cast<ssize_t>(lCell.mSequence) - static_cast<ssize_t>(lPos + 1);
+                if (lDiff == 0) {
+                    if (__sync_bool_compare_and_swap(&mHead, lPos, lPos + 1)) {
+                        pObject = lCell.mItem;
+                        pBytes = lCell.mBytes;
+                        // Do not keep a reference on the item until the cell is reused
+                        lCell.mItem = T();
+                        __sync_synchronize();
+                        lCell.mSequence = lPos + mMask + 1;
+                        return true;
+                    }
+                    lPos = mHead;
+                } else if (lDiff < 0) {
+                    return false;
+                } else {
+                    lPos = mHead;
+                }
+            }
+        }
+
+        /** @brief The number of items in the ring */
+        size_t size() const {
+            size_t lHead = mHead;
+            size_t lTail = mTail;
+            return lTail > lHead ? lTail - lHead : 0;
+        }
+    };
+
+    /** @brief The classes of items, a single one unless setClasses is called */
+    std::vector<tClass *> mClasses;
+    /** @brief Returns the index of the class of an item */
+    tClassOf mClassOf;
+    /** @brief The number of turns of the round robin, modulo the number of classes: the class being served */
+    volatile size_t mCurrentClass;
+    /** @brief The items pushed to the front, most recent first */
+    std::deque<T> mFront;
+    /** @brief The number of items in mFront, read without the lock */
+    volatile size_t mFrontCount;
+    /** @brief Protects mFront */
+    boost::mutex mFrontMutex;
+    /** @brief The futex the consumers sleep on: 1 when some may be sleeping, reset to 0 by the producer waking them */
+    volatile int mSleeping;
     /** @brief Number of added items since last call to getCounters */
-    unsigned mInCount;
+    volatile unsigned mInCount;
     /** @brief Number of removed items since last call to getCounters */
-    unsigned mOutCount;
+    volatile unsigned mOutCount;
     /** @brief Number of dropped items since last call to getCounters */
-    unsigned mDropCount;
+    volatile unsigned mDropCount;
     /** @brief Maximum number of items to be queued after which any new ones should get dropped */
     size_t mDropSize;
+    /** @brief Maximum number of bytes held by the queued items after which any new ones should get dropped, 0 for no limit */
+    size_t mMaxBytes;
+    /** @brief Returns the bytes held by an item */
+    tSizeOf mSizeOf;
+    /** @brief The bytes held by the items queued */
+    volatile size_t mBytes;
+    /** @brief Number of items dropped for being over mMaxBytes since last call to getByteDropCount */
+    volatile unsigned mByteDropCount;
+    /** @brief Where the items go when the queue is full, NULL to drop them */
+    IOverflow *mOverflow;
+    /** @brief Number of items spilled to mOverflow since last call to getSpillCount */
+    volatile unsigned mSpillCount;
+    /** @brief The size beyond which a push raises a high water event, 0 for no event */
+    volatile size_t mHighWater;
+    /** @brief The futex the high water events are waited on: 1 when an event was raised and not consumed yet */
+    volatile int mHighWaterEvent;
+    /** @brief The item handed to the consumers which should exit */
+    T mRetireItem;
+    /** @brief The number of consumers which did not get the retire item */
+    volatile size_t mWorkers;
+    /** @brief The number of consumers which never get the retire item for being idle */
+    size_t mMinWorkers;
+    /** @brief The time in ms after which an idle consumer gets the retire item, 0 to keep them */
+    unsigned int mIdleMs;
+    /** @brief 1 once closed: every consumer gets the retire item */
+    volatile int mClosed;
+
+    /**
+     * @brief Returns the class of an item
+     */
+    tClass &classOf(const T &pItem) {
+        if (mClasses.size() == 1) {
+            return *mClasses.front();
+        }
+        size_t lIndex = mClassOf(pItem);
+        return *mClasses[lIndex < mClasses.size() ? lIndex : 0];
+    }
+
+    /**
+     * @brief Remove the item at the front of the ring of a class, and release its bytes
+     * @return false if the ring is empty
+     */
+    bool popClass(tClass &pClass, T &pObject) {
+        size_t lBytes;
+        if (!pClass.pop(pObject, lBytes)) {
+            return false;
+        }
+        if (lBytes) {
+            __sync_fetch_and_sub(&mBytes, lBytes);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Remove the next item of the rings: the classes are served in turn, each up to its weight per round
+     * @return false if the rings are empty
+     */
+    bool popRing(T &pObject) {
+        if (mClasses.size() == 1) {
+            return popClass(*mClasses.front(), pObject);
+        }
+        // Once around, plus the class the round stopped at
+        for (size_t i = 0; i <= mClasses.size(); ++i) {
+            size_t lCurrent = mCurrentClass;
+            tClass &lClass = *mClasses[lCurrent % mClasses.size()];
+            if (takeTurn(lClass) && popClass(lClass, pObject)) {
+                return true;
+            }
+            // Done for this round, or empty: only the consumer which moves the round on gives the next class its turns,
+            // and an empty class does not save its turns for later
+            if (__sync_bool_compare_and_swap(&mCurrentClass, lCurrent, lCurrent + 1)) {
+                lClass.mDeficit = 0;
+                tClass &lNext = *mClasses[(lCurrent + 1) % mClasses.size()];
+                lNext.mDeficit = lNext.mWeight;
+            }
+        }
+        // The other consumers moved the round on meanwhile: never report an empty queue while a class has items
+        BOOST_FOREACH(tClass *lClass, mClasses) {
+            if (popClass(*lClass, pObject)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Take one of the turns left to a class in the current round
+     * @return false if it has none left
+     */
+    static bool takeTurn(tClass &pClass) {
+        for (;;) {
+            unsigned int lDeficit = pClass.mDeficit;
+            if (lDeficit == 0) {
+                return false;
+            }
+            if (__sync_bool_compare_and_swap(&pClass.mDeficit, lDeficit, lDeficit - 1)) {
+                return true;
+            }
+        }
+    }
+
+    /**
+     * @brief Spill an item to the overflow, accounting for it in its class
+     * @return false if the overflow is full
+     */
+    bool spill(tClass &pClass, const T &pObject) {
+        // Counted first, so that a consumer unspilling it at once never finds the class without spilled items
+        __sync_fetch_and_add(&pClass.mSpilled, 1);
+        if (!mOverflow->spill(pObject)) {
+            __sync_fetch_and_sub(&pClass.mSpilled, 1);
+            return false;
+        }
+        __sync_fetch_and_add(&mSpillCount, 1);
+        return true;
+    }
+
+    /**
+     * @brief Remove the first item of the overflow, accounting for it in its class
+     * @return false if the overflow is empty
+     */
+    bool unspill(T &pObject) {
+        if (!mOverflow || !mOverflow->size() || !mOverflow->unspill(pObject)) {
+            return false;
+        }
+        // Never below 0: the item may have been spilled before the classes changed
+        tClass &lClass = classOf(pObject);
+        for (;;) {
+            size_t lSpilled = lClass.mSpilled;
+            if (lSpilled == 0 || __sync_bool_compare_and_swap(&lClass.mSpilled, lSpilled, lSpilled - 1)) {
+                return true;
+            }
+        }
+    }
+
+    /**
+     * @brief Take all the items out of the rings
+     * @param pItems filled with the items, and the bytes accounted for them
+     */
+    void drain(std::vector<std::pair<T, size_t> > &pItems) {
+        T lItem;
+        size_t lBytes;
+        BOOST_FOREACH(tClass *lClass, mClasses) {
+            while (lClass->pop(lItem, lBytes)) {
+                pItems.push_back(std::make_pair(lItem, lBytes));
+            }
+        }
+    }
+
+    /**
+     * @brief Allocate the rings of the classes and their share of the queue, then put back the items taken out of them
+     * @param pItems the items, and the bytes accounted for them
+     */
+    void refill(const std::vector<std::pair<T, size_t> > &pItems) {
+        unsigned int lTotalWeight = 0;
+        BOOST_FOREACH(tClass *lClass, mClasses) {
+            lTotalWeight += lClass->mWeight;
+        }
+        // The items already queued are kept, even beyond the new maximum size
+        size_t lCapacity = std::max(mDropSize > 0 ? mDropSize : cDefaultCapacity, pItems.size());
+        BOOST_FOREACH(tClass *lClass, mClasses) {
+            lClass->allocate(lCapacity);
+            lClass->mShare = std::max<size_t>(1, mDropSize * lClass->mWeight / lTotalWeight);
+        }
+        typedef std::pair<T, size_t> tKept;
+        BOOST_FOREACH(const tKept &lKept, pItems) {
+            classOf(lKept.first).push(lKept.first, lKept.second);
+        }
+    }
+
+    /**
+     * @brief Remove the first item, the ones pushed to the front first
+     * @return false if the queue is empty
+     */
+    bool popAny(T &pObject) {
+        if (mFrontCount) {
+            boost::lock_guard<boost::mutex> lLock(mFrontMutex);
+            if (!mFront.empty()) {
+                pObject = mFront.front();
+                mFront.pop_front();
+                mFrontCount = mFront.size();
+                return true;
+            }
+        }
+        if (popRing(pObject)) {
+            return true;
+        }
+        // The overflow only holds items pushed after the ones of the rings of their class
+        return unspill(pObject);
+    }
+
+    /**
+     * @brief Wake the consumers up if some are sleeping
+     * Only the first item pushed to an empty queue pays for the system call, the next ones see that nobody sleeps.
+     */
+    void signal() {
+        // Full barrier: either the consumer sees the item, or we see the consumer
+        __sync_synchronize();
+        if (mSleeping && __sync_lock_test_and_set(&mSleeping, 0)) {
+            // All of them: the ones which find nothing go back to sleep
+            syscall(SYS_futex, &mSleeping, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+        }
+    }
+
+    /**
+     * @brief Account for an item pushed, and wake up whoever waits for it
+     * @param pSize the size of the queue before the push, if known
+     * @param pHighWater the high water mark read before the push
+     */
+    void pushed(size_t pSize, size_t pHighWater) {
+        __sync_fetch_and_add(&mInCount, 1);
+        signal();
+        // Only the first push over the mark pays for the system call, until the event is consumed
+        if (pHighWater > 0 && pSize + 1 >= pHighWater && !mHighWaterEvent
+                && __sync_bool_compare_and_swap(&mHighWaterEvent, 0, 1)) {
+            syscall(SYS_futex, &mHighWaterEvent, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        }
+    }
+
+    /**
+     * @brief Sleep until an object is pushed, unless one is already there
+     * @param pTimeout the maximum time to sleep, NULL for no limit
+     * @param pObject filled with the object if one was found before sleeping
+     * @return true if an object was found, false once woken up
+     */
+    bool sleepUntilPushed(const struct timespec *pTimeout, T &pObject) {
+        mSleeping = 1;
+        __sync_synchronize();
+        // Check again now that the producers know we are about to sleep
+        if (popAny(pObject)) {
+            return true;
+        }
+        if (mClosed) {
+            return false;
+        }
+        // Returns at once if a producer reset mSleeping in between
+        syscall(SYS_futex, &mSleeping, FUTEX_WAIT_PRIVATE, 1, pTimeout, NULL, 0);
+        return false;
+    }
+
+    /**
+     * @brief Take the place of an idle consumer, unless it is one of the last ones
+     * @return true if the consumer must exit
+     */
+    bool retire() {
+        for (;;) {
+            size_t lWorkers = mWorkers;
+            if (lWorkers <= mMinWorkers) {
+                return false;
+            }
+            if (__sync_bool_compare_and_swap(&mWorkers, lWorkers, lWorkers - 1)) {
+                return true;
+            }
+        }
+    }
+
+    /**
+     * @brief Remove the first object, waiting for one if the queue is empty
+     * @param pObject filled with the object
+     * @return false if the consumer must exit instead: pObject is not modified
+     */
+    bool popWait(T &pObject) {
+        // Items often come in bursts: a short wait is cheaper than sleeping and being woken up
+        for (int i = 0; i < cSpins && !mClosed; ++i) {
+            if (popAny(pObject)) {
+                return true;
+            }
+#if defined(__i386__) || defined(__x86_64__)
+            __builtin_ia32_pause();
+#endif
+        }
+        unsigned int lIdleMs = mIdleMs;
+        struct timespec lStart, lNow, lRemaining;
+        clock_gettime(CLOCK_MONOTONIC, &lStart);
+        for (;;) {
+            if (mClosed) {
+                __sync_fetch_and_sub(&mWorkers, 1);
+                return false;
+            }
+            if (popAny(pObject)) {
+                return true;
+            }
+            struct timespec *lTimeout = NULL;
+            if (lIdleMs) {
+                clock_gettime(CLOCK_MONOTONIC, &lNow);
+                long lElapsedMs = (lNow.tv_sec - lStart.tv_sec) * 1000 + (lNow.tv_nsec - lStart.tv_nsec) / 1000000L;
+                if (lElapsedMs >= lIdleMs) {
+                    if (retire()) {
+                        return false;
+                    }
+                    // One of the last consumers: idle for another while
+                    lStart = lNow;
+                    lElapsedMs = 0;
+                }
+                lRemaining.tv_sec = (lIdleMs - lElapsedMs) / 1000;
+                lRemaining.tv_nsec = ((lIdleMs - lElapsedMs) % 1000) * 1000000L;
+                lTimeout = &lRemaining;
+            }
+            if (sleepUntilPushed(lTimeout, pObject)) {
+                return true;
+            }
+        }
+    }
 
 public:
     /**
      * @brief Constructs a MultiThreadQueue
      */
-    MultiThreadQueue() : mInCount(0), mOutCount(0), mDropCount(0), mDropSize(0) {}
+    MultiThreadQueue() : mCurrentClass(0), mFrontCount(0), mSleeping(0),
+                         mInCount(0), mOutCount(0), mDropCount(0), mDropSize(0),
+                         mMaxBytes(0), mBytes(0), mByteDropCount(0), mOverflow(NULL), mSpillCount(0),
+                         mHighWater(0), mHighWaterEvent(0), mRetireItem(), mWorkers(0), mMinWorkers(0),
+                         mIdleMs(0), mClosed(0) {
+        mClasses.push_back(new tClass("", 1));
+        refill(std::vector<std::pair<T, size_t> >());
+    }
+
+    /**
+     * @brief Destructs a MultiThreadQueue
+     */
+    ~MultiThreadQueue() {
+        BOOST_FOREACH(tClass *lClass, mClasses) {
+            delete lClass;
+        }
+    }
 
     /**
      * @brief Adds the given object to the back of the queue so it will be the last one to be pulled
@@ -63,65 +576,357 @@ public:
      */
     void push(const T object)
     {
-        {
-            boost::lock_guard<boost::mutex> lLock(mMutex);
-            if (mDropSize > 0 && mQueue.size() >= mDropSize) {
-                mDropCount++;
-            } else {
-                mQueue.push_back(object);
-                mInCount++;
+        size_t lHighWater = mHighWater;
+        size_t lSize = (mDropSize > 0 || lHighWater > 0) ? size() : 0;
+        tClass &lClass = classOf(object);
+        // A full queue still takes the items of a class holding less than its share
+        bool lFull = mDropSize > 0 && lSize >= mDropSize && lClass.size() >= lClass.mShare;
+        // Once items of a class are spilled, its next ones follow them until they are all popped, so that they keep their
+        // order: the other classes keep their ring up to their share
+        bool lSpilled = false;
+        if (!lFull && mOverflow && mOverflow->size() && (lClass.mSpilled || lClass.size() >= lClass.mShare)) {
+            if (spill(lClass, object)) {
+                pushed(lSize, lHighWater);
+                return;
             }
+            // The overflow is full, but the ring has room: better out of order than dropped
+            lSpilled = true;
         }
-        mAvailableCondition.notify_one();
+        bool lOverBytes = false;
+        size_t lBytes = 0;
+        if (!lFull && mMaxBytes > 0) {
+            // Reserve the bytes first, so that concurrent producers never go over the budget together
+            lBytes = mSizeOf(object);
+            if (__sync_add_and_fetch(&mBytes, lBytes) > mMaxBytes) {
+                __sync_fetch_and_sub(&mBytes, lBytes);
+                lBytes = 0;
+                lFull = lOverBytes = true;
+            }
+        }
+        if (lFull || !lClass.push(object, lBytes)) {
+            if (lBytes) {
+                __sync_fetch_and_sub(&mBytes, lBytes);
+            }
+            if (!mOverflow || lSpilled || !spill(lClass, object)) {
+                __sync_fetch_and_add(lOverBytes ? &mByteDropCount : &mDropCount, 1);
+                __sync_fetch_and_add(&lClass.mDropCount, 1);
+                return;
+            }
+        }
+        pushed(lSize, lHighWater);
     }
 
     /**
      * @brief Adds the given object to the front of the queue so it will be the next one to be pulled
+     * If the queue is full, the oldest item pushed to the back of the largest class gets dropped to make room.
      * @param object The object to be inserted
      */
     void push_front(const T object)
     {
         {
-            boost::lock_guard<boost::mutex> lLock(mMutex);
-            if (mDropSize > 0 && mQueue.size() >= mDropSize) {
-                mDropCount++;
-                mQueue.pop_back();
+            boost::lock_guard<boost::mutex> lLock(mFrontMutex);
+            T lDropped;
+            if (mDropSize > 0 && memorySize() >= mDropSize) {
+                tClass *lLargest = mClasses.front();
+                BOOST_FOREACH(tClass *lClass, mClasses) {
+                    if (lClass->size() > lLargest->size()) {
+                        lLargest = lClass;
+                    }
+                }
+                if (popClass(*lLargest, lDropped)) {
+                    __sync_fetch_and_add(&mDropCount, 1);
+                    __sync_fetch_and_add(&lLargest->mDropCount, 1);
+                }
             }
-            mQueue.push_front(object);
+            mFront.push_front(object);
+            mFrontCount = mFront.size();
         }
-        mAvailableCondition.notify_one();
+        signal();
     }
 
     /**
      * @brief Remove and return the first object in the queue. Blocks until something is available.
-     * @return the object
+     * @return the object, or the retire item if the consumer must exit
      */
     T pop()
     {
-        boost::unique_lock<boost::mutex> lLock(mMutex);
-        while (mQueue.empty()) {
-            mAvailableCondition.wait(lLock);
+        T lObject;
+        if (!popWait(lObject)) {
+            return mRetireItem;
         }
-        T lObject = mQueue.front();
-        mQueue.pop_front();
-        mOutCount++;
+        __sync_fetch_and_add(&mOutCount, 1);
         return lObject;
     }
 
     /**
-     * @brief Returns the size of the queue
+     * @brief Remove several objects at once. Blocks until at least one is available.
+     * @param pItems the objects are appended to it
+     * @param pMaxItems the maximum number of objects to remove
+     * @param pMaxWaitMs how long to wait for more objects once the first one is there, 0 to only take the ones
+     * already queued
+     * @return the number of objects removed
+     */
+    size_t popBatch(std::vector<T> &pItems, size_t pMaxItems, unsigned int pMaxWaitMs)
+    {
+        T lObject;
+        if (!popWait(lObject)) {
+            pItems.push_back(mRetireItem);
+            return 1;
+        }
+        pItems.push_back(lObject);
+        size_t lCount = 1;
+        struct timespec lDeadline;
+        if (pMaxWaitMs) {
+            clock_gettime(CLOCK_MONOTONIC, &lDeadline);
+            lDeadline.tv_sec += pMaxWaitMs / 1000;
+            lDeadline.tv_nsec += (pMaxWaitMs % 1000) * 1000000L;
+            if (lDeadline.tv_nsec >= 1000000000L) {
+                lDeadline.tv_sec++;
+                lDeadline.tv_nsec -= 1000000000L;
+            }
+        }
+        while (lCount < pMaxItems && !mClosed) {
+            if (!popAny(lObject)) {
+                if (!pMaxWaitMs) {
+                    break;
+                }
+                struct timespec lNow, lRemaining;
+                clock_gettime(CLOCK_MONOTONIC, &lNow);
+                lRemaining.tv_sec = lDeadline.tv_sec - lNow.tv_sec;
+                lRemaining.tv_nsec = lDeadline.tv_nsec - lNow.tv_nsec;
+                if (lRemaining.tv_nsec < 0) {
+                    lRemaining.tv_sec--;
+                    lRemaining.tv_nsec += 1000000000L;
+                }
+                if (lRemaining.tv_sec < 0) {
+                    break;
+                }
+                if (!sleepUntilPushed(&lRemaining, lObject)) {
+                    // Woken up or timed out: look again, the deadline tells which
+                    continue;
+                }
+            }
+            pItems.push_back(lObject);
+            lCount++;
+        }
+        __sync_fetch_and_add(&mOutCount, lCount);
+        return lCount;
+    }
+
+    /**
+     * @brief Remove the first object in the queue if there is one. Never blocks.
+     * @param pObject filled with the object if one was available
+     * @return true if an object was popped, false if the queue was empty
+     */
+    bool tryPop(T &pObject)
+    {
+        if (mClosed) {
+            // The retire item, whether the consumer sleeps in pop or not
+            __sync_fetch_and_sub(&mWorkers, 1);
+            pObject = mRetireItem;
+            return true;
+        }
+        if (!popAny(pObject)) {
+            return false;
+        }
+        __sync_fetch_and_add(&mOutCount, 1);
+        return true;
+    }
+
+    /**
+     * @brief Returns the size of the queue. Only a snapshot while other threads push or pop.
      * @return the size of the queue
      */
     size_t size() {
-        return mQueue.size();
+        return memorySize() + (mOverflow ? mOverflow->size() : 0);
+    }
+
+    /**
+     * @brief Returns the number of items in memory, the ones spilled to the overflow excluded
+     */
+    size_t memorySize() {
+        size_t lSize = mFrontCount;
+        BOOST_FOREACH(const tClass *lClass, mClasses) {
+            lSize += lClass->size();
+        }
+        return lSize;
     }
 
     /**
      * @brief Sets the maximum size of the queue. Beyond this size, pushed elements will not be inserted anymnore
-     * @param pDropSize the maximum size of the queue. A value <= 0 means there's no maximum size.
+     * Resizes the ring: must not be called while other threads use the queue.
+     * @param pDropSize the maximum size of the queue. A value <= 0 means there's no maximum size other than the capacity of the ring.
      */
     void setDropSize(size_t pDropSize) {
         mDropSize = pDropSize;
+        std::vector<std::pair<T, size_t> > lItems;
+        drain(lItems);
+        refill(lItems);
+    }
+
+    /**
+     * @brief Splits the items into weighted classes served in turn. Must not be called while other threads use the queue.
+     * Each class gets a ring as large as the queue, and the share of the maximum size matching its weight: a full queue
+     * only drops the items of the classes holding more than their share.
+     * @param pNames the names of the classes, for the stats
+     * @param pWeights the number of items of each class served per round, at least 1
+     * @param pClassOf returns the index of the class of an item, an unknown index means the first class
+     */
+    void setClasses(const std::vector<std::string> &pNames, const std::vector<unsigned int> &pWeights, tClassOf pClassOf) {
+        std::vector<std::pair<T, size_t> > lItems;
+        drain(lItems);
+        BOOST_FOREACH(tClass *lClass, mClasses) {
+            delete lClass;
+        }
+        mClasses.clear();
+        for (size_t i = 0; i < pNames.size(); ++i) {
+            mClasses.push_back(new tClass(pNames[i], pWeights[i]));
+        }
+        if (mClasses.empty()) {
+            mClasses.push_back(new tClass("", 1));
+        }
+        mClassOf = pClassOf;
+        mCurrentClass = 0;
+        refill(lItems);
+    }
+
+    /**
+     * @brief Returns the number of classes of items
+     */
+    size_t getClassCount() const {
+        return mClasses.size();
+    }
+
+    /**
+     * @brief Returns the name of a class of items
+     * @param pIndex the index of the class
+     */
+    const std::string &getClassName(size_t pIndex) const {
+        return mClasses[pIndex]->mName;
+    }
+
+    /**
+     * @brief Gets the number of items of a class dropped, whether the queue was full or over its bytes, and resets it
+     * @param pIndex the index of the class
+     */
+    unsigned getClassDropCount(size_t pIndex) {
+        return __sync_fetch_and_and(&mClasses[pIndex]->mDropCount, 0);
+    }
+
+    /**
+     * @brief Sets the maximum memory held by the queued items. Beyond it, pushed items are dropped.
+     * Must not be called while other threads use the queue. The items pushed to the front are not accounted for.
+     * @param pMaxBytes the maximum number of bytes, 0 for no limit
+     * @param pSizeOf returns the bytes held by an item
+     */
+    void setMaxBytes(size_t pMaxBytes, tSizeOf pSizeOf) {
+        mMaxBytes = pMaxBytes;
+        mSizeOf = pSizeOf;
+    }
+
+    /**
+     * @brief Sets where the items go when the queue is full. Must not be called while other threads use the queue.
+     * @param pOverflow the overflow, kept by the caller until the queue is destroyed, NULL to drop the items
+     */
+    void setOverflow(IOverflow *pOverflow) {
+        mOverflow = pOverflow;
+    }
+
+    /**
+     * @brief Gets the number of items spilled to the overflow, and resets it
+     */
+    unsigned getSpillCount() {
+        return __sync_fetch_and_and(&mSpillCount, 0);
+    }
+
+    /**
+     * @brief Returns the bytes held by the queued items, if there is a maximum
+     */
+    size_t getBytes() const {
+        return mBytes;
+    }
+
+    /**
+     * @brief Gets the number of items dropped for being over the maximum bytes, and resets it
+     */
+    unsigned getByteDropCount() {
+        return __sync_fetch_and_and(&mByteDropCount, 0);
+    }
+
+    /**
+     * @brief Gets the total number of items pushed to and popped from the back of the queue since its last resize.
+     * Unlike getCounters, does not reset anything: meant to compute rates.
+     * @param pPushed the number of items pushed
+     * @param pPopped the number of items popped
+     */
+    void getTotals(size_t &pPushed, size_t &pPopped) {
+        pPopped = pPushed = 0;
+        BOOST_FOREACH(const tClass *lClass, mClasses) {
+            pPopped += lClass->mHead;
+            pPushed += lClass->mTail;
+        }
+    }
+
+    /**
+     * @brief Sets how the consumers which should exit are told so. Must not be called while other threads use the queue.
+     * Reopens the queue if it was closed.
+     * @param pRetireItem the item handed to a consumer instead of a queued one to make it exit
+     * @param pMinWorkers the number of consumers which never exit for being idle
+     * @param pIdleMs the time in ms after which an idle consumer gets the retire item, 0 to keep them all
+     */
+    void setRetirement(const T &pRetireItem, size_t pMinWorkers, unsigned int pIdleMs) {
+        mRetireItem = pRetireItem;
+        mMinWorkers = pMinWorkers;
+        mIdleMs = pIdleMs;
+        mWorkers = 0;
+        mClosed = 0;
+    }
+
+    /**
+     * @brief Account for new consumers
+     * @param pCount the number of consumers started
+     */
+    void addWorkers(size_t pCount) {
+        __sync_fetch_and_add(&mWorkers, pCount);
+    }
+
+    /**
+     * @brief Returns the number of consumers which did not get the retire item
+     */
+    size_t getWorkers() const {
+        return mWorkers;
+    }
+
+    /**
+     * @brief Hand the retire item to every consumer, before the items still queued, which are kept
+     */
+    void close() {
+        mClosed = 1;
+        __sync_synchronize();
+        mSleeping = 0;
+        syscall(SYS_futex, &mSleeping, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+
+    /**
+     * @brief Sets the size from which the pushes raise a high water event
+     * @param pHighWater the size, 0 for no event
+     */
+    void setHighWater(size_t pHighWater) {
+        mHighWater = pHighWater;
+    }
+
+    /**
+     * @brief Wait for a high water event, and consume it
+     * @param pTimeoutUs the maximum time to wait in micro seconds
+     * @return true if the queue went over its high water mark since the last event consumed
+     */
+    bool waitHighWater(unsigned int pTimeoutUs) {
+        struct timespec lTimeout;
+        lTimeout.tv_sec = pTimeoutUs / 1000000;
+        lTimeout.tv_nsec = (pTimeoutUs % 1000000) * 1000L;
+        // Returns at once if an event is pending
+        syscall(SYS_futex, &mHighWaterEvent, FUTEX_WAIT_PRIVATE, 0, &lTimeout, NULL, 0);
+        return __sync_lock_test_and_set(&mHighWaterEvent, 0);
     }
 
     /**
@@ -131,11 +936,17 @@ public:
      * @param pDropCount the number of elements dropped since last call
      */
     void getCounters(unsigned &pInCount, unsigned &pOutCount, unsigned &pDropCount) {
-        pInCount = mInCount;
-        pOutCount = mOutCount;
-        pDropCount = mDropCount;
-        mInCount = mOutCount = mDropCount = 0;
+        // Atomic read + reset
+        pInCount = __sync_fetch_and_and(&mInCount, 0);
+        pOutCount = __sync_fetch_and_and(&mOutCount, 0);
+        pDropCount = __sync_fetch_and_and(&mDropCount, 0);
     }
 };
 
+template <typename T>
+const int MultiThreadQueue<T>::cSpins;
+
+template <typename T>
+const size_t MultiThreadQueue<T>::cDefaultCapacity;
+
 }
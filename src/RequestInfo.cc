@@ -19,6 +19,7 @@
 #include "RequestInfo.hh"
 #include <assert.h>
 #include <iomanip>
+#include <stdint.h>
 #include <string.h>
 
 namespace DupModule {
@@ -65,17 +66,20 @@ RequestInfo::RequestInfo(std::string id, const std::string &pConfPath, const std
     : mPoison(false),
       mId(id),
       mConfPath(pConfPath),
+      mCommands(NULL),
       mPath(pPath),
       mArgs(pArgs),
       mEOS(false),
       mStartTime(boost::posix_time::microsec_clock::universal_time()),
-      mElapsedTime() {
+      mElapsedTime(),
+      mEnqueueTime(mStartTime) {
     if (pBody)
         mBody = *pBody;
 }
 
 RequestInfo::RequestInfo(const mapStr &reqHeader, const std::string &reqBody, const mapStr &respHeader,
                          const std::string &respBody, const mapStr &dupHeader, const std::string &dupBody):
+	mCommands(NULL),
 	mReqHeader(reqHeader),
 	mReqBody(reqBody),
 	mResponseHeader(respHeader),
@@ -84,22 +88,27 @@ RequestInfo::RequestInfo(const mapStr &reqHeader, const std::string &reqBody, co
 	mDupResponseBody(dupBody),
         mEOS(false),
         mStartTime(boost::posix_time::microsec_clock::universal_time()),
-        mElapsedTime() {
+        mElapsedTime(),
+        mEnqueueTime(mStartTime) {
 }
 
 RequestInfo::RequestInfo(const std::string &id)
     : mPoison(false),
       mId(id),
+      mCommands(NULL),
       mEOS(false),
       mStartTime(boost::posix_time::microsec_clock::universal_time()),
-      mElapsedTime() {
+      mElapsedTime(),
+      mEnqueueTime(mStartTime) {
 }
 
 RequestInfo::RequestInfo() :
     mPoison(true),
+    mCommands(NULL),
     mEOS(false),
     mStartTime(boost::posix_time::microsec_clock::universal_time()),
-    mElapsedTime() {
+    mElapsedTime(),
+    mEnqueueTime(mStartTime) {
 }
 
 bool
@@ -112,11 +121,184 @@ RequestInfo::hasBody() const {
     return !mBody.empty();
 }
 
+/// @brief The bytes held by the strings of a map or list of pairs
+template <typename tContainer>
+static size_t
+pairsSize(const tContainer &pPairs) {
+    size_t lSize = 0;
+    typename tContainer::const_iterator lIt;
+    for (lIt = pPairs.begin(); lIt != pPairs.end(); ++lIt) {
+        // The node and its pointers
+        lSize += lIt->first.size() + lIt->second.size() + 4 * sizeof(void *);
+    }
+    return lSize;
+}
+
+size_t
+RequestInfo::getSize() const {
+    return sizeof(RequestInfo) + mId.size() + mConfPath.size() + mPath.size() + mArgs.size() + mBody.size()
+        + mAnswer.size() + mRequest.size() + mReqBody.size() + mResponseBody.size() + mDupResponseBody.size()
+        + pairsSize(mReqHeader) + pairsSize(mResponseHeader) + pairsSize(mDupResponseHeader)
+        + pairsSize(mHeadersIn) + pairsSize(mHeadersOut);
+}
+
 void
 RequestInfo::Serialize(const std::string &toSerialize, std::stringstream &ss) {
     ss << std::setfill('0') << std::setw(8) << toSerialize.length() << toSerialize;
 }
 
+/// @brief Appends a value of a plain type to a spool record
+template <typename tValue>
+static void
+spoolValue(std::string &pOut, const tValue &pValue) {
+    pOut.append(reinterpret_cast<const char *>(&pValue), sizeof(pValue));
+}
+
+/// @brief Appends a string to a spool record, preceded by its length
+static void
+spoolString(std::string &pOut, const std::string &pValue) {
+    spoolValue(pOut, pValue.size());
+    pOut.append(pValue);
+}
+
+/// @brief Appends a map or list of string pairs to a spool record, preceded by its size
+template <typename tContainer>
+static void
+spoolPairs(std::string &pOut, const tContainer &pPairs) {
+    spoolValue(pOut, pPairs.size());
+    typename tContainer::const_iterator lIt;
+    for (lIt = pPairs.begin(); lIt != pPairs.end(); ++lIt) {
+        spoolString(pOut, lIt->first);
+        spoolString(pOut, lIt->second);
+    }
+}
+
+/// @brief Appends a time to a spool record
+static void
+spoolTime(std::string &pOut, const boost::posix_time::ptime &pTime) {
+    static const boost::posix_time::ptime lEpoch(boost::gregorian::date(1970, 1, 1));
+    spoolValue(pOut, static_cast<int64_t>((pTime - lEpoch).total_microseconds()));
+}
+
+/// @brief Reads a spool record written by the spool* functions
+class tSpoolReader {
+public:
+    tSpoolReader(const std::string &pIn) : mIn(pIn), mPos(0) {}
+
+    template <typename tValue>
+    bool read(tValue &pValue) {
+        if (mIn.size() - mPos < sizeof(pValue)) {
+            return false;
+        }
+        memcpy(&pValue, mIn.data() + mPos, sizeof(pValue));
+        mPos += sizeof(pValue);
+        return true;
+    }
+
+    bool readString(std::string &pValue) {
+        size_t lSize;
+        if (!read(lSize) || mIn.size() - mPos < lSize) {
+            return false;
+        }
+        pValue.assign(mIn, mPos, lSize);
+        mPos += lSize;
+        return true;
+    }
+
+    bool readPair(std::pair<std::string, std::string> &pPair) {
+        return readString(pPair.first) && readString(pPair.second);
+    }
+
+    bool readPairs(RequestInfo::mapStr &pPairs) {
+        size_t lSize;
+        std::pair<std::string, std::string> lPair;
+        if (!read(lSize)) {
+            return false;
+        }
+        for (size_t i = 0; i < lSize; ++i) {
+            if (!readPair(lPair)) {
+                return false;
+            }
+            pPairs.insert(lPair);
+        }
+        return true;
+    }
+
+    bool readPairs(RequestInfo::tHeaders &pPairs) {
+        size_t lSize;
+        std::pair<std::string, std::string> lPair;
+        if (!read(lSize)) {
+            return false;
+        }
+        for (size_t i = 0; i < lSize; ++i) {
+            if (!readPair(lPair)) {
+                return false;
+            }
+            pPairs.push_back(lPair);
+        }
+        return true;
+    }
+
+    bool readTime(boost::posix_time::ptime &pTime) {
+        static const boost::posix_time::ptime lEpoch(boost::gregorian::date(1970, 1, 1));
+        int64_t lMicroseconds;
+        if (!read(lMicroseconds)) {
+            return false;
+        }
+        pTime = lEpoch + boost::posix_time::microseconds(lMicroseconds);
+        return true;
+    }
+
+private:
+    const std::string   &mIn;
+    size_t              mPos;
+};
+
+void
+RequestInfo::toSpool(std::string &pOut) const {
+    spoolValue(pOut, mPoison);
+    spoolString(pOut, mId);
+    spoolString(pOut, mConfPath);
+    spoolString(pOut, mPath);
+    spoolString(pOut, mArgs);
+    spoolString(pOut, mBody);
+    spoolString(pOut, mAnswer);
+    spoolString(pOut, mRequest);
+    spoolPairs(pOut, mReqHeader);
+    spoolString(pOut, mReqBody);
+    spoolPairs(pOut, mResponseHeader);
+    spoolString(pOut, mResponseBody);
+    spoolPairs(pOut, mDupResponseHeader);
+    spoolString(pOut, mDupResponseBody);
+    spoolPairs(pOut, mHeadersIn);
+    spoolPairs(pOut, mHeadersOut);
+    spoolValue(pOut, offset);
+    spoolValue(pOut, mReqHttpStatus);
+    spoolValue(pOut, mDupResponseHttpStatus);
+    spoolValue(pOut, mEOS);
+    spoolTime(pOut, mStartTime);
+    spoolValue(pOut, static_cast<int64_t>(mElapsedTime.total_microseconds()));
+    spoolTime(pOut, mEnqueueTime);
+}
+
+bool
+RequestInfo::fromSpool(const std::string &pIn) {
+    tSpoolReader lReader(pIn);
+    int64_t lElapsed;
+    if (!(lReader.read(mPoison) && lReader.readString(mId) && lReader.readString(mConfPath) && lReader.readString(mPath)
+            && lReader.readString(mArgs) && lReader.readString(mBody) && lReader.readString(mAnswer)
+            && lReader.readString(mRequest) && lReader.readPairs(mReqHeader) && lReader.readString(mReqBody)
+            && lReader.readPairs(mResponseHeader) && lReader.readString(mResponseBody)
+            && lReader.readPairs(mDupResponseHeader) && lReader.readString(mDupResponseBody)
+            && lReader.readPairs(mHeadersIn) && lReader.readPairs(mHeadersOut) && lReader.read(offset)
+            && lReader.read(mReqHttpStatus) && lReader.read(mDupResponseHttpStatus) && lReader.read(mEOS)
+            && lReader.readTime(mStartTime) && lReader.read(lElapsed) && lReader.readTime(mEnqueueTime))) {
+        return false;
+    }
+    mElapsedTime = boost::posix_time::microseconds(lElapsed);
+    return true;
+}
+
 int
 RequestInfo::getElapsedTimeMS() const {
     return mElapsedTime.total_microseconds() / 1000;
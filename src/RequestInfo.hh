@@ -54,6 +54,8 @@ struct RequestInfo {
 
 namespace DupModule {
 
+struct CommandsByDestination;
+
 /*
  * Different duplication modes supported by mod_dup
  */
@@ -103,6 +105,8 @@ struct RequestInfo {
     std::string mId;
     /** @brief The location (in the conf) which matched this query. */
     std::string mConfPath;
+    /** @brief The commands of the location, NULL to look them up by mConfPath. Not spooled. */
+    CommandsByDestination *mCommands;
     /** @brief The path part of the request. */
     std::string mPath;
     /** @brief The parameters part of the query (without leading ?). */
@@ -171,6 +175,11 @@ struct RequestInfo {
      */
     bool hasBody() const;
 
+    /**
+     * @brief Returns the memory held by the request in bytes, approximately: the object and its strings
+     */
+    size_t getSize() const;
+
     /**
      * @brief Returns wether the the request is poisonous
      * @return true if poisonous, false otherwhise
@@ -185,6 +194,20 @@ struct RequestInfo {
      */
     static void Serialize(const std::string &toSerialize, std::stringstream &output);
 
+    /**
+     * @brief Writes the whole request, times included, in a binary format meant to be read back by fromSpool
+     * in the same process
+     * @param pOut the record, appended to
+     */
+    void toSpool(std::string &pOut) const;
+
+    /**
+     * @brief Reads back a request written by toSpool
+     * @param pIn the record
+     * @return false if the record is truncated
+     */
+    bool fromSpool(const std::string &pIn);
+
 
     /**
      * @brief Getter of the EOS flag indicator
@@ -206,6 +229,19 @@ struct RequestInfo {
     int getElapsedTimeMS() const;
 
 
+    /**
+     * @brief Set the time the request is queued at to now
+     */
+    void markEnqueued() { mEnqueueTime = boost::posix_time::microsec_clock::universal_time(); }
+
+    /**
+     * @brief Returns the time in ms since the request was queued, or created if it was not
+     * @param pNow the current time
+     */
+    long getQueuedTimeMS(const boost::posix_time::ptime &pNow) const {
+        return (pNow - mEnqueueTime).total_milliseconds();
+    }
+
     /**
      * @brief Reset the startTime to NOW
      */
@@ -228,6 +264,9 @@ private:
     boost::posix_time::ptime mStartTime;
     boost::posix_time::time_duration mElapsedTime; /* Elapsed time by the handler to process the request */
 
+    /* The time the request was queued at, for the workers to drop the stale ones */
+    boost::posix_time::ptime mEnqueueTime;
+
 
 };
 }
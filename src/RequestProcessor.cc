@@ -16,14 +16,15 @@
  * limitations under the License.
  */
 
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
-#include <boost/tokenizer.hpp>
 #include <boost/algorithm/string.hpp>
-#include <boost/algorithm/string/join.hpp>
 #include <boost/lexical_cast.hpp>
 
 #include <httpd.h>
+#include <algorithm>
 #include <iomanip>
+#include <iterator>
 #include <set>
 
 using namespace std;
@@ -36,6 +37,62 @@ namespace DupModule {
 
 const char * gUserAgent = "mod-dup";
 
+/// @brief The maximum time in ms a MULTI sender worker waits for network activity before polling its queue again
+static const int cMultiWaitMs = 5;
+
+namespace SenderMode {
+    // String representation of the SenderMode values
+    const char* c_BLOCKING =                    "blocking";
+    const char* c_MULTI =                       "multi";
+    /// Sender mode mismatch value error
+    const char* c_ERROR_ON_STRING_VALUE =       "Invalid Sender Mode Value. Supported Values: blocking | multi";
+
+    eSenderMode stringToEnum(const char *value) throw (std::exception) {
+        if (!strcmp(value, c_BLOCKING)) {
+            return BLOCKING;
+        }
+        if (!strcmp(value, c_MULTI)) {
+            return MULTI;
+        }
+        throw std::exception();
+    }
+};
+
+namespace SamplingKey {
+    // String representation of the SamplingKey values
+    const char* c_RANDOM =                      "RANDOM";
+    const char* c_ARG =                         "ARG";
+    const char* c_HEADER =                      "HEADER";
+    const char* c_UNIQUE_ID =                   "UNIQUE_ID";
+    /// Sampling key mismatch value error
+    const char* c_ERROR_ON_STRING_VALUE =       "Invalid Sampling Key Value. Supported Values: RANDOM | ARG | HEADER | UNIQUE_ID";
+
+    eSamplingKey stringToEnum(const char *value) throw (std::exception) {
+        if (!strcmp(value, c_RANDOM)) {
+            return RANDOM;
+        }
+        if (!strcmp(value, c_ARG)) {
+            return ARG;
+        }
+        if (!strcmp(value, c_HEADER)) {
+            return HEADER;
+        }
+        if (!strcmp(value, c_UNIQUE_ID)) {
+            return UNIQUE_ID;
+        }
+        throw std::exception();
+    }
+};
+
+/// @brief Deleter for the shared pointers wrapping a request owned by someone else
+struct NullDeleter {
+    void operator()(const void *) const {}
+};
+
+/// @brief Tells a destination worker to exit: a duplication without filter
+static const boost::shared_ptr<tDuplication> cPoisonDuplication(new tDuplication());
+
+
 bool
 Commands::toDuplicate() {
     static bool GlobalInit = false;
@@ -72,6 +129,83 @@ Commands::toDuplicate() {
     return ((randNum % 100) < static_cast<int>(mDuplicationPercentage));
 }
 
+unsigned int
+Commands::samplingBucket(const std::string &pValue) {
+    // 64 bits FNV-1a
+    uint64_t lHash = 14695981039346656037ULL;
+    for (std::string::const_iterator it = pValue.begin(); it != pValue.end(); ++it) {
+        lHash = (lHash ^ static_cast<unsigned char>(*it)) * 1099511628211ULL;
+    }
+    // FNV leaves the last bytes poorly mixed into the high bits: finish with the murmur3 mixer
+    lHash ^= lHash >> 33;
+    lHash *= 0xff51afd7ed558ccdULL;
+    lHash ^= lHash >> 33;
+    // Scale to [0, 100[ without a division
+    return static_cast<unsigned int>(((lHash >> 32) * 100) >> 32);
+}
+
+bool
+Commands::toDuplicate(const std::string *pKey) {
+    if (!pKey) {
+        return toDuplicate();
+    }
+    return samplingBucket(*pKey) < mDuplicationPercentage;
+}
+
+void
+Commands::compile() {
+    static const ApplicationScope::eApplicationScope lScopes[2] = { ApplicationScope::HEADER, ApplicationScope::BODY };
+
+    for (int lScope = HEADER_INDEX; lScope <= BODY_INDEX; ++lScope) {
+        mKeyFilters[lScope][tFilter::REGULAR].clear();
+        mKeyFilters[lScope][tFilter::PREVENT_DUPLICATION].clear();
+        mKeySubstitutions[lScope].clear();
+        mKeyFiltersOn[lScope] = mKeySubstitutionsOn[lScope] = false;
+    }
+    mRawFiltersByType[tFilter::REGULAR].clear();
+    mRawFiltersByType[tFilter::PREVENT_DUPLICATION].clear();
+
+    // Same key filters in the multimap keep their order of declaration
+    typedef std::pair<const std::string, tFilter> tKeyFilter;
+    BOOST_FOREACH(tKeyFilter &lFilter, mFilters) {
+        lFilter.second.mCommands = this;
+        for (int lScope = HEADER_INDEX; lScope <= BODY_INDEX; ++lScope) {
+            if (lFilter.second.mScope & lScopes[lScope]) {
+                mKeyFilters[lScope][lFilter.second.mFilterType][tStringRef(lFilter.first)].push_back(&lFilter.second);
+                mKeyFiltersOn[lScope] = true;
+            }
+        }
+    }
+    BOOST_FOREACH(tFilter &lFilter, mRawFilters) {
+        lFilter.mCommands = this;
+        mRawFiltersByType[lFilter.mFilterType].push_back(&lFilter);
+    }
+    for (int lType = tFilter::REGULAR; lType <= tFilter::PREVENT_DUPLICATION; ++lType) {
+        for (int lScope = HEADER_INDEX; lScope <= BODY_INDEX; ++lScope) {
+            std::vector<const tFilter *> lFilters;
+            std::vector<size_t> lRanks;
+            for (size_t lRank = 0; lRank < mRawFiltersByType[lType].size(); ++lRank) {
+                if (mRawFiltersByType[lType][lRank]->mScope & lScopes[lScope]) {
+                    lFilters.push_back(mRawFiltersByType[lType][lRank]);
+                    lRanks.push_back(lRank);
+                }
+            }
+            mRawFilterSets[lType][lScope].compile(lFilters, lRanks);
+        }
+    }
+    typedef std::pair<const std::string, std::list<tSubstitute> > tKeySubstitution;
+    BOOST_FOREACH(const tKeySubstitution &lSubstitutions, mSubstitutions) {
+        BOOST_FOREACH(const tSubstitute &lSubstitute, lSubstitutions.second) {
+            for (int lScope = HEADER_INDEX; lScope <= BODY_INDEX; ++lScope) {
+                if (lSubstitute.mScope & lScopes[lScope]) {
+                    mKeySubstitutions[lScope][tStringRef(lSubstitutions.first)].push_back(&lSubstitute);
+                    mKeySubstitutionsOn[lScope] = true;
+                }
+            }
+        }
+    }
+}
+
 
 void
 RequestProcessor::setTimeout(const unsigned int &pTimeout) {
@@ -97,34 +231,224 @@ RequestProcessor::getDuplicatedCount() {
     return lCount;
 }
 
+const unsigned int
+RequestProcessor::getNewConnectionCount() {
+    // Atomic read + reset
+    return __sync_fetch_and_and(&mNewConnectionCount, 0);
+}
+
+const unsigned int
+RequestProcessor::getReusedConnectionCount() {
+    // Atomic read + reset
+    return __sync_fetch_and_and(&mReusedConnectionCount, 0);
+}
+
+const unsigned int
+RequestProcessor::getCircuitOpenCount() {
+    // Atomic read + reset
+    return __sync_fetch_and_and(&mCircuitOpenCount, 0);
+}
+
+void
+RequestProcessor::setCircuitBreaker(unsigned int pErrorRate, unsigned int pOpenMs, unsigned int pWindow) {
+    mHealthSettings.mErrorRate = pErrorRate;
+    mHealthSettings.mOpenMs = pOpenMs;
+    mHealthSettings.mWindow = pWindow;
+}
+
+void
+RequestProcessor::setAdaptiveTimeout(unsigned int pMinTimeoutMs, unsigned int pFactor) {
+    mHealthSettings.mMinTimeoutMs = pMinTimeoutMs;
+    mHealthSettings.mTimeoutFactor = pFactor;
+}
+
+DestinationHealth *
+RequestProcessor::getHealth(const std::string &pDestination) {
+    DestinationHealth *&lHealth = mHealth[pDestination];
+    if (!lHealth) {
+        lHealth = new DestinationHealth();
+        lHealth->setName(pDestination);
+    }
+    return lHealth;
+}
+
+const unsigned int
+RequestProcessor::getRateLimitedCount() {
+    // Atomic read + reset
+    return __sync_fetch_and_and(&mRateLimitedCount, 0);
+}
+
+const unsigned int
+RequestProcessor::getConnectionLimitedCount() {
+    return mConnectionPool.getRefusedCount();
+}
+
+const unsigned int
+RequestProcessor::getStaleCount() {
+    // Atomic read + reset
+    return __sync_fetch_and_and(&mStaleCount, 0);
+}
+
+void
+RequestProcessor::setMaxAge(unsigned int pMaxAgeMs) {
+    mMaxAgeMs = pMaxAgeMs;
+}
+
+bool
+RequestProcessor::isStale(const RequestInfo &pRequest) {
+    if (!mMaxAgeMs
+            || pRequest.getQueuedTimeMS(boost::posix_time::microsec_clock::universal_time()) <= static_cast<long>(mMaxAgeMs)) {
+        return false;
+    }
+    __sync_fetch_and_add(&mStaleCount, 1);
+    return true;
+}
+
+TokenBucket *
+RequestProcessor::getRateLimit(const std::string &pDestination) {
+    TokenBucket *&lRateLimit = mRateLimits[pDestination];
+    if (!lRateLimit) {
+        lRateLimit = new TokenBucket();
+    }
+    return lRateLimit;
+}
+
+void
+RequestProcessor::setRateLimit(const std::string &pDestination, unsigned int pRate, unsigned int pBurst) {
+    getRateLimit(pDestination)->setRate(pRate, pBurst);
+}
+
+bool
+RequestProcessor::allowDuplication(const tFilter &pFilter, unsigned int &pProbe) {
+    pProbe = 0;
+    if (!pFilter.mHealth || pFilter.mHealth->allowRequest(mHealthSettings, pProbe)) {
+        return true;
+    }
+    Log::debug("Circuit open, duplication to %s dropped", pFilter.mDestination.c_str());
+    __sync_fetch_and_add(&mCircuitOpenCount, 1);
+    return false;
+}
+
+CURL *
+RequestProcessor::acquireHandle(const tFilter &pFilter, unsigned int &pProbe) {
+    CURL *lCurl = mConnectionPool.acquire(pFilter.mDestination);
+    // Only once the handle is there: a half open circuit expects the result of the request it lets through
+    if (lCurl && !allowDuplication(pFilter, pProbe)) {
+        mConnectionPool.release(pFilter.mDestination, lCurl);
+        return NULL;
+    }
+    return lCurl;
+}
+
+void
+RequestProcessor::releaseTransfer(tTransfer &pTransfer) {
+    mConnectionPool.release(pTransfer.mFilter->mDestination, pTransfer.mCurl);
+    pTransfer.mCurl = NULL;
+    pTransfer.reset();
+}
+
+void
+RequestProcessor::setConnectionLimits(size_t pMaxIdle, size_t pMaxTotal, unsigned int pIdleTimeoutMs) {
+    mConnectionPool.setLimits(pMaxIdle, pMaxTotal, pIdleTimeoutMs);
+}
+
+size_t
+RequestProcessor::countDestinations() const {
+    std::set<std::string> lDestinations;
+    typedef std::pair<const std::string, CommandsByDestination> tPathCommands;
+    typedef std::pair<const std::string, Commands> tDestinationCommands;
+    BOOST_FOREACH(const tPathCommands &lPath, mCommands) {
+        BOOST_FOREACH(const tDestinationCommands &lDestination, lPath.second.mCommands) {
+            lDestinations.insert(lDestination.first);
+        }
+    }
+    return std::max<size_t>(lDestinations.size(), 1);
+}
+
+CommandsByDestination *
+RequestProcessor::getLocation(const std::string &pPath) {
+    mCompiled = false;
+    return &mCommands[pPath];
+}
+
+void
+RequestProcessor::compile() {
+    boost::lock_guard<boost::mutex> lLock(mCompileMutex);
+    if (mCompiled) {
+        return;
+    }
+    typedef std::pair<const std::string, CommandsByDestination> tPathCommands;
+    typedef std::pair<const std::string, Commands> tDestinationCommands;
+    BOOST_FOREACH(tPathCommands &lPath, mCommands) {
+        lPath.second.mPlan.clear();
+        BOOST_FOREACH(tDestinationCommands &lDestination, lPath.second.mCommands) {
+            lDestination.second.compile();
+            lPath.second.mPlan.push_back(&lDestination.second);
+        }
+    }
+    __sync_synchronize();
+    mCompiled = true;
+}
+
+CommandsByDestination *
+RequestProcessor::findLocation(const RequestInfo &pRequest) {
+    if (!mCompiled) {
+        compile();
+    }
+    if (pRequest.mCommands) {
+        return pRequest.mCommands;
+    }
+    std::map<std::string, CommandsByDestination>::iterator it = mCommands.find(pRequest.mConfPath);
+    return it == mCommands.end() ? NULL : &it->second;
+}
+
 void
 RequestProcessor::addFilter(const std::string &pPath, const std::string &pField, const std::string &pFilter,
         const DupConf &pAssociatedConf, tFilter::eFilterTypes fType) {
 
+    tFilter lFilter(pFilter, pAssociatedConf.currentApplicationScope,
+            pAssociatedConf.currentDupDestination, pAssociatedConf.getCurrentDuplicationType(),
+            fType);
+    lFilter.mHealth = getHealth(pAssociatedConf.currentDupDestination);
+    lFilter.mRateLimit = getRateLimit(pAssociatedConf.currentDupDestination);
+    mCompiled = false;
     mCommands[pPath].mCommands[pAssociatedConf.currentDupDestination].mFilters.insert(std::pair<std::string, tFilter>(boost::to_upper_copy(pField),
-            tFilter(pFilter, pAssociatedConf.currentApplicationScope,
-                    pAssociatedConf.currentDupDestination, pAssociatedConf.getCurrentDuplicationType(),
-            fType)));
+            lFilter));
 }
 
 void
 RequestProcessor::setDestinationDuplicationPercentage(const std::string &pPath, const std::string &destination,
                                                       int percentage) {
+    mCompiled = false;
     mCommands[pPath].mCommands[destination].mDuplicationPercentage = percentage;
 }
 
+void
+RequestProcessor::setDestinationSamplingKey(const std::string &pPath, const std::string &pDestination,
+                                            SamplingKey::eSamplingKey pKey, const std::string &pName) {
+    mCompiled = false;
+    Commands &lCommands = mCommands[pPath].mCommands[pDestination];
+    lCommands.mSamplingKey = pKey;
+    lCommands.mSamplingKeyName = pName;
+}
+
 void
 RequestProcessor::addRawFilter(const std::string &pPath, const std::string &pFilter,
         const DupConf &pAssociatedConf, tFilter::eFilterTypes fType) {
 
-    mCommands[pPath].mCommands[pAssociatedConf.currentDupDestination].mRawFilters.push_back(tFilter(pFilter, pAssociatedConf.currentApplicationScope,
+    tFilter lFilter(pFilter, pAssociatedConf.currentApplicationScope,
             pAssociatedConf.currentDupDestination, pAssociatedConf.getCurrentDuplicationType(),
-            fType));
+            fType);
+    lFilter.mHealth = getHealth(pAssociatedConf.currentDupDestination);
+    lFilter.mRateLimit = getRateLimit(pAssociatedConf.currentDupDestination);
+    mCompiled = false;
+    mCommands[pPath].mCommands[pAssociatedConf.currentDupDestination].mRawFilters.push_back(lFilter);
 }
 
 void
 RequestProcessor::addSubstitution(const std::string &pPath, const std::string &pField, const std::string &pMatch,
         const std::string &pReplace,  const DupConf &pAssociatedConf) {
+    mCompiled = false;
     mCommands[pPath].mCommands[pAssociatedConf.currentDupDestination].mSubstitutions[boost::to_upper_copy(pField)].push_back(tSubstitute(pMatch, pReplace,
             pAssociatedConf.currentApplicationScope));
 }
@@ -132,468 +456,686 @@ RequestProcessor::addSubstitution(const std::string &pPath, const std::string &p
 void
 RequestProcessor::addRawSubstitution(const std::string &pPath, const std::string &pRegex, const std::string &pReplace,
         const DupConf &pAssociatedConf){
+    mCompiled = false;
     mCommands[pPath].mCommands[pAssociatedConf.currentDupDestination].mRawSubstitutions.push_back(tSubstitute(pRegex, pReplace,
             pAssociatedConf.currentApplicationScope));
 }
 
 void
 RequestProcessor::parseArgs(std::list<tKeyVal> &pParsedArgs, const std::string &pArgs) {
-    const boost::char_separator<char> lSep("&");
-    boost::tokenizer<boost::char_separator<char> > lTokens(pArgs, lSep);
-    BOOST_FOREACH (const std::string &lToken, lTokens) {
-        size_t lEqualPos = lToken.find('=');
-        if (lEqualPos == std::string::npos) {
-            std::string lKey = boost::to_upper_copy(lToken);
-
-            pParsedArgs.push_back(tKeyVal(lKey, std::string()));
-        } else {
-            std::string lKey = lToken.substr(0, lEqualPos);
-            boost::to_upper(lKey);
-            std::string lVal = mUrlCodec->decode(lToken.substr(lEqualPos+1, std::string::npos));
-            pParsedArgs.push_back(tKeyVal(lKey, lVal));
-        }
+    tArgs lArgs;
+    tokenizeArgs(pArgs, lArgs);
+    BOOST_FOREACH (const tArg &lArg, lArgs) {
+        pParsedArgs.push_back(tKeyVal(boost::to_upper_copy(lArg.mKey.str()), decodeValue(lArg)));
     }
 }
 
-const tFilter *
-RequestProcessor::keyFilterMatch(std::multimap<std::string, tFilter> &pFilters, const std::list<tKeyVal> &pParsedArgs,
-        ApplicationScope::eApplicationScope scope, tFilter::eFilterTypes fType){
+void
+RequestProcessor::parseArgs(tArgs &pParsedArgs, const std::string &pArgs) {
+    tokenizeArgs(pArgs, pParsedArgs);
+}
 
-    BOOST_FOREACH (const tKeyVal &lKeyVal, pParsedArgs) {
-        // Key Iteration
-        std::pair<std::multimap<std::string, tFilter>::iterator,
-        std::multimap<std::string, tFilter>::iterator> lFilterIter = pFilters.equal_range(lKeyVal.first);
-        // FilterIteration
-        for (std::multimap<std::string, tFilter>::iterator it = lFilterIter.first; it != lFilterIter.second; ++it) {
-            if ((it->second.mScope & scope) &&                                  // Scope check
-                    it->second.mFilterType == fType) {                              // Filter type check
-                if (boost::regex_search(lKeyVal.second, it->second.mRegex)) {
-                    return &it->second;
+void
+RequestProcessor::parseArgs(tRequestArgs &pParsedArgs, const RequestInfo &pRequest) {
+    pParsedArgs.reset(pRequest.mArgs, pRequest.mBody, *mUrlCodec);
+}
+
+std::string
+RequestProcessor::decodeValue(const tArg &pArg) const {
+    return pArg.mValue.empty() ? std::string() : mUrlCodec->decode(pArg.mValue.str());
+}
+
+const std::string *
+RequestProcessor::findSamplingKey(const Commands &pCommands, const RequestInfo &pRequest, tRequestArgs &pParsedArgs) {
+    const tStringRef lName(pCommands.mSamplingKeyName);
+    switch (pCommands.mSamplingKey) {
+    case SamplingKey::ARG:
+        for (size_t i = 0; i < pParsedArgs.header().args().size(); ++i) {
+            if (iequals(pParsedArgs.header().args()[i].mKey, lName)) {
+                return &pParsedArgs.header().value(i);
+            }
+        }
+        if (pRequest.hasBody()) {
+            tArgsCache &lBodyArgs = pParsedArgs.body();
+            for (size_t i = 0; i < lBodyArgs.args().size(); ++i) {
+                if (iequals(lBodyArgs.args()[i].mKey, lName)) {
+                    return &lBodyArgs.value(i);
                 }
             }
         }
+        return NULL;
+    case SamplingKey::HEADER:
+        BOOST_FOREACH(const RequestInfo::tHeaders::value_type &lHeader, pRequest.mHeadersIn) {
+            if (boost::iequals(lHeader.first, pCommands.mSamplingKeyName)) {
+                return &lHeader.second;
+            }
+        }
+        return NULL;
+    case SamplingKey::UNIQUE_ID:
+        return pRequest.mId.empty() ? NULL : &pRequest.mId;
+    default:
+        return NULL;
     }
-    // No matching
-    return NULL;
 }
 
-template <class T>
-void applicationOn(const T &list, int &header, int &body) {
-    header = body = 0;
-    BOOST_FOREACH(const typename T::value_type &f, list) {
-        if (f.mScope & ApplicationScope::BODY)
-            body = true;
-        if (f.mScope & ApplicationScope::HEADER)
-            header = true;
-    }
-}
+const tFilter *
+RequestProcessor::keyFilterMatch(const Commands::tKeyFilters &pFilters, tArgsCache &pParsedArgs) {
 
-template <class T>
-void applicationOnMap(const T &list, int &header, int &body) {
-    header = body = 0;
-    BOOST_FOREACH(const typename T::value_type &f, list) {
-        if (f.second.mScope & ApplicationScope::BODY)
-            body = true;
-        if (f.second.mScope & ApplicationScope::HEADER)
-            header = true;
+    for (size_t i = 0; i < pParsedArgs.args().size(); ++i) {
+        // Key Iteration
+        Commands::tKeyFilters::const_iterator lFilters = pFilters.find(pParsedArgs.args()[i].mKey);
+        if (lFilters == pFilters.end()) {
+            continue;
+        }
+        // Only the values of the keys filtered get decoded, once for all the destinations
+        const std::string &lValue = pParsedArgs.value(i);
+        // FilterIteration, only on the filters of the scope and type
+        BOOST_FOREACH (const tFilter *lFilter, lFilters->second) {
+            if (boost::regex_search(lValue, lFilter->mRegex)) {
+                return lFilter;
+            }
+        }
     }
+    // No matching
+    return NULL;
 }
 
 const tFilter *
-RequestProcessor::argsMatchFilter(RequestInfo &pRequest, Commands &pCommands, std::list<tKeyVal> &pHeaderParsedArgs) {
+RequestProcessor::argsMatchFilter(RequestInfo &pRequest, Commands &pCommands, tRequestArgs &pParsedArgs) {
 
+    if (!mCompiled) {
+        compile();
+    }
     const tFilter *matched = NULL;
-    std::multimap<std::string, tFilter> &pFilters = pCommands.mFilters;
-
-    // Key filter type deection
-    int keyFilterOnHeader, keyFilterOnBody;
-    applicationOnMap(pFilters, keyFilterOnHeader, keyFilterOnBody);
+    const bool keyFilterOnHeader = pCommands.mKeyFiltersOn[Commands::HEADER_INDEX];
+    const bool keyFilterOnBody = pCommands.mKeyFiltersOn[Commands::BODY_INDEX];
 
     Log::debug("Filters on body: %d | on header: %d", keyFilterOnBody, keyFilterOnHeader);
 
     // Prevent Filtering check on HEADER
-    if (keyFilterOnHeader && (matched = keyFilterMatch(pFilters, pHeaderParsedArgs, ApplicationScope::HEADER, tFilter::PREVENT_DUPLICATION))) {
+    if (keyFilterOnHeader && (matched = keyFilterMatch(pCommands.mKeyFilters[Commands::HEADER_INDEX][tFilter::PREVENT_DUPLICATION], pParsedArgs.header()))) {
         Log::debug("PREVENT Filter on HEADER match");
         return NULL;
     }
 
-    std::list<tKeyVal> lParsedArgs;
-
-    // Prevent Filtering check on BODY
+    // Prevent Filtering check on BODY, parsed by the first destination which needs it
     if (keyFilterOnBody){
-        parseArgs(lParsedArgs, pRequest.mBody);
-        if ((matched = keyFilterMatch(pFilters, lParsedArgs, ApplicationScope::BODY, tFilter::PREVENT_DUPLICATION))) {
+        if ((matched = keyFilterMatch(pCommands.mKeyFilters[Commands::BODY_INDEX][tFilter::PREVENT_DUPLICATION], pParsedArgs.body()))) {
             Log::debug("PREVENT Filter on BODY match");
             return NULL;
         }
     }
 
-    // Raw filters prevent analyse
-    BOOST_FOREACH (tFilter &raw, pCommands.mRawFilters) {
-        if (raw.mFilterType == tFilter::PREVENT_DUPLICATION) {
-            // Header application
-            if (raw.mScope & ApplicationScope::HEADER) {
-                if (boost::regex_search(pRequest.mArgs, raw.mRegex)) {
-                    Log::debug("Prevent Raw filter (HEADER) matched: %s | %s", pRequest.mArgs.c_str(), raw.mRegex.str().c_str());
-                    return NULL;
-                }
-            }
-            // Body application
-            if (raw.mScope & ApplicationScope::BODY) {
-                if (boost::regex_search(pRequest.mBody, raw.mRegex)) {
-                    Log::debug("Prevent Raw filter (BODY) matched: %s | %s", pRequest.mBody.c_str(), raw.mRegex.str().c_str());
-                    return NULL;
-                }
-            }
-        }
+    // Raw filters prevent analyse: any match prevents, one scan of the header and one of the body
+    size_t lRank;
+    if ((matched = pCommands.mRawFilterSets[tFilter::PREVENT_DUPLICATION][Commands::HEADER_INDEX].search(pRequest.mArgs, lRank))) {
+        Log::debug("Prevent Raw filter (HEADER) matched: %s | %s", pRequest.mArgs.c_str(), matched->mRegex.str().c_str());
+        return NULL;
+    }
+    if ((matched = pCommands.mRawFilterSets[tFilter::PREVENT_DUPLICATION][Commands::BODY_INDEX].search(pRequest.mBody, lRank))) {
+        Log::debug("Prevent Raw filter (BODY) matched: %s | %s", pRequest.mBody.c_str(), matched->mRegex.str().c_str());
+        return NULL;
     }
 
     // Key filters on header
-    if (keyFilterOnHeader && (matched = keyFilterMatch(pFilters, pHeaderParsedArgs, ApplicationScope::HEADER, tFilter::REGULAR))){
+    if (keyFilterOnHeader && (matched = keyFilterMatch(pCommands.mKeyFilters[Commands::HEADER_INDEX][tFilter::REGULAR], pParsedArgs.header()))){
         Log::debug("Filter on HEADER match");
         return matched;
     }
 
     // Key filters on body
     if (keyFilterOnBody){
-        if ((matched = keyFilterMatch(pFilters, lParsedArgs, ApplicationScope::BODY, tFilter::REGULAR))) {
+        if ((matched = keyFilterMatch(pCommands.mKeyFilters[Commands::BODY_INDEX][tFilter::REGULAR], pParsedArgs.body()))) {
             Log::debug("Filter on BODY match");
             return matched;
         }
     }
 
-    // Raw filters matching
-    BOOST_FOREACH (tFilter &raw, pCommands.mRawFilters) {
-        if (raw.mFilterType != tFilter::PREVENT_DUPLICATION) {
-            // Header application
-            if (raw.mScope & ApplicationScope::HEADER) {
-                if (boost::regex_search(pRequest.mArgs, raw.mRegex)) {
-                    Log::debug("Raw filter (HEADER) matched: %s | %s", pRequest.mArgs.c_str(), raw.mRegex.str().c_str());
-                    return &raw;
-                }
-            }
-            // Body application
-            if (raw.mScope & ApplicationScope::BODY) {
-                if (boost::regex_search(pRequest.mBody, raw.mRegex)) {
-                    Log::debug("Raw filter (BODY) matched: %s | %s", pRequest.mBody.c_str(), raw.mRegex.str().c_str());
-                    return &raw;
-                }
-            }
-        }
+    // Raw filters matching: the first declared filter which matches wins
+    size_t lHeaderRank, lBodyRank;
+    const tFilter *lHeaderMatch = pCommands.mRawFilterSets[tFilter::REGULAR][Commands::HEADER_INDEX].searchLowestRank(pRequest.mArgs, lHeaderRank);
+    const tFilter *lBodyMatch = pCommands.mRawFilterSets[tFilter::REGULAR][Commands::BODY_INDEX].searchLowestRank(pRequest.mBody, lBodyRank);
+    if (!lHeaderMatch && !lBodyMatch) {
+        return NULL;
     }
-    return NULL;
+    matched = !lHeaderMatch || (lBodyMatch && lBodyRank < lHeaderRank) ? lBodyMatch : lHeaderMatch;
+    Log::debug("Raw filter matched: %s | %s | %s", pRequest.mArgs.c_str(), pRequest.mBody.c_str(), matched->mRegex.str().c_str());
+    return matched;
 }
 
 bool
-RequestProcessor::keySubstitute(tFieldSubstitutionMap &pSubs,
-        std::list<tKeyVal> &pParsedArgs,
-        ApplicationScope::eApplicationScope scope,
+RequestProcessor::keySubstitute(const Commands::tKeySubstitutions &pSubs,
+        tArgsCache &pParsedArgs,
+        tArena &pArena,
         std::string &result){
-    apr_pool_t *lPool = NULL;
-    apr_pool_create(&lPool, 0);
-
-    std::list<std::string> lNewArgs;
+    // The arguments are joined as they get substituted and encoded, straight in the arena
+    tArenaString lNewArgs(pArena);
     bool lDidSubstitute = false;
 
     // Run through the keys
-    BOOST_FOREACH (const tKeyVal lKeyVal, pParsedArgs) {
-        std::map<std::string, std::list<tSubstitute> >::iterator lSubstIter = pSubs.find(lKeyVal.first);
-        std::string lVal = lKeyVal.second;
+    const tArgs &lArgs = pParsedArgs.args();
+    for (size_t i = 0; i < lArgs.size(); ++i) {
+        Commands::tKeySubstitutions::const_iterator lSubstIter = pSubs.find(lArgs[i].mKey);
+        if (i) {
+            lNewArgs.push_back('&');
+        }
+        char *lKey = lNewArgs.prepare(lArgs[i].mKey.mSize);
+        for (size_t j = 0; j < lArgs[i].mKey.mSize; ++j) {
+            const char c = lArgs[i].mKey.mData[j];
+            lKey[j] = (c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+        }
+        lNewArgs.commit(lArgs[i].mKey.mSize);
+        tStringRef lVal(pParsedArgs.value(i));
 
-        // Key found in the subs?
+        // Key found in the subs of the scope?
         if (lSubstIter != pSubs.end()) {
-            BOOST_FOREACH(const tSubstitute &lSubst, lSubstIter->second) {
-                Log::debug("Key substitute: %d | lVal:%s | lSubst:%s | Rep:%s", (int) lSubst.mScope, lVal.c_str(),
-                        lSubst.mRegex.str().c_str(), lSubst.mReplacement.c_str());
-                if (!(scope & lSubst.mScope))
-                    continue;
-
-                lVal = boost::regex_replace(lVal, lSubst.mRegex, lSubst.mReplacement, boost::match_default | boost::format_all);
+            BOOST_FOREACH(const tSubstitute *lSubst, lSubstIter->second) {
+                Log::debug("Key substitute: %d | lVal:%.*s | lSubst:%s | Rep:%s", (int) lSubst->mScope, (int) lVal.mSize, lVal.mData,
+                        lSubst->mRegex.str().c_str(), lSubst->mReplacement.c_str());
+
+                tArenaString lReplaced(pArena);
+                boost::regex_replace(std::back_inserter(lReplaced), lVal.mData, lVal.mData + lVal.mSize,
+                        lSubst->mRegex, lSubst->mReplacement, boost::match_default | boost::format_all);
+                lVal = tStringRef(lReplaced.data(), lReplaced.size());
                 lDidSubstitute = true;
-                Log::debug("Key substitute res: lVal:%s ", lVal.c_str());
+                Log::debug("Key substitute res: lVal:%.*s ", (int) lVal.mSize, lVal.mData);
 
             }
         }
-        if (lVal.empty()) {
-            lNewArgs.push_back(lKeyVal.first);
-        } else {
-            lNewArgs.push_back(lKeyVal.first + "=" + mUrlCodec->encode(lPool, lVal));
+        if (!lVal.empty()) {
+            lNewArgs.push_back('=');
+            char *lOut = lNewArgs.prepare(3 * lVal.mSize);
+            lNewArgs.commit(mUrlCodec->encode(lVal.mData, lVal.mSize, lOut) - lOut);
         }
     }
     if (lDidSubstitute) {
-        result = boost::algorithm::join(lNewArgs, "&");
+        result.assign(lNewArgs.data(), lNewArgs.size());
     }
-    apr_pool_destroy(lPool);
     return lDidSubstitute;
 }
 
 bool
-RequestProcessor::substituteRequest(RequestInfo &pRequest, Commands &pCommands, std::list<tKeyVal> &pHeaderParsedArgs) {
-    // Ideally we would use the pool from the apache request, but it's used in another thread
-
-    bool keySubOnBody, keySubOnHeader;
-    keySubOnBody = keySubOnHeader = false;
-    // Detect the presence of the different key filters
-    typedef std::pair<const std::string, std::list<tSubstitute> > value_type;
-    BOOST_FOREACH(value_type &f, pCommands.mSubstitutions) {
-        BOOST_FOREACH(tSubstitute &s, f.second) {
-            if (s.mScope & ApplicationScope::BODY)
-                keySubOnBody = true;
-            if (s.mScope & ApplicationScope::HEADER)
-                keySubOnHeader = true;
-        }
+RequestProcessor::substituteRequest(const RequestInfo &pRequest, Commands &pCommands, tRequestArgs &pParsedArgs,
+        tRequestOverlay &pOverlay) {
+    if (!mCompiled) {
+        compile();
     }
-
     bool lDidSubstitute = false;
     // Perform the key substitutions
-    if (keySubOnHeader) {
+    if (pCommands.mKeySubstitutionsOn[Commands::HEADER_INDEX]) {
         // On the header
-        lDidSubstitute = keySubstitute(pCommands.mSubstitutions,
-                pHeaderParsedArgs,
-                ApplicationScope::HEADER,
-                pRequest.mArgs);
-    }
-    if (keySubOnBody) {
-        // On the body
-        std::list<tKeyVal> lParsedArgs;
-        parseArgs(lParsedArgs, pRequest.mBody);
-        lDidSubstitute |= keySubstitute(pCommands.mSubstitutions,
-                lParsedArgs,
-                ApplicationScope::BODY,
-                pRequest.mBody);
-    }
-    // Run the raw substitutions
+        pOverlay.mHasArgs = keySubstitute(pCommands.mKeySubstitutions[Commands::HEADER_INDEX],
+                pParsedArgs.header(),
+                threadArena(),
+                pOverlay.mArgs);
+        lDidSubstitute = pOverlay.mHasArgs;
+    }
+    if (pCommands.mKeySubstitutionsOn[Commands::BODY_INDEX]) {
+        // On the body, parsed once for the filters and the substitutions of all the destinations
+        pOverlay.mHasBody = keySubstitute(pCommands.mKeySubstitutions[Commands::BODY_INDEX],
+                pParsedArgs.body(),
+                threadArena(),
+                pOverlay.mBody);
+        lDidSubstitute |= pOverlay.mHasBody;
+    }
+    // Run the raw substitutions, on the fields substituted so far
     BOOST_FOREACH(const tSubstitute &s, pCommands.mRawSubstitutions) {
         if (s.mScope & ApplicationScope::BODY) {
-            pRequest.mBody = boost::regex_replace(pRequest.mBody, s.mRegex, s.mReplacement, boost::match_default | boost::format_all);
+            pOverlay.mBody = boost::regex_replace(pOverlay.mHasBody ? pOverlay.mBody : pRequest.mBody, s.mRegex, s.mReplacement, boost::match_default | boost::format_all);
+            pOverlay.mHasBody = true;
         }
 
         if (s.mScope & ApplicationScope::HEADER) {
-            pRequest.mArgs = boost::regex_replace(pRequest.mArgs, s.mRegex, s.mReplacement, boost::match_default | boost::format_all);
+            pOverlay.mArgs = boost::regex_replace(pOverlay.mHasArgs ? pOverlay.mArgs : pRequest.mArgs, s.mRegex, s.mReplacement, boost::match_default | boost::format_all);
+            pOverlay.mHasArgs = true;
         }
         lDidSubstitute = true;
     }
     return lDidSubstitute;
 }
 
+bool
+RequestProcessor::substituteRequest(RequestInfo &pRequest, Commands &pCommands, tRequestArgs &pParsedArgs) {
+    tRequestOverlay lOverlay;
+    threadArena().reset();
+    bool lDidSubstitute = substituteRequest(pRequest, pCommands, pParsedArgs, lOverlay);
+    if (lOverlay.mHasArgs) {
+        pRequest.mArgs.swap(lOverlay.mArgs);
+    }
+    if (lOverlay.mHasBody) {
+        pRequest.mBody.swap(lOverlay.mBody);
+    }
+    return lDidSubstitute;
+}
+
 std::list<const tFilter *>
-RequestProcessor::processRequest(RequestInfo &pRequest, std::list<std::pair<std::string, std::string> > parsedArgs) {
+RequestProcessor::processRequest(RequestInfo &pRequest, tRequestArgs &pParsedArgs) {
     std::list<const tFilter *> ret;
 
-    const std::string &pConfPath = pRequest.mConfPath;
-    std::map<std::string, CommandsByDestination>::iterator it = mCommands.find(pConfPath);
+    CommandsByDestination *lCommands = findLocation(pRequest);
 
     // No settings for this path or no duplication mechanism
-    if (it == mCommands.end())
+    if (!lCommands)
         return ret;
 
-    CommandsByDestination &lCommands = (*it).second;
-
     // For each duplication destination
-    std::map<std::string, Commands>::iterator itb = lCommands.mCommands.begin(),
-        itbe = lCommands.mCommands.end();
-    while (itb != itbe) {
-        Log::debug("### Duplication tested: %s", itb->first.c_str() );
+    BOOST_FOREACH(Commands *lDestination, lCommands->mPlan) {
         // Tests if at least one active filter matches on this duplication location
         const tFilter* matchedFilter = NULL;
-        if ((matchedFilter = argsMatchFilter(pRequest, itb->second, parsedArgs))) {
+        if ((matchedFilter = argsMatchFilter(pRequest, *lDestination, pParsedArgs))) {
             ret.push_back(matchedFilter);
         }
-        ++itb;
     }
     return ret;
 }
 
 RequestProcessor::RequestProcessor() :
+            mCompiled(false),
             mTimeout(0), mTimeoutCount(0),
-            mDuplicatedCount(0) {
+            mDuplicatedCount(0),
+            mSenderMode(SenderMode::BLOCKING),
+            mMaxTransfers(32),
+            mBatchSize(16),
+            mBatchWaitMs(0),
+            mConnectionPool(boost::bind(&RequestProcessor::initCurl, this)),
+            mNewConnectionCount(0),
+            mReusedConnectionCount(0),
+            mCircuitOpenCount(0),
+            mRateLimitedCount(0),
+            mMaxAgeMs(0),
+            mStaleCount(0) {
     setUrlCodec();
 }
 
+RequestProcessor::~RequestProcessor() {
+    stopDestinationPools();
+    typedef std::pair<const std::string, tDestinationThreadPool *> tNamedPool;
+    BOOST_FOREACH(tNamedPool &lPool, mDestinationPools) {
+        delete lPool.second;
+    }
+    typedef std::pair<const std::string, DestinationHealth *> tNamedHealth;
+    BOOST_FOREACH(tNamedHealth &lHealth, mHealth) {
+        delete lHealth.second;
+    }
+    typedef std::pair<const std::string, TokenBucket *> tNamedRateLimit;
+    BOOST_FOREACH(tNamedRateLimit &lRateLimit, mRateLimits) {
+        delete lRateLimit.second;
+    }
+}
+
 void
 RequestProcessor::setUrlCodec(const std::string &pUrlCodec)
 {
     mUrlCodec.reset(getUrlCodec(pUrlCodec));
 }
 
+void
+RequestProcessor::setSenderMode(SenderMode::eSenderMode pMode, unsigned int pMaxTransfers)
+{
+    mSenderMode = pMode;
+    mMaxTransfers = pMaxTransfers;
+}
+
+void
+RequestProcessor::setBatch(unsigned int pSize, unsigned int pWaitMs)
+{
+    mBatchSize = pSize;
+    mBatchWaitMs = pWaitMs;
+}
+
+tDestinationThreadPool &
+RequestProcessor::getDestinationPool(const std::string &pDestination) {
+    tDestinationThreadPool *&lPool = mDestinationPools[pDestination];
+    if (!lPool) {
+        lPool = new tDestinationThreadPool(boost::bind(&RequestProcessor::runDestination, this, _1), cPoisonDuplication);
+    }
+    return *lPool;
+}
+
+void
+RequestProcessor::setDestinationThreads(const std::string &pDestination, size_t pMin, size_t pMax) {
+    getDestinationPool(pDestination).setThreads(pMin, pMax);
+}
+
+void
+RequestProcessor::setDestinationQueue(const std::string &pDestination, size_t pMax) {
+    getDestinationPool(pDestination).setQueue(pMax);
+}
+
+void
+RequestProcessor::startDestinationPools(const std::string &pProgramName, const CpuPolicy &pCpuPolicy,
+                                        unsigned int pIdleTimeoutMs) {
+    typedef std::pair<const std::string, tDestinationThreadPool *> tNamedPool;
+    BOOST_FOREACH(tNamedPool &lPool, mDestinationPools) {
+        // Each pool logs its own stats line, drops included
+        lPool.second->setProgramName(pProgramName + ":" + lPool.first);
+        lPool.second->setCpuPolicy(pCpuPolicy);
+        lPool.second->setIdleTimeout(pIdleTimeoutMs);
+        lPool.second->start();
+    }
+}
+
+void
+RequestProcessor::stopDestinationPools() {
+    typedef std::pair<const std::string, tDestinationThreadPool *> tNamedPool;
+    BOOST_FOREACH(tNamedPool &lPool, mDestinationPools) {
+        lPool.second->stop();
+    }
+}
+
+bool
+RequestProcessor::dispatch(const tDuplication &pDuplication) {
+    // The map is only modified at configuration time
+    std::map<std::string, tDestinationThreadPool *>::const_iterator lIt = mDestinationPools.find(pDuplication.mFilter->mDestination);
+    if (lIt == mDestinationPools.end()) {
+        return false;
+    }
+    lIt->second->push(boost::shared_ptr<tDuplication>(new tDuplication(pDuplication)));
+    return true;
+}
+
+void
+RequestProcessor::sendDuplication(const tDuplication &pDuplication) {
+    unsigned int lProbe;
+    CURL *lCurl = acquireHandle(*pDuplication.mFilter, lProbe);
+    if (!lCurl) {
+        return;
+    }
+    performCurlCall(lCurl, *pDuplication.mFilter, pDuplication.request(), lProbe);
+    mConnectionPool.release(pDuplication.mFilter->mDestination, lCurl);
+}
+
+void
+RequestProcessor::sendDuplications(const std::list<tDuplication> &pDuplications, bool pDispatch) {
+    std::vector<const tDuplication *> lToSend;
+    BOOST_FOREACH(const tDuplication &lDuplication, pDuplications) {
+        if (!pDispatch || !dispatch(lDuplication)) {
+            lToSend.push_back(&lDuplication);
+        }
+    }
+    if (lToSend.size() == 1) {
+        sendDuplication(*lToSend.front());
+    } else if (!lToSend.empty()) {
+        fanOut(lToSend);
+    }
+}
+
+void
+RequestProcessor::fanOut(const std::vector<const tDuplication *> &pDuplications) {
+    tFanOut *lFanOut = mThreadFanOut.get();
+    if (!lFanOut) {
+        lFanOut = new tFanOut();
+        mThreadFanOut.reset(lFanOut);
+        if (lFanOut->mMulti) {
+            curl_multi_setopt(lFanOut->mMulti, CURLMOPT_MAXCONNECTS,
+                    static_cast<long>(mConnectionPool.getMaxIdle() * countDestinations()));
+#if LIBCURL_VERSION_NUM >= 0x071e00
+            curl_multi_setopt(lFanOut->mMulti, CURLMOPT_MAX_HOST_CONNECTIONS,
+                    static_cast<long>(mConnectionPool.getMaxTotal()));
+#endif
+        } else {
+            Log::error(404, "Could not init curl multi object.");
+        }
+    }
+    if (!lFanOut->mMulti) {
+        BOOST_FOREACH(const tDuplication *lDuplication, pDuplications) {
+            sendDuplication(*lDuplication);
+        }
+        return;
+    }
+
+    // The handles come from the pool of their destination, so that its limits hold for the batches too.
+    // The requests are kept alive by the caller until all the transfers are done
+    size_t lCount = 0;
+    BOOST_FOREACH(const tDuplication *lDuplication, pDuplications) {
+        unsigned int lProbe;
+        CURL *lCurl = acquireHandle(*lDuplication->mFilter, lProbe);
+        if (!lCurl) {
+            continue;
+        }
+        if (lCount == lFanOut->mTransfers.size()) {
+            lFanOut->mTransfers.push_back(new tTransfer());
+        }
+        tTransfer &lTransfer = *lFanOut->mTransfers[lCount];
+        lTransfer.mCurl = lCurl;
+        prepareTransfer(lTransfer, *lDuplication->mFilter, lDuplication->request());
+        lTransfer.mProbe = lProbe;
+        if (curl_multi_add_handle(lFanOut->mMulti, lCurl) != CURLM_OK) {
+            completeTransfer(lTransfer, CURLE_FAILED_INIT);
+            releaseTransfer(lTransfer);
+            continue;
+        }
+        ++lCount;
+    }
+
+    int lStillRunning = lCount;
+    while (lStillRunning) {
+        curl_multi_perform(lFanOut->mMulti, &lStillRunning);
+        if (lStillRunning) {
+            curl_multi_wait(lFanOut->mMulti, NULL, 0, cMultiWaitMs, NULL);
+        }
+    }
+
+    int lMsgsLeft = 0;
+    CURLMsg *lMsg;
+    while ((lMsg = curl_multi_info_read(lFanOut->mMulti, &lMsgsLeft))) {
+        if (lMsg->msg != CURLMSG_DONE) {
+            continue;
+        }
+        for (size_t i = 0; i < lCount; ++i) {
+            if (lFanOut->mTransfers[i]->mCurl == lMsg->easy_handle) {
+                completeTransfer(*lFanOut->mTransfers[i], lMsg->data.result);
+                break;
+            }
+        }
+    }
+    for (size_t i = 0; i < lCount; ++i) {
+        curl_multi_remove_handle(lFanOut->mMulti, lFanOut->mTransfers[i]->mCurl);
+        releaseTransfer(*lFanOut->mTransfers[i]);
+    }
+}
+
+void
+RequestProcessor::runDestination(MultiThreadQueue<boost::shared_ptr<tDuplication> > &pQueue) {
+    Log::debug("New destination worker thread started");
+    for (;;) {
+        boost::shared_ptr<tDuplication> lDuplication = pQueue.pop();
+        if (!lDuplication->mFilter) {
+            Log::debug("Received poison pill. Exiting.");
+            break;
+        }
+        // The age since the request was first queued: the wait in both queues counts
+        if (isStale(*lDuplication->mRequest)) {
+            continue;
+        }
+        sendDuplication(*lDuplication);
+    }
+}
+
 /// @brief send a POST with a body
 /// @param toSend must be kept until the request is performed
 void
-RequestProcessor::sendInBody(CURL *curl, const RequestInfo &rInfo, curl_slist *&slist, const std::string &toSend) const {
-    std::string contentLen = std::string("Content-Length: ") +
-            boost::lexical_cast<std::string>(toSend.size());
-    slist = curl_slist_append(slist, contentLen.c_str());
-
+RequestProcessor::sendInBody(CURL *curl, const tRequestView &rInfo, const HeaderTemplate &headerTemplate,
+        HeaderBuilder &headers, const std::string &toSend) const {
+    headers.add("Content-Length", static_cast<long>(toSend.size()));
 
     curl_easy_setopt(curl, CURLOPT_POST, 1);
-    addOrigHeaders(rInfo, slist);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
+    headers.addOriginal(rInfo.original().mHeadersIn, headerTemplate);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers.get());
     curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, toSend.size());
     // the string is not copied by curl, so must be kept until request is performed
     curl_easy_setopt(curl, CURLOPT_POSTFIELDS, toSend.c_str());
 }
 
-std::string *
-RequestProcessor::sendDupFormat(CURL *curl, const RequestInfo &rInfo, curl_slist *&slist) const {
-  
-    // set the content type to application/x-dup-serialized if we pass the REQUEST_WITH_ANSWER
-    slist = curl_slist_append(slist, "Content-Type: application/x-dup-serialized");
-    // Adding HTTP HEADER to indicate that the request is duplicated with it's answer
-    slist = curl_slist_append(slist, "Duplication-Type: Response");
-    //Computing dup format string
-    std::stringstream ss;
-    //Request body
-    RequestInfo::Serialize(rInfo.mBody, ss);
-
-    // Answer headers, Copy requestInfo out headers
-    std::string answerHeaders;
-    BOOST_FOREACH(const RequestInfo::tHeaders::value_type &v, rInfo.mHeadersOut) {
-        answerHeaders.append(v.first + std::string(": ") + v.second + "\n");
-    }
-    RequestInfo::Serialize(answerHeaders, ss);
-
-    // Answer Body
-    RequestInfo::Serialize(rInfo.mAnswer, ss);
-    std::string *content = new std::string(ss.str());
-    sendInBody(curl, rInfo, slist, *content);
-    return content;
-}
-
-/// @brief add the original input headers making sure we have no duplicates
-/// duplicates are merged into csv by apache
-/// @param rInfo
-/// @param slist
-void RequestProcessor::addOrigHeaders(const RequestInfo &rInfo, struct curl_slist *&slist) {
-    // Copy the request input headers
-  
-    // Create a set of headers already added
-    std::set<std::string> headers;
-    
-    curl_slist * curlist = slist;
-    while ( curlist ) {
-      if ( curlist->data ) {
-	  char *pos = strchr(curlist->data, ':');
-	  if ( pos ) {
-	      std::string header;
-	      header.assign(curlist->data, pos - curlist->data);
-	      headers.insert(header);
-	  }
-      }
-      curlist = curlist->next;
-    }
-
-    /* The headers potentially added by dup or others and not to be added twice are currently the following:
-      ELAPSED_TIME_BY_DUP,X_DUP_HTTP_STATUS,X_DUP_METHOD,X_DUP_CONTENT_TYPE,
-      Duplication-Type,Content-Length,Host,Expect,Transfer-Encoding,Content-Type
-    */
-    
-    // Now append only if not in the set of headers already added
-    // or apache will at some point concatenate values in a csv list
-    // but also never add Transfer-Encoding chunked or a Content-Length, or Duplication-Type
-    // because we may not be adding it but a previous duplication might have put it there
-    BOOST_FOREACH(const RequestInfo::tHeaders::value_type &v, rInfo.mHeadersIn) {
-        if ( (headers.find(v.first) == headers.end()) && (v.first != std::string("Host")) && 
-	  (v.first != std::string("Transfer-Encoding")) && 
-	  (v.first != std::string("Content-Length")) && (v.first != std::string("Duplication-Type")) ) {
-            headers.insert(v.first);
-            slist = curl_slist_append(slist, std::string(v.first + std::string(": ") + v.second).c_str());
-            // Log::error(11, "Adding header %s: %s", v.first.c_str(), v.second.c_str());
-      } else {
-            // Log::error(11, "Skipping copy of header %s", v.first.c_str());
-        }
-    }
-}
-
-/// @brief add http headers common to all dup types
-/// @param slist slist ref on which to add
-void RequestProcessor::addCommonHeaders(const RequestInfo &rInfo, struct curl_slist *&slist) {
-    // Add the elapsed time header
-    std::string elapsed = std::string("ELAPSED_TIME_BY_DUP: ") + boost::lexical_cast<std::string>(rInfo.getElapsedTimeMS());
-    slist = curl_slist_append(slist, elapsed.c_str());
-
-    // This avoids the Expect: 100 continue
-    // Which is generated by curl when it's a POST and the body is long
-    slist = curl_slist_append(slist, "Expect:");
-    // Setting X-DUPLICATED-REQUEST to 1 in the header
-    slist = curl_slist_append(slist, "X-DUPLICATED-REQUEST: 1");
-    // Setting mod-dup as the real agent for tracability
-    slist = curl_slist_append(slist, "User-RealAgent: mod-dup");
-}
-
-void
-RequestProcessor::performCurlCall(CURL *curl, const tFilter &matchedFilter, const RequestInfo &rInfo) {
-    // Setting URI
-    std::string uri = matchedFilter.mDestination + rInfo.mPath + "?" + rInfo.mArgs;
-    curl_easy_setopt(curl, CURLOPT_URL, uri.c_str());
-
-    std::string *content = NULL;
-    struct curl_slist *slist = NULL;
-    
-    addCommonHeaders(rInfo, slist);
+void
+RequestProcessor::sendDupFormat(CURL *curl, const tRequestView &rInfo, const HeaderTemplate &headerTemplate,
+        HeaderBuilder &headers, tDupFormatReader &reader) const {
+    // The content type and Duplication-Type headers of the dup format are part of the template
+
+    // The dup format is streamed from the request buffers: no copy of the bodies
+    reader.reset(rInfo);
+    headers.add("Content-Length", static_cast<long>(reader.size()));
+
+    curl_easy_setopt(curl, CURLOPT_POST, 1);
+    headers.addOriginal(rInfo.original().mHeadersIn, headerTemplate);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers.get());
+    // A handle reused from a previous POST may still point to its body
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, NULL);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(reader.size()));
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, &tDupFormatReader::readCallback);
+    curl_easy_setopt(curl, CURLOPT_READDATA, &reader);
+    curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, &tDupFormatReader::seekCallback);
+    curl_easy_setopt(curl, CURLOPT_SEEKDATA, &reader);
+}
+
+void
+RequestProcessor::prepareTransfer(tTransfer &pTransfer, const tFilter &matchedFilter, const tRequestView &rInfo) {
+    const RequestInfo &lOriginal = rInfo.original();
+    CURL *curl = pTransfer.mCurl;
+    pTransfer.mFilter = &matchedFilter;
+    if (matchedFilter.mHealth) {
+        // Bounded by DupTimeout, shorter once the latency of the destination is known
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, static_cast<long>(matchedFilter.mHealth->getTimeout(mHealthSettings, mTimeout)));
+    }
+    // Setting URI, reusing the memory of the previous one
+    pTransfer.mUri.assign(matchedFilter.mDestination).append(lOriginal.mPath).append(1, '?').append(rInfo.args());
+    curl_easy_setopt(curl, CURLOPT_URL, pTransfer.mUri.c_str());
+
+    // Headers common to all dup types: the elapsed time, then the precomputed ones of the destination
+    HeaderBuilder &headers = pTransfer.mHeaders;
+    headers.clear();
+    headers.add("ELAPSED_TIME_BY_DUP", static_cast<long>(lOriginal.getElapsedTimeMS()));
+    headers.add(matchedFilter.mHeaderTemplate);
 
     // Sending body in plain or dup format according to the duplication need
     if (matchedFilter.mDuplicationType == DuplicationType::REQUEST_WITH_ANSWER) {
         // POST with dup serialized original request body AND response
-        content = sendDupFormat(curl, rInfo, slist);
-    } else if ((matchedFilter.mDuplicationType == DuplicationType::COMPLETE_REQUEST) && rInfo.hasBody()) {
+        sendDupFormat(curl, rInfo, matchedFilter.mHeaderTemplate, headers, pTransfer.mReader);
+    } else if ((matchedFilter.mDuplicationType == DuplicationType::COMPLETE_REQUEST) && !rInfo.body().empty()) {
         // POST with original body
-        sendInBody(curl, rInfo, slist, rInfo.mBody);
+        sendInBody(curl, rInfo, matchedFilter.mHeaderTemplate, headers, rInfo.body());
     } else {
         // Regular GET case
         curl_easy_setopt(curl, CURLOPT_HTTPGET, 1);
-        addOrigHeaders(rInfo, slist);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
+        headers.addOriginal(lOriginal.mHeadersIn, matchedFilter.mHeaderTemplate);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers.get());
     }
 
-    Log::debug(">> Duplicating: %s", uri.c_str());
-
-    int err = curl_easy_perform(curl);
-    if (slist)
-        curl_slist_free_all(slist);
+    Log::debug(">> Duplicating: %s", pTransfer.mUri.c_str());
+}
 
-    if (err == CURLE_OPERATION_TIMEDOUT) {
+void
+RequestProcessor::completeTransfer(tTransfer &pTransfer, int pResult) {
+    if (pResult == CURLE_OPERATION_TIMEDOUT) {
         __sync_fetch_and_add(&mTimeoutCount, 1);
-    } else if (err) {
-        Log::error(403, "Sending request failed with curl error code: %d, request:%s", err, uri.c_str());
+    } else if (pResult) {
+        Log::error(403, "Sending request failed with curl error code: %d, request:%s", pResult, pTransfer.mUri.c_str());
+    }
+
+    if (pTransfer.mFilter && pTransfer.mFilter->mHealth) {
+        // Server errors count as failures: the destination is up but cannot handle the duplications
+        long lCode = 0;
+        double lTotalTime = 0;
+        curl_easy_getinfo(pTransfer.mCurl, CURLINFO_RESPONSE_CODE, &lCode);
+        curl_easy_getinfo(pTransfer.mCurl, CURLINFO_TOTAL_TIME, &lTotalTime);
+        pTransfer.mFilter->mHealth->onResult(mHealthSettings, pTransfer.mProbe, pResult == CURLE_OK && lCode < 500,
+                static_cast<unsigned int>(lTotalTime * 1000));
+    }
+
+    // A transfer which did not need to connect reused a connection of the handle (or of the multi handle).
+    // One which never started only holds the counters of the previous one
+    long lConnects = 0;
+    if (pResult != CURLE_FAILED_INIT && curl_easy_getinfo(pTransfer.mCurl, CURLINFO_NUM_CONNECTS, &lConnects) == CURLE_OK) {
+        if (lConnects > 0) {
+            __sync_fetch_and_add(&mNewConnectionCount, 1);
+        } else if (!pResult) {
+            __sync_fetch_and_add(&mReusedConnectionCount, 1);
+        }
     }
-    delete content;
+    __sync_fetch_and_add(&mDuplicatedCount, 1);
 }
 
 void
-RequestProcessor::runOne(RequestInfo &reqInfo, CURL * pCurl) {
+RequestProcessor::performCurlCall(CURL *curl, const tFilter &matchedFilter, const tRequestView &rInfo, unsigned int pProbe) {
+    // One transfer per thread, so that its buffers are reused from one request to the next
+    tTransfer *lTransfer = mThreadTransfer.get();
+    if (!lTransfer) {
+        lTransfer = new tTransfer();
+        mThreadTransfer.reset(lTransfer);
+    }
+    lTransfer->mCurl = curl;
+    prepareTransfer(*lTransfer, matchedFilter, rInfo);
+    lTransfer->mProbe = pProbe;
+    completeTransfer(*lTransfer, curl_easy_perform(curl));
+    // The handle belongs to the caller
+    lTransfer->mCurl = NULL;
+    lTransfer->reset();
+}
+
+tArena &
+RequestProcessor::threadArena() {
+    tArena *lArena = mThreadArena.get();
+    if (!lArena) {
+        lArena = new tArena();
+        mThreadArena.reset(lArena);
+    }
+    return *lArena;
+}
 
-    std::list<std::pair<std::string, std::string> > lParsedArgs;
-    parseArgs(lParsedArgs, reqInfo.mArgs);
+void
+RequestProcessor::prepareDuplications(const boost::shared_ptr<RequestInfo> &pRequest, std::list<tDuplication> &pDuplications) {
+    RequestInfo &reqInfo = *pRequest;
 
+    // Parsed once, shared by all the destinations
+    tRequestArgs lParsedArgs;
+    parseArgs(lParsedArgs, reqInfo);
+    // The scratch memory of the substitutions of the previous request is free again
+    threadArena().reset();
 
     std::list<const tFilter *> matchedFilters = processRequest(reqInfo, lParsedArgs);
-    std::list<const tFilter *>::const_iterator it = matchedFilters.begin(),
-        ite = matchedFilters.end();
-        while (it != ite) {
-
-            // First get a hand the commands structure that matches the destination duplication
-            CommandsByDestination &cbd = mCommands.at(reqInfo.mConfPath);
-            Commands &c = cbd.mCommands.at((*it)->mDestination);
-
-            // Should we drop the duplication?
-            if (!c.toDuplicate()) {
-                Log::debug("Regulation drop");
-                ++it;
-                continue;
-            }
+    BOOST_FOREACH(const tFilter *lFilter, matchedFilters) {
+        // The commands of the destination, which the plan points the filter to
+        Commands &c = *lFilter->mCommands;
+
+        // Should we drop the duplication? No need to look for the sampling key when all requests are duplicated
+        if (c.mDuplicationPercentage < 100 && !c.toDuplicate(findSamplingKey(c, reqInfo, lParsedArgs))) {
+            Log::debug("Regulation drop");
+            continue;
+        }
+        // Checked before the substitutions and the queue of the destination: a duplication over the limit costs nothing
+        if (lFilter->mRateLimit && !lFilter->mRateLimit->tryTake()) {
+            Log::debug("Rate limit drop");
+            __sync_fetch_and_add(&mRateLimitedCount, 1);
+            continue;
+        }
 
-            if (!c.mSubstitutions.empty() || !c.mRawSubstitutions.empty()) {
-                // perform substitutions specific to this location
-                RequestInfo b(reqInfo);
-                substituteRequest(b, c, lParsedArgs);
-                performCurlCall(pCurl, **it, b);
+        tDuplication lDuplication;
+        lDuplication.mFilter = lFilter;
+        lDuplication.mRequest = pRequest;
+        if (!c.mSubstitutions.empty() || !c.mRawSubstitutions.empty()) {
+            // perform substitutions specific to this location, which only keep the fields they rewrite
+            lDuplication.mSubstituted.reset(new tRequestOverlay());
+            substituteRequest(reqInfo, c, lParsedArgs, *lDuplication.mSubstituted);
+        }
+        pDuplications.push_back(lDuplication);
+    }
+}
 
-            } else {
-                performCurlCall(pCurl, **it, reqInfo);
-            }
+void
+RequestProcessor::runOne(RequestInfo &reqInfo) {
+    // The request is owned by the caller
+    boost::shared_ptr<RequestInfo> lRequest(&reqInfo, NullDeleter());
+
+    std::list<tDuplication> lDuplications;
+    prepareDuplications(lRequest, lDuplications);
+    sendDuplications(lDuplications, false);
+}
 
-            __sync_fetch_and_add(&mDuplicatedCount, 1);
-            ++it;
+void
+RequestProcessor::initCurlShare()
+{
+    if (!mCurlShare.init()) {
+        Log::error(405, "Could not init curl share object, DNS and TLS session caches will not be shared.");
     }
 }
 
@@ -608,6 +1150,15 @@ CURL * RequestProcessor::initCurl()
     // Activer l'option provoque des timeouts sur des requests avec un fort payload
     curl_easy_setopt(lCurl, CURLOPT_TIMEOUT_MS, mTimeout);
     curl_easy_setopt(lCurl, CURLOPT_NOSIGNAL, 1);
+    if (mCurlShare.get()) {
+        curl_easy_setopt(lCurl, CURLOPT_SHARE, mCurlShare.get());
+    }
+#if LIBCURL_VERSION_NUM >= 0x074100
+    // Let curl close the connections idle for longer than the pool would keep them
+    if (mConnectionPool.getIdleTimeout()) {
+        curl_easy_setopt(lCurl, CURLOPT_MAXAGE_CONN, (mConnectionPool.getIdleTimeout() + 999) / 1000);
+    }
+#endif
 
     return lCurl;
 }
@@ -621,23 +1172,277 @@ RequestProcessor::run(MultiThreadQueue<boost::shared_ptr<RequestInfo> > &pQueue)
 {
     Log::debug("New worker thread started");
 
-    CURL * lCurl = initCurl();
-    if (!lCurl) {
+    if (mSenderMode == SenderMode::MULTI) {
+        runMulti(pQueue);
         return;
     }
 
+    std::vector<boost::shared_ptr<RequestInfo> > lBatch;
     for (;;) {
-        boost::shared_ptr<RequestInfo> lQueueItemShared = pQueue.pop();
-        RequestInfo *lQueueItem = lQueueItemShared.get();
+        lBatch.clear();
+        pQueue.popBatch(lBatch, mBatchSize, mBatchWaitMs);
+
+        // Match the whole batch first, then send its duplications together
+        std::list<tDuplication> lDuplications;
+        bool lRetire = false;
+        BOOST_FOREACH(const boost::shared_ptr<RequestInfo> &lQueueItem, lBatch) {
+            if (lQueueItem->isPoison()) {
+                // The retire item of a closed queue or of an idle worker, which popBatch returns on its own
+                lRetire = true;
+                break;
+            }
+            if (isStale(*lQueueItem)) {
+                continue;
+            }
+            // Destinations with their own workers only get their duplications queued
+            prepareDuplications(lQueueItem, lDuplications);
+        }
+        sendDuplications(lDuplications, true);
 
-        if (lQueueItem->isPoison()) {
-            // Master tells us to stop
+        if (lRetire) {
             Log::debug("Received poison pill. Exiting.");
             break;
         }
-        runOne(*lQueueItem, lCurl);
     }
-    curl_easy_cleanup(lCurl);
+}
+
+void
+RequestProcessor::runMulti(MultiThreadQueue<boost::shared_ptr<RequestInfo> > &pQueue)
+{
+    CURLM * lMulti = curl_multi_init();
+    if (!lMulti) {
+        Log::error(404, "Could not init curl multi object.");
+        return;
+    }
+    // The multi handle shares its connection cache between its easy handles: apply the pool limits to it
+    curl_multi_setopt(lMulti, CURLMOPT_MAXCONNECTS, static_cast<long>(mConnectionPool.getMaxIdle() * countDestinations()));
+#if LIBCURL_VERSION_NUM >= 0x071e00
+    curl_multi_setopt(lMulti, CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>(mConnectionPool.getMaxTotal()));
+#endif
+
+    // Transfers free to be used again, their easy handles back in the connection pool
+    std::list<tTransfer *> lIdle;
+    // Transfers in flight, indexed by their easy handle
+    std::map<CURL *, tTransfer *> lRunning;
+    bool lPoisoned = false;
+
+    while (!lPoisoned || !lRunning.empty()) {
+        // Pull requests while there is room for them, only wait on the queue when nothing is in flight
+        while (!lPoisoned && lRunning.size() < mMaxTransfers) {
+            boost::shared_ptr<RequestInfo> lQueueItemShared;
+            if (lRunning.empty()) {
+                lQueueItemShared = pQueue.pop();
+            } else if (!pQueue.tryPop(lQueueItemShared)) {
+                break;
+            }
+
+            if (lQueueItemShared->isPoison()) {
+                // Master tells us to stop, let the transfers in flight complete first
+                Log::debug("Received poison pill. Exiting.");
+                lPoisoned = true;
+                break;
+            }
+            if (isStale(*lQueueItemShared)) {
+                continue;
+            }
+
+            std::list<tDuplication> lDuplications;
+            prepareDuplications(lQueueItemShared, lDuplications);
+            BOOST_FOREACH(const tDuplication &lDuplication, lDuplications) {
+                if (dispatch(lDuplication)) {
+                    continue;
+                }
+                unsigned int lProbe;
+                CURL *lCurl = acquireHandle(*lDuplication.mFilter, lProbe);
+                if (!lCurl) {
+                    continue;
+                }
+                tTransfer *lTransfer;
+                if (lIdle.empty()) {
+                    lTransfer = new tTransfer();
+                } else {
+                    lTransfer = lIdle.front();
+                    lIdle.pop_front();
+                }
+                lTransfer->mCurl = lCurl;
+                lTransfer->mDuplication = lDuplication;
+                prepareTransfer(*lTransfer, *lDuplication.mFilter, lDuplication.request());
+                lTransfer->mProbe = lProbe;
+                if (curl_multi_add_handle(lMulti, lCurl) != CURLM_OK) {
+                    completeTransfer(*lTransfer, CURLE_FAILED_INIT);
+                    releaseTransfer(*lTransfer);
+                    lIdle.push_back(lTransfer);
+                    continue;
+                }
+                lRunning[lTransfer->mCurl] = lTransfer;
+            }
+        }
+
+        int lStillRunning = 0;
+        curl_multi_perform(lMulti, &lStillRunning);
+
+        // Account for the finished transfers and make them available again
+        int lMsgsLeft = 0;
+        CURLMsg *lMsg;
+        while ((lMsg = curl_multi_info_read(lMulti, &lMsgsLeft))) {
+            if (lMsg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            std::map<CURL *, tTransfer *>::iterator lIt = lRunning.find(lMsg->easy_handle);
+            if (lIt == lRunning.end()) {
+                continue;
+            }
+            tTransfer *lTransfer = lIt->second;
+            lRunning.erase(lIt);
+            // lMsg is invalidated by the removal
+            int lResult = lMsg->data.result;
+            curl_multi_remove_handle(lMulti, lTransfer->mCurl);
+            completeTransfer(*lTransfer, lResult);
+            releaseTransfer(*lTransfer);
+            lIdle.push_back(lTransfer);
+        }
+
+        if (!lRunning.empty()) {
+            curl_multi_wait(lMulti, NULL, 0, cMultiWaitMs, NULL);
+        }
+    }
+
+    BOOST_FOREACH(tTransfer *lTransfer, lIdle) {
+        delete lTransfer;
+    }
+    curl_multi_cleanup(lMulti);
+}
+
+tFanOut::tFanOut()
+: mMulti(curl_multi_init()) {
+}
+
+tFanOut::~tFanOut() {
+    // The easy handles are back in the connection pool
+    BOOST_FOREACH(tTransfer *lTransfer, mTransfers) {
+        delete lTransfer;
+    }
+    if (mMulti) {
+        curl_multi_cleanup(mMulti);
+    }
+}
+
+tTransfer::tTransfer()
+: mCurl(NULL)
+, mFilter(NULL)
+, mProbe(0) {
+}
+
+tTransfer::~tTransfer() {
+    reset();
+    if (mCurl) {
+        curl_easy_cleanup(mCurl);
+    }
+}
+
+void
+tTransfer::reset() {
+    mHeaders.clear();
+    mReader.clear();
+    mFilter = NULL;
+    mProbe = 0;
+    mDuplication = tDuplication();
+}
+
+tDupFormatReader::tDupFormatReader()
+: mSegment(0)
+, mOffset(0)
+, mSize(0) {
+}
+
+void
+tDupFormatReader::append(const char *pData, size_t pLength) {
+    if (pLength) {
+        mSegments.push_back(std::make_pair(pData, pLength));
+        mSize += pLength;
+    }
+}
+
+void
+tDupFormatReader::reset(const tRequestView &rInfo) {
+    clear();
+    const RequestInfo &lOriginal = rInfo.original();
+    const std::string &lBody = rInfo.body();
+
+    // Answer headers, written as "key: value\n" lines
+    size_t lHeadersLength = 0;
+    BOOST_FOREACH(const RequestInfo::tHeaders::value_type &v, lOriginal.mHeadersOut) {
+        lHeadersLength += v.first.size() + 2 + v.second.size() + 1;
+    }
+
+    // Same format as RequestInfo::Serialize
+    snprintf(mPrefixes[0], sizeof(mPrefixes[0]), "%08zu", lBody.size());
+    snprintf(mPrefixes[1], sizeof(mPrefixes[1]), "%08zu", lHeadersLength);
+    snprintf(mPrefixes[2], sizeof(mPrefixes[2]), "%08zu", lOriginal.mAnswer.size());
+
+    append(mPrefixes[0], strlen(mPrefixes[0]));
+    append(lBody.data(), lBody.size());
+    append(mPrefixes[1], strlen(mPrefixes[1]));
+    BOOST_FOREACH(const RequestInfo::tHeaders::value_type &v, lOriginal.mHeadersOut) {
+        append(v.first.data(), v.first.size());
+        append(": ", 2);
+        append(v.second.data(), v.second.size());
+        append("\n", 1);
+    }
+    append(mPrefixes[2], strlen(mPrefixes[2]));
+    append(lOriginal.mAnswer.data(), lOriginal.mAnswer.size());
+}
+
+void
+tDupFormatReader::clear() {
+    // Keeps the capacity of the segments for the next request
+    mSegments.clear();
+    mSegment = mOffset = mSize = 0;
+}
+
+size_t
+tDupFormatReader::read(char *pBuffer, size_t pSize) {
+    size_t lRead = 0;
+    while (lRead < pSize && mSegment < mSegments.size()) {
+        const std::pair<const char *, size_t> &lSegment = mSegments[mSegment];
+        size_t lLength = std::min(pSize - lRead, lSegment.second - mOffset);
+        memcpy(pBuffer + lRead, lSegment.first + mOffset, lLength);
+        lRead += lLength;
+        mOffset += lLength;
+        if (mOffset == lSegment.second) {
+            mSegment++;
+            mOffset = 0;
+        }
+    }
+    return lRead;
+}
+
+bool
+tDupFormatReader::seek(size_t pOffset) {
+    if (pOffset > mSize) {
+        return false;
+    }
+    mSegment = 0;
+    while (mSegment < mSegments.size() && pOffset >= mSegments[mSegment].second) {
+        pOffset -= mSegments[mSegment].second;
+        mSegment++;
+    }
+    mOffset = pOffset;
+    return true;
+}
+
+size_t
+tDupFormatReader::readCallback(char *pBuffer, size_t pSize, size_t pNItems, void *pReader) {
+    return static_cast<tDupFormatReader *>(pReader)->read(pBuffer, pSize * pNItems);
+}
+
+int
+tDupFormatReader::seekCallback(void *pReader, curl_off_t pOffset, int pOrigin) {
+    // curl only rewinds to absolute positions
+    if (pOrigin != SEEK_SET || pOffset < 0) {
+        return CURL_SEEKFUNC_CANTSEEK;
+    }
+    return static_cast<tDupFormatReader *>(pReader)->seek(pOffset) ? CURL_SEEKFUNC_OK : CURL_SEEKFUNC_FAIL;
 }
 
 tElementBase::tElementBase(const std::string &r, ApplicationScope::eApplicationScope s)
@@ -663,7 +1468,11 @@ tFilter::tFilter(const std::string &regex, ApplicationScope::eApplicationScope s
 : tElementBase(regex, scope)
 , mDestination(currentDupDestination)
 , mDuplicationType(dupType)
-, mFilterType(fType) {
+, mFilterType(fType)
+, mHeaderTemplate(dupType)
+, mHealth(NULL)
+, mRateLimit(NULL)
+, mCommands(NULL) {
 }
 
 tFilter::~tFilter() {
@@ -676,6 +1485,70 @@ tElementBase::tElementBase(const tElementBase &other) {
     mRegex = other.mRegex;
 }
 
+tFilterSet::tFilterSet()
+: mCombined(false) {
+}
+
+void
+tFilterSet::compile(const std::vector<const tFilter *> &pFilters, const std::vector<size_t> &pRanks) {
+    // Numbered back references and recursions would point to the groups of other filters once combined
+    static const boost::regex lGroupReferences("\\\\(?:[1-9]|g|k)|\\(\\?(?:P=|P>|&|R|[-+]?[0-9])");
+
+    mFilters = pFilters;
+    mRanks = pRanks;
+    mGroups.clear();
+    mCombined = false;
+    if (mFilters.size() < 2) {
+        return;
+    }
+    std::string lAlternatives;
+    size_t lGroup = 1;
+    BOOST_FOREACH(const tFilter *lFilter, mFilters) {
+        const std::string lRegex = lFilter->mRegex.str();
+        if (lFilter->mRegex.flags() != boost::regex::normal || boost::regex_search(lRegex, lGroupReferences)) {
+            return;
+        }
+        if (!lAlternatives.empty()) {
+            lAlternatives += '|';
+        }
+        lAlternatives += '(' + lRegex + ')';
+        mGroups.push_back(lGroup);
+        lGroup += lFilter->mRegex.mark_count() + 1;
+    }
+    try {
+        mRegex.assign(lAlternatives);
+        mCombined = true;
+    } catch (boost::regex_error &) {
+        // Too complex once combined
+        mGroups.clear();
+    }
+}
+
+const tFilter *
+tFilterSet::search(const std::string &pText, size_t &pRank) const {
+    if (!mCombined) {
+        for (size_t i = 0; i < mFilters.size(); ++i) {
+            if (boost::regex_search(pText, mFilters[i]->mRegex)) {
+                pRank = mRanks[i];
+                return mFilters[i];
+            }
+        }
+        return NULL;
+    }
+    boost::smatch lMatch;
+    if (!boost::regex_search(pText, lMatch, mRegex)) {
+        return NULL;
+    }
+    // The alternatives are tried in order at the leftmost match
+    for (size_t i = 0; i < mFilters.size(); ++i) {
+        if (lMatch[mGroups[i]].matched) {
+            pRank = mRanks[i];
+            return mFilters[i];
+        }
+    }
+    return NULL;
+}
+
 tSubstitute::tSubstitute(const std::string &regex, const std::string &replacement, ApplicationScope::eApplicationScope scope)
 : tElementBase(regex, scope)
 , mReplacement(replacement){
@@ -686,4 +1559,35 @@ tSubstitute::~tSubstitute() {
 }
 
 
+const tFilter *
+tFilterSet::searchLowestRank(const std::string &pText, size_t &pRank) const {
+    if (!mCombined) {
+        // The filters are tried in their order of precedence
+        return search(pText, pRank);
+    }
+    const tFilter *lBest = NULL;
+    boost::smatch lMatch;
+    std::string::const_iterator lStart = pText.begin();
+    boost::match_flag_type lFlags = boost::match_default;
+    // The alternatives are tried in order at the leftmost match only: a filter of lower rank can match further
+    while (boost::regex_search(lStart, pText.end(), lMatch, mRegex, lFlags)) {
+        for (size_t i = 0; i < mFilters.size(); ++i) {
+            if (lMatch[mGroups[i]].matched) {
+                if (!lBest || mRanks[i] < pRank) {
+                    lBest = mFilters[i];
+                    pRank = mRanks[i];
+                }
+                break;
+            }
+        }
+        if (lBest == mFilters.front() || lMatch[0].first == pText.end()) {
+            break;
+        }
+        // From the next position, the text before it still seen by the anchors and word boundaries
+        lStart = lMatch[0].first + 1;
+        lFlags = boost::match_prev_avail;
+    }
+    return lBest;
+}
+
 }
@@ -18,17 +18,28 @@
 
 #pragma once
 
+#include <boost/noncopyable.hpp>
 #include <boost/regex.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <curl/curl.h>
 #include <string>
 #include <map>
+#include <unordered_map>
+#include <vector>
 #include <apr_pools.h>
 
+#include "Arena.hh"
+#include "Args.hh"
+#include "ConnectionPool.hh"
+#include "DestinationHealth.hh"
+#include "HeaderBuilder.hh"
 #include "MultiThreadQueue.hh"
 #include "RequestInfo.hh"
 #include "UrlCodec.hh"
 #include "RequestCommon.hh"
+#include "ThreadPool.hh"
+#include "TokenBucket.hh"
 
 
 typedef void CURL;
@@ -39,6 +50,8 @@ class TestModDup;
 
 namespace DupModule {
 
+class Commands;
+
 /**
  * Base class for filters and substitutions
  */
@@ -83,6 +96,14 @@ public:
     DuplicationType::eDuplicationType mDuplicationType;     /** The duplication type for this filter */
 
     eFilterTypes mFilterType;
+
+    HeaderTemplate mHeaderTemplate;                         /** The headers sent with every duplication of this filter */
+
+    DestinationHealth *mHealth;                             /** The health of the destination, owned by the RequestProcessor */
+
+    TokenBucket *mRateLimit;                                /** The rate limit of the destination, owned by the RequestProcessor */
+
+    Commands *mCommands;                                    /** The commands of the destination the filter belongs to, set by Commands::compile */
 };
 
 /**
@@ -99,19 +120,95 @@ public:
     std::string mReplacement; /** The replacement value regex */
 };
 
+/**
+ * @brief Raw filters matched in a single scan of the text: their regexes are alternatives of a single regex,
+ * each in its own group, so that the cost of a scan does not depend on the number of filters
+ */
+class tFilterSet {
+public:
+    tFilterSet();
+
+    /**
+     * @brief Builds the set. Filters using back references or flags of their own cannot be combined:
+     * the set then scans the text once per filter
+     * @param pFilters the filters, in their order of precedence
+     * @param pRanks the rank of each filter in the order of precedence of the raw filters of its type
+     */
+    void compile(const std::vector<const tFilter *> &pFilters, const std::vector<size_t> &pRanks);
+
+    /**
+     * @brief Returns the filter of lowest rank matching at the leftmost position of the text where a filter matches
+     * @param pText the text to match
+     * @param pRank set to the rank of the filter returned
+     * @return NULL if no filter matches
+     */
+    const tFilter *search(const std::string &pText, size_t &pRank) const;
+
+    /**
+     * @brief Returns the filter of lowest rank matching anywhere in the text.
+     * The text is scanned again from each position where a filter of a higher rank than the best one so far matches.
+     * @param pText the text to match
+     * @param pRank set to the rank of the filter returned
+     * @return NULL if no filter matches
+     */
+    const tFilter *searchLowestRank(const std::string &pText, size_t &pRank) const;
+
+private:
+    std::vector<const tFilter *>    mFilters;       /** The filters of the set */
+    std::vector<size_t>             mRanks;         /** The rank of each filter */
+    std::vector<size_t>             mGroups;        /** The group of each filter in mRegex */
+    boost::regex                    mRegex;         /** The alternatives of the regexes of the filters */
+    bool                            mCombined;      /** false if the filters are matched one by one */
+};
+
 /** @brief Maps a path to a substitution. Not a multimap because order matters. */
 typedef std::map<std::string, std::list<tSubstitute> > tFieldSubstitutionMap;
 
 
 
+/*
+ * What the duplication percentage is applied on
+ */
+namespace SamplingKey {
+
+enum eSamplingKey {
+    RANDOM      = 0,    // Each request is drawn at random
+    ARG         = 1,    // The hash of a query or body parameter
+    HEADER      = 2,    // The hash of a request header
+    UNIQUE_ID   = 3,    // The hash of the UNIQUE_ID of the request
+};
+
+extern const char* c_ERROR_ON_STRING_VALUE;
+
+/*
+ * Converts the string representation of a SamplingKey into the enum value
+ */
+eSamplingKey stringToEnum(const char *value) throw (std::exception);
+
+};
+
 /** @brief A container for the operations */
 class Commands {
 public:
 
+    /** @brief The key filters of a scope and type, indexed case insensitively by the key, in their order of declaration */
+    typedef std::unordered_map<tStringRef, std::vector<const tFilter *>, tArgKeyHash, tArgKeyEqual> tKeyFilters;
+
+    /** @brief The key substitutions of a scope, indexed case insensitively by the key, in their order of declaration */
+    typedef std::unordered_map<tStringRef, std::vector<const tSubstitute *>, tArgKeyHash, tArgKeyEqual> tKeySubstitutions;
+
+    /** @brief The index of the HEADER and BODY scopes in the execution plan */
+    enum eScopeIndex {
+        HEADER_INDEX    = 0,
+        BODY_INDEX      = 1,
+    };
+
     /**
      * @brief Default Ctor
      */
-    Commands() : mDuplicationPercentage(100) {
+    Commands() : mDuplicationPercentage(100), mSamplingKey(SamplingKey::RANDOM) {
+        mKeyFiltersOn[HEADER_INDEX] = mKeyFiltersOn[BODY_INDEX] = false;
+        mKeySubstitutionsOn[HEADER_INDEX] = mKeySubstitutionsOn[BODY_INDEX] = false;
     }
 
     /** @brief The list of filter commands
@@ -137,8 +234,243 @@ public:
      * duplicated or not
      */
     bool toDuplicate();
+
+    /** What the percentage of duplication is applied on */
+    SamplingKey::eSamplingKey mSamplingKey;
+
+    /** The name of the parameter or header the sampling hashes, matched case insensitively */
+    std::string mSamplingKeyName;
+
+    /**
+     * @brief Returns true if the request must be duplicated
+     * Keeps the same fraction of the values of the sampling key, so that a given value is either always or never
+     * duplicated. Draws at random if there is no sampling key value.
+     * @param pKey the value of the sampling key of the request, NULL if it has none
+     */
+    bool toDuplicate(const std::string *pKey);
+
+    /**
+     * @brief Hash a sampling key value into a number in [0, 100[
+     */
+    static unsigned int samplingBucket(const std::string &pValue);
+
+    /**
+     * @brief Build the execution plan below from the filters and substitutions. To call once they are all added.
+     */
+    void compile();
+
+    // The execution plan: what a request is matched against, without looking for the scopes present
+    /** @brief The key filters per scope index and filter type */
+    tKeyFilters mKeyFilters[2][2];
+
+    /** @brief true if there are key filters on the scope index */
+    bool mKeyFiltersOn[2];
+
+    /** @brief The raw filters per filter type, in their order of declaration */
+    std::vector<const tFilter *> mRawFiltersByType[2];
+
+    /** @brief The raw filters per filter type and scope index, matched in a single scan */
+    tFilterSet mRawFilterSets[2][2];
+
+    /** @brief The key substitutions per scope index */
+    tKeySubstitutions mKeySubstitutions[2];
+
+    /** @brief true if there are key substitutions on the scope index */
+    bool mKeySubstitutionsOn[2];
+};
+
+/**
+ * @brief The fields of a request rewritten by the substitutions of a destination
+ */
+struct tRequestOverlay {
+    tRequestOverlay() : mHasArgs(false), mHasBody(false) {}
+
+    bool            mHasArgs;   /** true if mArgs replaces the query string of the request */
+    std::string     mArgs;      /** The query string substituted */
+    bool            mHasBody;   /** true if mBody replaces the body of the request */
+    std::string     mBody;      /** The body substituted */
+};
+
+/**
+ * @brief A request as sent to a destination: the fields of its overlay if it has one, the ones of the original otherwise
+ */
+class tRequestView {
+public:
+    tRequestView(const RequestInfo &pRequest, const tRequestOverlay *pOverlay = NULL)
+        : mRequest(pRequest), mOverlay(pOverlay) {}
+
+    /** @brief The request as it was received, for the fields no substitution rewrites */
+    const RequestInfo &original() const {
+        return mRequest;
+    }
+
+    const std::string &args() const {
+        return (mOverlay && mOverlay->mHasArgs) ? mOverlay->mArgs : mRequest.mArgs;
+    }
+
+    const std::string &body() const {
+        return (mOverlay && mOverlay->mHasBody) ? mOverlay->mBody : mRequest.mBody;
+    }
+
+private:
+    const RequestInfo       &mRequest;
+    const tRequestOverlay   *mOverlay;
+};
+
+/**
+ * @brief A duplication to perform: the filter that matched and the request to send
+ */
+struct tDuplication {
+    tDuplication() : mFilter(NULL) {}
+
+    /** @brief The request to send: the original, seen through the substitutions of the destination if it has some */
+    tRequestView request() const {
+        return tRequestView(*mRequest, mSubstituted.get());
+    }
+
+    /** The filter that matched, gives the destination and the duplication type */
+    const tFilter                       *mFilter;
+    /** The request as it was received, shared by all its duplications */
+    boost::shared_ptr<RequestInfo>      mRequest;
+    /** The fields rewritten by the substitutions of the destination, NULL if it has none */
+    boost::shared_ptr<tRequestOverlay>  mSubstituted;
+};
+
+/**
+ * @brief Streams the dup format body of a request to curl, straight from the RequestInfo buffers.
+ * The body is the request body, the answer headers and the answer body, each preceded by its length on 8 digits.
+ * Only the length prefixes are written by the reader: the rest is read in place, so the RequestInfo must be kept
+ * alive and unchanged until the transfer is done.
+ */
+class tDupFormatReader : private boost::noncopyable {
+public:
+    tDupFormatReader();
+
+    /**
+     * @brief Start streaming the dup format of a request
+     * @param rInfo the request, with its answer
+     */
+    void
+    reset(const tRequestView &rInfo);
+
+    /**
+     * @brief Forget the request streamed
+     */
+    void
+    clear();
+
+    /** @brief The total size of the dup format body */
+    size_t
+    size() const {
+        return mSize;
+    }
+
+    /**
+     * @brief Copy the next bytes of the body
+     * @param pBuffer where to copy them
+     * @param pSize the size of the buffer
+     * @return the number of bytes copied, 0 once the whole body was read
+     */
+    size_t
+    read(char *pBuffer, size_t pSize);
+
+    /**
+     * @brief Move to the given position in the body, for when curl needs to send it again
+     * @return false if the position is beyond the end of the body
+     */
+    bool
+    seek(size_t pOffset);
+
+    /** @brief The CURLOPT_READFUNCTION callback, the user data being the reader */
+    static size_t
+    readCallback(char *pBuffer, size_t pSize, size_t pNItems, void *pReader);
+
+    /** @brief The CURLOPT_SEEKFUNCTION callback, the user data being the reader */
+    static int
+    seekCallback(void *pReader, curl_off_t pOffset, int pOrigin);
+
+private:
+    /** @brief Add a segment of the body */
+    void
+    append(const char *pData, size_t pLength);
+
+    /** @brief The length prefixes of the request body, answer headers and answer body */
+    char                                                mPrefixes[3][24];
+    /** @brief The pieces of the body, in order */
+    std::vector<std::pair<const char *, size_t> >       mSegments;
+    /** @brief The segment being read */
+    size_t                                              mSegment;
+    /** @brief The position in the segment being read */
+    size_t                                              mOffset;
+    /** @brief The total size of the body */
+    size_t                                              mSize;
 };
 
+/**
+ * @brief The state of an outgoing request, which must be kept until curl is done with it
+ */
+struct tTransfer {
+    tTransfer();
+
+    ~tTransfer();
+
+    /**
+     * @brief Release what was allocated for the last request so that the transfer can be reused
+     */
+    void reset();
+
+    /** The easy handle performing the request */
+    CURL                                *mCurl;
+    /** The headers of the request */
+    HeaderBuilder                       mHeaders;
+    /** Streams the dup format body of a REQUEST_WITH_ANSWER duplication */
+    tDupFormatReader                    mReader;
+    /** The full uri of the request */
+    std::string                         mUri;
+    /** The filter of the request, gives the health of its destination */
+    const tFilter                       *mFilter;
+    /** The probe token the circuit of the destination gave to the request */
+    unsigned int                        mProbe;
+    /** Keeps the duplicated request alive while it is in flight */
+    tDuplication                        mDuplication;
+};
+
+/**
+ * @brief What a BLOCKING mode thread needs to send the duplications of a request to several destinations at once
+ */
+struct tFanOut {
+    tFanOut();
+
+    ~tFanOut();
+
+    /** The multi handle driving the transfers, which keeps the connections they open */
+    CURLM                               *mMulti;
+    /** As many transfers as the most duplications sent at once, their easy handles only set while they are sent */
+    std::vector<tTransfer *>            mTransfers;
+};
+
+/*
+ * The ways the worker threads can send the duplicated requests
+ */
+namespace SenderMode {
+
+enum eSenderMode {
+    BLOCKING    = 0,    // One request at a time per worker, using curl_easy_perform
+    MULTI       = 1,    // Many concurrent requests per worker, driven by a curl multi handle
+};
+
+extern const char* c_ERROR_ON_STRING_VALUE;
+
+/*
+ * Converts the string representation of a SenderMode into the enum value
+ */
+eSenderMode stringToEnum(const char *value) throw (std::exception);
+
+};
+
+/** @brief A pool of workers sending the duplications of a single destination */
+typedef ThreadPool<boost::shared_ptr<tDuplication> > tDestinationThreadPool;
+
 /**
  * @brief Overlay on the commands object
  * Adds a destination concept
@@ -146,6 +478,9 @@ public:
 struct CommandsByDestination {
     /** Commands indexed by the duplication destination*/
     std::map<std::string, Commands> mCommands;
+
+    /** The commands of each destination in the order of mCommands, compiled: the execution plan of the location */
+    std::vector<Commands *> mPlan;
 };
 
 /**
@@ -160,6 +495,12 @@ private:
     /** @brief Maps paths to their corresponding processing (filter and substitution) directives */
     std::map<std::string, CommandsByDestination> mCommands;
 
+    /** @brief true once the execution plans are built from mCommands, reset when a directive changes it */
+    volatile bool                                   mCompiled;
+
+    /** @brief Serializes the builds of the execution plans */
+    boost::mutex                                    mCompileMutex;
+
     /** @brief The timeout for outgoing requests in ms */
     unsigned int                                    mTimeout;
 
@@ -172,14 +513,173 @@ private:
     /** @brief The codec to use when encoding the url*/
     boost::scoped_ptr<const IUrlCodec>              mUrlCodec;
 
-    static void addOrigHeaders(const RequestInfo &rInfo, curl_slist *&slist);
-    static void addCommonHeaders(const RequestInfo &rInfo, curl_slist *&slist);
+    /** @brief How the workers send the duplicated requests */
+    SenderMode::eSenderMode                         mSenderMode;
+
+    /** @brief The maximum number of concurrent requests of a worker in MULTI sender mode */
+    unsigned int                                    mMaxTransfers;
+
+    /** @brief The maximum number of requests a worker takes off the queue at once in BLOCKING sender mode */
+    unsigned int                                    mBatchSize;
+
+    /** @brief How long in ms a worker waits for its batch to fill up once it got a request, 0 not to wait */
+    unsigned int                                    mBatchWaitMs;
+
+    /** @brief The DNS and TLS session caches shared by all the curl handles. Declared before the handles which use it */
+    CurlShare                                       mCurlShare;
+
+    /** @brief The curl handles of the BLOCKING sender mode, kept per destination to reuse their connections */
+    ConnectionPool                                  mConnectionPool;
+
+    /** @brief The number of duplications which had to open a new connection */
+    volatile unsigned int                           mNewConnectionCount;
+
+    /** @brief The number of duplications which reused an open connection */
+    volatile unsigned int                           mReusedConnectionCount;
+
+    /** @brief The pools of the destinations isolated from the others, indexed by destination */
+    std::map<std::string, tDestinationThreadPool *>  mDestinationPools;
+
+    /** @brief The circuit breaker and adaptive timeout settings */
+    tHealthSettings                                 mHealthSettings;
+
+    /** @brief The health of each destination, indexed by destination. Only modified at configuration time */
+    std::map<std::string, DestinationHealth *>      mHealth;
+
+    /** @brief The number of duplications not sent because the circuit of their destination was open */
+    volatile unsigned int                           mCircuitOpenCount;
+
+    /** @brief The rate limit of each destination, indexed by destination. Only modified at configuration time */
+    std::map<std::string, TokenBucket *>            mRateLimits;
+
+    /** @brief The number of duplications not sent because their destination was over its rate limit */
+    volatile unsigned int                           mRateLimitedCount;
+
+    /** @brief The time in ms after which a queued request is dropped rather than processed, 0 to process them all */
+    unsigned int                                    mMaxAgeMs;
+
+    /** @brief The number of requests dropped for having been queued too long */
+    volatile unsigned int                           mStaleCount;
+
+    /** @brief The transfer of the thread in BLOCKING mode, kept to reuse its buffers */
+    boost::thread_specific_ptr<tTransfer>           mThreadTransfer;
+
+    /** @brief The transfers of the thread in BLOCKING mode to send a request to several destinations at once */
+    boost::thread_specific_ptr<tFanOut>             mThreadFanOut;
+
+    /** @brief The scratch memory of the thread for the substitutions, reset per request */
+    boost::thread_specific_ptr<tArena>              mThreadArena;
+
+    /** @brief The arena of the calling thread, created on first use */
+    tArena &
+    threadArena();
+
+    void
+    sendInBody(CURL *curl, const tRequestView &rInfo, const HeaderTemplate &headerTemplate,
+            HeaderBuilder &headers, const std::string &toSend) const;
+
+    void
+    sendDupFormat(CURL *curl, const tRequestView &rInfo, const HeaderTemplate &headerTemplate,
+            HeaderBuilder &headers, tDupFormatReader &reader) const;
+
+    /**
+     * @brief Set the url, headers and body of a transfer
+     * @param pTransfer the transfer to prepare, its easy handle must be set
+     * @param matchedFilter the filter that matched, gives the destination and the duplication type
+     * @param rInfo the request to send
+     */
+    void
+    prepareTransfer(tTransfer &pTransfer, const tFilter &matchedFilter, const tRequestView &rInfo);
+
+    /**
+     * @brief Account for a finished transfer
+     * @param pTransfer the transfer which completed
+     * @param pResult the curl result code of the transfer
+     */
+    void
+    completeTransfer(tTransfer &pTransfer, int pResult);
+
+    /**
+     * @brief Get the health of a destination, creating it if needed. Only to call at configuration time
+     */
+    DestinationHealth *
+    getHealth(const std::string &pDestination);
+
+    /**
+     * @brief Get the rate limit of a destination, creating it if needed. Only to call at configuration time
+     */
+    TokenBucket *
+    getRateLimit(const std::string &pDestination);
+
+    /**
+     * @brief Returns true if the circuit of the destination of a duplication lets it through, counts it otherwise
+     * @param pProbe set to the probe token to give back with the result of the duplication
+     */
+    bool
+    allowDuplication(const tFilter &pFilter, unsigned int &pProbe);
+
+    /**
+     * @brief Get a handle from the connection pool to send a duplication, if the circuit of its destination lets it through
+     * @param pFilter the filter of the duplication
+     * @param pProbe set to the probe token to give back with the result of the duplication
+     * @return the handle, to give back to the pool, NULL if the duplication is dropped
+     */
+    CURL *
+    acquireHandle(const tFilter &pFilter, unsigned int &pProbe);
+
+    /**
+     * @brief Give the handle of a sent transfer back to the connection pool and reset the transfer
+     */
+    void
+    releaseTransfer(tTransfer &pTransfer);
+
+    /**
+     * @brief Get the pool of a destination, creating it if needed
+     */
+    tDestinationThreadPool &
+    getDestinationPool(const std::string &pDestination);
+
+    /**
+     * @brief Hand a duplication over to the pool of its destination, if the destination has one
+     * @return true if the duplication was queued, false if the caller must send it itself
+     */
+    bool
+    dispatch(const tDuplication &pDuplication);
 
+    /**
+     * @brief Send a duplication with a handle of the connection pool and wait for the answer
+     */
     void
-    sendInBody(CURL *curl, const RequestInfo &rInfo, curl_slist *&slist, const std::string &toSend) const;
+    sendDuplication(const tDuplication &pDuplication);
 
-    std::string *
-    sendDupFormat(CURL *curl, const RequestInfo &rInfo, curl_slist *&slist) const;
+    /**
+     * @brief Send the duplications of a request and wait for all the answers
+     * The duplications to several destinations are sent concurrently, so that it takes as long as the slowest one.
+     * @param pDuplications the duplications of a single request
+     * @param pDispatch true to queue the duplications of the destinations having their own workers
+     */
+    void
+    sendDuplications(const std::list<tDuplication> &pDuplications, bool pDispatch);
+
+    /**
+     * @brief Send several duplications concurrently with the multi handle of the thread and wait for all the answers
+     * The easy handles are taken from the connection pool, the duplications finding none are dropped.
+     */
+    void
+    fanOut(const std::vector<const tDuplication *> &pDuplications);
+
+    /**
+     * @brief Get the number of distinct duplication destinations configured, at least 1
+     */
+    size_t
+    countDestinations() const;
+
+    /**
+     * @brief The worker loop of the MULTI sender mode
+     * @param pQueue the queue which gets filled with incoming requests
+     */
+    void
+    runMulti(MultiThreadQueue<boost::shared_ptr<RequestInfo> > &pQueue);
 
 public:
     /**
@@ -187,6 +687,11 @@ public:
      */
     RequestProcessor();
 
+    /**
+     * @brief Stops and destroys the destination pools
+     */
+    ~RequestProcessor();
+
     /**
      * @brief Set the timeout
      * @param pTimeout the timeout in ms
@@ -208,6 +713,98 @@ public:
     const unsigned int
     getDuplicatedCount();
 
+    /**
+     * @brief Get the number of duplications which opened a new connection since last call to this method
+     * @return The new connection count
+     */
+    const unsigned int
+    getNewConnectionCount();
+
+    /**
+     * @brief Get the number of duplications which reused an open connection since last call to this method
+     * @return The reused connection count
+     */
+    const unsigned int
+    getReusedConnectionCount();
+
+    /**
+     * @brief Set the limits of the connections kept to the destinations
+     * @param pMaxIdle the maximum number of idle connections kept per destination
+     * @param pMaxTotal the maximum number of connections per destination, 0 means no limit
+     * @param pIdleTimeoutMs the time in ms after which an idle connection gets closed, 0 means never
+     */
+    void
+    setConnectionLimits(size_t pMaxIdle, size_t pMaxTotal, unsigned int pIdleTimeoutMs);
+
+    /**
+     * @brief Get the number of duplications not sent because of an open circuit since last call to this method
+     * @return The count of duplications dropped by the circuit breakers
+     */
+    const unsigned int
+    getCircuitOpenCount();
+
+    /**
+     * @brief Get the number of duplications over the rate limit of their destination since last call to this method
+     * @return The count of duplications dropped by the rate limits
+     */
+    const unsigned int
+    getRateLimitedCount();
+
+    /**
+     * @brief Get the number of duplications not sent because all the connections of their destination were busy
+     * since last call to this method
+     * @return The count of duplications dropped by the connection limits
+     */
+    const unsigned int
+    getConnectionLimitedCount();
+
+    /**
+     * @brief Get the number of requests and duplications dropped for having been queued too long since last call to this method
+     * @return The count of stale requests
+     */
+    const unsigned int
+    getStaleCount();
+
+    /**
+     * @brief Set the age at which the queued requests are dropped
+     * @param pMaxAgeMs the time in ms since a request was queued after which it is dropped, 0 to process them all
+     */
+    void
+    setMaxAge(unsigned int pMaxAgeMs);
+
+    /**
+     * @brief Returns true if a request was queued too long ago to be worth sending, and counts it
+     * @param pRequest the request as it was queued
+     */
+    bool
+    isStale(const RequestInfo &pRequest);
+
+    /**
+     * @brief Limit the rate of the duplications sent to a destination
+     * @param pDestination the destination in &lt;host>[:&lt;port>] format
+     * @param pRate the maximum number of duplications per second
+     * @param pBurst the number of duplications which can be sent at once
+     */
+    void
+    setRateLimit(const std::string &pDestination, unsigned int pRate, unsigned int pBurst);
+
+    /**
+     * @brief Enable the circuit breaker of the destinations
+     * @param pErrorRate the percentage of failed requests which opens the circuit, 0 disables the circuit breaker
+     * @param pOpenMs the time in ms the circuit stays open before a probe request is sent
+     * @param pWindow the number of last requests the error rate is computed on
+     */
+    void
+    setCircuitBreaker(unsigned int pErrorRate, unsigned int pOpenMs, unsigned int pWindow);
+
+    /**
+     * @brief Enable the timeouts adapting to the latency of the destinations
+     * @param pMinTimeoutMs the lowest timeout in ms, 0 disables adaptive timeouts
+     * @param pFactor the timeout is the 99th percentile of the latencies times this factor, bounded by the timeout
+     */
+    void
+    setAdaptiveTimeout(unsigned int pMinTimeoutMs, unsigned int pFactor);
+
     /**
      * @brief Set the url codec
      * @param pUrlCodec the codec to use
@@ -215,6 +812,76 @@ public:
     void
     setUrlCodec(const std::string &pUrlCodec="default");
 
+    /**
+     * @brief Set the way the workers send the duplicated requests
+     * @param pMode the sender mode
+     * @param pMaxTransfers the maximum number of concurrent requests per worker in MULTI mode
+     */
+    void
+    setSenderMode(SenderMode::eSenderMode pMode, unsigned int pMaxTransfers);
+
+    /**
+     * @brief Set how many requests the workers take off the queue at once in BLOCKING sender mode
+     * @param pSize the maximum number of requests per batch, 1 to process them one by one
+     * @param pWaitMs how long to wait for more requests once one is there, 0 to only take the ones already queued
+     */
+    void
+    setBatch(unsigned int pSize, unsigned int pWaitMs);
+
+    /**
+     * @brief Give a destination its own queue and workers, and set their number
+     * @param pDestination the destination in &lt;host>[:&lt;port>] format
+     * @param pMin the minimum number of threads
+     * @param pMax the maximum number of threads
+     */
+    void
+    setDestinationThreads(const std::string &pDestination, size_t pMin, size_t pMax);
+
+    /**
+     * @brief Give a destination its own queue and workers, and set the queue bounds of its workers
+     * @param pDestination the destination in &lt;host>[:&lt;port>] format
+     * @param pMax the maximum number of queued duplications per thread
+     */
+    void
+    setDestinationQueue(const std::string &pDestination, size_t pMax);
+
+    /**
+     * @brief Start the workers of the destinations having their own
+     * @param pProgramName the name of the stats log messages, suffixed with the destination
+     * @param pCpuPolicy where and at which priority their workers run
+     * @param pIdleTimeoutMs the time in ms after which an idle worker exits, 0 if never
+     */
+    void
+    startDestinationPools(const std::string &pProgramName, const CpuPolicy &pCpuPolicy = CpuPolicy(),
+                          unsigned int pIdleTimeoutMs = tDestinationThreadPool::cDefaultIdleTimeoutMs);
+
+    /**
+     * @brief Stop the workers of the destinations having their own
+     */
+    void
+    stopDestinationPools();
+
+    /**
+     * @brief Run the loop of a destination worker, sending the duplications of its queue one at a time
+     * @param pQueue the queue of the destination
+     */
+    void
+    runDestination(MultiThreadQueue<boost::shared_ptr<tDuplication> > &pQueue);
+
+    /**
+     * @brief Get the commands of a location, to which its configuration keeps a pointer. Only to call at configuration time
+     * @param pPath the path of the location
+     */
+    CommandsByDestination *
+    getLocation(const std::string &pPath);
+
+    /**
+     * @brief Build the execution plans of all the locations. To call once all the directives are read,
+     * otherwise the first request processed builds them.
+     */
+    void
+    compile();
+
     /**
      * @brief Add a filter for all requests on a given path
      * @param pPath the path of the request
@@ -236,6 +903,17 @@ public:
     setDestinationDuplicationPercentage(const std::string &pPath, const std::string &destination,
                                         int percentage);
 
+    /**
+     * @brief Sets what the duplication percentage of a destination is applied on
+     * @param pPath the path of the request
+     * @param pDestination the destination to treat
+     * @param pKey the type of the sampling key
+     * @param pName the name of the parameter or header, ignored for the other types
+     */
+    void
+    setDestinationSamplingKey(const std::string &pPath, const std::string &pDestination,
+                              SamplingKey::eSamplingKey pKey, const std::string &pName);
+
     /**
      * @brief Add a RAW filter for all requests on a given path
      * @param pPath the path of the request
@@ -276,7 +954,7 @@ public:
      * @return true if there are no filters or at least one filter matches, false otherwhise
      */
     const tFilter*
-    argsMatchFilter(RequestInfo &pRequest, Commands &pCommands, std::list<tKeyVal> &pParsedArgs);
+    argsMatchFilter(RequestInfo &pRequest, Commands &pCommands, tRequestArgs &pParsedArgs);
 
     /**
      * @brief Parses arguments into key valye pairs. Also url-decodes values and converts keys to upper case.
@@ -286,6 +964,38 @@ public:
     void
     parseArgs(std::list<tKeyVal> &pParsedArgs, const std::string &pArgs);
 
+    /**
+     * @brief Parses arguments without copying them: the keys are kept as is and the values are not decoded
+     * @param pParsedArgs filled with the arguments, which point into pArgs
+     * @param pArgs the parameters part of the query, to keep alive and unchanged as long as pParsedArgs is used
+     */
+    void
+    parseArgs(tArgs &pParsedArgs, const std::string &pArgs);
+
+    /**
+     * @brief Prepares the arguments of a request, parsed once for all its destinations
+     * @param pParsedArgs reset on the query string and the body of the request
+     * @param pRequest the request, to keep alive and unchanged as long as pParsedArgs is used
+     */
+    void
+    parseArgs(tRequestArgs &pParsedArgs, const RequestInfo &pRequest);
+
+    /**
+     * @brief Url-decodes the value of an argument
+     */
+    std::string
+    decodeValue(const tArg &pArg) const;
+
+    /**
+     * @brief Find the value of the sampling key of a destination in a request
+     * @param pCommands the commands of the destination
+     * @param pRequest the request
+     * @param pParsedArgs the parsed parameters of the request
+     * @return the value, NULL if the destination has no sampling key or the request does not have it
+     */
+    const std::string *
+    findSamplingKey(const Commands &pCommands, const RequestInfo &pRequest, tRequestArgs &pParsedArgs);
+
     /**
      * @brief Process a field. This includes filtering and executing substitutions
      * @param pConfPath the path of the configuration which is applied
@@ -293,7 +1003,7 @@ public:
      * @return an empty list if the request does not need to be duplicated, a filter by duplication that matched otherwise.
      */
     std::list<const tFilter *>
-    processRequest(RequestInfo &pRequest, std::list<std::pair<std::string, std::string> > parsedArgs);
+    processRequest(RequestInfo &pRequest, tRequestArgs &pParsedArgs);
 
     /**
      * @brief Run the infinite loop which pops new requests of the given queue, processes them and sends the over to the configured destination
@@ -302,6 +1012,12 @@ public:
     void
     run(MultiThreadQueue<boost::shared_ptr<RequestInfo> > &pQueue);
 
+    /**
+     * @brief Create the caches shared by all the curl handles of the process. To call once per child, before any handle is created.
+     */
+    void
+    initCurlShare();
+
     /**
      * @brief initialize curl handle and common curl options
      * @return a curl handle
@@ -309,29 +1025,64 @@ public:
     CURL * initCurl();
 
     void
-    performCurlCall(CURL *curl, const tFilter &matchedFilter, const RequestInfo &rInfo);
+    performCurlCall(CURL *curl, const tFilter &matchedFilter, const tRequestView &rInfo, unsigned int pProbe = 0);
 
     /**
      * @brief perform curl for one request if it matches
+     * The curl handles are taken from the connection pool of each destination
      * @param reqInfo the RequestInfo instance for this request
-     * @param pCurl a preinitialized curl handle
      */
-    void runOne(RequestInfo &reqInfo, CURL * pCurl);
+    void runOne(RequestInfo &reqInfo);
+
+    /**
+     * @brief Apply the filters, the duplication percentages and the substitutions to a request
+     * @param pRequest the request to process
+     * @param pDuplications filled with one entry per destination the request must be sent to
+     */
+    void
+    prepareDuplications(const boost::shared_ptr<RequestInfo> &pRequest, std::list<tDuplication> &pDuplications);
 
 private:
 
+    /**
+     * @brief Apply the substitutions of a destination to a request
+     * @param pRequest the request, left unchanged
+     * @param pCommands the commands of the destination
+     * @param pParsedArgs the arguments of the request
+     * @param pOverlay filled with the fields the substitutions rewrote
+     * @return true if a substitution was applied
+     */
+    bool
+    substituteRequest(const RequestInfo &pRequest, Commands &pCommands,
+            tRequestArgs &pParsedArgs, tRequestOverlay &pOverlay);
+
+    /**
+     * @brief Apply the substitutions of a destination to a request, in place
+     */
     bool
     substituteRequest(RequestInfo &pRequest, Commands &pCommands,
-            std::list<tKeyVal> &pHeaderParsedArgs);
+            tRequestArgs &pParsedArgs);
+
+    /**
+     * @brief Returns the commands of the location of a request, with their execution plan built
+     * @return NULL if the location has no commands
+     */
+    CommandsByDestination *
+    findLocation(const RequestInfo &pRequest);
 
     const tFilter *
-    keyFilterMatch(std::multimap<std::string, tFilter> &pFilters, const std::list<tKeyVal> &pParsedArgs,
-            ApplicationScope::eApplicationScope scope, tFilter::eFilterTypes eType);
+    keyFilterMatch(const Commands::tKeyFilters &pFilters, tArgsCache &pParsedArgs);
 
+    /**
+     * @brief Apply the key substitutions of a scope to its arguments, and join them again
+     * @param pArena the scratch memory the arguments get substituted, encoded and joined in
+     * @param result set to the joined arguments if a substitution was applied
+     * @return true if a substitution was applied
+     */
     bool
-    keySubstitute(tFieldSubstitutionMap &pSubs,
-            std::list<tKeyVal> &pParsedArgs,
-            ApplicationScope::eApplicationScope scope,
+    keySubstitute(const Commands::tKeySubstitutions &pSubs,
+            tArgsCache &pParsedArgs,
+            tArena &pArena,
             std::string &result);
 
     friend class ::TestRequestProcessor;
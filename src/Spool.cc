@@ -0,0 +1,138 @@
+/*
+ * mod_dup - duplicates apache requests
+ *
+ * Copyright (C) 2013 Orange
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "Log.hh"
+#include "Spool.hh"
+
+namespace DupModule {
+
+/// @brief The type of the length written before each record
+typedef uint32_t tRecordLength;
+
+Spool::Spool()
+: mFd(-1)
+, mData(NULL)
+, mCapacity(0)
+, mReadPos(0)
+, mWritePos(0)
+, mCount(0) {
+}
+
+Spool::~Spool() {
+    close();
+}
+
+bool
+Spool::open(const std::string &pPath, size_t pMaxBytes) {
+    boost::lock_guard<boost::mutex> lLock(mMutex);
+    int lFd = ::open(pPath.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (lFd < 0) {
+        Log::error(14, "Could not create the spool file %s: %s", pPath.c_str(), strerror(errno));
+        return false;
+    }
+    // Nobody else needs the file, it goes away with the process
+    unlink(pPath.c_str());
+    void *lData = MAP_FAILED;
+    if (ftruncate(lFd, pMaxBytes) == 0) {
+        lData = mmap(NULL, pMaxBytes, PROT_READ | PROT_WRITE, MAP_SHARED, lFd, 0);
+    }
+    if (lData == MAP_FAILED) {
+        Log::error(14, "Could not map the spool file %s: %s", pPath.c_str(), strerror(errno));
+        ::close(lFd);
+        return false;
+    }
+    mFd = lFd;
+    mData = static_cast<char *>(lData);
+    mCapacity = pMaxBytes;
+    mReadPos = mWritePos = mCount = 0;
+    return true;
+}
+
+void
+Spool::close() {
+    boost::lock_guard<boost::mutex> lLock(mMutex);
+    if (mFd < 0) {
+        return;
+    }
+    munmap(mData, mCapacity);
+    ::close(mFd);
+    mFd = -1;
+    mData = NULL;
+    mCapacity = mReadPos = mWritePos = mCount = 0;
+}
+
+bool
+Spool::push(const std::string &pRecord) {
+    boost::lock_guard<boost::mutex> lLock(mMutex);
+    if (!mData || sizeof(tRecordLength) + pRecord.size() > mCapacity - mWritePos) {
+        return false;
+    }
+    tRecordLength lLength = pRecord.size();
+    memcpy(mData + mWritePos, &lLength, sizeof(lLength));
+    memcpy(mData + mWritePos + sizeof(lLength), pRecord.data(), lLength);
+    mWritePos += sizeof(lLength) + lLength;
+    ++mCount;
+    return true;
+}
+
+bool
+Spool::pop(std::string &pRecord) {
+    boost::lock_guard<boost::mutex> lLock(mMutex);
+    if (!mCount) {
+        return false;
+    }
+    tRecordLength lLength;
+    memcpy(&lLength, mData + mReadPos, sizeof(lLength));
+    pRecord.assign(mData + mReadPos + sizeof(lLength), lLength);
+    mReadPos += sizeof(lLength) + lLength;
+    if (!--mCount) {
+        // Drained: start over from the beginning of the file
+        mReadPos = mWritePos = 0;
+    }
+    return true;
+}
+
+bool
+RequestSpool::spill(const boost::shared_ptr<RequestInfo> &pRequest) {
+    std::string lRecord;
+    pRequest->toSpool(lRecord);
+    return mSpool.push(lRecord);
+}
+
+bool
+RequestSpool::unspill(boost::shared_ptr<RequestInfo> &pRequest) {
+    std::string lRecord;
+    while (mSpool.pop(lRecord)) {
+        boost::shared_ptr<RequestInfo> lRequest(new RequestInfo(std::string()));
+        if (lRequest->fromSpool(lRecord)) {
+            pRequest = lRequest;
+            return true;
+        }
+        Log::error(14, "Dropping a truncated request from the spool");
+    }
+    return false;
+}
+
+}
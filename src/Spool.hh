@@ -0,0 +1,137 @@
+/*
+ * mod_dup - duplicates apache requests
+ *
+ * Copyright (C) 2013 Orange
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <string>
+
+#include "MultiThreadQueue.hh"
+#include "RequestInfo.hh"
+
+namespace DupModule {
+
+/**
+ * @brief A FIFO of records kept in a memory mapped file, to absorb the requests a full queue would drop.
+ * The file is a single append only segment of a fixed size: the records are appended after the last one and read
+ * from the first one, and both positions go back to the start of the file once it is drained. The space of the
+ * records read is only reused then. Nothing is ever synced to the disk: the file is unlinked as soon as it is open,
+ * the kernel writes its pages back only under memory pressure, and it is gone when the process exits.
+ */
+class Spool : private boost::noncopyable
+{
+public:
+    Spool();
+
+    ~Spool();
+
+    /**
+     * @brief Create and map the file
+     * @param pPath the path of the file, which must not exist
+     * @param pMaxBytes the size of the file
+     * @return false if the file could not be created or mapped
+     */
+    bool
+    open(const std::string &pPath, size_t pMaxBytes);
+
+    /**
+     * @brief Unmap and close the file, the records left are lost
+     */
+    void
+    close();
+
+    /**
+     * @brief Append a record
+     * @return false if the spool is not open or has no room left for it
+     */
+    bool
+    push(const std::string &pRecord);
+
+    /**
+     * @brief Remove the oldest record
+     * @param pRecord filled with the record
+     * @return false if the spool is empty
+     */
+    bool
+    pop(std::string &pRecord);
+
+    /** @brief The number of records in the spool */
+    size_t
+    size() const {
+        return mCount;
+    }
+
+    /** @brief The bytes used in the file, records read since it was last drained included */
+    size_t
+    getBytes() const {
+        return mWritePos;
+    }
+
+private:
+    /** @brief Protects everything below */
+    boost::mutex        mMutex;
+    /** @brief The file descriptor, -1 if not open */
+    int                 mFd;
+    /** @brief The mapping of the file */
+    char                *mData;
+    /** @brief The size of the file */
+    size_t              mCapacity;
+    /** @brief The offset of the oldest record */
+    size_t              mReadPos;
+    /** @brief The offset the next record is appended at */
+    size_t              mWritePos;
+    /** @brief The number of records, read without the lock */
+    volatile size_t     mCount;
+};
+
+/**
+ * @brief The overflow of a queue of requests, kept in a spool
+ */
+class RequestSpool : public MultiThreadQueue<boost::shared_ptr<RequestInfo> >::IOverflow, private boost::noncopyable
+{
+public:
+    /**
+     * @brief Create and map the spool file
+     * @param pPath the path of the file, which must not exist
+     * @param pMaxBytes the size of the file
+     * @return false if the file could not be created or mapped
+     */
+    bool
+    open(const std::string &pPath, size_t pMaxBytes) {
+        return mSpool.open(pPath, pMaxBytes);
+    }
+
+    bool
+    spill(const boost::shared_ptr<RequestInfo> &pRequest);
+
+    bool
+    unspill(boost::shared_ptr<RequestInfo> &pRequest);
+
+    size_t
+    size() const {
+        return mSpool.size();
+    }
+
+private:
+    /** @brief The serialized requests */
+    Spool               mSpool;
+};
+
+}
@@ -18,9 +18,14 @@
 
 #pragma once
 
+#include <boost/bind.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
+#include <cmath>
+#include <time.h>
 
+#include "CpuPolicy.hh"
 #include "MultiThreadQueue.hh"
 
 using namespace boost::posix_time;
@@ -28,8 +33,14 @@ using namespace boost::posix_time;
 namespace DupModule {
 
 /**
- * @brief Manages a pool of threads depending on the size of its queue.
- * As its queue grows, it spawns new worker threads. If the queue shrinks again, it hands poison pills to a worker which should then exit.
+ * @brief Manages a pool of threads depending on the load of its queue.
+ * The manager wakes up as soon as the queue goes over its high water mark, and at least every mManageInterval.
+ * It smoothes the arrival rate of the items and the time a worker takes per item with exponentially weighted
+ * moving averages, and spawns at once all the workers needed to absorb them and the backlog.
+ * The workers idle for longer than the idle timeout exit on their own: the queue hands them the poison item instead of
+ * a queued one, so the poison never takes the place of a real item.
+ * The workers apply a CPU policy when they start, and the maximum number of threads is scaled down to the CPU quota
+ * of the cgroup of the process, if any.
  * The class gets the queue item type as its template argument. This makes it independent of any business needs and therefore more easily reusable.
  */
 template <typename QueueT>
@@ -45,6 +56,16 @@ public:
 private:
 	/** @brief The time in micro sec for which we wait before controlling the number of threads in the pool */
 	static const unsigned mManageInterval = 100000;
+	/** @brief The time constant in sec of the moving averages: the weight of a measure halves every 0.7 of it */
+	static const double cSmoothing;
+	/** @brief The time in sec the extra workers should take to drain the backlog */
+	static const double cDrainTime;
+
+public:
+	/** @brief The time in ms after which an idle worker exits by default */
+	static const unsigned cDefaultIdleTimeoutMs;
+
+private:
 
 	/** @brief Contains the threads */
 	std::list<boost::thread *> mThreads;
@@ -54,16 +75,24 @@ private:
 	size_t mMinThreads;
 	/** @brief The maximum number of threads in the pool */
 	size_t mMaxThreads;
-	/** @brief The minimum number of queued items per thread */
-	size_t mMinQueued;
 	/** @brief The maximum number of queued items per thread */
 	size_t mMaxQueued;
-	// @ brief The number of threads a poison pill got sent to but have not exited yet
-	unsigned mBeingKilled;
+	/** @brief The maximum number of bytes held by the queued items, 0 for no limit */
+	size_t mMaxBytes;
+	/** @brief Where the items go when the queue is full, NULL to drop them */
+	typename MultiThreadQueue<QueueT>::IOverflow *mOverflow;
+	/** @brief The time in ms after which an idle worker exits, unless it is one of the mMinThreads last ones */
+	unsigned mIdleTimeoutMs;
 	// The time in micro sec for which we wait before emitting statistics in the log output
 	unsigned mStatsInterval;
+	/** @brief The smoothed number of items pushed per second */
+	double mArrivalRate;
+	/** @brief The smoothed time in sec a worker spends per item, 0 until measured */
+	double mServiceTime;
 	/** @brief A function object which pulls items off the queue */
 	tQueueWorker mWorker;
+	/** @brief Where and at which priority the workers run */
+	CpuPolicy mCpuPolicy;
 	/** @brief The queue of items to be handled by the threads */
 	MultiThreadQueue<QueueT> mQueue;
 	/** @brief The poison item which should be send to force a thread to exit */
@@ -80,20 +109,21 @@ private:
 	 */
 	void
 	newThread() {
-		mThreads.push_back(new boost::thread(mWorker, boost::ref(this->mQueue)));
+		mQueue.addWorkers(1);
+		mThreads.push_back(new boost::thread(boost::bind(&ThreadPool::work, this)));
 	}
 
 	/**
-	 * @brief Add a poison pill to the front of queue, to kill the next thread reading from it
+	 * @brief The body of the worker threads
 	 */
-	void poisonThread() {
-		Log::debug("Dropping a poison pill.");
-		mQueue.push_front(mPoisonItem);
-		mBeingKilled++;
+	void
+	work() {
+		mCpuPolicy.apply();
+		mWorker(mQueue);
 	}
 
 	/**
-	 * @brief Collect any threads which exited (probably because we poisoned them) and remove them from our list
+	 * @brief Collect any threads which exited (probably because they were idle) and remove them from our list
 	 */
 	void collectKilled() {
 		time_duration nowait(0, 0, 0, 0);
@@ -104,13 +134,55 @@ private:
 				Log::debug("Removing a terminated thread from pool.");
 				delete *it;
 				it = mThreads.erase(it);
-				mBeingKilled--;
 			} else {
 				++it;
 			}
 		}
 	}
 
+	/**
+	 * @brief Returns the number of workers needed for the current load
+	 * @param pQueued the number of queued items
+	 */
+	size_t
+	targetThreads(size_t pQueued) const {
+		// No worker may have more than mMaxQueued items waiting for it, 0 meaning no bound per worker
+		double lTarget = mMaxQueued ? std::ceil(static_cast<double>(pQueued) / mMaxQueued) : 0;
+		if (mServiceTime > 0) {
+			// Little's law: the workers busy with the items arriving, plus the ones draining the backlog
+			lTarget = std::max(lTarget, std::ceil(mArrivalRate * mServiceTime + pQueued * mServiceTime / cDrainTime));
+		}
+		return std::min(std::max(static_cast<size_t>(lTarget), mMinThreads), mMaxThreads);
+	}
+
+	/**
+	 * @brief Update the moving averages of the load
+	 * @param pElapsed the time in sec since the last update
+	 * @param pPushed the number of items pushed since the last update
+	 * @param pPopped the number of items popped since the last update
+	 * @param pSaturated true if the workers had items waiting during the whole time
+	 */
+	void
+	updateLoad(double pElapsed, size_t pPushed, size_t pPopped, bool pSaturated) {
+		double lWeight = 1 - std::exp(-pElapsed / cSmoothing);
+		mArrivalRate += lWeight * (pPushed / pElapsed - mArrivalRate);
+		// Only busy workers tell how long they take per item
+		if (pSaturated && pPopped) {
+			double lServiceTime = pElapsed * mQueue.getWorkers() / pPopped;
+			mServiceTime = mServiceTime > 0 ? mServiceTime + lWeight * (lServiceTime - mServiceTime) : lServiceTime;
+		}
+	}
+
+	/**
+	 * @brief Returns the time in sec on a monotonic clock
+	 */
+	static double
+	now() {
+		struct timespec lNow;
+		clock_gettime(CLOCK_MONOTONIC, &lNow);
+		return lNow.tv_sec + lNow.tv_nsec / 1e9;
+	}
+
 	/**
 	 * @brief Run an infinite loop which manages the threads in the pool,
 	 * depending on the amount of queued items
@@ -118,21 +190,41 @@ private:
 	void
 	run() {
 		unsigned pid = getpid();
-		unsigned iterationsSinceStats = 0;
+		double lLastUpdate = now(), lLastStats = lLastUpdate;
+		size_t lLastPushed, lLastPopped;
+		mQueue.getTotals(lLastPushed, lLastPopped);
+		size_t lLastQueued = mQueue.size();
 
 		while (mRunning) {
-			size_t lQueued = mQueue.size();
-			float lQueuedPerThread = static_cast<float>(mQueue.size()) / mThreads.size();
-
 			collectKilled();
 
-			if (lQueuedPerThread > mMaxQueued && mThreads.size() < mMaxThreads) {
-				newThread();
-			} else if (lQueuedPerThread < mMinQueued && mThreads.size() - mBeingKilled > mMinThreads) {
-				poisonThread();
+			size_t lQueued = mQueue.size();
+			size_t lPushed, lPopped;
+			mQueue.getTotals(lPushed, lPopped);
+			double lNow = now();
+			if (lNow > lLastUpdate) {
+				updateLoad(lNow - lLastUpdate, lPushed - lLastPushed, lPopped - lLastPopped,
+				           lLastQueued > 0 && lQueued > 0);
+				lLastUpdate = lNow;
+				lLastPushed = lPushed;
+				lLastPopped = lPopped;
+				lLastQueued = lQueued;
 			}
 
-			if (++iterationsSinceStats * mManageInterval >= mStatsInterval) {
+			// Spawn all the missing workers at once, the idle ones exit on their own
+			size_t lWorkers = mQueue.getWorkers();
+			size_t lTarget = targetThreads(lQueued);
+			if (lTarget > lWorkers) {
+				Log::debug("Spawning %zu threads.", lTarget - lWorkers);
+				for (size_t i = lWorkers; i < lTarget; ++i) {
+					newThread();
+				}
+				lWorkers = lTarget;
+			}
+			// Woken up again as soon as the workers have more items waiting than they should
+			mQueue.setHighWater(lWorkers < mMaxThreads ? mMaxQueued * lWorkers + 1 : 0);
+
+			if ((lNow - lLastStats) * 1000000 >= mStatsInterval) {
 				unsigned lInCount, lOutCount, lDropCount;
 				mQueue.getCounters(lInCount, lOutCount, lDropCount);
 
@@ -141,27 +233,56 @@ private:
 				const std::string lTimeoutCount = lStatsIter == mAdditionalStats.end() ? "??" : lStatsIter->second();
 				lStatsIter = mAdditionalStats.find("#DupReq");
                 const std::string lDuplicateCount = lStatsIter == mAdditionalStats.end() ? "??" : lStatsIter->second();
+				// The other stats are appended as name:value
+				std::string lOtherStats;
+				for (lStatsIter = mAdditionalStats.begin(); lStatsIter != mAdditionalStats.end(); ++lStatsIter) {
+					if (lStatsIter->first != "#TmOut" && lStatsIter->first != "#DupReq") {
+						lOtherStats += " - " + lStatsIter->first + ":" + lStatsIter->second();
+					}
+				}
+				unsigned lByteDropCount = 0;
+				if (mMaxBytes) {
+					lByteDropCount = mQueue.getByteDropCount();
+					lOtherStats += " - #QueueBytes:" + boost::lexical_cast<std::string>(mQueue.getBytes())
+					             + " - #ByteDrop:" + boost::lexical_cast<std::string>(lByteDropCount);
+				}
+				if (mOverflow) {
+					lOtherStats += " - #Spooled:" + boost::lexical_cast<std::string>(mQueue.getSpillCount())
+					             + " - #InSpool:" + boost::lexical_cast<std::string>(mOverflow->size());
+				}
 
-				Log::notice(201, "%s - %u - %zu - %zu - %u - %u - %u - %s - %s",
+				Log::notice(201, "%s - %u - %zu - %zu - %u - %u - %u - %s - %s%s",
 				        mProgramName.c_str(), pid, lQueued, mThreads.size(), lInCount, lOutCount,
-                        lDropCount, lTimeoutCount.c_str(), lDuplicateCount.c_str());
+                        lDropCount, lTimeoutCount.c_str(), lDuplicateCount.c_str(), lOtherStats.c_str());
 				if (lDropCount > 0) {
 					Log::warn(301, "Pool %u dropped %d requests during last cycle!", pid, lDropCount);
 				}
-				iterationsSinceStats = 0;
+				if (lByteDropCount > 0) {
+					Log::warn(305, "Pool %u dropped %u requests over its memory budget during last cycle!", pid, lByteDropCount);
+				}
+				if (mQueue.getClassCount() > 1) {
+					// Whose requests were dropped
+					for (size_t i = 0; i < mQueue.getClassCount(); ++i) {
+						unsigned lClassDropCount = mQueue.getClassDropCount(i);
+						if (lClassDropCount > 0) {
+							Log::warn(306, "Pool %u dropped %u requests of %s during last cycle!", pid, lClassDropCount,
+							          mQueue.getClassName(i).c_str());
+						}
+					}
+				}
+				lLastStats = lNow;
 			}
-			usleep(mManageInterval);
+			mQueue.waitHighWater(mManageInterval);
 		}
 
-		unsigned lToBeKilled = mThreads.size() - mBeingKilled;
-		// Poison all remaining threads ...
-		for (unsigned i=0; i<lToBeKilled; ++i) {
-			poisonThread();
-		}
+		// Hand the poison item to all the workers ...
+		mQueue.close();
 
 		// ... and collect them
-		while (mBeingKilled) {
-			collectKilled();
+		while (!mThreads.empty()) {
+			mThreads.front()->join();
+			delete mThreads.front();
+			mThreads.pop_front();
 		}
 	}
 
@@ -174,9 +295,13 @@ public:
 	ThreadPool(tQueueWorker pWorker, const QueueT &pPoisonItem) :
 									   mManagerThread(NULL),
 									   mMinThreads(1), mMaxThreads(10),
-									   mMinQueued(1), mMaxQueued(10),
-									   mBeingKilled(0),
+									   mMaxQueued(10),
+									   mMaxBytes(0),
+									   mOverflow(NULL),
+									   mIdleTimeoutMs(cDefaultIdleTimeoutMs),
 									   mStatsInterval(10000000),
+									   mArrivalRate(0),
+									   mServiceTime(0),
 									   mWorker(pWorker),
 									   mPoisonItem(pPoisonItem),
 									   mRunning(false),
@@ -218,6 +343,14 @@ public:
 		mProgramName = pProgramName;
 	}
 
+	/**
+	 * @brief Get the program name used in the stats log message
+	 */
+	const std::string &
+	getProgramName() const {
+		return mProgramName;
+	}
+
 	/**
 	 * @brief Set the minimum and maximum number of threads
 	 * @param pMinThreads the minimum number of threads
@@ -230,23 +363,86 @@ public:
 	}
 
 	/**
-	 * @brief Set the minimum and maximum queue size
-	 * @param pMinQueued the minimum queue size
-	 * @param pMaxQueued the maximum queue size
+	 * @brief Set the maximum queue size. There is no minimum: the idle workers exit after the idle timeout.
+	 * @param pMaxQueued the maximum number of queued items per thread
 	 */
 	void
-	setQueue(const size_t pMinQueued, const size_t pMaxQueued) {
-		mMinQueued = pMinQueued;
+	setQueue(const size_t pMaxQueued) {
 		mMaxQueued = pMaxQueued;
 	}
 
+	/**
+	 * @brief Set the maximum memory held by the queued items
+	 * @param pMaxBytes the maximum number of bytes, 0 for no limit
+	 * @param pSizeOf returns the bytes held by an item
+	 */
+	void
+	setMaxBytes(const size_t pMaxBytes, typename MultiThreadQueue<QueueT>::tSizeOf pSizeOf) {
+		mMaxBytes = pMaxBytes;
+		mQueue.setMaxBytes(pMaxBytes, pSizeOf);
+	}
+
+	/**
+	 * @brief Set where the items go when the queue is full
+	 * @param pOverflow the overflow, kept by the caller until the pool is destroyed, NULL to drop the items
+	 */
+	void
+	setOverflow(typename MultiThreadQueue<QueueT>::IOverflow *pOverflow) {
+		mOverflow = pOverflow;
+		mQueue.setOverflow(pOverflow);
+	}
+
+	/**
+	 * @brief Split the queue into weighted classes of items served in turn
+	 * @param pNames the names of the classes, for the logs
+	 * @param pWeights the number of items of each class served per round
+	 * @param pClassOf returns the index of the class of an item
+	 */
+	void
+	setClasses(const std::vector<std::string> &pNames, const std::vector<unsigned int> &pWeights,
+	           typename MultiThreadQueue<QueueT>::tClassOf pClassOf) {
+		mQueue.setClasses(pNames, pWeights, pClassOf);
+	}
+
+	/**
+	 * @brief Set where and at which priority the workers run
+	 * @param pCpuPolicy the policy, applied by the workers started afterwards
+	 */
+	void
+	setCpuPolicy(const CpuPolicy &pCpuPolicy) {
+		mCpuPolicy = pCpuPolicy;
+	}
+
+	/**
+	 * @brief Set the time after which an idle worker exits
+	 * @param pIdleTimeoutMs the time in ms, 0 to keep the workers once spawned
+	 */
+	void
+	setIdleTimeout(const unsigned pIdleTimeoutMs) {
+		mIdleTimeoutMs = pIdleTimeoutMs;
+	}
+
+	/** @brief The time in ms after which an idle worker exits, 0 if never */
+	unsigned
+	getIdleTimeout() const {
+		return mIdleTimeoutMs;
+	}
+
 	/**
 	 * @brief Start the manager thread and the minimum number of worker threads
 	 */
 	void
 	start() {
 		mRunning = true;
+		// The workers beyond the CPUs the quota allows would only wait for them
+		size_t lMaxThreads = std::max(CpuPolicy::scaleThreads(mMaxThreads), mMinThreads);
+		if (lMaxThreads < mMaxThreads) {
+			Log::notice(203, "%s: %zu threads at most under a quota of %.2f CPUs", mProgramName.c_str(), lMaxThreads,
+			            CpuPolicy::getCpuQuota());
+			mMaxThreads = lMaxThreads;
+		}
 		mQueue.setDropSize(mMaxQueued * mMaxThreads);
+		mQueue.setRetirement(mPoisonItem, mMinThreads, mIdleTimeoutMs);
 
 		Log::debug("Started thread pool %p", this);
 		for (unsigned i=0; i<mMinThreads; ++i) {
@@ -289,4 +485,13 @@ public:
 	}
 };
 
+template <typename QueueT>
+const double ThreadPool<QueueT>::cSmoothing = 1.0;
+
+template <typename QueueT>
+const double ThreadPool<QueueT>::cDrainTime = 0.5;
+
+template <typename QueueT>
+const unsigned ThreadPool<QueueT>::cDefaultIdleTimeoutMs = 300;
+
 }
@@ -0,0 +1,71 @@
+/*
+ * mod_dup - duplicates apache requests
+ *
+ * Copyright (C) 2013 Orange
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <time.h>
+
+#include "TokenBucket.hh"
+
+namespace DupModule {
+
+TokenBucket::TokenBucket()
+: mRate(0)
+, mBurst(1)
+, mIntervalNs(0)
+, mToleranceNs(0)
+, mFullAt(0) {
+}
+
+void
+TokenBucket::setRate(unsigned int pRate, unsigned int pBurst) {
+    mRate = pRate;
+    mBurst = pBurst ? pBurst : 1;
+    mIntervalNs = pRate ? 1000000000ULL / pRate : 0;
+    // The first token is always there: the burst adds the others
+    mToleranceNs = mIntervalNs * (mBurst - 1);
+    mFullAt = 0;
+}
+
+bool
+TokenBucket::tryTake() {
+    if (!mRate) {
+        return true;
+    }
+    struct timespec lNow;
+    clock_gettime(CLOCK_MONOTONIC, &lNow);
+    return tryTake(static_cast<uint64_t>(lNow.tv_sec) * 1000000000ULL + lNow.tv_nsec);
+}
+
+bool
+TokenBucket::tryTake(uint64_t pNowNs) {
+    if (!mRate) {
+        return true;
+    }
+    for (;;) {
+        uint64_t lFullAt = mFullAt;
+        // An empty bucket refills from now, not from when it was last full
+        uint64_t lFrom = lFullAt > pNowNs ? lFullAt : pNowNs;
+        if (lFrom - pNowNs > mToleranceNs) {
+            return false;
+        }
+        if (__sync_bool_compare_and_swap(&mFullAt, lFullAt, lFrom + mIntervalNs)) {
+            return true;
+        }
+    }
+}
+
+}
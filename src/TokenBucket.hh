@@ -0,0 +1,85 @@
+/*
+ * mod_dup - duplicates apache requests
+ *
+ * Copyright (C) 2013 Orange
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <stdint.h>
+
+namespace DupModule {
+
+/**
+ * @brief Caps the rate of the duplications sent to a destination, without locking.
+ * Implemented as the virtual scheduling form of a token bucket: a single atomic value holds the time at which the
+ * bucket will be full again, each request takes one token by moving it forward by the interval between two tokens,
+ * and is refused if that would put it further ahead than the burst allows. Requests are refused, never delayed.
+ */
+class TokenBucket : private boost::noncopyable
+{
+public:
+    TokenBucket();
+
+    /**
+     * @brief Set the rate and burst. Only to call at configuration time
+     * @param pRate the number of requests per second, 0 means no limit
+     * @param pBurst the number of requests which can be let through at once, at least 1
+     */
+    void
+    setRate(unsigned int pRate, unsigned int pBurst);
+
+    /** @brief The number of requests per second, 0 if there is no limit */
+    unsigned int
+    getRate() const {
+        return mRate;
+    }
+
+    /** @brief The number of requests which can be let through at once */
+    unsigned int
+    getBurst() const {
+        return mBurst;
+    }
+
+    /**
+     * @brief Take a token
+     * @return true if the request can be sent, false if it is over the limit
+     */
+    bool
+    tryTake();
+
+    /**
+     * @brief Take a token at a given time
+     * @param pNowNs the current time in ns, from a monotonic clock
+     * @return true if the request can be sent, false if it is over the limit
+     */
+    bool
+    tryTake(uint64_t pNowNs);
+
+private:
+    /** @brief The number of requests per second */
+    unsigned int        mRate;
+    /** @brief The number of requests which can be let through at once */
+    unsigned int        mBurst;
+    /** @brief The time in ns between two tokens */
+    uint64_t            mIntervalNs;
+    /** @brief How far ahead of the current time the bucket can be, in ns */
+    uint64_t            mToleranceNs;
+    /** @brief The time at which the bucket is full again, in ns */
+    volatile uint64_t   mFullAt;
+};
+
+}
@@ -17,6 +17,11 @@
 */
 
 #include <httpd.h>
+#include <algorithm>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <boost/algorithm/string/replace.hpp>
 
 #include "Log.hh"
@@ -24,6 +29,61 @@
 
 namespace DupModule {
 
+namespace {
+
+/**
+ * @brief The lookup tables of the codecs, built at load time
+ */
+struct tCodecTables {
+	/** @brief What encoding a byte needs */
+	enum eEscape {
+		KEEP = 0,
+		ESCAPE,
+		PLUS        // Kept by ap_escape_path_segment, escaped by the default codec
+	};
+
+	tCodecTables() {
+		for (int c = 0; c < 256; ++c) {
+			// RFC 1808, as ap_escape_path_segment: all but the alphanumerics and $-_.+!*'(),:@&=~
+			const bool lAlnum = (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+			mEscape[c] = (lAlnum || (c && strchr("$-_.!*'(),:@&=~", c))) ? KEEP : ESCAPE;
+			mHex[c] = (c >= '0' && c <= '9') ? c - '0' : ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') ? (c | 0x20) - 'a' + 10 : -1;
+		}
+		mEscape['+'] = PLUS;
+	}
+
+	/** @brief How to encode each byte */
+	unsigned char   mEscape[256];
+	/** @brief The value of each hex digit, -1 for the other bytes */
+	signed char     mHex[256];
+};
+
+const tCodecTables cTables;
+
+const char cHexDigits[] = "0123456789abcdef";
+
+}
+
+/**
+ * @brief Escapes a path segment like ap_escape_path_segment, into a buffer of 3 times its size
+ * @param pEscapePlus whether '+' gets escaped too, which ap_escape_path_segment leaves as is
+ * @return the end of the escaped bytes
+ */
+static inline char *
+escapePathSegment(const char *pIn, size_t pSize, char *pOut, bool pEscapePlus) {
+	for (size_t i = 0; i < pSize; ++i) {
+		const unsigned char c = pIn[i];
+		if (cTables.mEscape[c] == tCodecTables::ESCAPE || (pEscapePlus && cTables.mEscape[c] == tCodecTables::PLUS)) {
+			*pOut++ = '%';
+			*pOut++ = cHexDigits[c >> 4];
+			*pOut++ = cHexDigits[c & 0xf];
+		} else {
+			*pOut++ = c;
+		}
+	}
+	return pOut;
+}
+
 class ApacheUrlCodec : public IUrlCodec
 {
 public:
@@ -51,10 +111,15 @@ public:
 	 * @return encoded string
 	 */
 	const std::string
-	encode(apr_pool_t *pPool, const std::string &pIn) const {
-		// ap_escape_path_segment returns a char * which is allocated in the apache pool
-		// No need to free it, as apache will destroy the whole pool
-		return std::string(ap_escape_path_segment(pPool, pIn.c_str()));
+	encode(apr_pool_t * /*pPool*/, const std::string &pIn) const {
+		std::string lOut(3 * pIn.size(), '\0');
+		lOut.resize(encode(pIn.data(), pIn.size(), &lOut[0]) - lOut.data());
+		return lOut;
+	}
+
+	char *
+	encode(const char *pIn, size_t pSize, char *pOut) const {
+		return escapePathSegment(pIn, pSize, pOut, false);
 	}
 };
 
@@ -86,19 +151,188 @@ public:
 	 * @return encoded string
 	 */
 	const std::string
-	encode(apr_pool_t *pPool, const std::string &pIn) const {
-		// ap_escape_path_segment returns a char * which is allocated in the apache pool
-		// No need to free it, as apache will destroy the whole pool
-		std::string encoded(ap_escape_path_segment(pPool, pIn.c_str()));
-		return boost::replace_all_copy(encoded, "+", "%2b");
+	encode(apr_pool_t * /*pPool*/, const std::string &pIn) const {
+		std::string lOut(3 * pIn.size(), '\0');
+		lOut.resize(encode(pIn.data(), pIn.size(), &lOut[0]) - lOut.data());
+		return lOut;
+	}
+
+	char *
+	encode(const char *pIn, size_t pSize, char *pOut) const {
+		return escapePathSegment(pIn, pSize, pOut, true);
 	}
 };
 
+/**
+ * @brief Decodes and encodes like DefaultUrlCodec, straight from and into buffers, with lookup tables.
+ * The runs of bytes which need no decoding or no encoding are copied 16 bytes at a time
+ */
+class FastUrlCodec : public IUrlCodec
+{
+public:
+	/**
+	 * @brief Helper function to decode queries
+	 * @param pIn string to be decoded
+	 * @return decoded string
+	 */
+	const std::string
+	decode(const std::string &pIn) const {
+		std::string lOut(pIn.size(), '\0');
+		lOut.resize(decode(pIn.data(), pIn.size(), &lOut[0]) - lOut.data());
+		return lOut;
+	}
+
+	char *
+	decode(const char *pIn, size_t pSize, char *pOut) const {
+		const char *lEnd = pIn + pSize;
+		char *lOut = pOut;
+		bool lBadEscape = false;
+		while (pIn < lEnd) {
+#ifdef __SSE2__
+			// Up to the next '%', '+' or NUL, 16 bytes at a time
+			const __m128i lPercents = _mm_set1_epi8('%');
+			const __m128i lPluses = _mm_set1_epi8('+');
+			const __m128i lNuls = _mm_setzero_si128();
+			while (lEnd - pIn >= 16) {
+				const __m128i lChunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pIn));
+				const unsigned int lMask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(lChunk, lPercents),
+						_mm_cmpeq_epi8(lChunk, lPluses)), _mm_cmpeq_epi8(lChunk, lNuls)));
+				if (!lMask) {
+					// The output is never ahead of the input: the bytes stored are all read
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(lOut), lChunk);
+					pIn += 16;
+					lOut += 16;
+					continue;
+				}
+				const unsigned int lRun = __builtin_ctz(lMask);
+				memmove(lOut, pIn, lRun);
+				pIn += lRun;
+				lOut += lRun;
+				break;
+			}
+			if (pIn == lEnd) {
+				break;
+			}
+#endif
+			const unsigned char c = *pIn;
+			if (c == '%') {
+				if (lEnd - pIn >= 3 && cTables.mHex[(unsigned char) pIn[1]] >= 0 && cTables.mHex[(unsigned char) pIn[2]] >= 0) {
+					const char lDecoded = cTables.mHex[(unsigned char) pIn[1]] * 16 + cTables.mHex[(unsigned char) pIn[2]];
+					if (!lDecoded) {
+						// The other codecs end the string there
+						break;
+					}
+					*lOut++ = lDecoded;
+					pIn += 3;
+				} else {
+					lBadEscape = true;
+					*lOut++ = '%';
+					++pIn;
+				}
+			} else if (c == '+') {
+				*lOut++ = ' ';
+				++pIn;
+			} else if (!c) {
+				break;
+			} else {
+				*lOut++ = c;
+				++pIn;
+			}
+		}
+		if (lBadEscape) {
+			Log::warn(302, "Bad escape values in request: %.*s", static_cast<int>(lOut - pOut), pOut);
+		}
+		return lOut;
+	}
+
+	/**
+	 * @brief Helper function to encode queries
+	 * @param pIn string to be encoded
+	 * @return encoded string
+	 */
+	const std::string
+	encode(apr_pool_t * /*pPool*/, const std::string &pIn) const {
+		std::string lOut(3 * pIn.size(), '\0');
+		lOut.resize(encode(pIn.data(), pIn.size(), &lOut[0]) - lOut.data());
+		return lOut;
+	}
+
+	char *
+	encode(const char *pIn, size_t pSize, char *pOut) const {
+		const char *lEnd = pIn + pSize;
+		while (pIn < lEnd) {
+#ifdef __SSE2__
+			// Up to the next byte to escape, 16 bytes at a time
+			while (lEnd - pIn >= 16) {
+				const __m128i lChunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pIn));
+				const unsigned int lMask = keptBytes(lChunk);
+				if (lMask == 0xffff) {
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(pOut), lChunk);
+					pIn += 16;
+					pOut += 16;
+					continue;
+				}
+				const unsigned int lRun = __builtin_ctz(~lMask);
+				memcpy(pOut, pIn, lRun);
+				pIn += lRun;
+				pOut += lRun;
+				break;
+			}
+			if (pIn == lEnd) {
+				break;
+			}
+#endif
+			const unsigned char c = *pIn++;
+			if (cTables.mEscape[c] != tCodecTables::KEEP) {
+				*pOut++ = '%';
+				*pOut++ = cHexDigits[c >> 4];
+				*pOut++ = cHexDigits[c & 0xf];
+			} else {
+				*pOut++ = c;
+			}
+		}
+		return pOut;
+	}
+
+private:
+#ifdef __SSE2__
+	/**
+	 * @brief The mask of the bytes which need no escaping, those of tCodecTables::KEEP
+	 */
+	static unsigned int
+	keptBytes(__m128i pChunk) {
+		// The bytes from 0x80 are negative, hence out of all the ranges
+		const __m128i lRanges = _mm_or_si128(_mm_or_si128(inRange(pChunk, '&', '.'), inRange(pChunk, '0', ':')),
+				_mm_or_si128(inRange(pChunk, '@', 'Z'), inRange(pChunk, 'a', 'z')));
+		const __m128i lSingles = _mm_or_si128(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(pChunk, _mm_set1_epi8('!')),
+				_mm_cmpeq_epi8(pChunk, _mm_set1_epi8('$'))), _mm_or_si128(_mm_cmpeq_epi8(pChunk, _mm_set1_epi8('=')),
+				_mm_cmpeq_epi8(pChunk, _mm_set1_epi8('_')))), _mm_cmpeq_epi8(pChunk, _mm_set1_epi8('~')));
+		// '+' is within the first range
+		return _mm_movemask_epi8(_mm_andnot_si128(_mm_cmpeq_epi8(pChunk, _mm_set1_epi8('+')),
+				_mm_or_si128(lRanges, lSingles)));
+	}
+
+	/** @brief The bytes between pLow and pHigh, both included */
+	static __m128i
+	inRange(__m128i pChunk, char pLow, char pHigh) {
+		return _mm_and_si128(_mm_cmpgt_epi8(pChunk, _mm_set1_epi8(pLow - 1)), _mm_cmplt_epi8(pChunk, _mm_set1_epi8(pHigh + 1)));
+	}
+#endif
+};
+
+char *
+IUrlCodec::decode(const char *pIn, size_t pSize, char *pOut) const {
+	const std::string lOut = decode(std::string(pIn, pSize));
+	return std::copy(lOut.begin(), lOut.end(), pOut);
+}
+
 const IUrlCodec *
 getUrlCodec(const std::string pUrlCodec)
 {
 	if (pUrlCodec == "apache") {
 		return new ApacheUrlCodec();
+	} else if (pUrlCodec == "fast") {
+		return new FastUrlCodec();
 	} else {
 		return new DefaultUrlCodec();
 	}
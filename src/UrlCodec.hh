@@ -18,6 +18,7 @@
 
 #pragma once
 
+#include <cstddef>
 #include <string>
 #include <apr_pools.h>
 
@@ -29,6 +30,17 @@ class IUrlCodec
 public:
 	virtual const std::string decode(const std::string &pIn) const = 0;
 	virtual const std::string encode(apr_pool_t *pPool, const std::string &pIn) const = 0;
+	/**
+	 * @brief Encodes pSize bytes into a buffer of at least 3 times their size, without allocating
+	 * @return the end of the encoded bytes in pOut
+	 */
+	virtual char *encode(const char *pIn, size_t pSize, char *pOut) const = 0;
+	/**
+	 * @brief Decodes pSize bytes into a buffer of at least their size, which can be pIn itself.
+	 * Like decode, stops at the first NUL, decoded or not
+	 * @return the end of the decoded bytes in pOut
+	 */
+	virtual char *decode(const char *pIn, size_t pSize, char *pOut) const;
 };
 
 const IUrlCodec *
@@ -51,6 +51,7 @@ static void prepareRequestInfo(DupConf *tConf, request_rec *pRequest, RequestInf
     // Basic
     r.mPoison = false;
     r.mConfPath = tConf->dirName;
+    r.mCommands = tConf->commands;
     r.mPath = pRequest->uri;
     r.mArgs = pRequest->args ? pRequest->args : "";
 }
@@ -90,6 +91,7 @@ apr_status_t inputFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *pB, ap
             }
 
             info->mConfPath = conf->dirName;
+            info->mCommands = conf->commands;
             info->mArgs = pRequest->args ? pRequest->args : "";
         }
         pFilter->ctx = reqInfo->get();
@@ -164,6 +166,7 @@ apr_status_t outputBodyFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *p
             pFilter->ctx = ri;
 
             ri->mConfPath = tConf->dirName;
+            ri->mCommands = tConf->commands;
             ri->mArgs = pRequest->args ? pRequest->args : "";
 
         } else {
@@ -256,6 +259,7 @@ apr_status_t outputHeadersFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade
             pFilter->ctx = ri;
 
             ri->mConfPath = tConf->dirName;
+            ri->mCommands = tConf->commands;
             ri->mArgs = pRequest->args ? pRequest->args : "";
         } else {
             pFilter->ctx = (void *) -1;
@@ -280,12 +284,9 @@ apr_status_t outputHeadersFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade
     prepareRequestInfo(tConf, pRequest, *ri);
 
     if (tConf->synchronous) {
-        static __thread CURL * lCurl = NULL;
-        if (!lCurl) {
-            lCurl = gProcessor->initCurl();
-        }
-        gProcessor->runOne(*ri, lCurl);
+        gProcessor->runOne(*ri);
     } else {
+        ri->markEnqueued();
         gThreadPool->push(*reqInfo);
     }
     pFilter->ctx = (void *) -1;
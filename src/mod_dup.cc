@@ -29,11 +29,13 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string.hpp>
 #include <exception>
+#include <map>
 #include <set>
 #include <sstream>
 #include <sys/syscall.h>
 
 #include "mod_dup.hh"
+#include "Spool.hh"
 #include "Utils.hh"
 
 #define MOD_REWRITE_NAME "mod_rewrite.c"
@@ -58,6 +60,7 @@ namespace DuplicationType {
 DupConf::DupConf()
     : currentApplicationScope(ApplicationScope::HEADER)
     , dirName(NULL)
+    , commands(NULL)
     , currentDupDestination()
     , synchronous(false)
     , mCurrentDuplicationType(DuplicationType::NONE)
@@ -95,8 +98,26 @@ createDirConfig(apr_pool_t *pPool, char *pDirName)
     //TODO move in preconfig function
 static boost::shared_ptr<RequestInfo> POISON_REQUEST(new RequestInfo());
 
+/// @brief The directory of the spool files, and their size: 0 for no spool
+static std::string gSpoolDir;
+static size_t gSpoolBytes = 0;
+/// @brief The spool of the process, NULL if there is none
+static RequestSpool *gSpool = NULL;
+/// @brief Where and at which priority the workers of all the pools run
+static CpuPolicy gCpuPolicy;
+/// @brief The weight of each location duplicating requests in the queue, 1 unless set by DupWeight
+static std::map<std::string, unsigned int> gLocationWeights;
+/// @brief The index of the queue class of each location, set at child init
+static std::map<std::string, size_t> gLocationClasses;
+
+/// @brief true if a queue directive was given a minimum, which is not used anymore
+static bool gQueueMinGiven = false;
+
 int
 preConfig(apr_pool_t * pPool, apr_pool_t * pLog, apr_pool_t * pTemp) {
+    gLocationWeights.clear();
+    gQueueMinGiven = false;
+    gCpuPolicy = CpuPolicy();
     gProcessor = new RequestProcessor();
     gThreadPool = new ThreadPool<boost::shared_ptr<RequestInfo> >(boost::bind(&RequestProcessor::run, gProcessor, _1),
                                                                   POISON_REQUEST);
@@ -105,12 +126,30 @@ preConfig(apr_pool_t * pPool, apr_pool_t * pLog, apr_pool_t * pTemp) {
                                                boost::bind(&RequestProcessor::getTimeoutCount, gProcessor)));
     gThreadPool->addStat("#DupReq", boost::bind(boost::lexical_cast<std::string, unsigned int>,
                                                 boost::bind(&RequestProcessor::getDuplicatedCount, gProcessor)));
+    gThreadPool->addStat("#ConnNew", boost::bind(boost::lexical_cast<std::string, unsigned int>,
+                                                 boost::bind(&RequestProcessor::getNewConnectionCount, gProcessor)));
+    gThreadPool->addStat("#ConnReuse", boost::bind(boost::lexical_cast<std::string, unsigned int>,
+                                                   boost::bind(&RequestProcessor::getReusedConnectionCount, gProcessor)));
+    gThreadPool->addStat("#CircuitOpen", boost::bind(boost::lexical_cast<std::string, unsigned int>,
+                                                     boost::bind(&RequestProcessor::getCircuitOpenCount, gProcessor)));
+    gThreadPool->addStat("#RateLimit", boost::bind(boost::lexical_cast<std::string, unsigned int>,
+                                                   boost::bind(&RequestProcessor::getRateLimitedCount, gProcessor)));
+    gThreadPool->addStat("#ConnLimit", boost::bind(boost::lexical_cast<std::string, unsigned int>,
+                                                   boost::bind(&RequestProcessor::getConnectionLimitedCount, gProcessor)));
+    gThreadPool->addStat("#Stale", boost::bind(boost::lexical_cast<std::string, unsigned int>,
+                                               boost::bind(&RequestProcessor::getStaleCount, gProcessor)));
     return OK;
 }
 
 int
 postConfig(apr_pool_t * pPool, apr_pool_t * pLog, apr_pool_t * pTemp, server_rec * pServer) {
     Log::init();
+    if (gQueueMinGiven) {
+        Log::warn(308, "The minimum queue size of DupQueue and DupDestinationQueue is not used anymore: "
+                  "the idle threads exit after DupIdleTimeout");
+    }
+    // All the directives are read: build the execution plan of each location
+    gProcessor->compile();
     ap_add_version_component(pPool, c_COMPONENT_VERSION) ;
     return OK;
 }
@@ -163,6 +202,31 @@ setDestination(cmd_parms* pParams, void* pCfg, const char* pDestination, const c
     return NULL;
 }
 
+const char*
+setSamplingKey(cmd_parms* pParams, void* pCfg, const char* pKey, const char* pName) {
+    const char *lErrorMsg = setActive(pParams, pCfg);
+    if (lErrorMsg) {
+        return lErrorMsg;
+    }
+    struct DupConf *tC = reinterpret_cast<DupConf *>(pCfg);
+    assert(tC);
+    if (tC->currentDupDestination.empty()) {
+        return "DupSamplingKey must follow a DupDestination";
+    }
+
+    SamplingKey::eSamplingKey lKey;
+    try {
+        lKey = SamplingKey::stringToEnum(pKey);
+    } catch (std::exception& e) {
+        return SamplingKey::c_ERROR_ON_STRING_VALUE;
+    }
+    if ((lKey == SamplingKey::ARG || lKey == SamplingKey::HEADER) && (!pName || !strlen(pName))) {
+        return "Missing parameter or header name of the sampling key";
+    }
+    gProcessor->setDestinationSamplingKey(pParams->path, tC->currentDupDestination, lKey, pName ? pName : "");
+    return NULL;
+}
+
 const char*
 setApplicationScope(cmd_parms* pParams, void* pCfg, const char* pAppScope) {
     const char *lErrorMsg = setActive(pParams, pCfg);
@@ -227,21 +291,356 @@ setTimeout(cmd_parms* pParams, void* pCfg, const char* pTimeout) {
     return NULL;
 }
 
+const char*
+setWeight(cmd_parms* pParams, void* pCfg, const char* pWeight) {
+    const char *lErrorMsg = setActive(pParams, pCfg);
+    if (lErrorMsg) {
+        return lErrorMsg;
+    }
+    unsigned int lWeight;
+    try {
+        lWeight = boost::lexical_cast<unsigned int>(pWeight);
+    } catch (boost::bad_lexical_cast&) {
+        return "Invalid value for the weight of the location.";
+    }
+    if (!lWeight) {
+        return "Invalid value for the weight of the location.";
+    }
+
+    gLocationWeights[pParams->path] = lWeight;
+    return NULL;
+}
+
+const char*
+setCpuAffinity(cmd_parms* pParams, void* pCfg, const char* pCpus) {
+    if (!pCpus || !gCpuPolicy.setAffinity(pCpus)) {
+        return "Invalid list of CPUs.";
+    }
+    return NULL;
+}
+
+const char*
+setCpuPriority(cmd_parms* pParams, void* pCfg, const char* pPriority, const char* pNice) {
+    std::string lPriority(pPriority ? pPriority : "");
+    if (lPriority == "idle" && !pNice) {
+        gCpuPolicy.setIdle();
+        return NULL;
+    }
+    if (lPriority == "nice") {
+        int lNice = 10;
+        try {
+            if (pNice) {
+                lNice = boost::lexical_cast<int>(pNice);
+            }
+        } catch (boost::bad_lexical_cast&) {
+            return "Invalid nice value, it must be between 0 and 19.";
+        }
+        if (!gCpuPolicy.setNice(lNice)) {
+            return "Invalid nice value, it must be between 0 and 19.";
+        }
+        return NULL;
+    }
+    return "Invalid CPU priority: idle | nice [<0-19>]";
+}
+
+const char*
+setMaxAge(cmd_parms* pParams, void* pCfg, const char* pMaxAge) {
+    unsigned int lMaxAge;
+    try {
+        lMaxAge = boost::lexical_cast<unsigned int>(pMaxAge);
+    } catch (boost::bad_lexical_cast&) {
+        return "Invalid value for the maximum age of the queued requests.";
+    }
+
+    gProcessor->setMaxAge(lMaxAge);
+    return NULL;
+}
+
+const char*
+setSender(cmd_parms* pParams, void* pCfg, const char* pMode, const char* pMaxTransfers) {
+    SenderMode::eSenderMode lMode;
+    try {
+        lMode = SenderMode::stringToEnum(pMode);
+    } catch (std::exception& e) {
+        return SenderMode::c_ERROR_ON_STRING_VALUE;
+    }
+
+    unsigned int lMaxTransfers = 32;
+    if (pMaxTransfers) {
+        try {
+            lMaxTransfers = boost::lexical_cast<unsigned int>(pMaxTransfers);
+        } catch (boost::bad_lexical_cast&) {
+            return "Invalid value for the maximum number of concurrent requests per thread.";
+        }
+        if (!lMaxTransfers) {
+            return "Invalid value for the maximum number of concurrent requests per thread.";
+        }
+    }
+
+    gProcessor->setSenderMode(lMode, lMaxTransfers);
+    return NULL;
+}
+
+const char*
+setBatch(cmd_parms* pParams, void* pCfg, const char* pMaxItems, const char* pMaxWaitMs) {
+    unsigned int lMaxItems, lMaxWaitMs = 0;
+    try {
+        lMaxItems = boost::lexical_cast<unsigned int>(pMaxItems);
+        if (pMaxWaitMs) {
+            lMaxWaitMs = boost::lexical_cast<unsigned int>(pMaxWaitMs);
+        }
+    } catch (boost::bad_lexical_cast&) {
+        return "Invalid value(s) for the batch size.";
+    }
+    if (!lMaxItems) {
+        return "Invalid value(s) for the batch size.";
+    }
+
+    gProcessor->setBatch(lMaxItems, lMaxWaitMs);
+    return NULL;
+}
+
+const char*
+setConnections(cmd_parms* pParams, void* pCfg, const char* pMaxIdle, const char* pMaxTotal, const char* pIdleTimeout) {
+    size_t lMaxIdle, lMaxTotal;
+    unsigned int lIdleTimeout = 30000;
+    try {
+        lMaxIdle = boost::lexical_cast<size_t>(pMaxIdle);
+        lMaxTotal = boost::lexical_cast<size_t>(pMaxTotal);
+        if (pIdleTimeout) {
+            lIdleTimeout = boost::lexical_cast<unsigned int>(pIdleTimeout);
+        }
+    } catch (boost::bad_lexical_cast&) {
+        return "Invalid value(s) for the connection limits.";
+    }
+    if (lMaxTotal && lMaxIdle > lMaxTotal) {
+        return "Invalid value(s) for the connection limits.";
+    }
+    gProcessor->setConnectionLimits(lMaxIdle, lMaxTotal, lIdleTimeout);
+    return NULL;
+}
+
+const char*
+setRateLimit(cmd_parms* pParams, void* pCfg, const char* pRate, const char* pBurst) {
+    const char *lErrorMsg = setActive(pParams, pCfg);
+    if (lErrorMsg) {
+        return lErrorMsg;
+    }
+    struct DupConf *tC = reinterpret_cast<DupConf *>(pCfg);
+    assert(tC);
+    if (tC->currentDupDestination.empty()) {
+        return "DupRateLimit must follow a DupDestination";
+    }
+
+    unsigned int lRate, lBurst;
+    try {
+        lRate = boost::lexical_cast<unsigned int>(pRate);
+        // One second worth of duplications by default
+        lBurst = pBurst ? boost::lexical_cast<unsigned int>(pBurst) : lRate;
+    } catch (boost::bad_lexical_cast&) {
+        return "Invalid value(s) for the rate limit.";
+    }
+    if (!lRate || !lBurst) {
+        return "Invalid value(s) for the rate limit.";
+    }
+    gProcessor->setRateLimit(tC->currentDupDestination, lRate, lBurst);
+    return NULL;
+}
+
+const char*
+setCircuitBreaker(cmd_parms* pParams, void* pCfg, const char* pErrorRate, const char* pOpenMs, const char* pWindow) {
+    unsigned int lErrorRate, lOpenMs, lWindow = 20;
+    try {
+        lErrorRate = boost::lexical_cast<unsigned int>(pErrorRate);
+        lOpenMs = boost::lexical_cast<unsigned int>(pOpenMs);
+        if (pWindow) {
+            lWindow = boost::lexical_cast<unsigned int>(pWindow);
+        }
+    } catch (boost::bad_lexical_cast&) {
+        return "Invalid value(s) for the circuit breaker.";
+    }
+    if (lErrorRate > 100 || !lWindow) {
+        return "Invalid value(s) for the circuit breaker.";
+    }
+    gProcessor->setCircuitBreaker(lErrorRate, lOpenMs, lWindow);
+    return NULL;
+}
+
+const char*
+setAdaptiveTimeout(cmd_parms* pParams, void* pCfg, const char* pMinTimeout, const char* pFactor) {
+    unsigned int lMinTimeout, lFactor = 3;
+    try {
+        lMinTimeout = boost::lexical_cast<unsigned int>(pMinTimeout);
+        if (pFactor) {
+            lFactor = boost::lexical_cast<unsigned int>(pFactor);
+        }
+    } catch (boost::bad_lexical_cast&) {
+        return "Invalid value(s) for the adaptive timeout.";
+    }
+    if (!lFactor) {
+        return "Invalid value(s) for the adaptive timeout.";
+    }
+    gProcessor->setAdaptiveTimeout(lMinTimeout, lFactor);
+    return NULL;
+}
+
+/**
+ * @brief Parse the arguments of a queue directive: <max>, or <min> <max> where the minimum is only checked
+ * @param pFirst the maximum, or the minimum if pSecond is set
+ * @param pSecond the maximum, NULL if not given
+ * @param pMax set to the maximum queue size
+ * @return false if the arguments are not valid
+ */
+static bool
+parseQueue(const char *pFirst, const char *pSecond, size_t &pMax) {
+    size_t lMin;
+    try {
+        lMin = boost::lexical_cast<size_t>(pFirst);
+        pMax = pSecond ? boost::lexical_cast<size_t>(pSecond) : lMin;
+    } catch (boost::bad_lexical_cast&) {
+        return false;
+    }
+    if (pMax < lMin) {
+        return false;
+    }
+    gQueueMinGiven = gQueueMinGiven || pSecond;
+    return true;
+}
+
 const char*
 setQueue(cmd_parms* pParams, void* pCfg, const char* pMin, const char* pMax) {
+    size_t lMax;
+    if (!parseQueue(pMin, pMax, lMax)) {
+        return "Invalid value(s) for minimum and maximum queue size.";
+    }
+
+    gThreadPool->setQueue(lMax);
+    return NULL;
+}
+
+const char*
+setIdleTimeout(cmd_parms* pParams, void* pCfg, const char* pIdleTimeoutMs) {
+    unsigned int lIdleTimeoutMs;
+    try {
+        lIdleTimeoutMs = boost::lexical_cast<unsigned int>(pIdleTimeoutMs);
+    } catch (boost::bad_lexical_cast&) {
+        return "Invalid value for the idle timeout.";
+    }
+
+    gThreadPool->setIdleTimeout(lIdleTimeoutMs);
+    return NULL;
+}
+
+/// @brief Returns the index of the queue class of the location of a request
+static size_t
+requestLocation(const boost::shared_ptr<RequestInfo> &pRequest) {
+    std::map<std::string, size_t>::const_iterator lIt = gLocationClasses.find(pRequest->mConfPath);
+    return lIt == gLocationClasses.end() ? 0 : lIt->second;
+}
+
+/// @brief Returns the memory held by a queued request
+static size_t
+requestSize(const boost::shared_ptr<RequestInfo> &pRequest) {
+    return pRequest->getSize();
+}
+
+/**
+ * @brief Parse a number of bytes with an optional K, M or G suffix
+ * @param pValue the string to parse
+ * @param pBytes filled with the number of bytes
+ * @return false if the string is not a valid number of bytes
+ */
+static bool
+parseBytes(const char *pValue, size_t &pBytes) {
+    std::string lValue(pValue ? pValue : "");
+    size_t lUnit = 1;
+    if (!lValue.empty()) {
+        switch (toupper(lValue[lValue.size() - 1])) {
+        case 'K': lUnit = 1024; break;
+        case 'M': lUnit = 1024 * 1024; break;
+        case 'G': lUnit = 1024 * 1024 * 1024; break;
+        }
+        if (lUnit > 1) {
+            lValue.erase(lValue.size() - 1);
+        }
+    }
+    try {
+        pBytes = boost::lexical_cast<size_t>(lValue) * lUnit;
+    } catch (boost::bad_lexical_cast&) {
+        return false;
+    }
+    return true;
+}
+
+const char*
+setQueueBytes(cmd_parms* pParams, void* pCfg, const char* pMaxBytes) {
+    size_t lMaxBytes;
+    if (!parseBytes(pMaxBytes, lMaxBytes)) {
+        return "Invalid value for the maximum queue size in bytes.";
+    }
+
+    gThreadPool->setMaxBytes(lMaxBytes, &requestSize);
+    return NULL;
+}
+
+const char*
+setSpool(cmd_parms* pParams, void* pCfg, const char* pDirectory, const char* pMaxBytes) {
+    size_t lMaxBytes;
+    if (!parseBytes(pMaxBytes, lMaxBytes)) {
+        return "Invalid value for the spool size in bytes.";
+    }
+    if (!pDirectory || !*pDirectory) {
+        return "Missing spool directory.";
+    }
+
+    gSpoolDir = pDirectory;
+    gSpoolBytes = lMaxBytes;
+    return NULL;
+}
+
+const char*
+setDestinationThreads(cmd_parms* pParams, void* pCfg, const char* pMin, const char* pMax) {
+    const char *lErrorMsg = setActive(pParams, pCfg);
+    if (lErrorMsg) {
+        return lErrorMsg;
+    }
+    struct DupConf *tC = reinterpret_cast<DupConf *>(pCfg);
+    assert(tC);
+    if (tC->currentDupDestination.empty()) {
+        return "DupDestinationThreads must follow a DupDestination";
+    }
+
     size_t lMin, lMax;
     try {
         lMin = boost::lexical_cast<size_t>(pMin);
         lMax = boost::lexical_cast<size_t>(pMax);
     } catch (boost::bad_lexical_cast&) {
-        return "Invalid value(s) for minimum and maximum queue size.";
+        return "Invalid value(s) for minimum and maximum number of threads.";
+    }
+    if (lMax < lMin || !lMax) {
+        return "Invalid value(s) for minimum and maximum number of threads.";
     }
+    gProcessor->setDestinationThreads(tC->currentDupDestination, lMin, lMax);
+    return NULL;
+}
 
-    if (lMax < lMin) {
-        return "Invalid value(s) for minimum and maximum queue size.";
+const char*
+setDestinationQueue(cmd_parms* pParams, void* pCfg, const char* pMin, const char* pMax) {
+    const char *lErrorMsg = setActive(pParams, pCfg);
+    if (lErrorMsg) {
+        return lErrorMsg;
+    }
+    struct DupConf *tC = reinterpret_cast<DupConf *>(pCfg);
+    assert(tC);
+    if (tC->currentDupDestination.empty()) {
+        return "DupDestinationQueue must follow a DupDestination";
     }
 
-    gThreadPool->setQueue(lMin, lMax);
+    size_t lMax;
+    if (!parseQueue(pMin, pMax, lMax)) {
+        return "Invalid value(s) for minimum and maximum queue size.";
+    }
+    gProcessor->setDestinationQueue(tC->currentDupDestination, lMax);
     return NULL;
 }
 
@@ -273,7 +672,11 @@ setActive(cmd_parms* pParams, void* pCfg) {
     if (!(lConf->dirName)) {
         lConf->dirName = (char *) apr_pcalloc(pParams->pool, sizeof(char) * (strlen(pParams->path) + 1));
         strcpy(lConf->dirName, pParams->path);
+        // The requests of the location go straight to its plan
+        lConf->commands = gProcessor->getLocation(pParams->path);
     }
+    // Each location gets its turn in the queue, with a weight of 1 unless it has a DupWeight
+    gLocationWeights.insert(std::make_pair(std::string(pParams->path), 1u));
 
 #ifndef UNIT_TESTING
         if (!ap_find_linked_module(MOD_REWRITE_NAME)) {
@@ -375,6 +778,10 @@ cleanUp(void *) {
     delete gThreadPool;
     gThreadPool = NULL;
 
+    // The requests left in the spool are lost
+    delete gSpool;
+    gSpool = NULL;
+
     delete gProcessor;
     gProcessor = NULL;
     return APR_SUCCESS;
@@ -383,6 +790,34 @@ cleanUp(void *) {
 void
 childInit(apr_pool_t *pPool, server_rec *pServer) {
     curl_global_init(CURL_GLOBAL_ALL);
+    // Before starting the workers so that they all use the shared caches
+    gProcessor->initCurlShare();
+    // The destination workers first, so that they are ready when the first requests get matched
+    gProcessor->startDestinationPools(gThreadPool->getProgramName(), gCpuPolicy, gThreadPool->getIdleTimeout());
+    if (gSpoolBytes) {
+        // One spool per process
+        gSpool = new RequestSpool();
+        if (gSpool->open(gSpoolDir + "/mod_dup." + boost::lexical_cast<std::string>(getpid()) + ".spool", gSpoolBytes)) {
+            gThreadPool->setOverflow(gSpool);
+        } else {
+            delete gSpool;
+            gSpool = NULL;
+        }
+    }
+    if (gLocationWeights.size() > 1) {
+        // The locations share the workers in proportion to their weights
+        std::vector<std::string> lNames;
+        std::vector<unsigned int> lWeights;
+        gLocationClasses.clear();
+        for (std::map<std::string, unsigned int>::const_iterator lIt = gLocationWeights.begin();
+             lIt != gLocationWeights.end(); ++lIt) {
+            gLocationClasses[lIt->first] = lNames.size();
+            lNames.push_back(lIt->first);
+            lWeights.push_back(lIt->second);
+        }
+        gThreadPool->setClasses(lNames, lWeights, &requestLocation);
+    }
+    gThreadPool->setCpuPolicy(gCpuPolicy);
     gThreadPool->start();
     apr_pool_cleanup_register(pPool, NULL, cleanUp, cleanUp);
 }
@@ -404,22 +839,84 @@ command_rec gCmds[] = {
                   reinterpret_cast<const char *(*)()>(&setUrlCodec),
                   0,
                   OR_ALL,
-                  "Set the url enc/decoding style for url arguments (default or apache)"),
+                  "Set the url enc/decoding style for url arguments (default, apache or fast)"),
     AP_INIT_TAKE1("DupTimeout",
                   reinterpret_cast<const char *(*)()>(&setTimeout),
                   0,
                   OR_ALL,
                   "Set the timeout for outgoing requests in milliseconds."),
+    AP_INIT_TAKE1("DupMaxAge",
+                  reinterpret_cast<const char *(*)()>(&setMaxAge),
+                  0,
+                  OR_ALL,
+                  "Drop the requests queued for longer than the given time in milliseconds (default 0, never)."),
     AP_INIT_TAKE2("DupThreads",
                   reinterpret_cast<const char *(*)()>(&setThreads),
                   0,
                   OR_ALL,
                   "Set the minimum and maximum number of threads per pool."),
-    AP_INIT_TAKE2("DupQueue",
+    AP_INIT_TAKE12("DupSender",
+                  reinterpret_cast<const char *(*)()>(&setSender),
+                  0,
+                  OR_ALL,
+                  "Set how the threads send the duplicated requests: blocking (one at a time) "
+                  "or multi (up to the optional max number of concurrent requests per thread, default 32)."),
+    AP_INIT_TAKE12("DupBatch",
+                  reinterpret_cast<const char *(*)()>(&setBatch),
+                  0,
+                  OR_ALL,
+                  "Set the maximum number of requests a thread takes off its queue at once (default 16), "
+                  "and the optional time in milliseconds it waits for them (default 0)."),
+    AP_INIT_TAKE23("DupConnections",
+                  reinterpret_cast<const char *(*)()>(&setConnections),
+                  0,
+                  OR_ALL,
+                  "Set the maximum number of idle and total connections per destination (0 for no total limit), "
+                  "and the optional time in milliseconds after which an idle connection is closed (default 30000)."),
+    AP_INIT_TAKE23("DupCircuitBreaker",
+                  reinterpret_cast<const char *(*)()>(&setCircuitBreaker),
+                  0,
+                  OR_ALL,
+                  "Stop duplicating to a destination for the given time in milliseconds when the percentage of its failed "
+                  "requests over the optional number of last requests (default 20) reaches the given rate."),
+    AP_INIT_TAKE12("DupAdaptiveTimeout",
+                  reinterpret_cast<const char *(*)()>(&setAdaptiveTimeout),
+                  0,
+                  OR_ALL,
+                  "Lower the timeout of each destination to the 99th percentile of its latency times the optional factor "
+                  "(default 3), never below the given minimum in milliseconds."),
+    AP_INIT_TAKE1("DupCpuAffinity",
+                  reinterpret_cast<const char *(*)()>(&setCpuAffinity),
+                  0,
+                  OR_ALL,
+                  "Pin the threads to the given list of CPUs, such as 0-3,6."),
+    AP_INIT_TAKE12("DupCpuPriority",
+                  reinterpret_cast<const char *(*)()>(&setCpuPriority),
+                  0,
+                  OR_ALL,
+                  "Run the threads in the SCHED_IDLE class (idle), or with the optional nice value (nice, default 10)."),
+    AP_INIT_TAKE12("DupQueue",
                   reinterpret_cast<const char *(*)()>(&setQueue),
                   0,
                   OR_ALL,
-                  "Set the minimum and maximum queue size for each thread pool."),
+                  "Set the maximum queue size per thread. A minimum before it is accepted but not used anymore."),
+    AP_INIT_TAKE1("DupIdleTimeout",
+                  reinterpret_cast<const char *(*)()>(&setIdleTimeout),
+                  0,
+                  OR_ALL,
+                  "Set the time in milliseconds after which an idle thread exits (default 300, 0 for never)."),
+    AP_INIT_TAKE1("DupQueueBytes",
+                  reinterpret_cast<const char *(*)()>(&setQueueBytes),
+                  0,
+                  OR_ALL,
+                  "Set the maximum memory held by the queued requests of each process in bytes, "
+                  "with an optional K, M or G suffix (default 0, no limit)."),
+    AP_INIT_TAKE2("DupSpool",
+                  reinterpret_cast<const char *(*)()>(&setSpool),
+                  0,
+                  OR_ALL,
+                  "Spill the requests a full queue would drop to a file of each process in the given directory, "
+                  "up to the given size in bytes with an optional K, M or G suffix (0 for no spool)."),
     AP_INIT_TAKE1("DupDuplicationType",
                   reinterpret_cast<const char *(*)()>(&setDuplicationType),
                   0,
@@ -430,6 +927,34 @@ command_rec gCmds[] = {
                   0,
                   ACCESS_CONF,
                   "Set the destination for the duplicated requests. Format: host[:port]"),
+    AP_INIT_TAKE2("DupDestinationThreads",
+                  reinterpret_cast<const char *(*)()>(&setDestinationThreads),
+                  0,
+                  ACCESS_CONF,
+                  "Give the current destination its own queue and threads, and set their minimum and maximum number."),
+    AP_INIT_TAKE12("DupDestinationQueue",
+                  reinterpret_cast<const char *(*)()>(&setDestinationQueue),
+                  0,
+                  ACCESS_CONF,
+                  "Give the current destination its own queue and threads, and set the maximum queue size per thread."),
+    AP_INIT_TAKE12("DupSamplingKey",
+                  reinterpret_cast<const char *(*)()>(&setSamplingKey),
+                  0,
+                  ACCESS_CONF,
+                  "Set what the duplication percentage of the current destination is applied on: "
+                  "RANDOM | ARG <parameter> | HEADER <header> | UNIQUE_ID"),
+    AP_INIT_TAKE12("DupRateLimit",
+                  reinterpret_cast<const char *(*)()>(&setRateLimit),
+                  0,
+                  ACCESS_CONF,
+                  "Limit the number of duplications per second sent to the current destination, "
+                  "with the optional number of duplications which can be sent at once (default: the rate)."),
+    AP_INIT_TAKE1("DupWeight",
+                  reinterpret_cast<const char *(*)()>(&setWeight),
+                  0,
+                  ACCESS_CONF,
+                  "Set the share of the threads the requests of this location get when the queue is loaded, "
+                  "relative to the other locations (default 1)."),
     AP_INIT_TAKE1("DupApplicationScope",
                   reinterpret_cast<const char *(*)()>(&setApplicationScope),
                   0,
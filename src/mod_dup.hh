@@ -63,6 +63,9 @@ public:
 
     char                                        *dirName;
 
+    /** @brief The commands of the location in the RequestProcessor, along with their execution plan */
+    CommandsByDestination                       *commands;
+
     /** @brief the current duplication destination set by the DupDestination directive */
     std::string                                 currentDupDestination;
     /** The percentage of request to duplicate. Destination level */
@@ -144,16 +147,190 @@ const char*
 setTimeout(cmd_parms* pParams, void* pCfg, const char* pTimeout);
 
 /**
- * @brief Set the minimum and maximum queue size
+ * @brief Pin the worker threads to a set of CPUs
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pCpus the list of CPUs or ranges of CPUs, such as 0-3,6
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setCpuAffinity(cmd_parms* pParams, void* pCfg, const char* pCpus);
+
+/**
+ * @brief Set the scheduling priority of the worker threads
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pPriority idle for the SCHED_IDLE class, nice for a nice value
+ * @param pNice the nice value, 10 by default
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setCpuPriority(cmd_parms* pParams, void* pCfg, const char* pPriority, const char* pNice);
+
+/**
+ * @brief Set the weight of the location in the queue shared by all the locations
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pWeight the number of requests of the location served per round, at least 1
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setWeight(cmd_parms* pParams, void* pCfg, const char* pWeight);
+
+/**
+ * @brief Set the age at which the queued requests are dropped
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pMaxAge the time in milliseconds, 0 to never drop them
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setMaxAge(cmd_parms* pParams, void* pCfg, const char* pMaxAge);
+
+/**
+ * @brief Set the way the worker threads send the duplicated requests
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pMode the sender mode: blocking or multi
+ * @param pMaxTransfers the maximum number of concurrent requests per worker in multi mode
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setSender(cmd_parms* pParams, void* pCfg, const char* pMode, const char* pMaxTransfers);
+
+/**
+ * @brief Set how many requests the worker threads take off their queue at once
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pMaxItems the maximum number of requests per batch
+ * @param pMaxWaitMs how long to wait for a batch to fill up in milliseconds
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setBatch(cmd_parms* pParams, void* pCfg, const char* pMaxItems, const char* pMaxWaitMs);
+
+/**
+ * @brief Give the current destination its own queue and worker threads, and set their number
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pMin the minimum number of threads of the destination
+ * @param pMax the maximum number of threads of the destination
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setDestinationThreads(cmd_parms* pParams, void* pCfg, const char* pMin, const char* pMax);
+
+/**
+ * @brief Give the current destination its own queue and worker threads, and set the queue bounds per thread
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pMin the maximum number of queued duplications per thread of the destination, or the minimum, not used
+ * anymore, if pMax is set
+ * @param pMax the maximum number of queued duplications per thread of the destination, NULL if not given
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setDestinationQueue(cmd_parms* pParams, void* pCfg, const char* pMin, const char* pMax);
+
+/**
+ * @brief Set what the duplication percentage of the current destination is applied on
  * @param pParams miscellaneous data
  * @param pCfg user data for the directory/location
- * @param pMin the minimum queue size
- * @param pMax the maximum queue size
+ * @param pKey RANDOM, ARG, HEADER or UNIQUE_ID
+ * @param pName the name of the parameter or header, for ARG and HEADER
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setSamplingKey(cmd_parms* pParams, void* pCfg, const char* pKey, const char* pName);
+
+/**
+ * @brief Limit the rate of the duplications sent to the current destination
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pRate the maximum number of duplications per second
+ * @param pBurst the optional number of duplications which can be sent at once, the rate by default
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setRateLimit(cmd_parms* pParams, void* pCfg, const char* pRate, const char* pBurst);
+
+/**
+ * @brief Set the circuit breaker of the destinations
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pErrorRate the percentage of failed requests which opens the circuit of a destination
+ * @param pOpenMs the time in ms during which nothing is sent to a destination whose circuit opened
+ * @param pWindow the optional number of last requests the error rate is computed on
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setCircuitBreaker(cmd_parms* pParams, void* pCfg, const char* pErrorRate, const char* pOpenMs, const char* pWindow);
+
+/**
+ * @brief Set the timeouts adapting to the latency of each destination
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pMinTimeout the lowest timeout in ms
+ * @param pFactor the optional factor applied to the 99th percentile of the latency
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setAdaptiveTimeout(cmd_parms* pParams, void* pCfg, const char* pMinTimeout, const char* pFactor);
+
+/**
+ * @brief Set the limits of the connections kept to each destination
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pMaxIdle the maximum number of idle connections kept per destination
+ * @param pMaxTotal the maximum number of connections per destination, 0 means no limit
+ * @param pIdleTimeout the optional time in ms after which an idle connection is closed, 0 means never
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setConnections(cmd_parms* pParams, void* pCfg, const char* pMaxIdle, const char* pMaxTotal, const char* pIdleTimeout);
+
+/**
+ * @brief Set the maximum queue size
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pMin the maximum queue size, or the minimum, not used anymore, if pMax is set
+ * @param pMax the maximum queue size, NULL if not given
  * @return NULL if parameters are valid, otherwise a string describing the error
  */
 const char*
 setQueue(cmd_parms* pParams, void* pCfg, const char* pMin, const char* pMax);
 
+/**
+ * @brief Set the time after which an idle worker thread exits
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pIdleTimeoutMs the time in milliseconds, 0 for never
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setIdleTimeout(cmd_parms* pParams, void* pCfg, const char* pIdleTimeoutMs);
+
+/**
+ * @brief Set the maximum memory held by the queued requests of each Apache process
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pMaxBytes the maximum number of bytes, with an optional K, M or G suffix
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setQueueBytes(cmd_parms* pParams, void* pCfg, const char* pMaxBytes);
+
+/**
+ * @brief Set the spool the requests a full queue would drop go to
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pDirectory the directory of the spool files
+ * @param pMaxBytes the size of the spool file of each process, with an optional K, M or G suffix
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setSpool(cmd_parms* pParams, void* pCfg, const char* pDirectory, const char* pMaxBytes);
+
 /**
  * @brief Add a substitution definition
  * @param pParams miscellaneous data
@@ -0,0 +1,208 @@
+/*
+* mod_dup - duplicates apache requests
+* 
+* Copyright (C) 2013 Orange
+* 
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+ * Microbenchmark of the header list building of a duplication.
+ * Counts the heap allocations per request of the former curl_slist_append based code and of the HeaderBuilder.
+ * operator new and the curl allocator are replaced in this executable only.
+ */
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <set>
+
+#include "HeaderBuilder.hh"
+#include "RequestInfo.hh"
+#include "TfyTestRunner.hh"
+
+// cppunit
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#ifdef CPPUNIT_HAVE_NAMESPACES
+using namespace CPPUNIT_NS;
+#endif
+
+using namespace DupModule;
+
+/// @brief Number of heap allocations done so far
+static volatile unsigned long gAllocations = 0;
+
+void *
+operator new(size_t pSize) {
+    __sync_fetch_and_add(&gAllocations, 1);
+    void *lPtr = malloc(pSize ? pSize : 1);
+    if (!lPtr) {
+        throw std::bad_alloc();
+    }
+    return lPtr;
+}
+
+void
+operator delete(void *pPtr) throw() {
+    free(pPtr);
+}
+
+static void *
+countingMalloc(size_t pSize) {
+    __sync_fetch_and_add(&gAllocations, 1);
+    return malloc(pSize);
+}
+
+static void *
+countingRealloc(void *pPtr, size_t pSize) {
+    __sync_fetch_and_add(&gAllocations, 1);
+    return realloc(pPtr, pSize);
+}
+
+static char *
+countingStrdup(const char *pStr) {
+    __sync_fetch_and_add(&gAllocations, 1);
+    return strdup(pStr);
+}
+
+static void *
+countingCalloc(size_t pNb, size_t pSize) {
+    __sync_fetch_and_add(&gAllocations, 1);
+    return calloc(pNb, pSize);
+}
+
+/// @brief The header list building as done before the HeaderBuilder, for comparison
+static curl_slist *
+legacyHeaders(const RequestInfo &rInfo) {
+    curl_slist *slist = NULL;
+    std::string elapsed = std::string("ELAPSED_TIME_BY_DUP: ") + boost::lexical_cast<std::string>(rInfo.getElapsedTimeMS());
+    slist = curl_slist_append(slist, elapsed.c_str());
+    slist = curl_slist_append(slist, "Expect:");
+    slist = curl_slist_append(slist, "X-DUPLICATED-REQUEST: 1");
+    slist = curl_slist_append(slist, "User-RealAgent: mod-dup");
+    std::string contentLen = std::string("Content-Length: ") + boost::lexical_cast<std::string>(rInfo.mBody.size());
+    slist = curl_slist_append(slist, contentLen.c_str());
+
+    std::set<std::string> headers;
+    for (curl_slist *curlist = slist; curlist; curlist = curlist->next) {
+        char *pos = strchr(curlist->data, ':');
+        if (pos) {
+            headers.insert(std::string(curlist->data, pos - curlist->data));
+        }
+    }
+    BOOST_FOREACH(const RequestInfo::tHeaders::value_type &v, rInfo.mHeadersIn) {
+        if ((headers.find(v.first) == headers.end()) && (v.first != std::string("Host")) &&
+            (v.first != std::string("Transfer-Encoding")) &&
+            (v.first != std::string("Content-Length")) && (v.first != std::string("Duplication-Type"))) {
+            headers.insert(v.first);
+            slist = curl_slist_append(slist, std::string(v.first + std::string(": ") + v.second).c_str());
+        }
+    }
+    return slist;
+}
+
+class BenchHeaders :
+    public TestFixture
+{
+    CPPUNIT_TEST_SUITE(BenchHeaders);
+    CPPUNIT_TEST(run);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void run();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( BenchHeaders );
+
+void BenchHeaders::run()
+{
+    static const unsigned cRequests = 100000;
+
+    std::string lBody = "param1=value1&param2=value2";
+    RequestInfo lRequest(std::string("42"), "/path", "/path/wb", "a=b", &lBody);
+    const char *lHeaders[][2] = {
+        {"Host", "www.example.com"}, {"User-Agent", "Mozilla/5.0 (X11; Linux x86_64)"},
+        {"Accept", "text/html,application/xhtml+xml"}, {"Accept-Language", "en-US,en;q=0.5"},
+        {"Accept-Encoding", "gzip, deflate"}, {"Cookie", "session=0123456789abcdef"},
+        {"Connection", "keep-alive"}, {"Content-Type", "application/x-www-form-urlencoded"},
+        {"Content-Length", "27"}, {"X-Forwarded-For", "10.0.0.1"},
+    };
+    BOOST_FOREACH(const char **lHeader, lHeaders) {
+        lRequest.mHeadersIn.push_back(std::make_pair(std::string(lHeader[0]), std::string(lHeader[1])));
+    }
+
+    // Former implementation
+    size_t lLegacyCount = 0;
+    unsigned long lStart = gAllocations;
+    boost::posix_time::ptime lTime = boost::posix_time::microsec_clock::universal_time();
+    for (unsigned i = 0; i < cRequests; ++i) {
+        curl_slist *lList = legacyHeaders(lRequest);
+        for (curl_slist *lNode = lList; lNode; lNode = lNode->next) {
+            ++lLegacyCount;
+        }
+        curl_slist_free_all(lList);
+    }
+    double lLegacyAllocs = static_cast<double>(gAllocations - lStart) / cRequests;
+    long lLegacyUs = (boost::posix_time::microsec_clock::universal_time() - lTime).total_microseconds();
+
+    // HeaderBuilder, reused from one request to the next as a worker does
+    HeaderTemplate lTemplate(DuplicationType::COMPLETE_REQUEST);
+    HeaderBuilder lBuilder;
+    size_t lBuilderCount = 0;
+    lStart = gAllocations;
+    lTime = boost::posix_time::microsec_clock::universal_time();
+    for (unsigned i = 0; i < cRequests; ++i) {
+        lBuilder.clear();
+        lBuilder.add("ELAPSED_TIME_BY_DUP", static_cast<long>(lRequest.getElapsedTimeMS()));
+        lBuilder.add(lTemplate);
+        lBuilder.add("Content-Length", static_cast<long>(lRequest.mBody.size()));
+        lBuilder.addOriginal(lRequest.mHeadersIn, lTemplate);
+        for (curl_slist *lNode = lBuilder.get(); lNode; lNode = lNode->next) {
+            ++lBuilderCount;
+        }
+    }
+    double lBuilderAllocs = static_cast<double>(gAllocations - lStart) / cRequests;
+    long lBuilderUs = (boost::posix_time::microsec_clock::universal_time() - lTime).total_microseconds();
+
+    std::cout << std::endl
+              << "curl_slist_append: " << lLegacyAllocs << " allocations/request, "
+              << lLegacyUs * 1000.0 / cRequests << " ns/request" << std::endl
+              << "HeaderBuilder:     " << lBuilderAllocs << " allocations/request, "
+              << lBuilderUs * 1000.0 / cRequests << " ns/request" << std::endl;
+
+    // Same headers sent
+    CPPUNIT_ASSERT_EQUAL(lLegacyCount, lBuilderCount);
+    // Only the first request allocates, to size the buffers
+    CPPUNIT_ASSERT(lBuilderAllocs < 0.01);
+    CPPUNIT_ASSERT(lLegacyAllocs > 10);
+}
+
+int main(int argc, char* argv[])
+{
+    // Counts the allocations done by curl
+    curl_global_init_mem(CURL_GLOBAL_ALL, countingMalloc, free, countingRealloc, countingStrdup, countingCalloc);
+
+    TfyTestRunner runner(argv[0]);
+    runner.addTest(CppUnit::TestFactoryRegistry::getRegistry().makeTest());
+    bool failed = runner.run();
+
+    curl_global_cleanup();
+    return !failed;
+}
@@ -0,0 +1,179 @@
+/*
+* mod_dup - duplicates apache requests
+* 
+* Copyright (C) 2013 Orange
+* 
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+ * Benchmark of the request queue: the lock free MultiThreadQueue against the mutex and deque based queue it replaced.
+ * Producer threads push as fast as they can, as the Apache threads would, while a few consumers pop.
+ */
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+
+#include "MultiThreadQueue.hh"
+#include "TfyTestRunner.hh"
+
+// cppunit
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#ifdef CPPUNIT_HAVE_NAMESPACES
+using namespace CPPUNIT_NS;
+#endif
+
+using namespace DupModule;
+
+/// @brief The queue as it was before the ring buffer, for comparison
+template <typename T>
+class LegacyQueue
+{
+private:
+    std::deque<T> mQueue;
+    boost::mutex mMutex;
+    boost::condition_variable mAvailableCondition;
+    unsigned mInCount;
+    unsigned mOutCount;
+    unsigned mDropCount;
+    size_t mDropSize;
+
+public:
+    LegacyQueue() : mInCount(0), mOutCount(0), mDropCount(0), mDropSize(0) {}
+
+    void push(const T object)
+    {
+        {
+            boost::lock_guard<boost::mutex> lLock(mMutex);
+            if (mDropSize > 0 && mQueue.size() >= mDropSize) {
+                mDropCount++;
+            } else {
+                mQueue.push_back(object);
+                mInCount++;
+            }
+        }
+        mAvailableCondition.notify_one();
+    }
+
+    T pop()
+    {
+        boost::unique_lock<boost::mutex> lLock(mMutex);
+        while (mQueue.empty()) {
+            mAvailableCondition.wait(lLock);
+        }
+        T lObject = mQueue.front();
+        mQueue.pop_front();
+        mOutCount++;
+        return lObject;
+    }
+
+    void setDropSize(size_t pDropSize) {
+        mDropSize = pDropSize;
+    }
+};
+
+/// @brief The number of items pushed per run, split between the producers
+static const unsigned cItems = 400000;
+/// @brief The number of consumers
+static const unsigned cConsumers = 4;
+
+template <typename Queue>
+static void
+produce(Queue *pQueue, unsigned pCount) {
+    for (unsigned i = 0; i < pCount; ++i) {
+        pQueue->push(1);
+    }
+}
+
+template <typename Queue>
+static void
+consume(Queue *pQueue, volatile unsigned long *pSum) {
+    for (;;) {
+        long lItem = pQueue->pop();
+        if (lItem < 0) {
+            break;
+        }
+        __sync_fetch_and_add(pSum, lItem);
+    }
+}
+
+/**
+ * @brief Push cItems with pProducers threads while cConsumers threads pop them
+ * @return the time it took in microseconds
+ */
+template <typename Queue>
+static long
+runQueue(unsigned pProducers) {
+    Queue lQueue;
+    // Large enough for nothing to be dropped
+    lQueue.setDropSize(cItems + cConsumers);
+    volatile unsigned long lSum = 0;
+
+    boost::posix_time::ptime lStart = boost::posix_time::microsec_clock::universal_time();
+    boost::thread_group lConsumers, lProducers;
+    for (unsigned i = 0; i < cConsumers; ++i) {
+        lConsumers.create_thread(boost::bind(&consume<Queue>, &lQueue, &lSum));
+    }
+    for (unsigned i = 0; i < pProducers; ++i) {
+        lProducers.create_thread(boost::bind(&produce<Queue>, &lQueue, cItems / pProducers));
+    }
+    lProducers.join_all();
+    for (unsigned i = 0; i < cConsumers; ++i) {
+        lQueue.push(-1);
+    }
+    lConsumers.join_all();
+    long lUs = (boost::posix_time::microsec_clock::universal_time() - lStart).total_microseconds();
+
+    // Every item got through
+    CPPUNIT_ASSERT_EQUAL(static_cast<unsigned long>(cItems / pProducers * pProducers), static_cast<unsigned long>(lSum));
+    return lUs;
+}
+
+class BenchQueue :
+    public TestFixture
+{
+    CPPUNIT_TEST_SUITE(BenchQueue);
+    CPPUNIT_TEST(run);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void run();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( BenchQueue );
+
+void BenchQueue::run()
+{
+    std::cout << std::endl << "producers   mutex+deque ns/item   ring ns/item" << std::endl;
+    for (unsigned lProducers = 1; lProducers <= 64; lProducers *= 2) {
+        long lLegacyUs = runQueue<LegacyQueue<long> >(lProducers);
+        long lRingUs = runQueue<MultiThreadQueue<long> >(lProducers);
+        std::cout << std::setw(9) << lProducers
+                  << std::setw(22) << lLegacyUs * 1000.0 / cItems
+                  << std::setw(15) << lRingUs * 1000.0 / cItems << std::endl;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    TfyTestRunner runner(argv[0]);
+    runner.addTest(CppUnit::TestFactoryRegistry::getRegistry().makeTest());
+    return !runner.run();
+}
@@ -0,0 +1,136 @@
+/*
+* mod_dup - duplicates apache requests
+* 
+* Copyright (C) 2013 Orange
+* 
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "Arena.hh"
+#include "testArena.hh"
+
+#include <cstring>
+#include <iterator>
+#include <string>
+
+// cppunit
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TestArena );
+
+#define CPPUNIT_ASSERT_EQUAL_UINT(a, b) CPPUNIT_ASSERT_EQUAL(static_cast<unsigned int>(a), static_cast<unsigned int>(b))
+
+using namespace DupModule;
+
+void TestArena::testAllocate()
+{
+    tArena lArena(16);
+    CPPUNIT_ASSERT_EQUAL_UINT(0, lArena.capacity());
+
+    // Bumped in the first block
+    char *lFirst = lArena.allocate(4);
+    char *lSecond = lArena.allocate(4);
+    CPPUNIT_ASSERT(lSecond == lFirst + 4);
+    CPPUNIT_ASSERT_EQUAL_UINT(16, lArena.capacity());
+
+    // The last allocation grows in place while its block has room
+    CPPUNIT_ASSERT(lArena.grow(lSecond, 4, 12) == lSecond);
+    memcpy(lSecond, "abcd", 4);
+    // Then it moves to a block twice as big
+    char *lMoved = lArena.grow(lSecond, 12, 20);
+    CPPUNIT_ASSERT(lMoved != lSecond);
+    CPPUNIT_ASSERT_EQUAL(std::string("abcd"), std::string(lMoved, 4));
+    CPPUNIT_ASSERT_EQUAL_UINT(16 + 32, lArena.capacity());
+
+    // An allocation which is not the last one moves
+    lArena.allocate(1);
+    CPPUNIT_ASSERT(lArena.grow(lMoved, 20, 21) != lMoved);
+
+    // Bigger than a block
+    lArena.allocate(1000);
+    CPPUNIT_ASSERT(lArena.capacity() >= 16 + 32 + 1000);
+}
+
+void TestArena::testReset()
+{
+    tArena lArena(16);
+    for (int i = 0; i < 10; ++i) {
+        lArena.allocate(10);
+    }
+    size_t lCapacity = lArena.capacity();
+    CPPUNIT_ASSERT(lCapacity >= 100);
+
+    // The blocks are merged in one, which then fits the same request
+    lArena.reset();
+    CPPUNIT_ASSERT_EQUAL_UINT(lCapacity, lArena.capacity());
+    char *lFirst = lArena.allocate(10);
+    for (int i = 1; i < 10; ++i) {
+        CPPUNIT_ASSERT(lArena.allocate(10) == lFirst + 10 * i);
+    }
+    lArena.reset();
+    CPPUNIT_ASSERT(lArena.allocate(10) == lFirst);
+    CPPUNIT_ASSERT_EQUAL_UINT(lCapacity, lArena.capacity());
+
+    // Over the maximum kept, only the first block stays
+    tArena lCapped(16, 64);
+    lFirst = lCapped.allocate(10);
+    for (int i = 1; i < 10; ++i) {
+        lCapped.allocate(10);
+    }
+    CPPUNIT_ASSERT(lCapped.capacity() > 64);
+    lCapped.reset();
+    CPPUNIT_ASSERT_EQUAL_UINT(16, lCapped.capacity());
+    CPPUNIT_ASSERT(lCapped.allocate(10) == lFirst);
+    // Not even that one when the first allocation made it too big
+    tArena lBig(16, 64);
+    lBig.allocate(100);
+    lBig.reset();
+    CPPUNIT_ASSERT_EQUAL_UINT(0, lBig.capacity());
+    lBig.allocate(10);
+    CPPUNIT_ASSERT_EQUAL_UINT(16, lBig.capacity());
+}
+
+void TestArena::testString()
+{
+    tArena lArena(16);
+    tArenaString lString(lArena);
+    CPPUNIT_ASSERT_EQUAL_UINT(0, lString.size());
+    CPPUNIT_ASSERT_EQUAL(std::string(), std::string(lString.data(), lString.size()));
+
+    std::string lExpected;
+    for (int i = 0; i < 100; ++i) {
+        lString.append("ab", 2);
+        lString.push_back('c');
+        lExpected += "abc";
+    }
+    char *lRoom = lString.prepare(10);
+    memcpy(lRoom, "0123456789", 10);
+    lString.commit(3);
+    lExpected += "012";
+    CPPUNIT_ASSERT_EQUAL(lExpected, std::string(lString.data(), lString.size()));
+
+    // Two strings growing in turn
+    tArenaString lOther(lArena);
+    std::string lOtherExpected;
+    std::back_insert_iterator<tArenaString> lOut(lOther);
+    for (int i = 0; i < 200; ++i) {
+        *lOut++ = 'x';
+        lString.push_back('y');
+        lOtherExpected += 'x';
+        lExpected += 'y';
+    }
+    CPPUNIT_ASSERT_EQUAL(lExpected, std::string(lString.data(), lString.size()));
+    CPPUNIT_ASSERT_EQUAL(lOtherExpected, std::string(lOther.data(), lOther.size()));
+}
@@ -0,0 +1,145 @@
+/*
+* mod_dup - duplicates apache requests
+* 
+* Copyright (C) 2013 Orange
+* 
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "ConnectionPool.hh"
+#include "testConnectionPool.hh"
+
+#include <unistd.h>
+
+// cppunit
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TestConnectionPool );
+
+#define CPPUNIT_ASSERT_EQUAL_UINT(a, b) CPPUNIT_ASSERT_EQUAL(static_cast<unsigned int>(a), static_cast<unsigned int>(b))
+
+using namespace DupModule;
+
+static unsigned int gCreated = 0;
+
+static CURL *
+createHandle() {
+    gCreated++;
+    return curl_easy_init();
+}
+
+void TestConnectionPool::testReuse()
+{
+    gCreated = 0;
+    ConnectionPool lPool(&createHandle);
+    lPool.setLimits(2, 0, 0);
+
+    CURL *lA = lPool.acquire("dest-a:80");
+    CPPUNIT_ASSERT(lA);
+    CPPUNIT_ASSERT_EQUAL_UINT(1, gCreated);
+    lPool.release("dest-a:80", lA);
+    CPPUNIT_ASSERT_EQUAL_UINT(1, lPool.getIdleCount("dest-a:80"));
+
+    // A handle is only reused for its own destination
+    CURL *lB = lPool.acquire("dest-b:80");
+    CPPUNIT_ASSERT(lB != lA);
+    CPPUNIT_ASSERT_EQUAL_UINT(2, gCreated);
+    CPPUNIT_ASSERT_EQUAL(lA, lPool.acquire("dest-a:80"));
+    CPPUNIT_ASSERT_EQUAL_UINT(2, gCreated);
+    CPPUNIT_ASSERT_EQUAL_UINT(0, lPool.getIdleCount("dest-a:80"));
+
+    lPool.release("dest-a:80", lA);
+    lPool.release("dest-b:80", lB);
+    CPPUNIT_ASSERT_EQUAL_UINT(1, lPool.getIdleCount("dest-a:80"));
+    CPPUNIT_ASSERT_EQUAL_UINT(1, lPool.getIdleCount("dest-b:80"));
+}
+
+void TestConnectionPool::testLimits()
+{
+    gCreated = 0;
+    ConnectionPool lPool(&createHandle);
+    lPool.setLimits(1, 2, 0);
+
+    CURL *lHandles[2];
+    for (int i = 0; i < 2; ++i) {
+        lHandles[i] = lPool.acquire("dest");
+        CPPUNIT_ASSERT(lHandles[i]);
+    }
+    CPPUNIT_ASSERT_EQUAL_UINT(2, gCreated);
+    // 2 live handles for a total of 2: no more for this destination, the others are not limited by it
+    CPPUNIT_ASSERT(!lPool.acquire("dest"));
+    CPPUNIT_ASSERT_EQUAL_UINT(2, gCreated);
+    CPPUNIT_ASSERT_EQUAL_UINT(1, lPool.getRefusedCount());
+    CPPUNIT_ASSERT_EQUAL_UINT(0, lPool.getRefusedCount());
+    CURL *lOther = lPool.acquire("other");
+    CPPUNIT_ASSERT(lOther);
+    lPool.release("other", lOther);
+
+    lPool.release("dest", lHandles[0]);
+    CPPUNIT_ASSERT_EQUAL_UINT(1, lPool.getIdleCount("dest"));
+    // Only 1 idle handle is kept
+    lPool.release("dest", lHandles[1]);
+    CPPUNIT_ASSERT_EQUAL_UINT(1, lPool.getIdleCount("dest"));
+
+    // Closing a handle makes room for a new one
+    CPPUNIT_ASSERT_EQUAL(lHandles[0], lPool.acquire("dest"));
+    CURL *lNew = lPool.acquire("dest");
+    CPPUNIT_ASSERT(lNew);
+    CPPUNIT_ASSERT_EQUAL_UINT(4, gCreated);
+    CPPUNIT_ASSERT(!lPool.acquire("dest"));
+    lPool.release("dest", lHandles[0]);
+    lPool.release("dest", lNew);
+}
+
+void TestConnectionPool::testIdleTimeout()
+{
+    gCreated = 0;
+    ConnectionPool lPool(&createHandle);
+    lPool.setLimits(4, 0, 50);
+
+    lPool.release("dest", lPool.acquire("dest"));
+    CPPUNIT_ASSERT_EQUAL_UINT(1, lPool.getIdleCount("dest"));
+    CURL *lCurl = lPool.acquire("dest");
+    CPPUNIT_ASSERT_EQUAL_UINT(1, gCreated);
+
+    lPool.release("dest", lCurl);
+    usleep(100000);
+    // The idle handle expired, a new one gets created
+    lCurl = lPool.acquire("dest");
+    CPPUNIT_ASSERT_EQUAL_UINT(2, gCreated);
+    CPPUNIT_ASSERT_EQUAL_UINT(0, lPool.getIdleCount("dest"));
+    lPool.release("dest", lCurl);
+}
+
+void TestConnectionPool::testShare()
+{
+    curl_global_init(CURL_GLOBAL_ALL);
+    CurlShare lShare;
+    CPPUNIT_ASSERT(!lShare.get());
+    CPPUNIT_ASSERT(lShare.init());
+    CURLSH *lSh = lShare.get();
+    CPPUNIT_ASSERT(lSh);
+    // Initializing twice keeps the same share
+    CPPUNIT_ASSERT(lShare.init());
+    CPPUNIT_ASSERT_EQUAL(lSh, lShare.get());
+
+    // Handles using the share go through its lock callbacks
+    CURL *lCurl = curl_easy_init();
+    CPPUNIT_ASSERT_EQUAL(CURLE_OK, curl_easy_setopt(lCurl, CURLOPT_SHARE, lShare.get()));
+    curl_easy_setopt(lCurl, CURLOPT_URL, "http://localhost:1/");
+    curl_easy_setopt(lCurl, CURLOPT_TIMEOUT_MS, 500);
+    curl_easy_perform(lCurl);
+    curl_easy_cleanup(lCurl);
+}
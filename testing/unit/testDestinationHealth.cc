@@ -0,0 +1,133 @@
+/*
+* mod_dup - duplicates apache requests
+* 
+* Copyright (C) 2013 Orange
+* 
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "DestinationHealth.hh"
+#include "testDestinationHealth.hh"
+
+#include <unistd.h>
+
+// cppunit
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TestDestinationHealth );
+
+#define CPPUNIT_ASSERT_EQUAL_UINT(a, b) CPPUNIT_ASSERT_EQUAL(static_cast<unsigned int>(a), static_cast<unsigned int>(b))
+
+using namespace DupModule;
+
+void TestDestinationHealth::testDisabled()
+{
+    tHealthSettings lSettings;
+    DestinationHealth lHealth;
+    lHealth.setName("dest:80");
+    unsigned int lProbe;
+    for (int i = 0; i < 100; ++i) {
+        CPPUNIT_ASSERT(lHealth.allowRequest(lSettings, lProbe));
+        lHealth.onResult(lSettings, 0, false, 10);
+    }
+    CPPUNIT_ASSERT_EQUAL(DestinationHealth::CLOSED, lHealth.getState());
+    CPPUNIT_ASSERT_EQUAL_UINT(1000, lHealth.getTimeout(lSettings, 1000));
+}
+
+void TestDestinationHealth::testCircuit()
+{
+    tHealthSettings lSettings;
+    lSettings.mErrorRate = 50;
+    lSettings.mWindow = 4;
+    lSettings.mOpenMs = 50;
+    DestinationHealth lHealth;
+    lHealth.setName("dest:80");
+    unsigned int lProbe;
+
+    // One failure out of four is below the rate
+    lHealth.onResult(lSettings, 0, true, 10);
+    lHealth.onResult(lSettings, 0, false, 10);
+    lHealth.onResult(lSettings, 0, true, 10);
+    lHealth.onResult(lSettings, 0, true, 10);
+    CPPUNIT_ASSERT_EQUAL(DestinationHealth::CLOSED, lHealth.getState());
+    // Two failures out of the last four open the circuit
+    lHealth.onResult(lSettings, 0, false, 10);
+    CPPUNIT_ASSERT_EQUAL(DestinationHealth::OPEN, lHealth.getState());
+    CPPUNIT_ASSERT(!lHealth.allowRequest(lSettings, lProbe));
+    // Late results of requests sent before do not change anything
+    lHealth.onResult(lSettings, 0, true, 10);
+    CPPUNIT_ASSERT_EQUAL(DestinationHealth::OPEN, lHealth.getState());
+
+    // A single probe once the circuit was open long enough
+    usleep(60000);
+    CPPUNIT_ASSERT(lHealth.allowRequest(lSettings, lProbe));
+    CPPUNIT_ASSERT_EQUAL(DestinationHealth::HALF_OPEN, lHealth.getState());
+    unsigned int lFirstProbe = lProbe;
+    CPPUNIT_ASSERT(lFirstProbe);
+    CPPUNIT_ASSERT(!lHealth.allowRequest(lSettings, lProbe));
+    CPPUNIT_ASSERT(!lProbe);
+    // Only the probe decides: a late result of a request sent before the circuit opened is ignored
+    lHealth.onResult(lSettings, 0, true, 10);
+    CPPUNIT_ASSERT_EQUAL(DestinationHealth::HALF_OPEN, lHealth.getState());
+    // The probe fails: open again
+    lHealth.onResult(lSettings, lFirstProbe, false, 10);
+    CPPUNIT_ASSERT_EQUAL(DestinationHealth::OPEN, lHealth.getState());
+    CPPUNIT_ASSERT(!lHealth.allowRequest(lSettings, lProbe));
+
+    // The probe succeeds: closed with a clean history
+    usleep(60000);
+    CPPUNIT_ASSERT(lHealth.allowRequest(lSettings, lProbe));
+    CPPUNIT_ASSERT(lProbe != lFirstProbe);
+    // The result of the previous probe neither
+    lHealth.onResult(lSettings, lFirstProbe, true, 10);
+    CPPUNIT_ASSERT_EQUAL(DestinationHealth::HALF_OPEN, lHealth.getState());
+    lHealth.onResult(lSettings, lProbe, true, 10);
+    CPPUNIT_ASSERT_EQUAL(DestinationHealth::CLOSED, lHealth.getState());
+    CPPUNIT_ASSERT(lHealth.allowRequest(lSettings, lProbe));
+    lHealth.onResult(lSettings, 0, false, 10);
+    CPPUNIT_ASSERT_EQUAL(DestinationHealth::CLOSED, lHealth.getState());
+}
+
+void TestDestinationHealth::testAdaptiveTimeout()
+{
+    tHealthSettings lSettings;
+    lSettings.mMinTimeoutMs = 100;
+    lSettings.mTimeoutFactor = 3;
+    DestinationHealth lHealth;
+
+    // The configured timeout until enough latencies are known
+    for (int i = 0; i < 31; ++i) {
+        lHealth.onResult(lSettings, 0, true, 50);
+    }
+    CPPUNIT_ASSERT_EQUAL_UINT(5000, lHealth.getTimeout(lSettings, 5000));
+    lHealth.onResult(lSettings, 0, true, 50);
+    CPPUNIT_ASSERT_EQUAL_UINT(150, lHealth.getTimeout(lSettings, 5000));
+    // Never above the configured timeout, nor below the minimum
+    CPPUNIT_ASSERT_EQUAL_UINT(120, lHealth.getTimeout(lSettings, 120));
+    for (int i = 0; i < 256; ++i) {
+        lHealth.onResult(lSettings, 0, true, 1);
+    }
+    CPPUNIT_ASSERT_EQUAL_UINT(100, lHealth.getTimeout(lSettings, 5000));
+    // Failures do not count in the latencies
+    for (int i = 0; i < 256; ++i) {
+        lHealth.onResult(lSettings, 0, false, 4000);
+    }
+    CPPUNIT_ASSERT_EQUAL_UINT(100, lHealth.getTimeout(lSettings, 5000));
+    // The slowest percent of the requests set the timeout
+    for (int i = 0; i < 256; ++i) {
+        lHealth.onResult(lSettings, 0, true, i % 100 == 0 ? 1000 : 10);
+    }
+    CPPUNIT_ASSERT_EQUAL_UINT(3000, lHealth.getTimeout(lSettings, 5000));
+}
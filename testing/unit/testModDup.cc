@@ -114,6 +114,13 @@ void TestModDup::testConfig()
     CPPUNIT_ASSERT(!setQueue(NULL, NULL, "1", "2"));
     CPPUNIT_ASSERT(!setQueue(NULL, NULL, "0", "0"));
     CPPUNIT_ASSERT(setQueue(NULL, NULL, "-1", "2"));
+    // The maximum alone
+    CPPUNIT_ASSERT(!setQueue(NULL, NULL, "20", NULL));
+    CPPUNIT_ASSERT(setQueue(NULL, NULL, "many", NULL));
+
+    CPPUNIT_ASSERT(!setIdleTimeout(NULL, NULL, "1000"));
+    CPPUNIT_ASSERT(!setIdleTimeout(NULL, NULL, "0"));
+    CPPUNIT_ASSERT(setIdleTimeout(NULL, NULL, "soon"));
 
     cmd_parms * lParms = getParms();
     lParms->path = new char[10];
@@ -126,6 +133,41 @@ void TestModDup::testConfig()
     CPPUNIT_ASSERT(setDestination(lParms, (void *) lDoHandle, "", NULL));
     CPPUNIT_ASSERT(!setDestination(lParms, (void *) lDoHandle, "localhost", NULL));
 
+    // Destination pools must follow a destination
+    DupConf *lNoDestination = new DupConf();
+    CPPUNIT_ASSERT(setDestinationThreads(lParms, (void *) lNoDestination, "1", "2"));
+    CPPUNIT_ASSERT(setDestinationQueue(lParms, (void *) lNoDestination, "1", "2"));
+    delete lNoDestination;
+    CPPUNIT_ASSERT(!setDestinationThreads(lParms, (void *) lDoHandle, "1", "2"));
+    CPPUNIT_ASSERT(setDestinationThreads(lParms, (void *) lDoHandle, "2", "1"));
+    CPPUNIT_ASSERT(setDestinationThreads(lParms, (void *) lDoHandle, "0", "0"));
+    CPPUNIT_ASSERT(setDestinationThreads(lParms, (void *) lDoHandle, "one", "2"));
+    CPPUNIT_ASSERT(!setDestinationQueue(lParms, (void *) lDoHandle, "1", "20"));
+    CPPUNIT_ASSERT(setDestinationQueue(lParms, (void *) lDoHandle, "20", "1"));
+    CPPUNIT_ASSERT(!setDestinationQueue(lParms, (void *) lDoHandle, "20", NULL));
+
+    // Sampling keys must follow a destination
+    lNoDestination = new DupConf();
+    CPPUNIT_ASSERT(setSamplingKey(lParms, (void *) lNoDestination, "UNIQUE_ID", NULL));
+    delete lNoDestination;
+    CPPUNIT_ASSERT(!setSamplingKey(lParms, (void *) lDoHandle, "UNIQUE_ID", NULL));
+    CPPUNIT_ASSERT(!setSamplingKey(lParms, (void *) lDoHandle, "ARG", "userId"));
+    CPPUNIT_ASSERT(!setSamplingKey(lParms, (void *) lDoHandle, "HEADER", "X-User"));
+    CPPUNIT_ASSERT(!setSamplingKey(lParms, (void *) lDoHandle, "RANDOM", NULL));
+    CPPUNIT_ASSERT(setSamplingKey(lParms, (void *) lDoHandle, "ARG", NULL));
+    CPPUNIT_ASSERT(setSamplingKey(lParms, (void *) lDoHandle, "HEADER", ""));
+    CPPUNIT_ASSERT(setSamplingKey(lParms, (void *) lDoHandle, "COOKIE", "id"));
+
+    // Rate limits must follow a destination
+    lNoDestination = new DupConf();
+    CPPUNIT_ASSERT(setRateLimit(lParms, (void *) lNoDestination, "100", NULL));
+    delete lNoDestination;
+    CPPUNIT_ASSERT(!setRateLimit(lParms, (void *) lDoHandle, "100", NULL));
+    CPPUNIT_ASSERT(!setRateLimit(lParms, (void *) lDoHandle, "100", "10"));
+    CPPUNIT_ASSERT(setRateLimit(lParms, (void *) lDoHandle, "0", NULL));
+    CPPUNIT_ASSERT(setRateLimit(lParms, (void *) lDoHandle, "100", "0"));
+    CPPUNIT_ASSERT(setRateLimit(lParms, (void *) lDoHandle, "lots", NULL));
+
     // Substitutions
     CPPUNIT_ASSERT(!setSubstitute(lParms, (void *)lDoHandle, "toto", "toto", "titi"));
     CPPUNIT_ASSERT(setSubstitute(lParms, (void *)lDoHandle, "toto", "*t(oto", "titi"));
@@ -152,6 +194,75 @@ void TestModDup::testConfig()
     CPPUNIT_ASSERT(setUrlCodec(lParms, (void *) lDoHandle, ""));
     CPPUNIT_ASSERT(setUrlCodec(lParms, (void *) lDoHandle, NULL));
 
+    // CPU policy of the threads
+    CPPUNIT_ASSERT(!setCpuAffinity(lParms, (void *) lDoHandle, "0-1"));
+    CPPUNIT_ASSERT(setCpuAffinity(lParms, (void *) lDoHandle, "first"));
+    CPPUNIT_ASSERT(!setCpuPriority(lParms, (void *) lDoHandle, "idle", NULL));
+    CPPUNIT_ASSERT(!setCpuPriority(lParms, (void *) lDoHandle, "nice", NULL));
+    CPPUNIT_ASSERT(!setCpuPriority(lParms, (void *) lDoHandle, "nice", "19"));
+    CPPUNIT_ASSERT(setCpuPriority(lParms, (void *) lDoHandle, "nice", "-1"));
+    CPPUNIT_ASSERT(setCpuPriority(lParms, (void *) lDoHandle, "idle", "5"));
+    CPPUNIT_ASSERT(setCpuPriority(lParms, (void *) lDoHandle, "realtime", NULL));
+
+    // Weight of the location
+    CPPUNIT_ASSERT(!setWeight(lParms, (void *) lDoHandle, "4"));
+    CPPUNIT_ASSERT(setWeight(lParms, (void *) lDoHandle, "0"));
+    CPPUNIT_ASSERT(setWeight(lParms, (void *) lDoHandle, "heavy"));
+
+    // Maximum age of the queued requests
+    CPPUNIT_ASSERT(!setMaxAge(lParms, (void *) lDoHandle, "2000"));
+    CPPUNIT_ASSERT(!setMaxAge(lParms, (void *) lDoHandle, "0"));
+    CPPUNIT_ASSERT(setMaxAge(lParms, (void *) lDoHandle, "old"));
+
+    // Sender mode
+    CPPUNIT_ASSERT(!setSender(lParms, (void *) lDoHandle, "multi", NULL));
+    CPPUNIT_ASSERT(!setSender(lParms, (void *) lDoHandle, "multi", "64"));
+    CPPUNIT_ASSERT(!setSender(lParms, (void *) lDoHandle, "blocking", NULL));
+    CPPUNIT_ASSERT(setSender(lParms, (void *) lDoHandle, "async", NULL));
+    CPPUNIT_ASSERT(setSender(lParms, (void *) lDoHandle, "multi", "many"));
+    CPPUNIT_ASSERT(setSender(lParms, (void *) lDoHandle, "multi", "0"));
+
+    // Batch size
+    CPPUNIT_ASSERT(!setBatch(lParms, (void *) lDoHandle, "32", NULL));
+    CPPUNIT_ASSERT(!setBatch(lParms, (void *) lDoHandle, "8", "5"));
+    CPPUNIT_ASSERT(!setBatch(lParms, (void *) lDoHandle, "1", "0"));
+    CPPUNIT_ASSERT(setBatch(lParms, (void *) lDoHandle, "0", NULL));
+    CPPUNIT_ASSERT(setBatch(lParms, (void *) lDoHandle, "many", NULL));
+    CPPUNIT_ASSERT(setBatch(lParms, (void *) lDoHandle, "8", "-"));
+
+    // Queue memory budget
+    CPPUNIT_ASSERT(!setQueueBytes(lParms, (void *) lDoHandle, "1048576"));
+    CPPUNIT_ASSERT(!setQueueBytes(lParms, (void *) lDoHandle, "64M"));
+    CPPUNIT_ASSERT(!setQueueBytes(lParms, (void *) lDoHandle, "2g"));
+    CPPUNIT_ASSERT(!setQueueBytes(lParms, (void *) lDoHandle, "0"));
+    CPPUNIT_ASSERT(setQueueBytes(lParms, (void *) lDoHandle, "M"));
+    CPPUNIT_ASSERT(setQueueBytes(lParms, (void *) lDoHandle, "12T"));
+    CPPUNIT_ASSERT(setQueueBytes(lParms, (void *) lDoHandle, ""));
+
+    // Overflow spool
+    CPPUNIT_ASSERT(!setSpool(lParms, (void *) lDoHandle, "/tmp", "64M"));
+    CPPUNIT_ASSERT(!setSpool(lParms, (void *) lDoHandle, "/tmp", "0"));
+    CPPUNIT_ASSERT(setSpool(lParms, (void *) lDoHandle, "/tmp", "big"));
+    CPPUNIT_ASSERT(setSpool(lParms, (void *) lDoHandle, "", "64M"));
+
+    // Connection limits
+    CPPUNIT_ASSERT(!setConnections(lParms, (void *) lDoHandle, "4", "0", NULL));
+    CPPUNIT_ASSERT(!setConnections(lParms, (void *) lDoHandle, "2", "8", "1000"));
+    CPPUNIT_ASSERT(setConnections(lParms, (void *) lDoHandle, "8", "2", NULL));
+    CPPUNIT_ASSERT(setConnections(lParms, (void *) lDoHandle, "a", "2", NULL));
+    CPPUNIT_ASSERT(setConnections(lParms, (void *) lDoHandle, "2", "8", "never"));
+
+    // Circuit breaker and adaptive timeouts
+    CPPUNIT_ASSERT(!setCircuitBreaker(lParms, (void *) lDoHandle, "50", "5000", NULL));
+    CPPUNIT_ASSERT(!setCircuitBreaker(lParms, (void *) lDoHandle, "50", "5000", "100"));
+    CPPUNIT_ASSERT(setCircuitBreaker(lParms, (void *) lDoHandle, "150", "5000", NULL));
+    CPPUNIT_ASSERT(setCircuitBreaker(lParms, (void *) lDoHandle, "50", "5000", "0"));
+    CPPUNIT_ASSERT(setCircuitBreaker(lParms, (void *) lDoHandle, "50", "soon", NULL));
+    CPPUNIT_ASSERT(!setAdaptiveTimeout(lParms, (void *) lDoHandle, "100", NULL));
+    CPPUNIT_ASSERT(!setAdaptiveTimeout(lParms, (void *) lDoHandle, "100", "5"));
+    CPPUNIT_ASSERT(setAdaptiveTimeout(lParms, (void *) lDoHandle, "100", "0"));
+    CPPUNIT_ASSERT(setAdaptiveTimeout(lParms, (void *) lDoHandle, "fast", NULL));
+
     CPPUNIT_ASSERT(!setActive(lParms, lDoHandle));
 
 
@@ -269,8 +380,8 @@ void TestModDup::testDuplicationPercentage() {
 
         {
             RequestInfo ri = RequestInfo(std::string("42"),"/spp/main", "/spp/main/foo/", "SID=eightyfour");
-            std::list<std::pair<std::string, std::string> > lParsedArgs;
-            gProcessor->parseArgs(lParsedArgs, ri.mArgs);
+            tRequestArgs lParsedArgs;
+            gProcessor->parseArgs(lParsedArgs, ri);
             std::list<const tFilter *> ff = gProcessor->processRequest(ri, lParsedArgs);
             CPPUNIT_ASSERT_EQUAL(1, (int)ff.size());
 
@@ -288,8 +399,8 @@ void TestModDup::testDuplicationPercentage() {
 
         {
             RequestInfo ri = RequestInfo(std::string("42"),"/spp/main", "/spp/main/foo/", "SID=fortytwo");
-            std::list<std::pair<std::string, std::string> > lParsedArgs;
-            gProcessor->parseArgs(lParsedArgs, ri.mArgs);
+            tRequestArgs lParsedArgs;
+            gProcessor->parseArgs(lParsedArgs, ri);
             std::list<const tFilter *> ff = gProcessor->processRequest(ri, lParsedArgs);
             CPPUNIT_ASSERT_EQUAL(1, (int)ff.size());
 
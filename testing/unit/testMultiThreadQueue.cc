@@ -19,6 +19,10 @@
 #include "MultiThreadQueue.hh"
 #include "testMultiThreadQueue.hh"
 
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+
 // cppunit
 #include <cppunit/extensions/TestFactoryRegistry.h>
 #include <cppunit/ui/text/TestRunner.h>
@@ -103,4 +107,282 @@ void TestMultiThreadQueue::run()
 	CPPUNIT_ASSERT_EQUAL_UINT(1, lOutCount);
 	CPPUNIT_ASSERT_EQUAL_UINT(0, lDropCount);
 	CPPUNIT_ASSERT_EQUAL_UINT(0, queue.size());
+
+	// tryPop does not block on an empty queue
+	int lPopped = 0;
+	queue.getCounters(lInCount, lOutCount, lDropCount);
+	CPPUNIT_ASSERT(!queue.tryPop(lPopped));
+	queue.push(5);
+	CPPUNIT_ASSERT(queue.tryPop(lPopped));
+	CPPUNIT_ASSERT_EQUAL(5, lPopped);
+	queue.getCounters(lInCount, lOutCount, lDropCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(1, lInCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(1, lOutCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(0, lDropCount);
+}
+
+static void
+produce(MultiThreadQueue<int> *pQueue, int pCount) {
+	for (int i = 1; i <= pCount; ++i) {
+		pQueue->push(i);
+	}
+}
+
+static void
+consume(MultiThreadQueue<int> *pQueue, volatile long *pSum, volatile long *pCount) {
+	for (;;) {
+		int lItem = pQueue->pop();
+		if (lItem < 0) {
+			break;
+		}
+		__sync_fetch_and_add(pSum, lItem);
+		__sync_fetch_and_add(pCount, 1);
+	}
+}
+
+void TestMultiThreadQueue::testConcurrent()
+{
+	unsigned lInCount, lOutCount, lDropCount;
+	volatile long lSum = 0, lCount = 0;
+
+	// Nothing lost nor duplicated with many producers and consumers, consumers sleeping when the queue is empty
+	MultiThreadQueue<int> queue;
+	boost::thread_group lConsumers, lProducers;
+	for (int i = 0; i < 4; ++i) {
+		lConsumers.create_thread(boost::bind(&consume, &queue, &lSum, &lCount));
+	}
+	for (int i = 0; i < 8; ++i) {
+		lProducers.create_thread(boost::bind(&produce, &queue, 5000));
+	}
+	lProducers.join_all();
+	usleep(10000);
+	CPPUNIT_ASSERT_EQUAL_UINT(0, queue.size());
+	// The consumers are asleep, the poison pills wake them all up
+	for (int i = 0; i < 4; ++i) {
+		queue.push_front(-1);
+	}
+	lConsumers.join_all();
+	CPPUNIT_ASSERT_EQUAL(40000L, static_cast<long>(lCount));
+	CPPUNIT_ASSERT_EQUAL(8L * 5000 * 5001 / 2, static_cast<long>(lSum));
+	queue.getCounters(lInCount, lOutCount, lDropCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(40000, lInCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(40004, lOutCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(0, lDropCount);
+
+	// The maximum size holds with concurrent producers
+	MultiThreadQueue<int> bounded;
+	bounded.setDropSize(100);
+	for (int i = 0; i < 8; ++i) {
+		lProducers.create_thread(boost::bind(&produce, &bounded, 1000));
+	}
+	lProducers.join_all();
+	bounded.getCounters(lInCount, lOutCount, lDropCount);
+	CPPUNIT_ASSERT(lInCount >= 100 && lInCount <= 128);
+	CPPUNIT_ASSERT_EQUAL_UINT(8000, lInCount + lDropCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(lInCount, bounded.size());
+}
+
+static void
+pushLater(MultiThreadQueue<int> *pQueue, int pItem, unsigned int pDelayMs) {
+	usleep(pDelayMs * 1000);
+	pQueue->push(pItem);
+}
+
+void TestMultiThreadQueue::testBatch()
+{
+	unsigned lInCount, lOutCount, lDropCount;
+	MultiThreadQueue<int> queue;
+	std::vector<int> lItems;
+
+	// At most the maximum number of items, in order
+	for (int i = 0; i < 10; ++i) {
+		queue.push(i);
+	}
+	CPPUNIT_ASSERT_EQUAL((size_t)4, queue.popBatch(lItems, 4, 0));
+	CPPUNIT_ASSERT_EQUAL((size_t)4, lItems.size());
+	CPPUNIT_ASSERT_EQUAL(0, lItems[0]);
+	CPPUNIT_ASSERT_EQUAL(3, lItems[3]);
+	CPPUNIT_ASSERT_EQUAL_UINT(6, queue.size());
+
+	// Without wait, only the items already queued
+	lItems.clear();
+	CPPUNIT_ASSERT_EQUAL((size_t)6, queue.popBatch(lItems, 16, 0));
+	CPPUNIT_ASSERT_EQUAL(9, lItems.back());
+	queue.getCounters(lInCount, lOutCount, lDropCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(10, lInCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(10, lOutCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(0, lDropCount);
+
+	// Items pushed in front come first
+	lItems.clear();
+	queue.push(1);
+	queue.push_front(-1);
+	CPPUNIT_ASSERT_EQUAL((size_t)2, queue.popBatch(lItems, 16, 0));
+	CPPUNIT_ASSERT_EQUAL(-1, lItems[0]);
+	CPPUNIT_ASSERT_EQUAL(1, lItems[1]);
+
+	// Blocks until the first item, then waits for the others up to the maximum wait
+	lItems.clear();
+	boost::thread lProducer(boost::bind(&pushLater, &queue, 1, 20));
+	boost::posix_time::ptime lStart = boost::posix_time::microsec_clock::universal_time();
+	CPPUNIT_ASSERT_EQUAL((size_t)1, queue.popBatch(lItems, 16, 50));
+	long lElapsed = (boost::posix_time::microsec_clock::universal_time() - lStart).total_milliseconds();
+	CPPUNIT_ASSERT(lElapsed >= 60);
+	lProducer.join();
+
+	// Returns as soon as the batch is full
+	lItems.clear();
+	queue.push(1);
+	boost::thread lLateProducer(boost::bind(&pushLater, &queue, 2, 20));
+	lStart = boost::posix_time::microsec_clock::universal_time();
+	CPPUNIT_ASSERT_EQUAL((size_t)2, queue.popBatch(lItems, 2, 5000));
+	lElapsed = (boost::posix_time::microsec_clock::universal_time() - lStart).total_milliseconds();
+	CPPUNIT_ASSERT(lElapsed < 1000);
+	CPPUNIT_ASSERT_EQUAL(2, lItems[1]);
+	lLateProducer.join();
+	CPPUNIT_ASSERT_EQUAL_UINT(0, queue.size());
+}
+
+void TestMultiThreadQueue::testRetirement()
+{
+	MultiThreadQueue<int> queue;
+	queue.setRetirement(-1, 1, 50);
+	queue.addWorkers(2);
+	volatile long lSum = 0, lCount = 0;
+
+	// The idle consumers exit, but the last one
+	boost::thread_group lConsumers;
+	lConsumers.create_thread(boost::bind(&consume, &queue, &lSum, &lCount));
+	lConsumers.create_thread(boost::bind(&consume, &queue, &lSum, &lCount));
+	usleep(200000);
+	CPPUNIT_ASSERT_EQUAL_UINT(1, queue.getWorkers());
+	queue.push(3);
+	usleep(20000);
+	CPPUNIT_ASSERT_EQUAL(3L, static_cast<long>(lSum));
+
+	// Closing makes the last one exit, the retire item is never queued
+	queue.close();
+	lConsumers.join_all();
+	CPPUNIT_ASSERT_EQUAL_UINT(0, queue.getWorkers());
+	CPPUNIT_ASSERT_EQUAL_UINT(0, queue.size());
+	int lItem;
+	CPPUNIT_ASSERT(queue.tryPop(lItem));
+	CPPUNIT_ASSERT_EQUAL(-1, lItem);
+
+	// Reopened
+	queue.setRetirement(-1, 0, 0);
+	CPPUNIT_ASSERT(!queue.tryPop(lItem));
+
+	// High water events
+	queue.setHighWater(3);
+	CPPUNIT_ASSERT(!queue.waitHighWater(1000));
+	queue.push(1);
+	queue.push(2);
+	CPPUNIT_ASSERT(!queue.waitHighWater(1000));
+	queue.push(3);
+	queue.push(4);
+	CPPUNIT_ASSERT(queue.waitHighWater(1000));
+	CPPUNIT_ASSERT(!queue.waitHighWater(1000));
+	size_t lPushed, lPopped;
+	queue.getTotals(lPushed, lPopped);
+	queue.pop();
+	size_t lPushedAfter, lPoppedAfter;
+	queue.getTotals(lPushedAfter, lPoppedAfter);
+	CPPUNIT_ASSERT_EQUAL(lPushed, lPushedAfter);
+	CPPUNIT_ASSERT_EQUAL(lPopped + 1, lPoppedAfter);
+}
+
+static size_t
+stringSize(const std::string &pItem) {
+	return pItem.size();
+}
+
+void TestMultiThreadQueue::testMaxBytes()
+{
+	unsigned lInCount, lOutCount, lDropCount;
+	MultiThreadQueue<std::string> queue;
+	queue.setMaxBytes(100, &stringSize);
+
+	// Dropped once the items hold more than the budget, whatever their number
+	queue.push(std::string(60, 'a'));
+	queue.push(std::string(50, 'b'));
+	queue.push(std::string(40, 'c'));
+	CPPUNIT_ASSERT_EQUAL_UINT(2, queue.size());
+	CPPUNIT_ASSERT_EQUAL_UINT(100, queue.getBytes());
+	CPPUNIT_ASSERT_EQUAL_UINT(1, queue.getByteDropCount());
+	CPPUNIT_ASSERT_EQUAL_UINT(0, queue.getByteDropCount());
+	queue.getCounters(lInCount, lOutCount, lDropCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(2, lInCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(0, lDropCount);
+
+	// The bytes are released when popped, front items are not accounted for
+	queue.push_front(std::string(200, 'z'));
+	CPPUNIT_ASSERT_EQUAL(std::string(200, 'z'), queue.pop());
+	CPPUNIT_ASSERT_EQUAL(std::string(60, 'a'), queue.pop());
+	CPPUNIT_ASSERT_EQUAL_UINT(40, queue.getBytes());
+	queue.push(std::string(50, 'd'));
+	CPPUNIT_ASSERT_EQUAL_UINT(0, queue.getByteDropCount());
+
+	// Kept through a resize
+	queue.setDropSize(10);
+	CPPUNIT_ASSERT_EQUAL_UINT(90, queue.getBytes());
+	std::string lItem;
+	CPPUNIT_ASSERT(queue.tryPop(lItem));
+	CPPUNIT_ASSERT(queue.tryPop(lItem));
+	CPPUNIT_ASSERT_EQUAL_UINT(0, queue.getBytes());
+}
+
+static size_t
+firstLetter(const std::string &pItem)
+{
+	return pItem[0] - 'a';
+}
+
+void TestMultiThreadQueue::testClasses()
+{
+	unsigned lInCount, lOutCount, lDropCount;
+	MultiThreadQueue<std::string> queue;
+	std::vector<std::string> lNames;
+	lNames.push_back("a");
+	lNames.push_back("b");
+	std::vector<unsigned int> lWeights;
+	lWeights.push_back(1);
+	lWeights.push_back(3);
+	queue.setClasses(lNames, lWeights, &firstLetter);
+	queue.setDropSize(8);
+	CPPUNIT_ASSERT_EQUAL_UINT(2, queue.getClassCount());
+	CPPUNIT_ASSERT_EQUAL(std::string("b"), queue.getClassName(1));
+
+	// A class flooding the queue fills it up, but only its own items are dropped
+	for (int i = 0; i < 20; ++i) {
+		queue.push("a");
+	}
+	// The other class still gets its share, 6 out of 8
+	for (int i = 0; i < 10; ++i) {
+		queue.push("b");
+	}
+	CPPUNIT_ASSERT_EQUAL_UINT(14, queue.size());
+	CPPUNIT_ASSERT_EQUAL_UINT(12, queue.getClassDropCount(0));
+	CPPUNIT_ASSERT_EQUAL_UINT(4, queue.getClassDropCount(1));
+	CPPUNIT_ASSERT_EQUAL_UINT(0, queue.getClassDropCount(1));
+	queue.getCounters(lInCount, lOutCount, lDropCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(14, lInCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(16, lDropCount);
+
+	// Served in turn, in proportion to their weights
+	std::string lOrder;
+	std::string lItem;
+	while (queue.tryPop(lItem)) {
+		lOrder += lItem;
+	}
+	CPPUNIT_ASSERT_EQUAL(std::string("bbbabbbaaaaaaa"), lOrder);
+
+	// Kept through a resize
+	queue.push("b");
+	queue.push("a");
+	queue.setDropSize(16);
+	CPPUNIT_ASSERT_EQUAL_UINT(2, queue.size());
+	CPPUNIT_ASSERT(queue.tryPop(lItem));
+	CPPUNIT_ASSERT(queue.tryPop(lItem));
+	CPPUNIT_ASSERT(!queue.tryPop(lItem));
 }
@@ -31,8 +31,18 @@ class TestMultiThreadQueue :
 
     CPPUNIT_TEST_SUITE(TestMultiThreadQueue);
     CPPUNIT_TEST(run);
+    CPPUNIT_TEST(testConcurrent);
+    CPPUNIT_TEST(testBatch);
+    CPPUNIT_TEST(testRetirement);
+    CPPUNIT_TEST(testMaxBytes);
+    CPPUNIT_TEST(testClasses);
     CPPUNIT_TEST_SUITE_END();
 
 public:
     void run();
+    void testConcurrent();
+    void testBatch();
+    void testRetirement();
+    void testMaxBytes();
+    void testClasses();
 };
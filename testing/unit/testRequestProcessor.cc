@@ -26,6 +26,9 @@
 #include <cppunit/extensions/TestFactoryRegistry.h>
 #include <cppunit/ui/text/TestRunner.h>
 #include <cppunit/extensions/HelperMacros.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/shared_ptr.hpp>
 
 CPPUNIT_TEST_SUITE_REGISTRATION( TestRequestProcessor );
@@ -69,8 +72,8 @@ void TestRequestProcessor::testSubstitution()
 
     query = "titi=tatae&tutu=tatae";
     RequestInfo ri = RequestInfo(std::string("42"), "/toto", "/toto", query);
-    std::list<std::pair<std::string, std::string> > lParsedArgs;
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    tRequestArgs lParsedArgs;
+    proc.parseArgs(lParsedArgs, ri);
     CommandsByDestination &cbd = proc.mCommands.at(ri.mConfPath);
     Commands &c = cbd.mCommands.at(conf.currentDupDestination);
     proc.substituteRequest(ri, c, lParsedArgs);
@@ -80,8 +83,8 @@ void TestRequestProcessor::testSubstitution()
         //  Empty fields are preserved
         query = "titi=tatae&tutu";
         ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         CommandsByDestination &cbd = proc.mCommands.at(ri.mConfPath);
         Commands &c = cbd.mCommands.at(conf.currentDupDestination);
         proc.substituteRequest(ri, c, lParsedArgs);
@@ -93,8 +96,8 @@ void TestRequestProcessor::testSubstitution()
         proc.addSubstitution("/toto", "tutu", "^$", "titi", conf);
         query = "titi=tatae&tutu";
         ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         CommandsByDestination &cbd = proc.mCommands.at(ri.mConfPath);
         Commands &c = cbd.mCommands.at(conf.currentDupDestination);
         proc.substituteRequest(ri, c, lParsedArgs);
@@ -105,8 +108,8 @@ void TestRequestProcessor::testSubstitution()
         // Substitutions are case-sensitive
         query = "titi=TATAE&tutu=TATAE";
         ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         CommandsByDestination &cbd = proc.mCommands.at(ri.mConfPath);
         Commands &c = cbd.mCommands.at(conf.currentDupDestination);
         proc.substituteRequest(ri, c, lParsedArgs);
@@ -118,8 +121,8 @@ void TestRequestProcessor::testSubstitution()
         proc.addSubstitution("/toto", "titi", "-(.*)-", "T\\1", conf);
         query = "titi=tatae&tutu=tatae";
         ri = RequestInfo(std::string("42"), "/toto", "/toto", query);
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         CommandsByDestination &cbd = proc.mCommands.at(ri.mConfPath);
         Commands &c = cbd.mCommands.at(conf.currentDupDestination);
         proc.substituteRequest(ri, c, lParsedArgs);
@@ -131,8 +134,8 @@ void TestRequestProcessor::testSubstitution()
         proc.addSubstitution("/toto", "tutu", "ata", "W", conf);
         query = "titi=tatae&tutu=tatae";
         ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         CommandsByDestination &cbd = proc.mCommands.at(ri.mConfPath);
         Commands &c = cbd.mCommands.at(conf.currentDupDestination);
         proc.substituteRequest(ri, c, lParsedArgs);
@@ -143,8 +146,8 @@ void TestRequestProcessor::testSubstitution()
         // ... doesn't affect previous path
         query = "titi=tatae&tutu=tatae";
         ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         CommandsByDestination &cbd = proc.mCommands.at(ri.mConfPath);
         Commands &c = cbd.mCommands.at(conf.currentDupDestination);
         proc.substituteRequest(ri, c, lParsedArgs);
@@ -156,8 +159,8 @@ void TestRequestProcessor::testSubstitution()
         proc.addSubstitution("/toto", "titi", ",", "/", conf);
         query = "titi=1%2C2%2C3";
         ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         CommandsByDestination &cbd = proc.mCommands.at(ri.mConfPath);
         Commands &c = cbd.mCommands.at(conf.currentDupDestination);
         proc.substituteRequest(ri, c, lParsedArgs);
@@ -168,8 +171,8 @@ void TestRequestProcessor::testSubstitution()
         // Keys should be compared case-insensitively
         query = "TiTI=1%2C2%2C3";
         ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         CommandsByDestination &cbd = proc.mCommands.at(ri.mConfPath);
         Commands &c = cbd.mCommands.at(conf.currentDupDestination);
         proc.substituteRequest(ri, c, lParsedArgs);
@@ -188,8 +191,8 @@ void TestRequestProcessor::testFilterBasic()
         RequestProcessor proc;
         proc.addFilter("/toto", "INFO", "[my]+", conf, tFilter::eFilterTypes::REGULAR);
         RequestInfo ri = RequestInfo(std::string("42"),"/toto", "/toto/pws/titi/", "INFO=myinfo");
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         CPPUNIT_ASSERT(!proc.processRequest(ri, lParsedArgs).empty());
     }
 
@@ -198,8 +201,8 @@ void TestRequestProcessor::testFilterBasic()
         RequestProcessor proc;
         proc.addFilter("/toto", "INFO", "KIDO", conf, tFilter::eFilterTypes::REGULAR);
         RequestInfo ri = RequestInfo(std::string("42"),"/toto", "/toto/pws/titi/", "INFO=myinfo");
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         CPPUNIT_ASSERT(proc.processRequest(ri, lParsedArgs).empty());
     }
 
@@ -209,8 +212,8 @@ void TestRequestProcessor::testFilterBasic()
         RequestProcessor proc;
         proc.addFilter("/toto", "INFO", "my", conf, tFilter::eFilterTypes::REGULAR);
         RequestInfo ri = RequestInfo(std::string("42"),"/toto", "/toto/pws/titi/", "INFO=myinfo");
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         CPPUNIT_ASSERT(proc.processRequest(ri, lParsedArgs).empty());
     }
 
@@ -220,8 +223,8 @@ void TestRequestProcessor::testFilterBasic()
         proc.addFilter("/bb", "BODY", "hello", conf, tFilter::eFilterTypes::REGULAR);
         std::string body = "BODY=hello";
         RequestInfo ri = RequestInfo(std::string("42"),"/bb", "/bb/pws/titi/", "INFO=myinfo", &body);
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         CPPUNIT_ASSERT(!proc.processRequest(ri, lParsedArgs).empty());
     }
 
@@ -232,8 +235,8 @@ void TestRequestProcessor::testFilterBasic()
         proc.addFilter("/bb", "STOP", "true", conf, tFilter::eFilterTypes::PREVENT_DUPLICATION);
         std::string body = "BODY=hello&STOP=true";
         RequestInfo ri = RequestInfo(std::string("42"),"/bb", "/bb/pws/titi/", "INFO=myinfo", &body);
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         CPPUNIT_ASSERT(proc.processRequest(ri, lParsedArgs).empty());
     }
 
@@ -254,39 +257,33 @@ void TestRequestProcessor::testFilterOnNotMatching()
                        tFilter::eFilterTypes::REGULAR);
 
         RequestInfo ri = RequestInfo(std::string("42"),"/toto", "/toto/pws/titi/", "DATAS=fdlskjqdfWelcomefdsfd");
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         CPPUNIT_ASSERT(!proc.processRequest(ri, lParsedArgs).empty());
 
         RequestInfo ri2 = RequestInfo(std::string("42"),"/toto", "/toto/pws/titi/", "DATAS=fdlskjqdffdsfBmkPortailFibred");
-        lParsedArgs.clear();
-        proc.parseArgs(lParsedArgs, ri2.mArgs);
+        proc.parseArgs(lParsedArgs, ri2);
         CPPUNIT_ASSERT(proc.processRequest(ri2, lParsedArgs).empty());
 
         RequestInfo ri3 = RequestInfo(std::string("42"),"/toto", "/toto/pws/titi/", "DATAS=fdlskjqdffdsfdsfqsfgsAppNatSubDateqf");
-        lParsedArgs.clear();
-        proc.parseArgs(lParsedArgs, ri3.mArgs);
+        proc.parseArgs(lParsedArgs, ri3);
         CPPUNIT_ASSERT(proc.processRequest(ri3, lParsedArgs).empty());
 
         RequestInfo ri4 = RequestInfo(std::string("42"),"/toto", "/toto/pws/titi/", "DATAS=fdlskBmkVideoPortailFibrejqdffdsfdsfqsfgsqf");
-        lParsedArgs.clear();
-        proc.parseArgs(lParsedArgs, ri4.mArgs);
+        proc.parseArgs(lParsedArgs, ri4);
         CPPUNIT_ASSERT(proc.processRequest(ri4, lParsedArgs).empty());
 
 
         RequestInfo ri5 = RequestInfo(std::string("42"),"/toto", "/toto/pws/titi/", "DATAS=fd,FullCompositeOffer,lskFibrejqdffdsfdsfqsfgsqf");
-        lParsedArgs.clear();
-        proc.parseArgs(lParsedArgs, ri5.mArgs);
+        proc.parseArgs(lParsedArgs, ri5);
         CPPUNIT_ASSERT(proc.processRequest(ri5, lParsedArgs).empty());
 
         RequestInfo ri6 = RequestInfo(std::string("42"),"/toto", "/toto/pws/titi/", "DATAS=AdviseCapping,FullCompositeOffer,InternetBillList,InternetBillList/Bill,InternetBillList/Date,InternetInvoiceTypePay,MSISDN-SI,MobileBillList/Bill,MobileBillList/Date,MobileBillingAccount,MobileDeviceTac,MobileLoyaltyDRE,MobileLoyaltyDRO,MobileLoyaltyDebutDate,MobileLoyaltyPcmNonAnnuleDate,MobileLoyaltyPoints,MobileLoyaltySeuilPcm,MobileLoyaltyProgrammeFid,MobileStartContractDate,OOPSApplications,TlmMobileTac,TlmMode&credential=2,161232061&sid=ADVSCO&version=1.0.0&country=FR");
-        lParsedArgs.clear();
-        proc.parseArgs(lParsedArgs, ri6.mArgs);
+        proc.parseArgs(lParsedArgs, ri6);
         CPPUNIT_ASSERT(proc.processRequest(ri6, lParsedArgs).empty());
 
         RequestInfo ri7 = RequestInfo(std::string("42"),"/toto", "/toto/pws/titi/", "REQUEST=getPNS&DATAS=AdviseCapping,FullCompositeOffer,InternetBillList,InternetBillList/Bill,InternetBillList/Date,InternetInvoiceTypePay,MSISDN-SI,MobileBillList/Bill,MobileBillList/Date,MobileBillingAccount,MobileDeviceTac,MobileLoyaltyDRE,MobileLoyaltyDRO,MobileLoyaltyDebutDate,MobileLoyaltyPcmNonAnnuleDate,MobileLoyaltyPoints,MobileLoyaltySeuilPcm,MobileLoyaltyProgrammeFid,MobileStartContractDate,OOPSApplications,TlmMobileTac,TlmMode&credential=2,161232061&sid=ADVSCO&version=1.0.0&country=FR");
-        lParsedArgs.clear();
-        proc.parseArgs(lParsedArgs, ri7.mArgs);
+        proc.parseArgs(lParsedArgs, ri7);
         CPPUNIT_ASSERT(proc.processRequest(ri7, lParsedArgs).empty());
 
      }
@@ -306,15 +303,14 @@ void TestRequestProcessor::testFilter()
     query = "titi=tata&tutu";
     RequestInfo ri = RequestInfo(std::string("42"),"/toto", "/toto/pws/titi/", query);
 
-    std::list<std::pair<std::string, std::string> > lParsedArgs;
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    tRequestArgs lParsedArgs;
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(std::string("titi=tata&tutu"), ri.mArgs);
 
     query = "";
     ri = RequestInfo(std::string("42"),"", "", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
 
     CPPUNIT_ASSERT(proc.processRequest(ri, lParsedArgs).empty());
 
@@ -323,45 +319,39 @@ void TestRequestProcessor::testFilter()
     proc.addFilter("/toto", "titi", "^ta", conf, tFilter::eFilterTypes::REGULAR);
     query = "titi=tata&tutu";
     ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(!proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(ri.mArgs, std::string("titi=tata&tutu"));
 
     query = "tata&tutu";
     ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(ri.mArgs, std::string("tata&tutu"));
 
     query = "tititi=tata&tutu";
     ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(ri.mArgs, std::string("tititi=tata&tutu"));
 
     // Filters are case-insensitive
     query = "TITi=tata&tutu";
     ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(!proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(ri.mArgs, std::string("TITi=tata&tutu"));
 
     // On other paths, no filter is applied
     query = "titi=tata&tutu";
     ri = RequestInfo(std::string("42"),"/to", "/to", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(query, std::string("titi=tata&tutu"));
 
     query = "tata&tutu";
     ri = RequestInfo(std::string("42"),"/toto", "/toto/bla", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(ri.mArgs, std::string("tata&tutu"));
 
@@ -370,22 +360,19 @@ void TestRequestProcessor::testFilter()
     proc.addFilter("/toto", "titi", "[tu]{2,15}", conf, tFilter::eFilterTypes::REGULAR);
     query = "titi=tata&tutu";
     ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(!proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(ri.mArgs, std::string("titi=tata&tutu"));
 
     query = "titi=tutu";
     ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(!proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(ri.mArgs, std::string("titi=tutu"));
 
     query = "titi=t";
     ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(ri.mArgs, std::string("titi=t"));
 
@@ -393,38 +380,33 @@ void TestRequestProcessor::testFilter()
     proc.addFilter("/some/path", "x", "^.{3,5}$", conf, tFilter::eFilterTypes::REGULAR);
     query = "x=1234";
     ri = RequestInfo(std::string("42"),"/some/path", "/toto", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(!proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(ri.mArgs, std::string("x=1234"));
 
     query = "x=123456";
     ri = RequestInfo(std::string("42"),"/some/path", "/some/path", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(ri.mArgs, std::string("x=123456"));
 
     // New filter should not change filter on other path
     query = "titi=tutu";
     ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(!proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(ri.mArgs, std::string("titi=tutu"));
 
     query = "ti=tu";
     ri = RequestInfo(std::string("42"),"/toto", "/toto", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(ri.mArgs, std::string("ti=tu"));
 
     // Unknown paths still shouldn't have a filter applied
     query = "ti=tu";
     ri = RequestInfo(std::string("42"),"/waaazzaaaa", "/toto", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(ri.mArgs, std::string("ti=tu"));
 
@@ -432,8 +414,7 @@ void TestRequestProcessor::testFilter()
     proc.addFilter("/escaped", "y", "^ ", conf, tFilter::eFilterTypes::REGULAR);
     query = "y=%20";
     ri = RequestInfo(std::string("42"),"/escaped", "/toto", query);
-    lParsedArgs.clear();
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    proc.parseArgs(lParsedArgs, ri);
     CPPUNIT_ASSERT(!proc.processRequest(ri, lParsedArgs).empty());
     CPPUNIT_ASSERT_EQUAL(ri.mArgs, std::string("y=%20"));
 }
@@ -453,6 +434,47 @@ void TestRequestProcessor::testParseArgs()
     CPPUNIT_ASSERT_EQUAL(lParsedArgs.front().first, std::string("TUTU"));
     CPPUNIT_ASSERT_EQUAL(lParsedArgs.front().second, std::string(""));
     lParsedArgs.pop_front();
+
+    // Without copies: the keys as is and the values not decoded, empty arguments skipped
+    tArgs lArgs;
+    query = "&titi=a%20b=c&&Tutu&=v&";
+    proc.parseArgs(lArgs, query);
+    CPPUNIT_ASSERT_EQUAL((size_t)3, lArgs.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("titi"), lArgs[0].mKey.str());
+    CPPUNIT_ASSERT_EQUAL(std::string("a%20b=c"), lArgs[0].mValue.str());
+    CPPUNIT_ASSERT(lArgs[0].mKey.mData == query.data() + 1);
+    CPPUNIT_ASSERT_EQUAL(std::string("a b=c"), proc.decodeValue(lArgs[0]));
+    CPPUNIT_ASSERT_EQUAL(std::string("Tutu"), lArgs[1].mKey.str());
+    CPPUNIT_ASSERT(lArgs[1].mValue.empty());
+    CPPUNIT_ASSERT(lArgs[2].mKey.empty());
+    CPPUNIT_ASSERT_EQUAL(std::string("v"), lArgs[2].mValue.str());
+    CPPUNIT_ASSERT(iequals(lArgs[1].mKey, tStringRef(std::string("TUTU"))));
+    CPPUNIT_ASSERT(!iequals(lArgs[1].mKey, tStringRef(std::string("TUT"))));
+    CPPUNIT_ASSERT_EQUAL(tArgKeyHash()(lArgs[1].mKey), tArgKeyHash()(tStringRef(std::string("tUTU"))));
+
+    // The separators in and across the blocks scanned at once
+    for (size_t lLength = 1; lLength < 40; ++lLength) {
+        query.clear();
+        for (size_t i = 0; i < 100; ++i) {
+            query += "&=Aa%41"[(i * lLength + i / 3) % 7];
+        }
+        std::vector<std::string> lTokens;
+        boost::split(lTokens, query, boost::is_any_of("&"));
+        lArgs.clear();
+        proc.parseArgs(lArgs, query);
+        tArgs::const_iterator lArg = lArgs.begin();
+        BOOST_FOREACH(const std::string &lToken, lTokens) {
+            if (lToken.empty()) {
+                continue;
+            }
+            CPPUNIT_ASSERT(lArg != lArgs.end());
+            size_t lEqual = lToken.find('=');
+            CPPUNIT_ASSERT_EQUAL(lToken.substr(0, lEqual), lArg->mKey.str());
+            CPPUNIT_ASSERT_EQUAL(lEqual == std::string::npos ? std::string() : lToken.substr(lEqual + 1), lArg->mValue.str());
+            ++lArg;
+        }
+        CPPUNIT_ASSERT(lArg == lArgs.end());
+    }
 }
 
 void TestRequestProcessor::testRawSubstitution()
@@ -471,8 +493,8 @@ void TestRequestProcessor::testRawSubstitution()
 
         proc.addRawFilter("/toto", ".*", conf, tFilter::eFilterTypes::REGULAR);
         proc.addRawSubstitution("/toto", "1", "2", conf);
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         std::list<const tFilter *> matches = proc.processRequest(ri, lParsedArgs);
         CPPUNIT_ASSERT(!matches.empty());
         const tFilter *match = *matches.begin();
@@ -501,8 +523,8 @@ void TestRequestProcessor::testRawSubstitution()
         proc.addRawFilter("/toto", ".*", conf, tFilter::eFilterTypes::REGULAR);
         proc.addRawSubstitution("/toto", "1", "2", conf);
 
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         std::list<const tFilter *> matches = proc.processRequest(ri, lParsedArgs);
         CPPUNIT_ASSERT(!matches.empty());
         const tFilter *match = *matches.begin();
@@ -530,8 +552,8 @@ void TestRequestProcessor::testRawSubstitution()
         proc.addRawFilter("/toto", ".*", conf, tFilter::eFilterTypes::REGULAR);
         proc.addRawSubstitution("/toto", "1", "2", conf);
 
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         std::list<const tFilter *> matches = proc.processRequest(ri, lParsedArgs);
         CPPUNIT_ASSERT(!matches.empty());
         const tFilter *match = *matches.begin();
@@ -560,8 +582,8 @@ void TestRequestProcessor::testRawSubstitution()
         conf.currentApplicationScope = ApplicationScope::BODY;
         proc.addRawSubstitution("/toto", "1", "3", conf);
 
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         std::list<const tFilter *> matches = proc.processRequest(ri, lParsedArgs);
         CPPUNIT_ASSERT(!matches.empty());
         const tFilter *match = *matches.begin();
@@ -576,6 +598,18 @@ void TestRequestProcessor::testRawSubstitution()
     }
 }
 
+/// @brief Read a whole dup format body, in small chunks to cross the segments boundaries
+static std::string
+readDupFormat(tDupFormatReader &reader) {
+    std::string lResult;
+    char lBuffer[5];
+    size_t lRead;
+    while ((lRead = tDupFormatReader::readCallback(lBuffer, 1, sizeof(lBuffer), &reader))) {
+        lResult.append(lBuffer, lRead);
+    }
+    return lResult;
+}
+
 void TestRequestProcessor::testDupFormat() {
 
     // sendDupFormat test
@@ -584,27 +618,93 @@ void TestRequestProcessor::testDupFormat() {
     std::string body = "mybody1test";
     RequestInfo ri = RequestInfo(std::string("42"), "/mypath", "/mypath/wb", query, &body);
     CURL * curl = curl_easy_init();
-    struct curl_slist *slist = NULL;
+    HeaderTemplate headerTemplate(DuplicationType::REQUEST_WITH_ANSWER);
+    HeaderBuilder headers;
+    tDupFormatReader reader;
 
     // Just the request body, no answer header or answer body
-    std::string *df = proc.sendDupFormat(curl, ri, slist);
+    proc.sendDupFormat(curl, ri, headerTemplate, headers, reader);
     CPPUNIT_ASSERT_EQUAL(std::string("00000011mybody1test0000000000000000"),
-                         *df);
-    delete df;
+                         readDupFormat(reader));
 
     // Request body, + answer header
     ri.mHeadersOut.push_back(std::make_pair(std::string("key"), std::string("val")));
-    df = proc.sendDupFormat(curl, ri, slist);
+    proc.sendDupFormat(curl, ri, headerTemplate, headers, reader);
     CPPUNIT_ASSERT_EQUAL(std::string("00000011mybody1test00000009key: val\n00000000"),
-                         *df);
+                         readDupFormat(reader));
 
     // Request body, + answer header + answer body
     ri.mAnswer = "TheAnswerBody";
-    df = proc.sendDupFormat(curl, ri, slist);
+    proc.sendDupFormat(curl, ri, headerTemplate, headers, reader);
     CPPUNIT_ASSERT_EQUAL(std::string("00000011mybody1test00000009key: val\n00000013TheAnswerBody"),
-                         *df);
+                         readDupFormat(reader));
+
+    // Same result as the serialization used by mod_compare
+    std::stringstream ss;
+    RequestInfo::Serialize(ri.mBody, ss);
+    RequestInfo::Serialize("key: val\n", ss);
+    RequestInfo::Serialize(ri.mAnswer, ss);
+    CPPUNIT_ASSERT_EQUAL(ss.str().size(), reader.size());
+    // Rewinding, as curl does when it must send the body again
+    CPPUNIT_ASSERT_EQUAL(int(CURL_SEEKFUNC_OK), tDupFormatReader::seekCallback(&reader, 0, SEEK_SET));
+    CPPUNIT_ASSERT_EQUAL(ss.str(), readDupFormat(reader));
+    CPPUNIT_ASSERT_EQUAL(int(CURL_SEEKFUNC_OK), tDupFormatReader::seekCallback(&reader, 21, SEEK_SET));
+    CPPUNIT_ASSERT_EQUAL(ss.str().substr(21), readDupFormat(reader));
+    CPPUNIT_ASSERT_EQUAL(int(CURL_SEEKFUNC_FAIL), tDupFormatReader::seekCallback(&reader, 1000, SEEK_SET));
+
+    curl_easy_cleanup(curl);
+}
+
+/// @brief Join the lines of a header list, starting at the second one: the first is the elapsed time
+static std::string
+joinHeaders(curl_slist *pList) {
+    CPPUNIT_ASSERT(pList);
+    CPPUNIT_ASSERT_EQUAL(std::string("ELAPSED_TIME_BY_DUP: "), std::string(pList->data).substr(0, 21));
+    std::string lResult;
+    for (curl_slist *lNode = pList->next; lNode; lNode = lNode->next) {
+        lResult += std::string(lNode->data) + "|";
+    }
+    return lResult;
+}
 
-    delete df;
+void TestRequestProcessor::testHeaders() {
+    RequestProcessor proc;
+    std::string body = "sdf";
+    RequestInfo ri(std::string("42"), "/mypath", "/mypath/wb", "a=b", &body);
+    ri.mHeadersIn.push_back(std::make_pair(std::string("Host"), std::string("orig")));
+    ri.mHeadersIn.push_back(std::make_pair(std::string("Accept"), std::string("a")));
+    ri.mHeadersIn.push_back(std::make_pair(std::string("Accept"), std::string("b")));
+    ri.mHeadersIn.push_back(std::make_pair(std::string("Content-Length"), std::string("3")));
+    ri.mHeadersIn.push_back(std::make_pair(std::string("Content-Type"), std::string("text/plain")));
+    ri.mHeadersIn.push_back(std::make_pair(std::string("Expect"), std::string("100-continue")));
+
+    tTransfer transfer;
+    transfer.mCurl = curl_easy_init();
+
+    // Original headers are copied once, without the ones set by mod_dup
+    tFilter headerOnly("", ApplicationScope::ALL, "localhost", DuplicationType::HEADER_ONLY);
+    proc.prepareTransfer(transfer, headerOnly, ri);
+    CPPUNIT_ASSERT_EQUAL(std::string("Expect:|X-DUPLICATED-REQUEST: 1|User-RealAgent: mod-dup|"
+                                     "Accept: a|Content-Type: text/plain|"),
+                         joinHeaders(transfer.mHeaders.get()));
+    CPPUNIT_ASSERT_EQUAL(std::string("localhost/mypath/wb?a=b"), transfer.mUri);
+    transfer.reset();
+
+    tFilter complete("", ApplicationScope::ALL, "localhost", DuplicationType::COMPLETE_REQUEST);
+    proc.prepareTransfer(transfer, complete, ri);
+    CPPUNIT_ASSERT_EQUAL(std::string("Expect:|X-DUPLICATED-REQUEST: 1|User-RealAgent: mod-dup|Content-Length: 3|"
+                                     "Accept: a|Content-Type: text/plain|"),
+                         joinHeaders(transfer.mHeaders.get()));
+    transfer.reset();
+
+    tFilter withAnswer("", ApplicationScope::ALL, "localhost", DuplicationType::REQUEST_WITH_ANSWER);
+    proc.prepareTransfer(transfer, withAnswer, ri);
+    CPPUNIT_ASSERT_EQUAL(std::string("Expect:|X-DUPLICATED-REQUEST: 1|User-RealAgent: mod-dup|"
+                                     "Content-Type: application/x-dup-serialized|Duplication-Type: Response|"
+                                     "Content-Length: 27|Accept: a|"),
+                         joinHeaders(transfer.mHeaders.get()));
+    transfer.reset();
+    CPPUNIT_ASSERT(!transfer.mHeaders.get());
 }
 
 void TestRequestProcessor::testRequestInfo() {
@@ -612,6 +712,12 @@ void TestRequestProcessor::testRequestInfo() {
     CPPUNIT_ASSERT(!ri.hasBody());
     ri.mBody = "sdf";
     CPPUNIT_ASSERT(ri.hasBody());
+
+    // The size follows the body and headers
+    size_t lSize = ri.getSize();
+    ri.mBody = std::string(1000, 'x');
+    ri.mHeadersIn.push_back(std::make_pair(std::string("Content-Type"), std::string("text/plain")));
+    CPPUNIT_ASSERT(ri.getSize() >= lSize + 997 + 22);
 }
 
 void TestRequestProcessor::testTimeout() {
@@ -630,6 +736,218 @@ void TestRequestProcessor::testTimeout() {
     CPPUNIT_ASSERT_EQUAL((unsigned int)1, proc.getDuplicatedCount());
 }
 
+void TestRequestProcessor::testRunMulti() {
+    RequestProcessor proc;
+    MultiThreadQueue<boost::shared_ptr<RequestInfo> > queue;
+    proc.setSenderMode(SenderMode::MULTI, 4);
+
+    DupConf conf;
+    conf.currentApplicationScope = ApplicationScope::ALL;
+    conf.currentDupDestination = "Honolulu:8080";
+    proc.addFilter("/spp/main", "SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+    conf.currentDupDestination = "Hikkaduwa:8090";
+    proc.addFilter("/spp/main", "SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+    proc.addSubstitution("/spp/main", "SID", "my", "your", conf);
+
+    // More duplications than concurrent transfers allowed, not all of them match
+    for (int i = 0; i < 5; ++i) {
+        queue.push(boost::shared_ptr<RequestInfo>(new RequestInfo(std::string("42"),"/spp/main", "/spp/main", "SID=mySid")));
+    }
+    queue.push(boost::shared_ptr<RequestInfo>(new RequestInfo(std::string("43"),"/spp/main", "/spp/main", "SID=other")));
+    queue.push(POISON_REQUEST);
+
+    // The poison pill only stops the worker once the transfers in flight are done
+    proc.run(queue);
+
+    CPPUNIT_ASSERT_EQUAL((unsigned int)10, proc.getDuplicatedCount());
+    CPPUNIT_ASSERT_EQUAL((size_t)0, queue.size());
+}
+
+void TestRequestProcessor::testDestinationPools() {
+    RequestProcessor proc;
+    MultiThreadQueue<boost::shared_ptr<RequestInfo> > queue;
+    proc.setTimeout(1000);
+
+    DupConf conf;
+    conf.currentApplicationScope = ApplicationScope::ALL;
+    conf.currentDupDestination = "localhost:1";
+    proc.addFilter("/spp/main", "SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+    conf.currentDupDestination = "localhost:2";
+    proc.addFilter("/spp/main", "SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+    proc.addSubstitution("/spp/main", "SID", "my", "your", conf);
+    // The second destination gets its own workers
+    proc.setDestinationThreads("localhost:2", 1, 2);
+    proc.setDestinationQueue("localhost:2", 5);
+
+    for (int i = 0; i < 5; ++i) {
+        queue.push(boost::shared_ptr<RequestInfo>(new RequestInfo(std::string("42"),"/spp/main", "/spp/main", "SID=mySid")));
+    }
+    queue.push(POISON_REQUEST);
+    proc.run(queue);
+
+    // The shared worker only sent the duplications of the first destination, the others are queued
+    CPPUNIT_ASSERT_EQUAL((unsigned int)5, proc.getDuplicatedCount());
+    CPPUNIT_ASSERT_EQUAL((size_t)1, proc.mDestinationPools.size());
+
+    // Until the destination workers start
+    proc.startDestinationPools("test");
+    unsigned int lSent = 0;
+    for (int i = 0; i < 50 && lSent < 5; ++i) {
+        usleep(100000);
+        lSent += proc.getDuplicatedCount();
+    }
+    CPPUNIT_ASSERT_EQUAL((unsigned int)5, lSent);
+    proc.stopDestinationPools();
+}
+
+void TestRequestProcessor::testRateLimit() {
+    RequestProcessor proc;
+
+    DupConf conf;
+    conf.currentApplicationScope = ApplicationScope::ALL;
+    conf.currentDupDestination = "localhost:1";
+    proc.addFilter("/spp/main", "SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+    conf.currentDupDestination = "localhost:2";
+    proc.addFilter("/spp/main", "SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+    // Only the second destination is limited, set after its filters
+    proc.setRateLimit("localhost:2", 1, 3);
+
+    unsigned int lSecond = 0;
+    for (int i = 0; i < 10; ++i) {
+        boost::shared_ptr<RequestInfo> lRequest(new RequestInfo(std::string("42"),"/spp/main", "/spp/main", "SID=mySid"));
+        std::list<tDuplication> lDuplications;
+        proc.prepareDuplications(lRequest, lDuplications);
+        BOOST_FOREACH(const tDuplication &lDuplication, lDuplications) {
+            lSecond += lDuplication.mFilter->mDestination == "localhost:2";
+        }
+    }
+    CPPUNIT_ASSERT_EQUAL((unsigned int)3, lSecond);
+    CPPUNIT_ASSERT_EQUAL((unsigned int)7, proc.getRateLimitedCount());
+    CPPUNIT_ASSERT_EQUAL((unsigned int)0, proc.getRateLimitedCount());
+}
+
+/// @brief Count the requests with the given query, body and header which are duplicated to a destination
+static unsigned int
+countSampled(RequestProcessor &proc, const std::string &pId, const std::string &pArgs, const std::string &pBody,
+        const std::string &pHeader, int pTimes) {
+    unsigned int lCount = 0;
+    for (int i = 0; i < pTimes; ++i) {
+        boost::shared_ptr<RequestInfo> lRequest(new RequestInfo(pId, "/spp/main", "/spp/main", pArgs));
+        lRequest->mBody = pBody;
+        lRequest->mHeadersIn.push_back(std::make_pair("X-User", pHeader));
+        std::list<tDuplication> lDuplications;
+        proc.prepareDuplications(lRequest, lDuplications);
+        lCount += lDuplications.size();
+    }
+    return lCount;
+}
+
+void TestRequestProcessor::testSamplingKey() {
+    RequestProcessor proc;
+    DupConf conf;
+    conf.currentApplicationScope = ApplicationScope::ALL;
+    conf.currentDupDestination = "localhost:1";
+    proc.addRawFilter("/spp/main", ".*", conf, tFilter::eFilterTypes::REGULAR);
+    proc.setDestinationDuplicationPercentage("/spp/main", "localhost:1", 30);
+
+    // The buckets are stable and spread evenly
+    CPPUNIT_ASSERT_EQUAL(Commands::samplingBucket("user42"), Commands::samplingBucket("user42"));
+    unsigned int lBuckets[100] = {0};
+    for (int i = 0; i < 10000; ++i) {
+        unsigned int lBucket = Commands::samplingBucket("user" + boost::lexical_cast<std::string>(i));
+        CPPUNIT_ASSERT(lBucket < 100);
+        lBuckets[lBucket]++;
+    }
+    for (int i = 0; i < 100; ++i) {
+        CPPUNIT_ASSERT(lBuckets[i] > 50 && lBuckets[i] < 150);
+    }
+
+    // A given user is always or never duplicated, whatever the case of the parameter
+    proc.setDestinationSamplingKey("/spp/main", "localhost:1", SamplingKey::ARG, "userId");
+    unsigned int lUsers = 0;
+    for (int i = 0; i < 200; ++i) {
+        std::string lArgs = "USERID=user" + boost::lexical_cast<std::string>(i) + "&x=y";
+        unsigned int lCount = countSampled(proc, "42", lArgs, "", "", 5);
+        CPPUNIT_ASSERT(lCount == 0 || lCount == 5);
+        lUsers += lCount / 5;
+    }
+    CPPUNIT_ASSERT(lUsers > 30 && lUsers < 90);
+    // The key can be in the body, it is decoded before being hashed
+    std::string lSampled;
+    for (int i = 0; lSampled.empty(); ++i) {
+        std::string lUser = "user@" + boost::lexical_cast<std::string>(i);
+        if (Commands::samplingBucket(lUser) < 30) {
+            lSampled = lUser;
+        }
+    }
+    CPPUNIT_ASSERT_EQUAL(10u, countSampled(proc, "42", "x=y", "userid=" + lSampled.replace(4, 1, "%40"), "", 10));
+
+    // Headers, the name is case insensitive
+    proc.setDestinationSamplingKey("/spp/main", "localhost:1", SamplingKey::HEADER, "x-user");
+    unsigned int lHeaderCount = countSampled(proc, "42", "x=y", "", "user1", 5);
+    CPPUNIT_ASSERT_EQUAL(Commands::samplingBucket("user1") < 30 ? 5u : 0u, lHeaderCount);
+
+    // UNIQUE_ID
+    proc.setDestinationSamplingKey("/spp/main", "localhost:1", SamplingKey::UNIQUE_ID, "");
+    unsigned int lIdCount = countSampled(proc, "my-unique-id", "x=y", "", "", 5);
+    CPPUNIT_ASSERT_EQUAL(Commands::samplingBucket("my-unique-id") < 30 ? 5u : 0u, lIdCount);
+}
+
+void TestRequestProcessor::testFanOut() {
+    RequestProcessor proc;
+    MultiThreadQueue<boost::shared_ptr<RequestInfo> > queue;
+    proc.setTimeout(1000);
+
+    DupConf conf;
+    conf.currentApplicationScope = ApplicationScope::ALL;
+    for (int i = 1; i <= 3; ++i) {
+        conf.currentDupDestination = "localhost:" + boost::lexical_cast<std::string>(i);
+        proc.addFilter("/spp/main", "SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+    }
+    proc.addSubstitution("/spp/main", "SID", "my", "your", conf);
+
+    // Only the last destination gets an overlay of the request
+    boost::shared_ptr<RequestInfo> lRequest(new RequestInfo(std::string("42"),"/spp/main", "/spp/main", "SID=mySid"));
+    std::list<tDuplication> lDuplications;
+    proc.prepareDuplications(lRequest, lDuplications);
+    CPPUNIT_ASSERT_EQUAL((size_t)3, lDuplications.size());
+    BOOST_FOREACH(const tDuplication &lDuplication, lDuplications) {
+        CPPUNIT_ASSERT(lDuplication.mRequest == lRequest);
+        CPPUNIT_ASSERT_EQUAL(lDuplication.mFilter->mDestination == "localhost:3", !!lDuplication.mSubstituted);
+    }
+
+    // All the duplications are sent by the same call, the transfers are kept for the next request
+    RequestInfo ri(std::string("42"),"/spp/main", "/spp/main", "SID=mySid");
+    proc.runOne(ri);
+    CPPUNIT_ASSERT_EQUAL((unsigned int)3, proc.getDuplicatedCount());
+    CPPUNIT_ASSERT(proc.mThreadFanOut.get());
+    CPPUNIT_ASSERT_EQUAL((size_t)3, proc.mThreadFanOut->mTransfers.size());
+    proc.runOne(ri);
+    CPPUNIT_ASSERT_EQUAL((unsigned int)3, proc.getDuplicatedCount());
+    CPPUNIT_ASSERT_EQUAL((size_t)3, proc.mThreadFanOut->mTransfers.size());
+    // The handles are back in the pool of their destination
+    CPPUNIT_ASSERT_EQUAL((size_t)1, proc.mConnectionPool.getIdleCount("localhost:1"));
+    CPPUNIT_ASSERT_EQUAL((size_t)1, proc.mConnectionPool.getIdleCount("localhost:3"));
+
+    // The pool limits hold for the fan out: no duplication to a destination whose handles are all busy
+    proc.setConnectionLimits(4, 1, 0);
+    CURL *lBusy = proc.mConnectionPool.acquire("localhost:2");
+    proc.runOne(ri);
+    CPPUNIT_ASSERT_EQUAL((unsigned int)2, proc.getDuplicatedCount());
+    CPPUNIT_ASSERT_EQUAL((unsigned int)1, proc.getConnectionLimitedCount());
+    proc.mConnectionPool.release("localhost:2", lBusy);
+    proc.setConnectionLimits(4, 0, 0);
+
+    // Same from the workers, the destinations with their own workers excluded
+    proc.setDestinationThreads("localhost:3", 1, 1);
+    for (int i = 0; i < 4; ++i) {
+        queue.push(boost::shared_ptr<RequestInfo>(new RequestInfo(std::string("42"),"/spp/main", "/spp/main", "SID=mySid")));
+    }
+    queue.push(POISON_REQUEST);
+    proc.run(queue);
+    CPPUNIT_ASSERT_EQUAL((unsigned int)8, proc.getDuplicatedCount());
+}
+
 void TestRequestProcessor::testKeySubstitutionOnBody()
 {
     RequestProcessor proc;
@@ -644,8 +962,8 @@ void TestRequestProcessor::testKeySubstitutionOnBody()
     ri.mBody = "key1=what??&titi=value";
 
 
-    std::list<std::pair<std::string, std::string> > lParsedArgs;
-    proc.parseArgs(lParsedArgs, ri.mArgs);
+    tRequestArgs lParsedArgs;
+    proc.parseArgs(lParsedArgs, ri);
     std::list<const tFilter *> matches = proc.processRequest(ri, lParsedArgs);
     CPPUNIT_ASSERT(!matches.empty());
     const tFilter *match = *matches.begin();
@@ -672,8 +990,8 @@ void TestRequestProcessor::testMultiDestination() {
         proc.addFilter("/match", "INFO", "myinfo", conf, tFilter::eFilterTypes::REGULAR);
 
         RequestInfo ri = RequestInfo(std::string("42"),"/match", "/match/pws/titi/", "INFO=myinfo");
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         CPPUNIT_ASSERT_EQUAL(1, (int)proc.processRequest(ri, lParsedArgs).size());
     }
 
@@ -687,8 +1005,8 @@ void TestRequestProcessor::testMultiDestination() {
         proc.addFilter("/match", "INFO", "myinfo", conf, tFilter::eFilterTypes::REGULAR);
 
         RequestInfo ri = RequestInfo(std::string("42"),"/match", "/match/pws/titi/", "INFO=myinfo");
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         std::list<const tFilter *> ff = proc.processRequest(ri, lParsedArgs);
         CPPUNIT_ASSERT_EQUAL(2, (int)ff.size());
 
@@ -720,8 +1038,8 @@ void TestRequestProcessor::testMultiDestination() {
         proc.addFilter("/match", "NO", "dup", conf, tFilter::eFilterTypes::PREVENT_DUPLICATION);
 
         RequestInfo ri = RequestInfo(std::string("42"),"/match", "/match/pws/titi/", "INFO=myinfo&NO=dup");
-        std::list<std::pair<std::string, std::string> > lParsedArgs;
-        proc.parseArgs(lParsedArgs, ri.mArgs);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
         std::list<const tFilter *> ff = proc.processRequest(ri, lParsedArgs);
         CPPUNIT_ASSERT_EQUAL(1, (int)ff.size());
 
@@ -749,3 +1067,345 @@ int main(int argc, char* argv[])
     return !failed;
 }
 
+void TestRequestProcessor::testBatch() {
+    RequestProcessor proc;
+    MultiThreadQueue<boost::shared_ptr<RequestInfo> > queue;
+    proc.setBatch(8, 0);
+
+    DupConf conf;
+    conf.currentApplicationScope = ApplicationScope::ALL;
+    conf.currentDupDestination = "Honolulu:8080";
+    proc.addFilter("/spp/main", "SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+    conf.currentDupDestination = "Hikkaduwa:8090";
+    proc.addFilter("/spp/main", "SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+
+    // The worker exits once idle, with the retire item the queue hands it
+    queue.setRetirement(POISON_REQUEST, 0, 50);
+
+    // A single batch
+    for (int i = 0; i < 3; ++i) {
+        queue.push(boost::shared_ptr<RequestInfo>(new RequestInfo(std::string("42"),"/spp/main", "/spp/main", "SID=mySid")));
+    }
+    queue.push(boost::shared_ptr<RequestInfo>(new RequestInfo(std::string("43"),"/spp/main", "/spp/main", "SID=other")));
+    queue.addWorkers(1);
+    proc.run(queue);
+
+    // The requests of the batch are all sent before the worker exits
+    CPPUNIT_ASSERT_EQUAL((unsigned int)6, proc.getDuplicatedCount());
+    CPPUNIT_ASSERT_EQUAL((size_t)0, queue.size());
+
+    // Batches of one
+    proc.setBatch(1, 0);
+    queue.push(boost::shared_ptr<RequestInfo>(new RequestInfo(std::string("42"),"/spp/main", "/spp/main", "SID=mySid")));
+    queue.push(boost::shared_ptr<RequestInfo>(new RequestInfo(std::string("42"),"/spp/main", "/spp/main", "SID=mySid")));
+    queue.addWorkers(1);
+    proc.run(queue);
+    CPPUNIT_ASSERT_EQUAL((unsigned int)4, proc.getDuplicatedCount());
+    CPPUNIT_ASSERT_EQUAL((size_t)0, queue.size());
+
+    // A closed queue makes its workers exit at once
+    queue.close();
+    proc.run(queue);
+}
+
+void TestRequestProcessor::testMaxAge() {
+    RequestProcessor proc;
+    MultiThreadQueue<boost::shared_ptr<RequestInfo> > queue;
+
+    DupConf conf;
+    conf.currentApplicationScope = ApplicationScope::ALL;
+    conf.currentDupDestination = "Honolulu:8080";
+    proc.addFilter("/spp/main", "SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+
+    boost::shared_ptr<RequestInfo> lOld(new RequestInfo(std::string("42"),"/spp/main", "/spp/main", "SID=mySid"));
+    lOld->markEnqueued();
+    usleep(100000);
+    queue.push(lOld);
+    boost::shared_ptr<RequestInfo> lNew(new RequestInfo(std::string("43"),"/spp/main", "/spp/main", "SID=mySid"));
+    lNew->markEnqueued();
+    queue.push(lNew);
+    queue.push(POISON_REQUEST);
+
+    // Disabled by default
+    boost::posix_time::ptime lNow = boost::posix_time::microsec_clock::universal_time();
+    CPPUNIT_ASSERT(lOld->getQueuedTimeMS(lNow) >= 100);
+    CPPUNIT_ASSERT(!proc.isStale(*lOld));
+
+    // The old request is dropped before being matched
+    proc.setMaxAge(50);
+    proc.run(queue);
+    CPPUNIT_ASSERT_EQUAL((unsigned int)1, proc.getDuplicatedCount());
+    CPPUNIT_ASSERT_EQUAL((unsigned int)1, proc.getStaleCount());
+    CPPUNIT_ASSERT_EQUAL((unsigned int)0, proc.getStaleCount());
+
+    // Same in MULTI mode
+    proc.setSenderMode(SenderMode::MULTI, 4);
+    queue.push(lOld);
+    queue.push(POISON_REQUEST);
+    proc.run(queue);
+    CPPUNIT_ASSERT_EQUAL((unsigned int)0, proc.getDuplicatedCount());
+    CPPUNIT_ASSERT_EQUAL((unsigned int)1, proc.getStaleCount());
+}
+
+void TestRequestProcessor::testPlan()
+{
+    RequestProcessor proc;
+    DupConf conf;
+    conf.currentDupDestination = "Honolulu:8080";
+    conf.currentApplicationScope = ApplicationScope::HEADER;
+    proc.addFilter("/plan", "INFO", "header", conf, tFilter::eFilterTypes::REGULAR);
+    conf.currentApplicationScope = ApplicationScope::BODY;
+    proc.addFilter("/plan", "INFO", "body", conf, tFilter::eFilterTypes::REGULAR);
+    proc.addSubstitution("/plan", "INFO", "body", "BODY", conf);
+    conf.currentDupDestination = "Hikkaduwa:8090";
+    conf.currentApplicationScope = ApplicationScope::ALL;
+    proc.addFilter("/plan", "INFO", ".", conf, tFilter::eFilterTypes::REGULAR);
+    proc.addRawFilter("/plan", "nodup", conf, tFilter::eFilterTypes::PREVENT_DUPLICATION);
+    CommandsByDestination *lLocation = proc.getLocation("/plan");
+    proc.compile();
+
+    // The filters are split by scope and type
+    const tStringRef lInfo("info", 4);
+    Commands &lHonolulu = lLocation->mCommands.at("Honolulu:8080");
+    Commands &lHikkaduwa = lLocation->mCommands.at("Hikkaduwa:8090");
+    CPPUNIT_ASSERT_EQUAL((size_t)2, lLocation->mPlan.size());
+    CPPUNIT_ASSERT_EQUAL((size_t)1, lHonolulu.mKeyFilters[Commands::HEADER_INDEX][tFilter::REGULAR][lInfo].size());
+    CPPUNIT_ASSERT_EQUAL((size_t)1, lHonolulu.mKeyFilters[Commands::BODY_INDEX][tFilter::REGULAR][lInfo].size());
+    CPPUNIT_ASSERT(lHonolulu.mKeyFilters[Commands::HEADER_INDEX][tFilter::PREVENT_DUPLICATION].empty());
+    CPPUNIT_ASSERT(!lHonolulu.mKeySubstitutionsOn[Commands::HEADER_INDEX]);
+    CPPUNIT_ASSERT(lHonolulu.mKeySubstitutionsOn[Commands::BODY_INDEX]);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, lHikkaduwa.mKeyFilters[Commands::BODY_INDEX][tFilter::REGULAR][lInfo].size());
+    CPPUNIT_ASSERT_EQUAL((size_t)1, lHikkaduwa.mRawFiltersByType[tFilter::PREVENT_DUPLICATION].size());
+    CPPUNIT_ASSERT(lHikkaduwa.mRawFiltersByType[tFilter::REGULAR].empty());
+
+    {
+        // A request pointing to the plan matches as one looked up by its location, on the filters of the right scope
+        RequestInfo ri(std::string("42"), "/unknown", "/plan", "INFO=header");
+        ri.mCommands = lLocation;
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
+        std::list<const tFilter *> lMatched = proc.processRequest(ri, lParsedArgs);
+        CPPUNIT_ASSERT_EQUAL((size_t)2, lMatched.size());
+        BOOST_FOREACH(const tFilter *lFilter, lMatched) {
+            CPPUNIT_ASSERT(lFilter->mCommands == &lLocation->mCommands.at(lFilter->mDestination));
+        }
+        ri.mArgs = "INFO=body";
+        proc.parseArgs(lParsedArgs, ri);
+        CPPUNIT_ASSERT_EQUAL((size_t)1, proc.processRequest(ri, lParsedArgs).size());
+        ri.mCommands = NULL;
+        CPPUNIT_ASSERT(proc.processRequest(ri, lParsedArgs).empty());
+    }
+    {
+        // The raw prevent filter only applies to its destination
+        std::string lBody("INFO=body&nodup");
+        RequestInfo ri(std::string("42"), "/plan", "/plan", "", &lBody);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
+        std::list<const tFilter *> lMatched = proc.processRequest(ri, lParsedArgs);
+        CPPUNIT_ASSERT_EQUAL((size_t)1, lMatched.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("Honolulu:8080"), lMatched.front()->mDestination);
+        CPPUNIT_ASSERT(proc.substituteRequest(ri, lHonolulu, lParsedArgs));
+        CPPUNIT_ASSERT_EQUAL(std::string("INFO=BODY&NODUP"), ri.mBody);
+    }
+    {
+        // A directive read after the build of the plan gets in the next one
+        conf.currentDupDestination = "Honolulu:8080";
+        proc.addRawFilter("/plan", "nodup", conf, tFilter::eFilterTypes::PREVENT_DUPLICATION);
+        std::string lBody("INFO=body&nodup");
+        RequestInfo ri(std::string("42"), "/plan", "/plan", "", &lBody);
+        tRequestArgs lParsedArgs;
+        proc.parseArgs(lParsedArgs, ri);
+        CPPUNIT_ASSERT(proc.processRequest(ri, lParsedArgs).empty());
+    }
+}
+
+void TestRequestProcessor::testRawFilterSet()
+{
+    RequestProcessor proc;
+    DupConf conf;
+    conf.currentDupDestination = "Honolulu:8080";
+    conf.currentApplicationScope = ApplicationScope::BODY;
+    conf.setCurrentDuplicationType(DuplicationType::HEADER_ONLY);
+    for (int i = 0; i < 80; ++i) {
+        proc.addRawFilter("/set", "item(" + boost::lexical_cast<std::string>(i) + ")=x", conf, tFilter::eFilterTypes::REGULAR);
+    }
+    // Declared last but matching first in the body
+    conf.setCurrentDuplicationType(DuplicationType::COMPLETE_REQUEST);
+    conf.currentApplicationScope = ApplicationScope::ALL;
+    proc.addRawFilter("/set", "(?i)FIRST", conf, tFilter::eFilterTypes::REGULAR);
+    conf.currentApplicationScope = ApplicationScope::HEADER;
+    proc.addRawFilter("/set", "nodup|skip", conf, tFilter::eFilterTypes::PREVENT_DUPLICATION);
+    proc.addRawFilter("/set", "never", conf, tFilter::eFilterTypes::PREVENT_DUPLICATION);
+    proc.compile();
+    Commands &c = proc.mCommands.at("/set").mCommands.at("Honolulu:8080");
+    CPPUNIT_ASSERT_EQUAL((size_t)81, c.mRawFiltersByType[tFilter::REGULAR].size());
+
+    tRequestArgs lParsedArgs;
+    {
+        // The first declared filter matching wins, even when another one matches first in the text
+        std::string lBody("first&item42=x&item7=x");
+        RequestInfo ri(std::string("42"), "/set", "/set", "", &lBody);
+        const tFilter *lMatched = proc.argsMatchFilter(ri, c, lParsedArgs);
+        CPPUNIT_ASSERT(lMatched);
+        CPPUNIT_ASSERT_EQUAL(std::string("item(7)=x"), lMatched->mRegex.str());
+    }
+    {
+        std::string lBody("item80=x&First");
+        RequestInfo ri(std::string("42"), "/set", "/set", "", &lBody);
+        const tFilter *lMatched = proc.argsMatchFilter(ri, c, lParsedArgs);
+        CPPUNIT_ASSERT(lMatched);
+        CPPUNIT_ASSERT_EQUAL(DuplicationType::COMPLETE_REQUEST, lMatched->mDuplicationType);
+    }
+    {
+        // Out of its scope, a filter does not match
+        RequestInfo ri(std::string("42"), "/set", "/set", "item3=x");
+        CPPUNIT_ASSERT(!proc.argsMatchFilter(ri, c, lParsedArgs));
+    }
+    {
+        // The prevent filters take precedence
+        std::string lBody("item3=x");
+        RequestInfo ri(std::string("42"), "/set", "/set", "skip=1", &lBody);
+        CPPUNIT_ASSERT(!proc.argsMatchFilter(ri, c, lParsedArgs));
+        ri.mArgs = "keep=1";
+        CPPUNIT_ASSERT(proc.argsMatchFilter(ri, c, lParsedArgs));
+    }
+    {
+        // Matches overlapping the one found first count too, and the anchors still see the whole text
+        conf.currentApplicationScope = ApplicationScope::BODY;
+        proc.addRawFilter("/overlap", "bcd", conf, tFilter::eFilterTypes::REGULAR);
+        proc.addRawFilter("/overlap", "^cd", conf, tFilter::eFilterTypes::REGULAR);
+        proc.addRawFilter("/overlap", "abc|cd", conf, tFilter::eFilterTypes::REGULAR);
+        proc.compile();
+        Commands &lOverlap = proc.mCommands.at("/overlap").mCommands.at("Honolulu:8080");
+        std::string lBody("abcd");
+        RequestInfo ri(std::string("42"), "/overlap", "/overlap", "", &lBody);
+        const tFilter *lMatched = proc.argsMatchFilter(ri, lOverlap, lParsedArgs);
+        CPPUNIT_ASSERT(lMatched);
+        CPPUNIT_ASSERT_EQUAL(std::string("bcd"), lMatched->mRegex.str());
+        lBody = "xcd";
+        ri = RequestInfo(std::string("42"), "/overlap", "/overlap", "", &lBody);
+        lMatched = proc.argsMatchFilter(ri, lOverlap, lParsedArgs);
+        CPPUNIT_ASSERT(lMatched);
+        CPPUNIT_ASSERT_EQUAL(std::string("abc|cd"), lMatched->mRegex.str());
+    }
+    {
+        // A back reference cannot be combined: the filters get matched one by one, with the same results
+        conf.currentApplicationScope = ApplicationScope::BODY;
+        proc.addRawFilter("/set", "(a)\\1b", conf, tFilter::eFilterTypes::REGULAR);
+        std::string lBody("zaab&item79=x");
+        RequestInfo ri(std::string("42"), "/set", "/set", "", &lBody);
+        const tFilter *lMatched = proc.argsMatchFilter(ri, c, lParsedArgs);
+        CPPUNIT_ASSERT(lMatched);
+        CPPUNIT_ASSERT_EQUAL(std::string("item(79)=x"), lMatched->mRegex.str());
+        lBody = "zaab";
+        ri = RequestInfo(std::string("42"), "/set", "/set", "", &lBody);
+        lMatched = proc.argsMatchFilter(ri, c, lParsedArgs);
+        CPPUNIT_ASSERT(lMatched);
+        CPPUNIT_ASSERT_EQUAL(std::string("(a)\\1b"), lMatched->mRegex.str());
+    }
+}
+
+/// @brief Counts the values it decodes
+class tCountingCodec : public IUrlCodec {
+public:
+    const std::string decode(const std::string &pIn) const {
+        ++mDecoded;
+        return mCodec->decode(pIn);
+    }
+    const std::string encode(apr_pool_t *pPool, const std::string &pIn) const {
+        return mCodec->encode(pPool, pIn);
+    }
+    char *encode(const char *pIn, size_t pSize, char *pOut) const {
+        return mCodec->encode(pIn, pSize, pOut);
+    }
+    tCountingCodec() : mCodec(getUrlCodec()) {}
+    static unsigned int mDecoded;
+private:
+    const IUrlCodec *mCodec;
+};
+unsigned int tCountingCodec::mDecoded = 0;
+
+void TestRequestProcessor::testArgsCache()
+{
+    RequestProcessor proc;
+    proc.mUrlCodec.reset(new tCountingCodec());
+    DupConf conf;
+    conf.currentApplicationScope = ApplicationScope::BODY;
+    const char *lDestinations[] = { "Honolulu:8080", "Hikkaduwa:8090", "Hanoi:8070" };
+    BOOST_FOREACH(const char *lDestination, lDestinations) {
+        conf.currentDupDestination = lDestination;
+        proc.addFilter("/cache", "KEY", "va lue", conf, tFilter::eFilterTypes::REGULAR);
+        proc.addSubstitution("/cache", "KEY", "lue", "LUE", conf);
+    }
+
+    std::string lBody("other=x%20y&key=va%20lue");
+    RequestInfo ri(std::string("42"), "/cache", "/cache", "unused=a%20b", &lBody);
+    tRequestArgs lParsedArgs;
+    proc.parseArgs(lParsedArgs, ri);
+    tCountingCodec::mDecoded = 0;
+    std::list<const tFilter *> lMatched = proc.processRequest(ri, lParsedArgs);
+    CPPUNIT_ASSERT_EQUAL((size_t)3, lMatched.size());
+    // Only the value filtered got decoded, once for the three destinations
+    CPPUNIT_ASSERT_EQUAL(1u, tCountingCodec::mDecoded);
+
+    // The substitutions of each destination read the same parsed body, with the values decoded once
+    BOOST_FOREACH(const tFilter *lFilter, lMatched) {
+        RequestInfo lSubstituted(ri);
+        CPPUNIT_ASSERT(proc.substituteRequest(lSubstituted, *lFilter->mCommands, lParsedArgs));
+        CPPUNIT_ASSERT_EQUAL(std::string("OTHER=x%20y&KEY=va%20LUE"), lSubstituted.mBody);
+        CPPUNIT_ASSERT_EQUAL(std::string("unused=a%20b"), lSubstituted.mArgs);
+    }
+    CPPUNIT_ASSERT_EQUAL(2u, tCountingCodec::mDecoded);
+    CPPUNIT_ASSERT_EQUAL(std::string("other=x%20y&key=va%20lue"), ri.mBody);
+}
+
+void TestRequestProcessor::testOverlay()
+{
+    RequestProcessor proc;
+    DupConf conf;
+    conf.currentApplicationScope = ApplicationScope::ALL;
+    conf.setCurrentDuplicationType(DuplicationType::REQUEST_WITH_ANSWER);
+    conf.currentDupDestination = "localhost:1";
+    proc.addRawFilter("/overlay", ".", conf, tFilter::eFilterTypes::REGULAR);
+    conf.currentDupDestination = "localhost:2";
+    proc.addRawFilter("/overlay", ".", conf, tFilter::eFilterTypes::REGULAR);
+    conf.currentApplicationScope = ApplicationScope::HEADER;
+    proc.addSubstitution("/overlay", "SID", "my", "your", conf);
+    conf.currentDupDestination = "localhost:3";
+    proc.addRawFilter("/overlay", ".", conf, tFilter::eFilterTypes::REGULAR);
+    conf.currentApplicationScope = ApplicationScope::BODY;
+    proc.addRawSubstitution("/overlay", "body", "BODY", conf);
+
+    std::string lBody("mybody");
+    boost::shared_ptr<RequestInfo> lRequest(new RequestInfo(std::string("42"), "/overlay", "/overlay", "SID=mySid", &lBody));
+    lRequest->mAnswer = "TheAnswer";
+    std::list<tDuplication> lDuplications;
+    proc.prepareDuplications(lRequest, lDuplications);
+    CPPUNIT_ASSERT_EQUAL((size_t)3, lDuplications.size());
+
+    BOOST_FOREACH(const tDuplication &lDuplication, lDuplications) {
+        const tRequestView lView = lDuplication.request();
+        const std::string &lDestination = lDuplication.mFilter->mDestination;
+        // The fields not substituted are read from the original
+        CPPUNIT_ASSERT(&lView.original() == lRequest.get());
+        if (lDestination == "localhost:1") {
+            CPPUNIT_ASSERT(!lDuplication.mSubstituted);
+            CPPUNIT_ASSERT(&lView.args() == &lRequest->mArgs);
+            CPPUNIT_ASSERT(&lView.body() == &lRequest->mBody);
+        } else if (lDestination == "localhost:2") {
+            CPPUNIT_ASSERT_EQUAL(std::string("SID=yourSid"), lView.args());
+            CPPUNIT_ASSERT(&lView.body() == &lRequest->mBody);
+            CPPUNIT_ASSERT(lDuplication.mSubstituted->mBody.empty());
+        } else {
+            CPPUNIT_ASSERT(&lView.args() == &lRequest->mArgs);
+            CPPUNIT_ASSERT_EQUAL(std::string("myBODY"), lView.body());
+            // The dup format is streamed from the substituted body and the original answer
+            tDupFormatReader lReader;
+            lReader.reset(lView);
+            CPPUNIT_ASSERT_EQUAL(std::string("00000006myBODY0000000000000009TheAnswer"), readDupFormat(lReader));
+        }
+    }
+    // The original is left as it was received
+    CPPUNIT_ASSERT_EQUAL(std::string("SID=mySid"), lRequest->mArgs);
+    CPPUNIT_ASSERT_EQUAL(std::string("mybody"), lRequest->mBody);
+}
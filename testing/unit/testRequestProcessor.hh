@@ -36,11 +36,23 @@ class TestRequestProcessor :
     CPPUNIT_TEST(testFilterBasic);
     CPPUNIT_TEST(testRawSubstitution);
     CPPUNIT_TEST(testDupFormat);
+    CPPUNIT_TEST(testHeaders);
     CPPUNIT_TEST(testRequestInfo);
     CPPUNIT_TEST(testKeySubstitutionOnBody);
     CPPUNIT_TEST(testTimeout);
+    CPPUNIT_TEST(testRunMulti);
+    CPPUNIT_TEST(testDestinationPools);
+    CPPUNIT_TEST(testRateLimit);
+    CPPUNIT_TEST(testSamplingKey);
+    CPPUNIT_TEST(testFanOut);
+    CPPUNIT_TEST(testBatch);
+    CPPUNIT_TEST(testMaxAge);
     CPPUNIT_TEST(testFilterOnNotMatching);
     CPPUNIT_TEST(testMultiDestination);
+    CPPUNIT_TEST(testPlan);
+    CPPUNIT_TEST(testRawFilterSet);
+    CPPUNIT_TEST(testArgsCache);
+    CPPUNIT_TEST(testOverlay);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -54,6 +66,17 @@ public:
     void testRawSubstitution();
     void testRequestInfo();
     void testTimeout();
+
+    /**
+     * @brief Tests that the multi sender mode duplicates and accounts like the blocking one
+     */
+    void testRunMulti();
+    void testDestinationPools();
+    void testRateLimit();
+    void testSamplingKey();
+    void testFanOut();
+    void testBatch();
+    void testMaxAge();
     void testFilterOnNotMatching();
 
     /**
@@ -65,10 +88,31 @@ public:
      * Tests that the a duplicated request respects the dup format
      */
     void testDupFormat();
+    void testHeaders();
 
     /**
      * @brief Tests that a single request can be duplicated several times depending on the location
      */
     void testMultiDestination();
 
+    /**
+     * @brief Tests the execution plan built for each location
+     */
+    void testPlan();
+
+    /**
+     * @brief Tests the raw filters matched in a single scan
+     */
+    void testRawFilterSet();
+
+    /**
+     * @brief Tests that the arguments of a request are parsed and decoded once for all its destinations
+     */
+    void testArgsCache();
+
+    /**
+     * @brief Tests that the substitutions of a destination only hold the fields they rewrite
+     */
+    void testOverlay();
+
 };
@@ -0,0 +1,268 @@
+/*
+* mod_dup - duplicates apache requests
+* 
+* Copyright (C) 2013 Orange
+* 
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "Spool.hh"
+#include "testSpool.hh"
+
+#include <boost/lexical_cast.hpp>
+#include <unistd.h>
+
+// cppunit
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TestSpool );
+
+#define CPPUNIT_ASSERT_EQUAL_UINT(a, b) CPPUNIT_ASSERT_EQUAL(static_cast<unsigned int>(a), static_cast<unsigned int>(b))
+
+using namespace DupModule;
+
+/// @brief A path for a spool file of the test
+static std::string
+spoolPath(const std::string &pName) {
+    return "/tmp/testSpool." + boost::lexical_cast<std::string>(getpid()) + "." + pName;
+}
+
+/// @brief The class of a request of the test: the first letter of its id, a or b
+static size_t
+classOfId(const boost::shared_ptr<RequestInfo> &pRequest) {
+    return pRequest->mId[0] == 'b' ? 1 : 0;
+}
+
+/// @brief A request of the test
+static boost::shared_ptr<RequestInfo>
+request(const std::string &pId) {
+    return boost::shared_ptr<RequestInfo>(new RequestInfo(pId, "/a", "/b", ""));
+}
+
+void TestSpool::testFifo()
+{
+    Spool lSpool;
+    std::string lRecord;
+    CPPUNIT_ASSERT(!lSpool.push("not open"));
+    CPPUNIT_ASSERT(!lSpool.pop(lRecord));
+
+    CPPUNIT_ASSERT(lSpool.open(spoolPath("fifo"), 64));
+    // Unlinked as soon as open
+    CPPUNIT_ASSERT(access(spoolPath("fifo").c_str(), F_OK) != 0);
+
+    // Read back in order, up to the size of the file
+    CPPUNIT_ASSERT(lSpool.push(std::string(20, 'a')));
+    CPPUNIT_ASSERT(lSpool.push(""));
+    CPPUNIT_ASSERT(lSpool.push(std::string(20, 'b')));
+    CPPUNIT_ASSERT(!lSpool.push(std::string(20, 'c')));
+    CPPUNIT_ASSERT_EQUAL_UINT(3, lSpool.size());
+    CPPUNIT_ASSERT_EQUAL_UINT(52, lSpool.getBytes());
+    CPPUNIT_ASSERT(lSpool.pop(lRecord));
+    CPPUNIT_ASSERT_EQUAL(std::string(20, 'a'), lRecord);
+
+    // Append only: the space of the records read is not reused until drained
+    CPPUNIT_ASSERT(!lSpool.push(std::string(20, 'c')));
+    CPPUNIT_ASSERT(lSpool.pop(lRecord));
+    CPPUNIT_ASSERT_EQUAL(std::string(), lRecord);
+    CPPUNIT_ASSERT(lSpool.pop(lRecord));
+    CPPUNIT_ASSERT_EQUAL(std::string(20, 'b'), lRecord);
+    CPPUNIT_ASSERT(!lSpool.pop(lRecord));
+    CPPUNIT_ASSERT_EQUAL_UINT(0, lSpool.getBytes());
+    CPPUNIT_ASSERT(lSpool.push(std::string(60, 'c')));
+    CPPUNIT_ASSERT(lSpool.pop(lRecord));
+    CPPUNIT_ASSERT_EQUAL(std::string(60, 'c'), lRecord);
+
+    lSpool.close();
+    CPPUNIT_ASSERT(!lSpool.push("closed"));
+
+    // The directory must exist
+    CPPUNIT_ASSERT(!lSpool.open("/nonexistent/spool", 64));
+}
+
+void TestSpool::testRequests()
+{
+    RequestSpool lSpool;
+    CPPUNIT_ASSERT(lSpool.open(spoolPath("requests"), 1024 * 1024));
+
+    boost::shared_ptr<RequestInfo> lRequest(new RequestInfo(std::string("42"), "/spp/main", "/spp/main?x=1", "x=1"));
+    lRequest->mBody = std::string("body\0with a zero", 16);
+    lRequest->mAnswer = "answer";
+    lRequest->mHeadersIn.push_back(std::make_pair(std::string("Content-Type"), std::string("text/plain")));
+    lRequest->mHeadersIn.push_back(std::make_pair(std::string("X-Dup"), std::string("")));
+    lRequest->mResponseHeader["Status"] = "200";
+    lRequest->mReqHttpStatus = 201;
+    lRequest->eos_seen(true);
+    lRequest->markEnqueued();
+    boost::posix_time::ptime lNow = boost::posix_time::microsec_clock::universal_time();
+
+    CPPUNIT_ASSERT(lSpool.spill(lRequest));
+    CPPUNIT_ASSERT(lSpool.spill(boost::shared_ptr<RequestInfo>(new RequestInfo(std::string("43"), "/a", "/b", ""))));
+    CPPUNIT_ASSERT_EQUAL_UINT(2, lSpool.size());
+
+    // Everything is read back, the time it was queued at included
+    boost::shared_ptr<RequestInfo> lRead;
+    CPPUNIT_ASSERT(lSpool.unspill(lRead));
+    CPPUNIT_ASSERT(lRead != lRequest);
+    CPPUNIT_ASSERT_EQUAL(std::string("42"), lRead->mId);
+    CPPUNIT_ASSERT_EQUAL(std::string("/spp/main"), lRead->mConfPath);
+    CPPUNIT_ASSERT_EQUAL(std::string("/spp/main?x=1"), lRead->mPath);
+    CPPUNIT_ASSERT_EQUAL(std::string("x=1"), lRead->mArgs);
+    CPPUNIT_ASSERT_EQUAL(lRequest->mBody, lRead->mBody);
+    CPPUNIT_ASSERT_EQUAL(std::string("answer"), lRead->mAnswer);
+    CPPUNIT_ASSERT(lRequest->mHeadersIn == lRead->mHeadersIn);
+    CPPUNIT_ASSERT(lRequest->mResponseHeader == lRead->mResponseHeader);
+    CPPUNIT_ASSERT_EQUAL(201, lRead->mReqHttpStatus);
+    CPPUNIT_ASSERT(lRead->eos_seen());
+    CPPUNIT_ASSERT(!lRead->isPoison());
+    CPPUNIT_ASSERT_EQUAL(lRequest->getElapsedTimeMS(), lRead->getElapsedTimeMS());
+    CPPUNIT_ASSERT_EQUAL(lRequest->getQueuedTimeMS(lNow), lRead->getQueuedTimeMS(lNow));
+
+    CPPUNIT_ASSERT(lSpool.unspill(lRead));
+    CPPUNIT_ASSERT_EQUAL(std::string("43"), lRead->mId);
+    CPPUNIT_ASSERT(!lSpool.unspill(lRead));
+
+    // Truncated records are refused
+    std::string lRecord;
+    lRequest->toSpool(lRecord);
+    RequestInfo lTruncated(std::string(""));
+    CPPUNIT_ASSERT(lTruncated.fromSpool(lRecord));
+    CPPUNIT_ASSERT(!lTruncated.fromSpool(lRecord.substr(0, lRecord.size() - 1)));
+}
+
+void TestSpool::testOverflow()
+{
+    unsigned lInCount, lOutCount, lDropCount;
+    MultiThreadQueue<boost::shared_ptr<RequestInfo> > lQueue;
+    RequestSpool lSpool;
+    CPPUNIT_ASSERT(lSpool.open(spoolPath("overflow"), 4096));
+    lQueue.setDropSize(4);
+    lQueue.setOverflow(&lSpool);
+
+    // The requests a full queue would drop go to the spool, until it is full too
+    for (int i = 0; i < 200; ++i) {
+        lQueue.push(boost::shared_ptr<RequestInfo>(new RequestInfo(boost::lexical_cast<std::string>(i), "/a", "/b", "")));
+    }
+    lQueue.getCounters(lInCount, lOutCount, lDropCount);
+    size_t lSpilled = lSpool.size();
+    CPPUNIT_ASSERT(lSpilled > 4 && lSpilled < 196);
+    CPPUNIT_ASSERT_EQUAL_UINT(lSpilled, lQueue.getSpillCount());
+    CPPUNIT_ASSERT_EQUAL_UINT(4 + lSpilled, lInCount);
+    CPPUNIT_ASSERT_EQUAL_UINT(200, lInCount + lDropCount);
+    CPPUNIT_ASSERT_EQUAL_UINT(4 + lSpilled, lQueue.size());
+
+    // Popped in order: the queue first, then the spool
+    for (size_t i = 0; i < 4 + lSpilled; ++i) {
+        CPPUNIT_ASSERT_EQUAL(boost::lexical_cast<std::string>(i), lQueue.pop()->mId);
+    }
+    CPPUNIT_ASSERT_EQUAL_UINT(0, lQueue.size());
+
+    // Drained: its space is reused, and the new requests follow the spooled ones
+    for (int i = 0; i < 10; ++i) {
+        lQueue.push(boost::shared_ptr<RequestInfo>(new RequestInfo(boost::lexical_cast<std::string>(i), "/a", "/b", "")));
+    }
+    CPPUNIT_ASSERT_EQUAL_UINT(6, lSpool.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("0"), lQueue.pop()->mId);
+    lQueue.push(boost::shared_ptr<RequestInfo>(new RequestInfo(std::string("late"), "/a", "/b", "")));
+    CPPUNIT_ASSERT_EQUAL_UINT(7, lSpool.size());
+    for (int i = 1; i < 10; ++i) {
+        CPPUNIT_ASSERT_EQUAL(boost::lexical_cast<std::string>(i), lQueue.pop()->mId);
+    }
+    CPPUNIT_ASSERT_EQUAL(std::string("late"), lQueue.pop()->mId);
+    CPPUNIT_ASSERT_EQUAL_UINT(0, lQueue.size());
+
+    // Back to the queue
+    lQueue.push(boost::shared_ptr<RequestInfo>(new RequestInfo(std::string("next"), "/a", "/b", "")));
+    CPPUNIT_ASSERT_EQUAL_UINT(0, lSpool.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("next"), lQueue.pop()->mId);
+}
+
+void TestSpool::testOverflowFull()
+{
+    unsigned lInCount, lOutCount, lDropCount;
+    MultiThreadQueue<boost::shared_ptr<RequestInfo> > lQueue;
+    RequestSpool lSpool;
+    CPPUNIT_ASSERT(lSpool.open(spoolPath("overflow_full"), 4096));
+    lQueue.setDropSize(4);
+    lQueue.setOverflow(&lSpool);
+
+    // The queue and the spool full
+    for (int i = 0; i < 200; ++i) {
+        lQueue.push(boost::shared_ptr<RequestInfo>(new RequestInfo(boost::lexical_cast<std::string>(i), "/a", "/b", "")));
+    }
+    size_t lSpilled = lSpool.size();
+    for (size_t i = 0; i < 4; ++i) {
+        CPPUNIT_ASSERT_EQUAL(boost::lexical_cast<std::string>(i), lQueue.pop()->mId);
+    }
+    CPPUNIT_ASSERT_EQUAL_UINT(lSpilled, lQueue.size());
+    lQueue.getCounters(lInCount, lOutCount, lDropCount);
+
+    // The spool still full, the queue takes the requests its empty ring has room for rather than dropping them
+    for (int i = 0; i < 5; ++i) {
+        lQueue.push(boost::shared_ptr<RequestInfo>(new RequestInfo(std::string("new") + boost::lexical_cast<std::string>(i), "/a", "/b", "")));
+    }
+    lQueue.getCounters(lInCount, lOutCount, lDropCount);
+    CPPUNIT_ASSERT_EQUAL_UINT(4, lInCount);
+    CPPUNIT_ASSERT_EQUAL_UINT(1, lDropCount);
+    CPPUNIT_ASSERT_EQUAL_UINT(lSpilled, lSpool.size());
+
+    // Served before the spooled ones
+    for (int i = 0; i < 4; ++i) {
+        CPPUNIT_ASSERT_EQUAL(std::string("new") + boost::lexical_cast<std::string>(i), lQueue.pop()->mId);
+    }
+    CPPUNIT_ASSERT_EQUAL(boost::lexical_cast<std::string>(4), lQueue.pop()->mId);
+}
+
+void TestSpool::testOverflowClasses()
+{
+    MultiThreadQueue<boost::shared_ptr<RequestInfo> > lQueue;
+    RequestSpool lSpool;
+    CPPUNIT_ASSERT(lSpool.open(spoolPath("overflow_classes"), 4096));
+    std::vector<std::string> lNames;
+    lNames.push_back("a");
+    lNames.push_back("b");
+    lQueue.setClasses(lNames, std::vector<unsigned int>(2, 1), &classOfId);
+    lQueue.setDropSize(4);
+    lQueue.setOverflow(&lSpool);
+
+    // A class flooding the queue gets spooled
+    for (int i = 0; i < 20; ++i) {
+        lQueue.push(request("a" + boost::lexical_cast<std::string>(i)));
+    }
+    CPPUNIT_ASSERT_EQUAL_UINT(16, lSpool.size());
+
+    // The other one keeps its share of the queue, then follows its own spooled requests
+    for (int i = 0; i < 4; ++i) {
+        lQueue.push(request("b" + boost::lexical_cast<std::string>(i)));
+    }
+    CPPUNIT_ASSERT_EQUAL_UINT(18, lSpool.size());
+    CPPUNIT_ASSERT_EQUAL_UINT(0, lQueue.getClassDropCount(0));
+    CPPUNIT_ASSERT_EQUAL_UINT(0, lQueue.getClassDropCount(1));
+
+    // The classes in turn, then the spool in order
+    const char *lExpected[] = {"b0", "a0", "b1", "a1", "a2", "a3"};
+    for (size_t i = 0; i < 6; ++i) {
+        CPPUNIT_ASSERT_EQUAL(std::string(lExpected[i]), lQueue.pop()->mId);
+    }
+    for (int i = 4; i < 20; ++i) {
+        CPPUNIT_ASSERT_EQUAL("a" + boost::lexical_cast<std::string>(i), lQueue.pop()->mId);
+    }
+    CPPUNIT_ASSERT_EQUAL(std::string("b2"), lQueue.pop()->mId);
+    CPPUNIT_ASSERT_EQUAL(std::string("b3"), lQueue.pop()->mId);
+
+    // Drained: back to the rings
+    lQueue.push(request("b4"));
+    CPPUNIT_ASSERT_EQUAL_UINT(0, lSpool.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("b4"), lQueue.pop()->mId);
+}
@@ -17,6 +17,9 @@
 */
 
 #include <httpd.h>
+#include <fstream>
+#include <sched.h>
+#include <sys/stat.h>
 
 #include "ThreadPool.hh"
 #include "MultiThreadQueue.hh"
@@ -68,7 +71,7 @@ void TestThreadPool::run()
 	for (int i=0; i<1000; ++i)
 		pool.push(2000);
 
-	pool.setQueue(1, 2);
+	pool.setQueue(2);
 	pool.setThreads(1, 4);
 
 	CPPUNIT_ASSERT_EQUAL(0, count);
@@ -86,6 +89,129 @@ void TestThreadPool::run()
 	pool.stop();
 }
 
+void TestThreadPool::testBurst()
+{
+	ThreadPool<int> pool(&worker, POISON);
+	pool.setQueue(50);
+	pool.setThreads(1, 8);
+	pool.setIdleTimeout(200);
+	pool.start();
+	usleep(200000);
+	CPPUNIT_ASSERT_EQUAL_UINT(1, pool.getThreadCount());
+
+	// A burst gets all the threads it needs at once, without waiting for the next check
+	count = 0;
+	for (int i=0; i<400; ++i)
+		pool.push(5000);
+	usleep(20000);
+	CPPUNIT_ASSERT_EQUAL_UINT(8, pool.getThreadCount());
+
+	// Once the smoothed arrival rate decays, the idle threads exit on their own, no item is lost to make them exit
+	usleep(1500000);
+	CPPUNIT_ASSERT_EQUAL(400, count);
+	CPPUNIT_ASSERT_EQUAL_UINT(1, pool.getThreadCount());
+
+	pool.stop();
+	CPPUNIT_ASSERT_EQUAL_UINT(0, pool.getThreadCount());
+}
+
+/// @brief The scheduling class the last worker ran in
+volatile int gWorkerPolicy = -1;
+
+void policyWorker(MultiThreadQueue<int> &queue)
+{
+	while (queue.pop() != POISON) {
+		gWorkerPolicy = sched_getscheduler(0);
+	}
+}
+
+/// @brief Write a file of a fake cgroup file system
+static void
+writeCgroupFile(const std::string &pPath, const std::string &pContent)
+{
+	std::ofstream lFile(pPath.c_str());
+	lFile << pContent << std::endl;
+}
+
+void TestThreadPool::testCpuPolicy()
+{
+	CpuPolicy lPolicy;
+	CPPUNIT_ASSERT_EQUAL(0, lPolicy.getCpuCount());
+	CPPUNIT_ASSERT(lPolicy.setAffinity("0-3,6"));
+	CPPUNIT_ASSERT_EQUAL(5, lPolicy.getCpuCount());
+	CPPUNIT_ASSERT(!lPolicy.setAffinity("3-1"));
+	CPPUNIT_ASSERT(!lPolicy.setAffinity("one"));
+	CPPUNIT_ASSERT(!lPolicy.setAffinity(""));
+	CPPUNIT_ASSERT_EQUAL(5, lPolicy.getCpuCount());
+	CPPUNIT_ASSERT(!lPolicy.setNice(20));
+	CPPUNIT_ASSERT(!lPolicy.setNice(-5));
+	CPPUNIT_ASSERT(lPolicy.setNice(5));
+
+	// CPU quotas at the root, v2 then v1, as in a cgroup namespace
+	std::string lRoot = "/tmp/testCgroup." + boost::lexical_cast<std::string>(getpid());
+	std::string lProc = lRoot + "/self.cgroup";
+	mkdir(lRoot.c_str(), 0700);
+	mkdir((lRoot + "/cpu").c_str(), 0700);
+	CPPUNIT_ASSERT_EQUAL(0.0, CpuPolicy::getCpuQuota(lRoot, lProc));
+	CPPUNIT_ASSERT_EQUAL_UINT(10, CpuPolicy::scaleThreads(10, lRoot, lProc));
+	writeCgroupFile(lRoot + "/cpu/cpu.cfs_quota_us", "-1");
+	writeCgroupFile(lRoot + "/cpu/cpu.cfs_period_us", "100000");
+	CPPUNIT_ASSERT_EQUAL(0.0, CpuPolicy::getCpuQuota(lRoot, lProc));
+	writeCgroupFile(lRoot + "/cpu/cpu.cfs_quota_us", "50000");
+	CPPUNIT_ASSERT_EQUAL(0.5, CpuPolicy::getCpuQuota(lRoot, lProc));
+	// In proportion to the online CPUs
+	long lOnline = sysconf(_SC_NPROCESSORS_ONLN);
+	CPPUNIT_ASSERT_EQUAL_UINT(std::ceil(10 * 0.5 / lOnline), CpuPolicy::scaleThreads(10, lRoot, lProc));
+	writeCgroupFile(lRoot + "/cpu.max", "max 100000");
+	CPPUNIT_ASSERT_EQUAL(0.0, CpuPolicy::getCpuQuota(lRoot, lProc));
+	writeCgroupFile(lRoot + "/cpu.max", "150000 100000");
+	CPPUNIT_ASSERT_EQUAL(1.5, CpuPolicy::getCpuQuota(lRoot, lProc));
+
+	// The cgroup of the process, v2: the lowest quota of the cgroup and of its parents
+	mkdir((lRoot + "/app").c_str(), 0700);
+	mkdir((lRoot + "/app/worker").c_str(), 0700);
+	writeCgroupFile(lProc, "0::/app/worker");
+	writeCgroupFile(lRoot + "/app/worker/cpu.max", "max 100000");
+	CPPUNIT_ASSERT_EQUAL(1.5, CpuPolicy::getCpuQuota(lRoot, lProc));
+	writeCgroupFile(lRoot + "/app/cpu.max", "100000 100000");
+	CPPUNIT_ASSERT_EQUAL(1.0, CpuPolicy::getCpuQuota(lRoot, lProc));
+	writeCgroupFile(lRoot + "/app/worker/cpu.max", "25000 100000");
+	CPPUNIT_ASSERT_EQUAL(0.25, CpuPolicy::getCpuQuota(lRoot, lProc));
+	// v1: the cgroup of the cpu controller, the v1 files only
+	mkdir((lRoot + "/cpu/app").c_str(), 0700);
+	writeCgroupFile(lProc, "3:cpu,cpuacct:/app\n2:memory:/other\n0::/app/worker");
+	CPPUNIT_ASSERT_EQUAL(0.5, CpuPolicy::getCpuQuota(lRoot, lProc));
+	writeCgroupFile(lRoot + "/cpu/app/cpu.cfs_quota_us", "20000");
+	writeCgroupFile(lRoot + "/cpu/app/cpu.cfs_period_us", "100000");
+	CPPUNIT_ASSERT_EQUAL(0.2, CpuPolicy::getCpuQuota(lRoot, lProc));
+
+	const char *lFiles[] = { "/cpu/app/cpu.cfs_quota_us", "/cpu/app/cpu.cfs_period_us", "/cpu/cpu.cfs_quota_us",
+	                         "/cpu/cpu.cfs_period_us", "/app/worker/cpu.max", "/app/cpu.max", "/cpu.max", "/self.cgroup" };
+	for (size_t i = 0; i < sizeof(lFiles) / sizeof(*lFiles); ++i) {
+		unlink((lRoot + lFiles[i]).c_str());
+	}
+	const char *lDirs[] = { "/cpu/app", "/cpu", "/app/worker", "/app", "" };
+	for (size_t i = 0; i < sizeof(lDirs) / sizeof(*lDirs); ++i) {
+		rmdir((lRoot + lDirs[i]).c_str());
+	}
+
+	// Applied by the workers, not by the thread starting the pool
+	ThreadPool<int> pool(&policyWorker, POISON);
+	CpuPolicy lIdle;
+	CPPUNIT_ASSERT(lIdle.setAffinity("0"));
+	lIdle.setIdle();
+	pool.setCpuPolicy(lIdle);
+	pool.setThreads(1, 1);
+	pool.start();
+	pool.push(1);
+	for (int i = 0; i < 100 && gWorkerPolicy == -1; ++i) {
+		usleep(10000);
+	}
+	pool.stop();
+	CPPUNIT_ASSERT_EQUAL(SCHED_IDLE, static_cast<int>(gWorkerPolicy));
+	CPPUNIT_ASSERT(sched_getscheduler(0) != SCHED_IDLE);
+}
+
 #ifdef UNIT_TESTING
 //--------------------------------------
 // the main method
@@ -30,8 +30,12 @@ class TestThreadPool :
 
     CPPUNIT_TEST_SUITE(TestThreadPool);
     CPPUNIT_TEST(run);
+    CPPUNIT_TEST(testBurst);
+    CPPUNIT_TEST(testCpuPolicy);
     CPPUNIT_TEST_SUITE_END();
 
 public:
     void run();
+    void testBurst();
+    void testCpuPolicy();
 };
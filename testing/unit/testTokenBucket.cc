@@ -0,0 +1,114 @@
+/*
+* mod_dup - duplicates apache requests
+* 
+* Copyright (C) 2013 Orange
+* 
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "TokenBucket.hh"
+#include "testTokenBucket.hh"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+// cppunit
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TestTokenBucket );
+
+#define CPPUNIT_ASSERT_EQUAL_UINT(a, b) CPPUNIT_ASSERT_EQUAL(static_cast<unsigned int>(a), static_cast<unsigned int>(b))
+
+using namespace DupModule;
+
+static const uint64_t cSecond = 1000000000ULL;
+
+void TestTokenBucket::testUnlimited()
+{
+    TokenBucket lBucket;
+    for (int i = 0; i < 1000; ++i) {
+        CPPUNIT_ASSERT(lBucket.tryTake(0));
+        CPPUNIT_ASSERT(lBucket.tryTake());
+    }
+}
+
+void TestTokenBucket::testRate()
+{
+    TokenBucket lBucket;
+    lBucket.setRate(10, 1);
+    CPPUNIT_ASSERT_EQUAL_UINT(10, lBucket.getRate());
+    CPPUNIT_ASSERT_EQUAL_UINT(1, lBucket.getBurst());
+
+    uint64_t lNow = 5 * cSecond;
+    CPPUNIT_ASSERT(lBucket.tryTake(lNow));
+    CPPUNIT_ASSERT(!lBucket.tryTake(lNow));
+    // The next token comes 100ms later
+    CPPUNIT_ASSERT(!lBucket.tryTake(lNow + cSecond / 20));
+    CPPUNIT_ASSERT(lBucket.tryTake(lNow + cSecond / 10));
+    CPPUNIT_ASSERT(!lBucket.tryTake(lNow + cSecond / 10));
+
+    // Over a second, 10 requests out of 1000 evenly spread get through
+    lNow = 10 * cSecond;
+    unsigned int lTaken = 0;
+    for (int i = 0; i < 1000; ++i) {
+        lTaken += lBucket.tryTake(lNow + i * cSecond / 1000);
+    }
+    CPPUNIT_ASSERT_EQUAL_UINT(10, lTaken);
+}
+
+void TestTokenBucket::testBurst()
+{
+    TokenBucket lBucket;
+    lBucket.setRate(10, 5);
+
+    uint64_t lNow = 5 * cSecond;
+    for (int i = 0; i < 5; ++i) {
+        CPPUNIT_ASSERT(lBucket.tryTake(lNow));
+    }
+    CPPUNIT_ASSERT(!lBucket.tryTake(lNow));
+    // One token back after 100ms
+    CPPUNIT_ASSERT(lBucket.tryTake(lNow + cSecond / 10));
+    CPPUNIT_ASSERT(!lBucket.tryTake(lNow + cSecond / 10));
+    // The bucket does not hold more than the burst after a long pause
+    lNow += 60 * cSecond;
+    for (int i = 0; i < 5; ++i) {
+        CPPUNIT_ASSERT(lBucket.tryTake(lNow));
+    }
+    CPPUNIT_ASSERT(!lBucket.tryTake(lNow));
+}
+
+static void
+takeTokens(TokenBucket *pBucket, uint64_t pNow, volatile unsigned int *pTaken) {
+    for (int i = 0; i < 10000; ++i) {
+        if (pBucket->tryTake(pNow)) {
+            __sync_fetch_and_add(pTaken, 1);
+        }
+    }
+}
+
+void TestTokenBucket::testConcurrent()
+{
+    TokenBucket lBucket;
+    lBucket.setRate(1000, 100);
+    volatile unsigned int lTaken = 0;
+
+    // Exactly the burst gets through, whatever the number of threads racing for it
+    boost::thread_group lThreads;
+    for (int i = 0; i < 8; ++i) {
+        lThreads.create_thread(boost::bind(&takeTokens, &lBucket, 5 * cSecond, &lTaken));
+    }
+    lThreads.join_all();
+    CPPUNIT_ASSERT_EQUAL_UINT(100, lTaken);
+}
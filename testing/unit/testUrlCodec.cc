@@ -16,7 +16,12 @@
 * limitations under the License.
 */
 
+#include <boost/algorithm/string/replace.hpp>
+#include <boost/foreach.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <cstdlib>
+#include <httpd.h>
+#include <vector>
 
 #include "UrlCodec.hh"
 #include "testUrlCodec.hh"
@@ -115,3 +120,91 @@ void TestUrlCodec::testDefaultCodec()
 	CPPUNIT_ASSERT_EQUAL(std::string("!#$&'()*+,/:;=?@[] \"%-.<>\\^_`{|}~"),
 			urlCodec->decode(urlCodec->encode(lPool, "!#$&'()*+,/:;=?@[] \"%-.<>\\^_`{|}~")));
 }
+
+void TestUrlCodec::testEncodeBuffer()
+{
+    apr_pool_t *lPool;
+    apr_pool_create(&lPool, 0);
+
+    // All the bytes but NUL, which ap_escape_path_segment stops at
+    std::string lAll;
+    for (int c = 1; c < 256; ++c) {
+        lAll += static_cast<char>(c);
+    }
+    const std::string lApache(ap_escape_path_segment(lPool, lAll.c_str()));
+
+    boost::scoped_ptr<const IUrlCodec> lApacheCodec(getUrlCodec("apache"));
+    boost::scoped_ptr<const IUrlCodec> lDefaultCodec(getUrlCodec("default"));
+    std::string lOut(3 * lAll.size(), '\0');
+    char *lEnd = lApacheCodec->encode(lAll.data(), lAll.size(), &lOut[0]);
+    CPPUNIT_ASSERT_EQUAL(lApache, std::string(&lOut[0], lEnd));
+    CPPUNIT_ASSERT_EQUAL(lApache, lApacheCodec->encode(lPool, lAll));
+
+    // The default codec escapes '+' on top of it
+    lEnd = lDefaultCodec->encode(lAll.data(), lAll.size(), &lOut[0]);
+    CPPUNIT_ASSERT_EQUAL(boost::replace_all_copy(lApache, "+", "%2b"), std::string(&lOut[0], lEnd));
+    CPPUNIT_ASSERT_EQUAL(boost::replace_all_copy(lApache, "+", "%2b"), lDefaultCodec->encode(lPool, lAll));
+
+    // Sizes are explicit: a NUL gets escaped rather than ending the string
+    CPPUNIT_ASSERT_EQUAL(std::string("a%00b"), lDefaultCodec->encode(lPool, std::string("a\0b", 3)));
+    lEnd = lDefaultCodec->encode("", 0, &lOut[0]);
+    CPPUNIT_ASSERT(lEnd == &lOut[0]);
+}
+
+void TestUrlCodec::testFastCodec()
+{
+    apr_pool_t *lPool;
+    apr_pool_create(&lPool, 0);
+
+    boost::scoped_ptr<const IUrlCodec> lDefault(getUrlCodec("default"));
+    boost::scoped_ptr<const IUrlCodec> lFast(getUrlCodec("fast"));
+    CPPUNIT_ASSERT(lFast.get() != NULL);
+    CPPUNIT_ASSERT_EQUAL(std::string(" "), lFast->decode("%20"));
+    CPPUNIT_ASSERT_EQUAL(std::string("%20"), lFast->encode(lPool, " "));
+
+    // Byte for byte the output of the default codec, on bytes decoded and encoded one by one or in runs of 16
+    std::vector<std::string> lInputs;
+    lInputs.push_back("");
+    lInputs.push_back("a+b%2Bc%2bd%20e");
+    lInputs.push_back("%");
+    lInputs.push_back("%2");
+    lInputs.push_back("%%41");
+    lInputs.push_back("%zz%4");
+    lInputs.push_back("%+1");
+    lInputs.push_back("%2F%2f/");
+    lInputs.push_back("before%00after");
+    lInputs.push_back(std::string("before\0after", 12));
+    lInputs.push_back("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.~!$&'()*,:=@");
+    lInputs.push_back("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+ABCDEFGHIJKLMNOPQRSTUVWXYZ%41");
+    std::string lAll;
+    for (int c = 1; c < 256; ++c) {
+        lAll += static_cast<char>(c);
+    }
+    lInputs.push_back(lAll);
+    // Runs of all lengths of plain bytes between the special ones
+    srand(42);
+    const char lAlphabet[] = "aZ09-~%+ /#\x80\xff%2b%41%0";
+    for (int i = 0; i < 2000; ++i) {
+        std::string lInput;
+        const int lSize = rand() % 80;
+        for (int j = 0; j < lSize; ++j) {
+            lInput += rand() % 4 ? 'a' + rand() % 26 : lAlphabet[rand() % (sizeof(lAlphabet) - 1)];
+        }
+        lInputs.push_back(lInput);
+    }
+
+    BOOST_FOREACH(const std::string &lInput, lInputs) {
+        CPPUNIT_ASSERT_EQUAL(lDefault->decode(lInput), lFast->decode(lInput));
+        CPPUNIT_ASSERT_EQUAL(lDefault->encode(lPool, lInput), lFast->encode(lPool, lInput));
+
+        // In place
+        std::string lInPlace(lInput);
+        char *lEnd = lFast->decode(lInPlace.data(), lInPlace.size(), &lInPlace[0]);
+        CPPUNIT_ASSERT_EQUAL(lDefault->decode(lInput), std::string(&lInPlace[0], lEnd));
+
+        std::string lEncoded(3 * lInput.size(), '\0');
+        lEnd = lFast->encode(lInput.data(), lInput.size(), &lEncoded[0]);
+        CPPUNIT_ASSERT_EQUAL(lDefault->encode(lPool, lInput), std::string(&lEncoded[0], lEnd));
+        CPPUNIT_ASSERT_EQUAL(lInput.substr(0, lInput.find('\0')), lFast->decode(std::string(&lEncoded[0], lEnd)));
+    }
+}
@@ -32,10 +32,14 @@ class TestUrlCodec :
     CPPUNIT_TEST(testUrlCodec);
     CPPUNIT_TEST(testApacheCodec);
     CPPUNIT_TEST(testDefaultCodec);
+    CPPUNIT_TEST(testEncodeBuffer);
+    CPPUNIT_TEST(testFastCodec);
     CPPUNIT_TEST_SUITE_END();
 
 public:
     void testUrlCodec();
 	void testApacheCodec();
 	void testDefaultCodec();
+	void testEncodeBuffer();
+	void testFastCodec();
 };